@@ -36,9 +36,6 @@ CryptBufferTest::~CryptBufferTest() {}
 
 void CryptBufferTest::initTestCase()
 {
-    unsigned char salt[CryptingEngine::SALT_SIZE];
-    CryptingEngine::create_nonce(salt, CryptingEngine::SALT_SIZE);
-
     unsigned char iv[CryptingEngine::IV_SIZE];
     CryptingEngine::create_nonce(iv, CryptingEngine::IV_SIZE);
 
@@ -47,7 +44,7 @@ void CryptBufferTest::initTestCase()
     crengine.setKeyNameEncrypting("ksecrets-test:encrypting");
     crengine.setKeyNameMac("ksecrets-test:mac");
     crengine.setIV(iv, CryptingEngine::IV_SIZE);
-    crengine.setCredentials("test", salt);
+    crengine.generateMasterKeys();
 }
 
 void CryptBufferTest::cleanupTestCase()
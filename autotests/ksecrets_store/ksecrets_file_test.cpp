@@ -23,8 +23,12 @@
 
 #include <ksecrets_file.h>
 #include <crypting_engine.h>
+#include <ksecrets_io.h>
 #include <QtTest/QtTest>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 QTEST_GUILESS_MAIN(KSecretsFileTest)
 
@@ -34,16 +38,13 @@ KSecretsFileTest::~KSecretsFileTest() {}
 void KSecretsFileTest::initTestCase()
 {
     CryptingEngine &crengine = CryptingEngine::instance();
-    unsigned char salt[CryptingEngine::SALT_SIZE];
-    CryptingEngine::create_nonce(salt, CryptingEngine::SALT_SIZE);
-
     unsigned char iv[CryptingEngine::IV_SIZE];
     CryptingEngine::create_nonce(iv, CryptingEngine::IV_SIZE);
 
     crengine.setKeyNameEncrypting("ksecrets-test:encrypting");
     crengine.setKeyNameMac("ksecrets-test:mac");
     crengine.setIV(iv, CryptingEngine::IV_SIZE);
-    crengine.setCredentials("test", salt);
+    crengine.generateMasterKeys();
 }
 
 void KSecretsFileTest::testIntegrityCheck()
@@ -55,4 +56,277 @@ void KSecretsFileTest::testIntegrityCheck()
     theFile.setup(TEST_FILE_NAME, false);
     QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
 }
+
+void KSecretsFileTest::testIndexedLookup()
+{
+    const char* TEST_FILE_NAME = "ksecrets_file_test_index_tmp.data";
+
+    KSecretsFile theFile;
+    theFile.create(TEST_FILE_NAME);
+    theFile.setup(TEST_FILE_NAME, false);
+    QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    QVERIFY(theFile.collection_directory().get() == nullptr);
+
+    auto dir = std::make_shared<CollectionDirectory>();
+    QVERIFY(theFile.emplace_entity(dir));
+    QVERIFY(theFile.collection_directory() == dir);
+
+    auto collection = std::make_shared<SecretsCollection>();
+    collection->setName("indexed");
+    dir->addCollection("indexed");
+    QVERIFY(theFile.emplace_entity(collection));
+    QVERIFY(theFile.find_collection("indexed") == collection);
+    QVERIFY(theFile.find_collection("missing").get() == nullptr);
+
+    auto item = std::make_shared<SecretsItem>();
+    item->setId("item-id");
+    QVERIFY(theFile.emplace_item(collection, item));
+    QVERIFY(theFile.find_item("item-id") == item);
+
+    // handles should resolve again after the entities get reloaded from disk
+    KSecretsFile::CollectionHandle handle("indexed");
+    QVERIFY(handle.get(theFile) == collection);
+    QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    auto reloaded = handle.get(theFile);
+    QVERIFY(reloaded.get() != nullptr);
+    QVERIFY(reloaded != collection);
+    QVERIFY(reloaded->name() == "indexed");
+    QVERIFY(theFile.find_item("item-id").get() != nullptr);
+    QVERIFY(theFile.collection_directory()->hasEntry("indexed"));
+
+    QVERIFY(theFile.remove_item(reloaded, theFile.find_item("item-id")));
+    QVERIFY(theFile.find_item("item-id").get() == nullptr);
+}
+
+void KSecretsFileTest::testUnsequencedEntities()
+{
+    const char* TEST_FILE_NAME = "ksecrets_file_test_unsequenced_tmp.data";
+
+    KSecretsFile theFile;
+    theFile.create(TEST_FILE_NAME);
+    theFile.setup(TEST_FILE_NAME, false);
+    QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    auto collection = std::make_shared<SecretsCollection>();
+    collection->setName("unsequenced");
+    QVERIFY(theFile.emplace_entity(collection));
+    auto item1 = std::make_shared<SecretsItem>();
+    item1->setId("item-1");
+    QVERIFY(theFile.emplace_item(collection, item1));
+    auto item2 = std::make_shared<SecretsItem>();
+    item2->setId("item-2");
+    QVERIFY(theFile.emplace_item(collection, item2));
+
+    // as written before the change feed
+    collection->setSequence(0);
+    item1->setSequence(0);
+    item2->setSequence(0);
+    QVERIFY(theFile.save());
+    auto sequence = theFile.sequence();
+
+    // the reload gives each of them its own position, after the last change
+    QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    QVERIFY(theFile.sequence() == sequence + 3);
+    auto change = theFile.changes_since(sequence);
+    QVERIFY(change != theFile.changes_end() && change->second.collection_ == "unsequenced" && change->second.item_.empty());
+    QVERIFY(++change != theFile.changes_end() && change->second.item_ == "item-1");
+    QVERIFY(++change != theFile.changes_end() && change->second.item_ == "item-2");
+    QVERIFY(++change == theFile.changes_end());
+    QVERIFY(theFile.find_item("item-1")->sequence() == sequence + 2);
+
+    // another reader of the same file agrees on these positions
+    KSecretsFile reader;
+    reader.setup(TEST_FILE_NAME, true);
+    QVERIFY(reader.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    QVERIFY(reader.find_item("item-2")->sequence() == sequence + 3);
+    unlink(TEST_FILE_NAME);
+}
+
+void KSecretsFileTest::testArena()
+{
+    std::weak_ptr<EntityArena> weakArena;
+    SecretsCollectionPtr collection;
+    {
+        auto arena = std::make_shared<EntityArena>();
+        weakArena = arena;
+        collection = std::static_pointer_cast<SecretsCollection>(SecretsEntityFactory::createInstance(SecretsEntity::EntityType::SecretsCollectionType, arena));
+        for (int i = 0; i < 1000; i++) {
+            auto item = EntityArena::make<SecretsItem>(arena);
+            item->setId(std::to_string(1000 - i));
+            collection->addItem(item);
+        }
+        // the entities are packed together
+        QVERIFY(arena->blocksCount() < 1000 / 10);
+    }
+    // the entities keep their arena alive
+    QVERIFY(!weakArena.expired());
+
+    // the items table keeps the items sorted by id
+    const auto& items = collection->items();
+    QVERIFY(items.size() == 1000);
+    QVERIFY(items.id(0) == "1");
+    QVERIFY(items.find("500") != SecretsCollection::ItemsTable::npos);
+    QVERIFY(items.item(items.find("500"))->id() == "500");
+    QVERIFY(items.upper_bound("999") == items.size());
+    QVERIFY(collection->removeItem(items.item(items.find("500"))));
+    QVERIFY(items.find("500") == SecretsCollection::ItemsTable::npos);
+
+    collection.reset();
+    QVERIFY(weakArena.expired());
+}
+
+void KSecretsFileTest::testChangePassword()
+{
+    const char* TEST_FILE_NAME = "ksecrets_file_test_password_tmp.data";
+
+    {
+        // the first open with a password protects the master keys generated by create
+        KSecretsFile theFile;
+        QVERIFY(theFile.create(TEST_FILE_NAME) == 0);
+        theFile.setup(TEST_FILE_NAME, false);
+        theFile.setPassword("old password");
+        QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+        QVERIFY(theFile.changePassword("new password"));
+    }
+    {
+        KSecretsFile theFile;
+        theFile.setup(TEST_FILE_NAME, true);
+        theFile.setPassword("old password");
+        QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::CannotUnlockKeys);
+    }
+    {
+        KSecretsFile theFile;
+        theFile.setup(TEST_FILE_NAME, true);
+        theFile.setPassword("new password");
+        QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    }
+}
+
+void KSecretsFileTest::testLegacyFormat()
+{
+    const char* TEST_FILE_NAME = "ksecrets_file_test_legacy_tmp.data";
+
+    // the files preceding the key slots have the same header, with another magic
+    KSecretsFile::FileHeadStruct header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic_, "ksecrets", 8);
+    int fd = ::open(TEST_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    QVERIFY(fd != -1);
+    QVERIFY(::write(fd, &header, sizeof(header)) == sizeof(header));
+    ::close(fd);
+
+    KSecretsFile theFile;
+    theFile.setup(TEST_FILE_NAME, true);
+    theFile.setPassword("password");
+    QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::UnsupportedVersion);
+    unlink(TEST_FILE_NAME);
+}
+
+void KSecretsFileTest::testBackups()
+{
+    const char* TEST_FILE_NAME = "ksecrets_file_test_backup_tmp.data";
+
+    KSecretsFile theFile;
+    theFile.create(TEST_FILE_NAME);
+    theFile.setup(TEST_FILE_NAME, false);
+    theFile.setBackupGenerations(2);
+    QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+
+    auto dir = std::make_shared<CollectionDirectory>();
+    QVERIFY(theFile.emplace_entity(dir));
+    auto coll1 = std::make_shared<SecretsCollection>();
+    coll1->setName("coll1");
+    dir->addCollection("coll1");
+    QVERIFY(theFile.emplace_entity(coll1));
+    auto coll2 = std::make_shared<SecretsCollection>();
+    coll2->setName("coll2");
+    dir->addCollection("coll2");
+    QVERIFY(theFile.emplace_entity(coll2));
+
+    // only two generations are kept
+    QVERIFY(QFile::exists(QString::fromStdString(theFile.backupPath(1))));
+    QVERIFY(QFile::exists(QString::fromStdString(theFile.backupPath(2))));
+    QVERIFY(!QFile::exists(QString::fromStdString(theFile.backupPath(3))));
+
+    // the most recent backup was taken before coll2 got added
+    QVERIFY(theFile.restoreBackup(1));
+    QVERIFY(theFile.find_collection("coll1").get() != nullptr);
+    QVERIFY(theFile.find_collection("coll2").get() == nullptr);
+
+    // restoring backed-up the file, so that can be undone
+    QVERIFY(theFile.restoreBackup(1));
+    QVERIFY(theFile.find_collection("coll2").get() != nullptr);
+}
+
+void KSecretsFileTest::testRestoreKeepsKeySlots()
+{
+    const char* TEST_FILE_NAME = "ksecrets_file_test_restore_tmp.data";
+
+    {
+        KSecretsFile theFile;
+        QVERIFY(theFile.create(TEST_FILE_NAME) == 0);
+        theFile.setup(TEST_FILE_NAME, false);
+        theFile.setBackupGenerations(2);
+        theFile.setPassword("old password");
+        QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+        QVERIFY(theFile.emplace_entity(std::make_shared<CollectionDirectory>()));
+
+        // the backup still holds the old password's slot, but the restore should not bring it back
+        QVERIFY(theFile.changePassword("new password"));
+        QVERIFY(theFile.restoreBackup(1));
+        QVERIFY(theFile.collection_directory().get() == nullptr);
+    }
+    {
+        KSecretsFile theFile;
+        theFile.setup(TEST_FILE_NAME, true);
+        theFile.setPassword("old password");
+        QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::CannotUnlockKeys);
+    }
+    {
+        KSecretsFile theFile;
+        theFile.setup(TEST_FILE_NAME, true);
+        theFile.setPassword("new password");
+        QVERIFY(theFile.openAndCheck(false) == KSecretsFile::OpenStatus::Ok);
+    }
+}
+
+void KSecretsFileTest::testIO_data()
+{
+    QTest::addColumn<int>("backend");
+    QTest::newRow("syscalls") << (int)KSecretsIO::Backend::Syscalls;
+    QTest::newRow("io_uring") << (int)KSecretsIO::Backend::IoUring;
+}
+
+void KSecretsFileTest::testIO()
+{
+    QFETCH(int, backend);
+    const char* TEST_FILE_NAME = "ksecrets_file_test_io_tmp.data";
+    const char* TEST_RENAMED_FILE_NAME = "ksecrets_file_test_io_renamed_tmp.data";
+
+    // spans several chunks and ends in the middle of one
+    QByteArray data(KSecretsIO::CHUNK_SIZE * 3 + 123, 0);
+    for (int i = 0; i < data.size(); i++) {
+        data[i] = (char)(i * 7);
+    }
+
+    auto io = KSecretsIO::create((KSecretsIO::Backend)backend);
+    int fd = ::open(TEST_FILE_NAME, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    QVERIFY(fd != -1);
+    io->attach(fd);
+    for (int pos = 0, step = 1; pos < data.size(); pos += step, step = step * 3 % 10007 + 1) {
+        QVERIFY(io->write(data.constData() + pos, std::min(step, data.size() - pos)));
+    }
+    QVERIFY(io->finish(TEST_FILE_NAME, TEST_RENAMED_FILE_NAME));
+    ::close(fd);
+    QVERIFY(!QFile::exists(QString::fromLatin1(TEST_FILE_NAME)));
+
+    fd = ::open(TEST_RENAMED_FILE_NAME, O_RDONLY);
+    QVERIFY(fd != -1);
+    io->attach(fd);
+    QByteArray readData(data.size() + 1, 0);
+    QCOMPARE(io->read(readData.data(), readData.size()), (ssize_t)data.size());
+    readData.chop(1);
+    QCOMPARE(readData, data);
+    QCOMPARE(io->offset(), (off_t)data.size());
+    ::close(fd);
+}
 // vim: tw=220:ts=4
@@ -32,5 +32,14 @@ public:
 private Q_SLOTS:
     void initTestCase();
     void testIntegrityCheck();
+    void testIndexedLookup();
+    void testUnsequencedEntities();
+    void testArena();
+    void testChangePassword();
+    void testLegacyFormat();
+    void testBackups();
+    void testRestoreKeepsKeySlots();
+    void testIO_data();
+    void testIO();
 };
 #endif
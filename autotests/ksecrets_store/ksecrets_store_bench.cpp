@@ -0,0 +1,348 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+#include "ksecrets_store_bench.h"
+
+#include <ksecrets_store.h>
+#include <QtTest/QtTest>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+QTEST_GUILESS_MAIN(KSecretsStoreBench)
+
+static unsigned envValue(const char* name, unsigned defaultValue)
+{
+    bool ok = false;
+    unsigned value = qgetenv(name).toUInt(&ok);
+    return ok && value > 0 ? value : defaultValue;
+}
+
+static unsigned benchSeed() { return envValue("KSECRETS_BENCH_SEED", 42); }
+
+/**
+ * The collections and items counts of the benchmarked datasets, the last one being the largest
+ */
+static std::vector<std::pair<int, int> > datasetSizes()
+{
+    int collections = envValue("KSECRETS_BENCH_COLLECTIONS", 4);
+    int items = envValue("KSECRETS_BENCH_ITEMS", 250);
+    return { { 1, 10 }, { collections, std::max(1, items / 10) }, { collections, items } };
+}
+
+/**
+ * Generates secrets looking like the ones desktop applications store: mostly short passwords with a few attributes,
+ * along with some larger blobs like certificates or tokens.
+ *
+ * The standard distributions are implementation defined, so the values are mapped from the engine's output, which is
+ * not, to get the same dataset from a given seed on any platform.
+ */
+class DatasetGenerator {
+public:
+    explicit DatasetGenerator(unsigned seed)
+        : random_(seed)
+    {
+    }
+
+    /**
+     * @return a value in [minValue, maxValue], the modulo bias does not matter here
+     */
+    size_t range(size_t minValue, size_t maxValue) { return minValue + random_() % (maxValue - minValue + 1); }
+
+    /**
+     * @return a value in (0, 1)
+     */
+    double unit() { return (random_() + 0.5) / 4294967296.0; }
+
+    std::string text(size_t len)
+    {
+        std::string res(len, ' ');
+        for (auto& c : res) {
+            c = static_cast<char>(range('a', 'z'));
+        }
+        return res;
+    }
+
+    std::string text(size_t minLen, size_t maxLen) { return text(range(minLen, maxLen)); }
+
+    KSecretsStore::AttributesMap attributes()
+    {
+        static const char* schemas[] = { "org.freedesktop.Secret.Generic", "org.gnome.keyring.NetworkPassword", "org.kde.kwallet.Password", "org.mozilla.Login" };
+        KSecretsStore::AttributesMap attrs;
+        attrs["xdg:schema"] = schemas[range(0, 3)];
+        attrs["service"] = text(6, 24);
+        attrs["username"] = text(4, 16);
+        for (size_t extra = range(0, 3); extra > 0; extra--) {
+            attrs[text(4, 12)] = text(4, 64);
+        }
+        return attrs;
+    }
+
+    KSecretsStore::ItemValue value()
+    {
+        KSecretsStore::ItemValue value;
+        size_t len;
+        if (range(0, 9) == 0) {
+            // certificates, tokens and the like: around one kilobyte, with a long tail, log-normal through Box-Muller
+            double radius = std::sqrt(-2.0 * std::log(unit()));
+            double normal = radius * std::cos(2.0 * M_PI * unit());
+            len = std::min<size_t>(16 * 1024, static_cast<size_t>(std::exp(7.0 + 0.6 * normal)));
+            value.contentType = "application/octet-stream";
+        }
+        else {
+            len = range(8, 40);
+            value.contentType = "text/plain";
+        }
+        auto contents = text(len);
+        value.contents.assign(contents.begin(), contents.end());
+        return value;
+    }
+
+    bool populate(KSecretsStore& backend, int collections, int items)
+    {
+        for (int c = 0; c < collections; c++) {
+            auto coll = backend.createCollection(QByteArray("collection-").append(QByteArray::number(c)).constData()).result_;
+            if (!coll)
+                return false;
+            for (int i = 0; i < items; i++) {
+                auto label = "item-" + std::to_string(i) + "-" + text(8);
+                if (!coll->createItem(label.c_str(), attributes(), value()))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::mt19937 random_;
+};
+
+static QString copyOf(const QString& path, const char* suffix)
+{
+    QString copy = path + QLatin1String(suffix);
+    QFile::remove(copy);
+    return QFile::copy(path, copy) ? copy : QString();
+}
+
+static QByteArray nextName(const char* prefix)
+{
+    static int counter = 0;
+    return QByteArray(prefix).append(QByteArray::number(++counter));
+}
+
+KSecretsStoreBench::KSecretsStoreBench(QObject* parent)
+    : QObject(parent)
+{
+}
+
+void KSecretsStoreBench::initTestCase()
+{
+    QVERIFY(dir_.isValid());
+    KSecretsStore backend;
+    auto credfut = backend.setCredentials("test", "ksecrets-test:crypt", "ksecrets-test:mac");
+    QVERIFY(credfut.get());
+}
+
+QString KSecretsStoreBench::dataset(int collections, int items)
+{
+    QString path = dir_.path() + QString::fromLatin1("/bench-%1x%2-%3.data").arg(collections).arg(items).arg(benchSeed());
+    if (!QFileInfo::exists(path)) {
+        // the generation is way faster in memory, as each update would otherwise sync the file
+        KSecretsStore backend;
+        if (!backend.setupInMemory().get())
+            return QString();
+        DatasetGenerator generator(benchSeed());
+        if (!generator.populate(backend, collections, items) || !backend.snapshot(QFile::encodeName(path).constData()))
+            return QString();
+    }
+    return path;
+}
+
+void KSecretsStoreBench::addDatasetRows()
+{
+    QTest::addColumn<int>("collections");
+    QTest::addColumn<int>("items");
+    for (const auto& size : datasetSizes()) {
+        QTest::newRow(QByteArray::number(size.first).append('x').append(QByteArray::number(size.second)).constData()) << size.first << size.second;
+    }
+}
+
+void KSecretsStoreBench::benchSetup_data()
+{
+    QTest::addColumn<int>("collections");
+    QTest::addColumn<int>("items");
+    QTest::addColumn<bool>("cold");
+    for (const auto& size : datasetSizes()) {
+        auto name = QByteArray::number(size.first).append('x').append(QByteArray::number(size.second));
+        QTest::newRow(QByteArray(name).append(" cold").constData()) << size.first << size.second << true;
+        QTest::newRow(QByteArray(name).append(" warm").constData()) << size.first << size.second << false;
+    }
+}
+
+void KSecretsStoreBench::benchSetup()
+{
+    QFETCH(int, collections);
+    QFETCH(int, items);
+    QFETCH(bool, cold);
+    auto path = QFile::encodeName(dataset(collections, items));
+    QVERIFY(!path.isEmpty());
+
+    QBENCHMARK {
+        if (cold) {
+            // dropping the file pages is as cold as it gets without privileges, the library itself stays in memory
+            int fd = ::open(path.constData(), O_RDONLY);
+            QVERIFY(fd != -1);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+        KSecretsStore backend;
+        QVERIFY(backend.setup(path.constData(), true).get());
+    }
+}
+
+void KSecretsStoreBench::benchCreateCollection_data() { addDatasetRows(); }
+
+void KSecretsStoreBench::benchCreateCollection()
+{
+    QFETCH(int, collections);
+    QFETCH(int, items);
+    auto path = QFile::encodeName(copyOf(dataset(collections, items), ".work"));
+    QVERIFY(!path.isEmpty());
+    KSecretsStore backend;
+    QVERIFY(backend.setup(path.constData(), false).get());
+
+    QBENCHMARK {
+        QVERIFY(backend.createCollection(nextName("bench collection ").constData()));
+    }
+}
+
+void KSecretsStoreBench::benchCreateItem_data() { addDatasetRows(); }
+
+void KSecretsStoreBench::benchCreateItem()
+{
+    QFETCH(int, collections);
+    QFETCH(int, items);
+    auto path = QFile::encodeName(copyOf(dataset(collections, items), ".work"));
+    QVERIFY(!path.isEmpty());
+    KSecretsStore backend;
+    QVERIFY(backend.setup(path.constData(), false).get());
+    auto coll = backend.readCollection("collection-0").result_;
+    QVERIFY(coll.get() != nullptr);
+    DatasetGenerator generator(benchSeed());
+
+    QBENCHMARK {
+        QVERIFY(coll->createItem(nextName("bench item ").constData(), generator.attributes(), generator.value()).get() != nullptr);
+    }
+}
+
+void KSecretsStoreBench::benchSave_data() { addDatasetRows(); }
+
+void KSecretsStoreBench::benchSave()
+{
+    QFETCH(int, collections);
+    QFETCH(int, items);
+    auto path = QFile::encodeName(copyOf(dataset(collections, items), ".work"));
+    QVERIFY(!path.isEmpty());
+    KSecretsStore backend;
+    QVERIFY(backend.setup(path.constData(), false).get());
+    auto coll = backend.readCollection("collection-0").result_;
+    QVERIFY(coll.get() != nullptr);
+    auto item = coll->dirItems().front();
+
+    // each item update saves the whole file, so the throughput is the file size per update duration
+    const int saves = 20;
+    backend.resetStats();
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < saves; i++) {
+        QVERIFY(item->setLabel(nextName("bench label ").constData()));
+    }
+    auto elapsed = timer.nsecsElapsed();
+    auto written = backend.stats().bytesWritten_;
+    QTest::setBenchmarkResult(written * 1e9 / elapsed, QTest::BytesPerSecond);
+}
+
+void KSecretsStoreBench::benchSearch_data()
+{
+    QTest::addColumn<int>("collections");
+    QTest::addColumn<int>("items");
+    QTest::addColumn<QByteArray>("query");
+    for (const auto& size : datasetSizes()) {
+        auto name = QByteArray::number(size.first).append('x').append(QByteArray::number(size.second));
+        QTest::newRow(QByteArray(name).append(" attribute").constData()) << size.first << size.second << QByteArray("attribute");
+        QTest::newRow(QByteArray(name).append(" label").constData()) << size.first << size.second << QByteArray("label");
+        QTest::newRow(QByteArray(name).append(" page").constData()) << size.first << size.second << QByteArray("page");
+    }
+}
+
+void KSecretsStoreBench::benchSearch()
+{
+    QFETCH(int, collections);
+    QFETCH(int, items);
+    QFETCH(QByteArray, query);
+    auto path = QFile::encodeName(dataset(collections, items));
+    QVERIFY(!path.isEmpty());
+    KSecretsStore backend;
+    QVERIFY(backend.setup(path.constData(), true).get());
+    auto coll = backend.readCollection("collection-0").result_;
+    QVERIFY(coll.get() != nullptr);
+
+    KSecretsStore::AttributesMap attrs{ { "xdg:schema", "Password" } };
+    size_t found = 0;
+    QBENCHMARK {
+        if (query == "attribute") {
+            found = coll->searchItems(attrs).size();
+        }
+        else if (query == "label") {
+            found = coll->searchItems("item-1*").size();
+        }
+        else {
+            found = coll->dirItems(KSecretsStore::Collection::Cursor(), 50, KSecretsStore::Collection::Projection::MetadataOnly).items_.size();
+        }
+    }
+    // the attribute is only partially matched, so it may not be found in the smallest datasets
+    QVERIFY(found > 0 || query == "attribute");
+}
+
+void KSecretsStoreBench::benchPeakRss()
+{
+    auto size = datasetSizes().back();
+    auto path = QFile::encodeName(dataset(size.first, size.second));
+    QVERIFY(!path.isEmpty());
+    KSecretsStore backend;
+    QVERIFY(backend.setup(path.constData(), true).get());
+    QVERIFY(backend.readCollection("collection-0").result_->dirItems().size() == static_cast<size_t>(size.second));
+
+    struct rusage usage;
+    QVERIFY(getrusage(RUSAGE_SELF, &usage) == 0);
+    // ru_maxrss is in kilobytes on Linux
+    QTest::setBenchmarkResult(usage.ru_maxrss * 1024.0, QTest::BytesAllocated);
+}
+
+// vim: tw=220:ts=4
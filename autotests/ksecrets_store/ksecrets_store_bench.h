@@ -0,0 +1,61 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#ifndef KSECRETS_STORE_BENCH_H
+#define KSECRETS_STORE_BENCH_H
+
+#include <QtCore/QObject>
+#include <QtCore/QTemporaryDir>
+
+/**
+ * Benchmarks of the secrets store against synthetic datasets
+ *
+ * The datasets are generated from a seed, so the runs are reproducible. Their size is given by the environment:
+ * KSECRETS_BENCH_COLLECTIONS and KSECRETS_BENCH_ITEMS (per collection), KSECRETS_BENCH_SEED for the generator.
+ * Use the QTest output options for machine-readable results, e.g. `ksecrets_store_bench -o results.xml,xml`
+ */
+class KSecretsStoreBench : public QObject {
+    Q_OBJECT
+public:
+    explicit KSecretsStoreBench(QObject* parent = 0);
+
+private Q_SLOTS:
+    void initTestCase();
+    void benchSetup_data();
+    void benchSetup();
+    void benchCreateCollection_data();
+    void benchCreateCollection();
+    void benchCreateItem_data();
+    void benchCreateItem();
+    void benchSave_data();
+    void benchSave();
+    void benchSearch_data();
+    void benchSearch();
+    void benchPeakRss();
+
+private:
+    void addDatasetRows();
+    QString dataset(int collections, int items);
+
+    QTemporaryDir dir_;
+};
+
+#endif
+// vim: tw=220:ts=4
@@ -0,0 +1,298 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+/**
+ * Multi-process contention harness for the secrets file
+ *
+ * Forks reader and writer processes against one store per given directory, e.g. one on a tmpfs and one on a real disk.
+ * Each writer opens the store read-write, which takes the file lock, adds an item then closes the store. Each reader
+ * opens the store read-only and lists the items. After each run, the file is checked with KSecretsFile::openAndCheck and
+ * the items are counted, so lost updates show up.
+ *
+ * Usage: ksecrets_store_stress [-r readers] [-w writers] [-n operations] [-j] directory...
+ *
+ * The -j option prints one JSON object per directory instead of the human-readable report.
+ */
+
+#include <ksecrets_store.h>
+#include <ksecrets_file.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+const char* STORE_FILE_NAME = "/ksecrets-stress.data";
+const char* COLLECTION_NAME = "stress";
+
+struct Options {
+    int readers = 4;
+    int writers = 4;
+    int operations = 50;
+    bool json = false;
+    std::vector<std::string> directories;
+};
+
+struct Sample {
+    bool writer;
+    std::uint64_t latencyNs;
+    std::uint64_t lockWaitNs;
+    bool ok;
+};
+
+std::uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Runs in the forked process and writes one line per operation to the results file
+ */
+int runWorker(const Options& options, const std::string& path, bool writer, int id, const std::string& resultsPath)
+{
+    FILE* out = fopen(resultsPath.c_str(), "w");
+    if (out == nullptr)
+        return 1;
+    for (int op = 0; op < options.operations; op++) {
+        auto start = nowNs();
+        KSecretsStore store;
+        bool ok = store.setup(path.c_str(), !writer).get();
+        if (ok) {
+            auto collection = store.readCollection(COLLECTION_NAME).result_;
+            ok = collection.get() != nullptr;
+            if (ok && writer) {
+                auto label = "writer " + std::to_string(id) + " item " + std::to_string(op);
+                ok = collection->createItem(label.c_str(), KSecretsStore::ItemValue{ "text/plain", { 's', 'e', 'c', 'r', 'e', 't' } }).get() != nullptr;
+            }
+            else if (ok) {
+                collection->dirItems();
+            }
+        }
+        auto latency = nowNs() - start;
+        auto lockWait = store.stats()[KSecretsStore::Operation::LockWait].totalNs_;
+        fprintf(out, "%d %llu %llu %d\n", writer ? 1 : 0, (unsigned long long)latency, (unsigned long long)lockWait, ok ? 1 : 0);
+    }
+    return fclose(out) == 0 ? 0 : 1;
+}
+
+std::vector<Sample> readResults(const std::string& resultsPath)
+{
+    std::vector<Sample> samples;
+    FILE* in = fopen(resultsPath.c_str(), "r");
+    if (in == nullptr)
+        return samples;
+    int writer, ok;
+    unsigned long long latency, lockWait;
+    while (fscanf(in, "%d %llu %llu %d", &writer, &latency, &lockWait, &ok) == 4) {
+        samples.push_back(Sample{ writer != 0, latency, lockWait, ok != 0 });
+    }
+    fclose(in);
+    unlink(resultsPath.c_str());
+    return samples;
+}
+
+struct Percentiles {
+    std::uint64_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+};
+
+Percentiles percentiles(std::vector<std::uint64_t> values)
+{
+    Percentiles res;
+    if (values.empty())
+        return res;
+    std::sort(values.begin(), values.end());
+    auto at = [&values](size_t p) { return values[std::min(values.size() - 1, values.size() * p / 100)]; };
+    res.p50 = at(50);
+    res.p90 = at(90);
+    res.p99 = at(99);
+    res.max = values.back();
+    return res;
+}
+
+void removeStore(const std::string& path)
+{
+    KSecretsFile file;
+    file.setup(path, true);
+    for (unsigned generation = 1; generation <= file.backupGenerations(); generation++) {
+        unlink(file.backupPath(generation).c_str());
+    }
+    unlink(path.c_str());
+}
+
+bool prepareStore(const std::string& path)
+{
+    removeStore(path);
+    KSecretsStore store;
+    if (!store.setup(path.c_str(), false).get())
+        return false;
+    return store.createCollection(COLLECTION_NAME);
+}
+
+void printPercentiles(const Options& options, const char* name, const Percentiles& p, bool last = false)
+{
+    if (options.json) {
+        printf("\"%s\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}%s", name, (unsigned long long)p.p50, (unsigned long long)p.p90, (unsigned long long)p.p99,
+            (unsigned long long)p.max, last ? "" : ",");
+    }
+    else {
+        printf("  %-16s p50 %10.3fms  p90 %10.3fms  p99 %10.3fms  max %10.3fms\n", name, p.p50 / 1e6, p.p90 / 1e6, p.p99 / 1e6, p.max / 1e6);
+    }
+}
+
+/**
+ * @return false if the run found an integrity problem
+ */
+bool runDirectory(const Options& options, const std::string& directory)
+{
+    std::string path = directory + STORE_FILE_NAME;
+    if (!prepareStore(path)) {
+        fprintf(stderr, "ksecrets_store_stress: cannot create the store %s\n", path.c_str());
+        return false;
+    }
+
+    std::vector<pid_t> children;
+    std::vector<std::string> resultsPaths;
+    auto start = nowNs();
+    for (int i = 0; i < options.writers + options.readers; i++) {
+        bool writer = i < options.writers;
+        auto resultsPath = path + ".results." + std::to_string(i);
+        resultsPaths.push_back(resultsPath);
+        pid_t pid = fork();
+        if (pid == 0) {
+            _exit(runWorker(options, path, writer, i, resultsPath));
+        }
+        if (pid == -1) {
+            perror("ksecrets_store_stress: fork");
+            return false;
+        }
+        children.push_back(pid);
+    }
+    bool childrenOk = true;
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        childrenOk = childrenOk && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    auto elapsed = nowNs() - start;
+
+    std::vector<std::uint64_t> writeLatencies, readLatencies, lockWaits;
+    size_t writeFailures = 0, readFailures = 0, writesDone = 0;
+    for (const auto& resultsPath : resultsPaths) {
+        for (const auto& sample : readResults(resultsPath)) {
+            if (sample.writer) {
+                writeLatencies.push_back(sample.latencyNs);
+                lockWaits.push_back(sample.lockWaitNs);
+                sample.ok ? writesDone++ : writeFailures++;
+            }
+            else {
+                readLatencies.push_back(sample.latencyNs);
+                readFailures += sample.ok ? 0 : 1;
+            }
+        }
+    }
+
+    KSecretsFile file;
+    file.setup(path, true);
+    bool intact = file.openAndCheck(false, true) == KSecretsFile::OpenStatus::Ok;
+    size_t itemsFound = 0;
+    {
+        KSecretsStore store;
+        if (store.setup(path.c_str(), true).get()) {
+            auto collection = store.readCollection(COLLECTION_NAME).result_;
+            itemsFound = collection ? collection->dirItems().size() : 0;
+        }
+    }
+    size_t lostUpdates = writesDone > itemsFound ? writesDone - itemsFound : 0;
+    double throughput = (writeLatencies.size() + readLatencies.size()) * 1e9 / elapsed;
+
+    if (options.json) {
+        printf("{\"directory\":\"%s\",\"readers\":%d,\"writers\":%d,\"operations\":%d,\"elapsed_ns\":%llu,\"throughput_ops\":%.1f,", directory.c_str(), options.readers,
+            options.writers, options.operations, (unsigned long long)elapsed, throughput);
+        printPercentiles(options, "write_ns", percentiles(writeLatencies));
+        printPercentiles(options, "read_ns", percentiles(readLatencies));
+        printPercentiles(options, "lock_wait_ns", percentiles(lockWaits));
+        printf("\"write_failures\":%zu,\"read_failures\":%zu,\"lost_updates\":%zu,\"intact\":%s}\n", writeFailures, readFailures, lostUpdates, intact ? "true" : "false");
+    }
+    else {
+        printf("%s: %d readers, %d writers, %d operations each, %.1f ops/s\n", directory.c_str(), options.readers, options.writers, options.operations, throughput);
+        printPercentiles(options, "write", percentiles(writeLatencies));
+        printPercentiles(options, "read", percentiles(readLatencies));
+        printPercentiles(options, "lock wait", percentiles(lockWaits));
+        printf("  write failures %zu, read failures %zu, lost updates %zu, file %s\n", writeFailures, readFailures, lostUpdates, intact ? "intact" : "CORRUPTED");
+    }
+
+    removeStore(path);
+    return childrenOk && intact && readFailures == 0 && writeFailures == 0 && lostUpdates == 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:n:j")) != -1) {
+        switch (opt) {
+        case 'r':
+            options.readers = atoi(optarg);
+            break;
+        case 'w':
+            options.writers = atoi(optarg);
+            break;
+        case 'n':
+            options.operations = atoi(optarg);
+            break;
+        case 'j':
+            options.json = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r readers] [-w writers] [-n operations] [-j] directory...\n", argv[0]);
+            return 2;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        options.directories.emplace_back(argv[i]);
+    }
+    if (options.directories.empty()) {
+        options.directories.emplace_back(".");
+    }
+
+    KSecretsStore store;
+    if (!store.setCredentials("stress", "ksecrets-test:crypt", "ksecrets-test:mac").get()) {
+        fprintf(stderr, "ksecrets_store_stress: cannot set the credentials\n");
+        return 1;
+    }
+
+    bool ok = true;
+    for (const auto& directory : options.directories) {
+        ok = runDirectory(options, directory) && ok;
+    }
+    return ok ? 0 : 1;
+}
+
+// vim: tw=220:ts=4
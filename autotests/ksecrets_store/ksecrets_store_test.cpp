@@ -24,6 +24,7 @@
 #include <ksecrets_store.h>
 #include <QtTest/QtTest>
 #include <QtCore/QDir>
+#include <set>
 #include <ksharedconfig.h>
 #include <kconfiggroup.h>
 
@@ -360,6 +361,286 @@ void KSecretServiceStoreTest::testDeleteCollectionFailOnReadonly()
     QVERIFY(list1 == list2);
 }
 
+void KSecretServiceStoreTest::testInMemory()
+{
+    QString snapshotPath = secretsFilePath + QLatin1Literal(".snapshot");
+    QDir::home().remove(snapshotPath);
+    {
+        KSecretsStore backend;
+        auto setupfut = backend.setupInMemory(snapshotPath.toLocal8Bit().constData());
+        QVERIFY(setupfut.get());
+        QVERIFY(backend.createCollection(collName1));
+        QVERIFY(backend.dirBackups().result_.empty());
+    }
+    {
+        // the snapshot is a regular secrets file
+        KSecretsStore backend;
+        auto setupfut = backend.setup(snapshotPath.toLocal8Bit().constData());
+        QVERIFY(setupfut.get());
+        QVERIFY(backend.readCollection(collName1));
+    }
+    {
+        KSecretsStore backend;
+        auto setupfut = backend.setupInMemory();
+        QVERIFY(setupfut.get());
+        QVERIFY(!backend.readCollection(collName1));
+    }
+    QDir::home().remove(snapshotPath);
+}
+
+void KSecretServiceStoreTest::testInMemoryAlongsideFile()
+{
+    // neither the in-memory contents nor their own password should change the keys the file gets saved with
+    static const char* collName = "alongside collection";
+    KSecretsStore::ItemValue value{ "text/plain", { 's', 'e', 'c', 'r', 'e', 't' } };
+    {
+        KSecretsStore fileBackend;
+        QVERIFY(fileBackend.setCredentials("test", "ksecrets-test:crypt", "ksecrets-test:mac").get());
+        QVERIFY(fileBackend.setup(secretsFilePath.toLocal8Bit().constData(), false).get());
+        KSecretsStore privateBackend;
+        QVERIFY(privateBackend.setCredentials("other", "ksecrets-test:crypt", "ksecrets-test:mac").get());
+        QVERIFY(privateBackend.setupInMemory().get());
+        QVERIFY(privateBackend.createCollection(collName1));
+        KSecretsStore sessionBackend;
+        QVERIFY(sessionBackend.setupInMemory().get());
+        QVERIFY(sessionBackend.createCollection(collName1));
+
+        auto coll = fileBackend.createCollection(collName).result_;
+        QVERIFY(coll.get() != nullptr);
+        QVERIFY(coll->createItem(itemName1, value).get() != nullptr);
+        QVERIFY(privateBackend.readCollection(collName1));
+        QVERIFY(sessionBackend.readCollection(collName1));
+    }
+    {
+        KSecretsStore backend;
+        QVERIFY(backend.setCredentials("test", "ksecrets-test:crypt", "ksecrets-test:mac").get());
+        QVERIFY(backend.setup(secretsFilePath.toLocal8Bit().constData(), false).get());
+        auto coll = backend.readCollection(collName).result_;
+        QVERIFY(coll.get() != nullptr);
+        QVERIFY(coll->dirItems().size() == 1);
+        QVERIFY(backend.deleteCollection(collName).result_);
+    }
+}
+
+void KSecretServiceStoreTest::testItemsPages()
+{
+    KSecretsStore backend;
+    auto setupfut = backend.setupInMemory();
+    QVERIFY(setupfut.get());
+    auto coll = backend.createCollection(collName1).result_;
+    QVERIFY(coll.get() != nullptr);
+
+    const int itemsCount = 25;
+    for (int i = 0; i < itemsCount; i++) {
+        KSecretsStore::AttributesMap attrs{ { "parity", i % 2 ? "odd" : "even" } };
+        QVERIFY(coll->createItem(("item" + std::to_string(i)).c_str(), attrs, emptyValue).get() != nullptr);
+    }
+
+    // walk through all the items, deleting one of them along the way, nothing should be skipped
+    std::set<std::string> labels;
+    KSecretsStore::Collection::Cursor cursor;
+    int pages = 0;
+    do {
+        auto page = coll->dirItems(cursor, 10, KSecretsStore::Collection::Projection::MetadataOnly);
+        QVERIFY(page.items_.size() <= 10);
+        for (auto item : page.items_) {
+            QVERIFY(labels.insert(item->label()).second);
+        }
+        if (++pages == 1) {
+            QVERIFY(coll->deleteItem(page.items_.back()));
+        }
+        cursor = page.next_;
+    } while (!cursor.empty());
+    QVERIFY(pages == 3);
+    QVERIFY(labels.size() == itemsCount);
+
+    // a cursor resumes after any id, whether it's one of an item or not
+    auto all = coll->dirItems(KSecretsStore::Collection::Cursor(), itemsCount, KSecretsStore::Collection::Projection::MetadataOnly);
+    QVERIFY(all.items_.size() == itemsCount - 1 && all.next_.empty());
+    auto afterFirst = coll->dirItems(all.items_.front()->id(), itemsCount, KSecretsStore::Collection::Projection::MetadataOnly);
+    QVERIFY(afterFirst.items_.size() == itemsCount - 2);
+    QVERIFY(afterFirst.items_.front()->id() == all.items_[1]->id());
+    QVERIFY(coll->dirItems(all.items_.back()->id(), 10).items_.empty());
+    QVERIFY(coll->dirItems(all.items_.front()->id() + "~", 1).items_.front()->id() == all.items_[1]->id());
+
+    auto page = coll->searchItems(nullptr, KSecretsStore::AttributesMap{ { "parity", "odd" } }, KSecretsStore::Collection::Cursor(), 100);
+    QVERIFY(page.next_.empty());
+    QVERIFY(page.items_.size() >= itemsCount / 2 - 1);
+}
+
+void KSecretServiceStoreTest::testChangesSince()
+{
+    KSecretsStore backend;
+    auto setupfut = backend.setupInMemory();
+    QVERIFY(setupfut.get());
+    auto coll1 = backend.createCollection(collName1).result_;
+    QVERIFY(coll1.get() != nullptr);
+    auto item1 = coll1->createItem("item1", emptyValue);
+    auto item2 = coll1->createItem("item2", emptyValue);
+    QVERIFY(item1.get() != nullptr && item2.get() != nullptr);
+    auto coll2 = backend.createCollection(collName2).result_;
+    QVERIFY(coll2->createItem("item3", emptyValue).get() != nullptr);
+
+    auto seen = backend.sequence();
+    QVERIFY(backend.changesSince(seen).result_.empty());
+
+    QVERIFY(item1->setLabel("item1 renamed"));
+    QVERIFY(coll1->deleteItem(item2));
+    QVERIFY(backend.deleteCollection(collName2).result_);
+
+    // only the last change of each item is reported, and the deleted collection does not report its items
+    auto changes = backend.changesSince(seen);
+    QVERIFY(changes);
+    QVERIFY(changes.result_.size() == 3);
+    QVERIFY(changes.result_[0].itemId_ == item1->id() && !changes.result_[0].deleted_);
+    QVERIFY(changes.result_[1].collection_ == collName1 && changes.result_[1].deleted_);
+    QVERIFY(changes.result_[2].collection_ == collName2 && changes.result_[2].itemId_.empty() && changes.result_[2].deleted_);
+    QVERIFY(coll1->readItem(changes.result_[0].itemId_.c_str())->label() == "item1 renamed");
+    QVERIFY(backend.changesSince(seen, 1).result_.size() == 1);
+
+    QVERIFY(backend.purgeTombstones(backend.sequence()));
+    QVERIFY(backend.changesSince(seen).result_.size() == 1);
+
+    // an empty collection gets deleted the same way, with only its own tombstone
+    seen = backend.sequence();
+    QVERIFY(backend.createCollection(collName2).result_.get() != nullptr);
+    QVERIFY(backend.deleteCollection(collName2).result_);
+    changes = backend.changesSince(seen);
+    QVERIFY(changes.result_.size() == 1);
+    QVERIFY(changes.result_[0].collection_ == collName2 && changes.result_[0].itemId_.empty() && changes.result_[0].deleted_);
+}
+
+void KSecretServiceStoreTest::testStats()
+{
+    KSecretsStore backend;
+    size_t sunk = 0;
+    backend.setStatsSink([&sunk](KSecretsStore::Operation, std::uint64_t) { sunk++; });
+    auto setupfut = backend.setup(secretsFilePath.toLocal8Bit().constData(), false);
+    QVERIFY(setupfut.get());
+    QVERIFY(backend.createCollection("stats collection"));
+
+    auto stats = backend.stats();
+    QVERIFY(stats[KSecretsStore::Operation::Open].count_ > 0);
+    QVERIFY(stats[KSecretsStore::Operation::Save].count_ > 0);
+    // each save syncs and renames the written file
+    QVERIFY(stats[KSecretsStore::Operation::Sync].count_ == stats[KSecretsStore::Operation::Save].count_);
+    QVERIFY(stats[KSecretsStore::Operation::Rename].count_ == stats[KSecretsStore::Operation::Save].count_);
+    QVERIFY(stats.bytesRead_ > 0);
+    QVERIFY(stats.bytesWritten_ > 0);
+    const auto& macUpdates = stats[KSecretsStore::Operation::MacUpdate];
+    std::uint64_t bucketed = 0;
+    for (auto bucket : macUpdates.buckets_) {
+        bucketed += bucket;
+    }
+    QVERIFY(bucketed == macUpdates.count_);
+    QVERIFY(sunk > 0);
+
+    backend.resetStats();
+    QVERIFY(backend.stats()[KSecretsStore::Operation::Save].count_ == 0);
+    QVERIFY(backend.deleteCollection("stats collection"));
+}
+
+void KSecretServiceStoreTest::testCompressedCollection()
+{
+#ifndef KSECRETS_HAVE_ZLIB
+    QSKIP("built without compression support");
+#endif
+    QString snapshotPath = secretsFilePath + QLatin1Literal(".compressed");
+    QDir::home().remove(snapshotPath);
+    KSecretsStore::ItemValue value{ "text/plain", { 's', 'e', 'c', 'r', 'e', 't' } };
+    {
+        KSecretsStore backend;
+        auto setupfut = backend.setupInMemory(snapshotPath.toLocal8Bit().constData());
+        QVERIFY(setupfut.get());
+        auto coll = backend.createCollection(collName1).result_;
+        QVERIFY(coll.get() != nullptr);
+        QVERIFY(!coll->compressed());
+        QVERIFY(coll->setCompressed(true));
+        for (int i = 0; i < 10; i++) {
+            KSecretsStore::AttributesMap attrs{ { "xdg:schema", "org.freedesktop.Secret.Generic" }, { "index", std::to_string(i) } };
+            QVERIFY(coll->createItem(("compressed item " + std::to_string(i)).c_str(), attrs, value).get() != nullptr);
+        }
+    }
+    {
+        // the setting is kept in the file along with the items
+        KSecretsStore backend;
+        auto setupfut = backend.setup(snapshotPath.toLocal8Bit().constData(), false);
+        QVERIFY(setupfut.get());
+        auto coll = backend.readCollection(collName1).result_;
+        QVERIFY(coll.get() != nullptr);
+        QVERIFY(coll->compressed());
+        auto items = coll->searchItems("compressed item 7");
+        QVERIFY(items.size() == 1);
+        QVERIFY(items.front()->attributes().at("index") == "7");
+        QVERIFY(items.front()->value() == value);
+        QVERIFY(coll->setCompressed(false));
+    }
+    {
+        KSecretsStore backend;
+        auto setupfut = backend.setup(snapshotPath.toLocal8Bit().constData(), true);
+        QVERIFY(setupfut.get());
+        auto coll = backend.readCollection(collName1).result_;
+        QVERIFY(!coll->compressed());
+        QVERIFY(coll->dirItems().size() == 10);
+        QVERIFY(!coll->setCompressed(true));
+    }
+    QDir::home().remove(snapshotPath);
+}
+
+void KSecretServiceStoreTest::testSealed()
+{
+    auto path = secretsFilePath.toLocal8Bit();
+    KSecretsStore backend;
+    auto setupfut = backend.setup(path.constData(), false);
+    QVERIFY(setupfut.get());
+    auto coll = backend.createCollection("sealed collection").result_;
+    QVERIFY(coll.get() != nullptr);
+    for (int i = 0; i < 20; i++) {
+        KSecretsStore::AttributesMap attrs{ { "user", "user" + std::to_string(i) }, { "parity", i % 2 ? "odd" : "even" } };
+        QVERIFY(coll->createItem(("sealed item " + std::to_string(i)).c_str(), attrs, emptyValue).get() != nullptr);
+    }
+    QVERIFY(KSecretsStore::searchSealed(path.constData(), "sealed collection", {}).status_ == KSecretsStore::StoreStatus::CannotOpenFile);
+    QVERIFY(backend.setSealing(true));
+
+    auto found = KSecretsStore::searchSealed(path.constData(), "sealed collection", { { "user", "user7" } });
+    QVERIFY(found);
+    QVERIFY(found.result_.size() == 1);
+    QVERIFY(found.result_.front().label_ == "sealed item 7");
+    QVERIFY(KSecretsStore::searchSealed(path.constData(), "sealed collection", { { "parity", "odd" } }).result_.size() == 10);
+    QVERIFY(KSecretsStore::searchSealed(path.constData(), "sealed collection", {}).result_.size() == 20);
+    QVERIFY(KSecretsStore::searchSealed(path.constData(), "sealed collection", { { "user", "nobody" } }).result_.empty());
+
+    // the image follows the updates
+    QVERIFY(coll->createItem("sealed item 20", { { "user", "user20" } }, emptyValue).get() != nullptr);
+    QVERIFY(KSecretsStore::searchSealed(path.constData(), "sealed collection", { { "user", "user20" } }).result_.size() == 1);
+
+    QVERIFY(backend.setSealing(false));
+    QVERIFY(!KSecretsStore::searchSealed(path.constData(), "sealed collection", {}));
+    QVERIFY(backend.deleteCollection("sealed collection"));
+}
+
+void KSecretServiceStoreTest::testWarmUp()
+{
+    {
+        KSecretsStore backend;
+        auto setupfut = backend.setup(secretsFilePath.toLocal8Bit().constData(), false);
+        QVERIFY(setupfut.get());
+        QVERIFY(backend.isReady());
+        QVERIFY(backend.createCollection("warm collection"));
+    }
+    KSecretsStore backend;
+    QVERIFY(!backend.isReady());
+    auto warmfut = backend.warmUp(secretsFilePath.toLocal8Bit().constData());
+    QVERIFY(warmfut.get());
+    QVERIFY(backend.isReady());
+    QVERIFY(backend.readCollection("warm collection"));
+
+    KSecretsStore missing;
+    auto missingfut = missing.warmUp(QString(secretsFilePath + QLatin1Literal(".missing")).toLocal8Bit().constData());
+    QVERIFY(!missingfut.get());
+    QVERIFY(!missing.isReady());
+}
+
 void KSecretServiceStoreTest::cleanupTestCase() { QDir::home().remove(secretsFilePath); }
 
 // vim: tw=220 ts=4
@@ -42,6 +42,14 @@ private Q_SLOTS:
     void testDeleteItemFailOnReadonly();
     void testDeleteCollection();
     void testDeleteCollectionFailOnReadonly();
+    void testInMemory();
+    void testInMemoryAlongsideFile();
+    void testItemsPages();
+    void testChangesSince();
+    void testStats();
+    void testCompressedCollection();
+    void testSealed();
+    void testWarmUp();
     void cleanupTestCase();
 };
 
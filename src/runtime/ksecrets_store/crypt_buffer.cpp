@@ -34,6 +34,7 @@ CryptBuffer::CryptBuffer()
     : len_(0)
     , encrypted_(nullptr)
     , decrypted_(nullptr)
+    , context_(nullptr)
 {
     setg(nullptr, nullptr, nullptr);
     setp(nullptr, nullptr);
@@ -57,6 +58,7 @@ void CryptBuffer::empty() noexcept
 bool CryptBuffer::read(KSecretsDevice& file) noexcept
 {
     empty();
+    context_ = file.cryptingContext();
 
     if (!file.read(len_))
         return false;
@@ -82,8 +84,11 @@ bool CryptBuffer::read(KSecretsDevice& file) noexcept
 
 bool CryptBuffer::write(KSecretsDevice& file) noexcept
 {
+    context_ = file.cryptingContext();
     if (file.write(len_)) {
-        syslog(KSS_LOG_DEBUG, "ksecrets: write: |%s|", decrypted_);
+#ifdef KSECRETS_TRACE_IO
+        syslog(KSS_LOG_DEBUG, "ksecrets: write: %lu bytes", (unsigned long)len_);
+#endif
         encrypt();
         return file.write(encrypted_, len_);
     }
@@ -97,9 +102,11 @@ bool CryptBuffer::decrypt() noexcept
         return false;
     assert(encrypted_ != nullptr);
     decrypted_ = new unsigned char[len_];
-    auto dres = CryptingEngine::instance().decrypt(decrypted_, len_, encrypted_, len_);
+    auto dres = context_ != nullptr ? context_->decrypt(decrypted_, len_, encrypted_, len_) : CryptingEngine::instance().decrypt(decrypted_, len_, encrypted_, len_);
     if (dres) {
-        syslog(KSS_LOG_DEBUG, "ksecrets: read decrypted: |%s|", decrypted_);
+#ifdef KSECRETS_TRACE_IO
+        syslog(KSS_LOG_DEBUG, "ksecrets: read decrypted: %lu bytes", (unsigned long)len_);
+#endif
         setg((char*)decrypted_, (char*)decrypted_, (char*)decrypted_ + len_);
         setp((char*)decrypted_, (char*)decrypted_ + len_);
         return true;
@@ -123,7 +130,7 @@ bool CryptBuffer::encrypt() noexcept
     }
     CryptingEngine::create_nonce(encrypted_, len_);
 
-    auto eres = CryptingEngine::instance().encrypt(encrypted_, len_, decrypted_, len_);
+    auto eres = context_ != nullptr ? context_->encrypt(encrypted_, len_, decrypted_, len_) : CryptingEngine::instance().encrypt(encrypted_, len_, decrypted_, len_);
     if (!eres)
         return false;
     delete[] decrypted_, decrypted_ = nullptr;
@@ -28,6 +28,7 @@
 #include <iostream>
 
 class KSecretsFile;
+class CryptingContext;
 
 /**
  * @brief The CryptBuffer class is responsible for holding a serialization buffer allowing SecretEntity serialization then encryption
@@ -71,6 +72,7 @@ private:
     size_t len_;                                 /// the length of both encrypted_ and decrypted_ buffers is the same
     unsigned char* encrypted_;
     unsigned char* decrypted_;
+    CryptingContext* context_; /// the context of the device last read or written, the CryptingEngine if none
 };
 
 // operators for text-mode serialization
@@ -33,8 +33,6 @@ extern "C" {
 }
 
 #define GCRYPT_REQUIRED_VERSION "1.6.0"
-#define KSECRETS_SALTSIZE 56
-#define KSECRETS_KEYSIZE 256
 
 #define ERRNO(cryres) gcry_err_code_to_errno(gcry_err_code(cryres))
 
@@ -44,42 +42,31 @@ const char* keyNameMac = nullptr;
 const char* get_keyname_encrypting() { return keyNameEncrypting; }
 const char* get_keyname_mac() { return keyNameMac; }
 
-int kss_derive_keys(const char* salt, const char* password, char* encryption_key, char* mac_key, size_t keySize)
+int kss_derive_slot_key(const unsigned char* salt, const char* password, unsigned char* slot_key, size_t keySize)
 {
     gpg_error_t gcryerr;
 
-    syslog(KSS_LOG_INFO, "ksecrets: attempting keys generation");
+    syslog(KSS_LOG_INFO, "ksecrets: attempting key slot key generation");
     if (0 == password) {
         syslog(KSS_LOG_INFO, "NULL password given. ksecrets will not be available.");
         return FALSE;
     }
 
-    /* generate both encryption and MAC key in one go */
-    char* keys = new char[2 * keySize];
-    if (keys == nullptr) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot allocate memory for key buffer");
-        return FALSE;
-    }
-    gcryerr = gcry_kdf_derive(password, strlen(password), GCRY_KDF_ITERSALTED_S2K, GCRY_MD_SHA512, salt, 8, KSECRETS_ITERATIONS, 2 * keySize, keys);
+    gcryerr = gcry_kdf_derive(password, strlen(password), GCRY_KDF_PBKDF2, GCRY_MD_SHA512, salt, CryptingEngine::SALT_SIZE, KSECRETS_ITERATIONS, keySize, slot_key);
     if (gcryerr) {
-        delete[] keys;
         syslog(KSS_LOG_ERR, "ksecrets: key derivation failed: code 0x%0x: %s/%s", gcryerr, gcry_strsource(gcryerr), gcry_strerror(gcryerr));
         return FALSE;
     }
-
-    memcpy(encryption_key, keys, keySize);
-    memcpy(mac_key, keys + keySize, keySize);
-    delete[] keys;
-    syslog(KSS_LOG_INFO, "successuflly generated ksecrets keys from user password.");
+    syslog(KSS_LOG_INFO, "successuflly generated ksecrets key slot key from user password.");
 
     return TRUE;
 }
 
-int kss_store_keys(const char* encryption_key, const char* mac_key, size_t keySize)
+int kss_store_keys(const unsigned char* encryption_key, const unsigned char* mac_key)
 {
     key_serial_t ks;
     const char* key_name = get_keyname_encrypting();
-    ks = add_key("user", key_name, encryption_key, keySize, KEY_SPEC_USER_SESSION_KEYRING);
+    ks = add_key("user", key_name, encryption_key, CryptingEngine::ENCRYPTING_KEY_SIZE, KEY_SPEC_USER_SESSION_KEYRING);
     if (-1 == ks) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot store encryption key in kernel "
                             "keyring: errno=%d",
@@ -89,7 +76,7 @@ int kss_store_keys(const char* encryption_key, const char* mac_key, size_t keySi
     syslog(KSS_LOG_DEBUG, "ksecrets: encrypting key now in kernel keyring with id %d and desc %s", ks, key_name);
 
     key_name = get_keyname_mac();
-    ks = add_key("user", key_name, mac_key, keySize, KEY_SPEC_USER_SESSION_KEYRING);
+    ks = add_key("user", key_name, mac_key, CryptingEngine::MAC_KEY_SIZE, KEY_SPEC_USER_SESSION_KEYRING);
     if (-1 == ks) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot store mac key in kernel keyring: errno=%d", errno);
         return FALSE;
@@ -98,19 +85,6 @@ int kss_store_keys(const char* encryption_key, const char* mac_key, size_t keySi
     return TRUE;
 }
 
-int kss_set_credentials(const std::string& password, const char* salt)
-{
-    // FIXME this should be adjusted on platforms where kernel keyring is not
-    // available and store the keys elsewhere
-    char encryption_key[KSECRETS_KEYSIZE];
-    char mac_key[KSECRETS_KEYSIZE];
-    auto res = kss_derive_keys(salt, password.c_str(), encryption_key, mac_key, KSECRETS_KEYSIZE);
-    if (res == FALSE)
-        return res;
-
-    return kss_store_keys(encryption_key, mac_key, KSECRETS_KEYSIZE);
-}
-
 /**
  * @brief Reads a key from the kernel keyring
  *
@@ -225,7 +199,7 @@ bool CryptingEngine::isReady() noexcept
         return false;
     }
     if (!has_credentials_) {
-        char encryptingKey[KSECRETS_KEYSIZE];
+        char encryptingKey[ENCRYPTING_KEY_SIZE];
         auto keyres = kss_read_encrypting_key(encryptingKey, sizeof(encryptingKey) / sizeof(encryptingKey[0]));
         assert(keyres <= 0); // if positive result, then the handed buffer size is not sufficient
         if (keyres < 0) {
@@ -233,17 +207,36 @@ bool CryptingEngine::isReady() noexcept
             syslog(KSS_LOG_ERR, "ksecrets: encrypting key not found in the keyring");
             return false;
         }
-        auto cryres = gcry_cipher_setkey(hd_, encryptingKey, sizeof(encryptingKey) / sizeof(encryptingKey[0]));
-        if (cryres) {
-            syslog(KSS_LOG_ERR, "ksecrets: gcry_cipher_setkey returned %d", cryres);
-            return false;
-        }
-        has_credentials_ = true;
+        return setEncryptingKey((const unsigned char*)encryptingKey);
+    }
+    return true;
+}
+
+bool CryptingEngine::setEncryptingKey(const unsigned char* key) noexcept
+{
+    auto cryres = gcry_cipher_setkey(hd_, key, ENCRYPTING_KEY_SIZE);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: gcry_cipher_setkey returned %d", cryres);
+        return false;
     }
+    has_credentials_ = true;
     return true;
 }
 
-bool CryptingEngine::setCredentials(const std::string& password, const unsigned char* salt) noexcept
+bool CryptingEngine::generateMasterKeys() noexcept
+{
+    unsigned char* keys = (unsigned char*)gcry_malloc_secure(MASTER_KEYS_SIZE);
+    if (keys == nullptr) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot allocate secure memory for the master keys");
+        return false;
+    }
+    randomize(keys, MASTER_KEYS_SIZE);
+    auto res = setMasterKeys(keys);
+    gcry_free(keys);
+    return res;
+}
+
+bool CryptingEngine::setMasterKeys(const unsigned char* keys) noexcept
 {
     if (keyNameEncrypting == nullptr) {
         syslog(KSS_LOG_ERR, "ksecrets: please set encrypting keyname first");
@@ -253,13 +246,73 @@ bool CryptingEngine::setCredentials(const std::string& password, const unsigned
         syslog(KSS_LOG_ERR, "ksecrets: please set mac keyname first");
         return false;
     }
-    if (kss_set_credentials(password, (char*)salt) == FALSE) {
+    if (!isValid())
+        return false;
+    if (kss_store_keys(keys, keys + ENCRYPTING_KEY_SIZE) == FALSE) {
+        return false;
+    }
+    return setEncryptingKey(keys);
+}
+
+bool CryptingEngine::readMasterKeys(unsigned char* keys) noexcept
+{
+    if (keyNameEncrypting == nullptr || keyNameMac == nullptr) {
+        syslog(KSS_LOG_ERR, "ksecrets: please set the key names first");
+        return false;
+    }
+    if (kss_read_encrypting_key((char*)keys, ENCRYPTING_KEY_SIZE) != 0) {
+        syslog(KSS_LOG_ERR, "ksecrets: encrypting key not found in the keyring");
+        return false;
+    }
+    if (kss_read_mac_key((char*)keys + ENCRYPTING_KEY_SIZE, MAC_KEY_SIZE) != 0) {
+        syslog(KSS_LOG_ERR, "ksecrets: mac key not found in the keyring");
+        return false;
+    }
+    return true;
+}
+
+bool CryptingEngine::deriveSlotKey(const std::string& password, const unsigned char* salt, unsigned char* slotKey) noexcept
+{
+    return kss_derive_slot_key(salt, password.c_str(), slotKey, SLOT_KEY_SIZE) == TRUE;
+}
+
+bool CryptingEngine::wrapKeys(const unsigned char* slotKey, const unsigned char* keys, unsigned char* wrapped) noexcept
+{
+    gcry_cipher_hd_t hd;
+    auto cryres = gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_AESWRAP, GCRY_CIPHER_SECURE);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot open key wrapping cipher: %d", cryres);
+        return false;
+    }
+    cryres = gcry_cipher_setkey(hd, slotKey, SLOT_KEY_SIZE);
+    if (!cryres) {
+        cryres = gcry_cipher_encrypt(hd, wrapped, WRAPPED_KEYS_SIZE, keys, MASTER_KEYS_SIZE);
+    }
+    gcry_cipher_close(hd);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot wrap the master keys: %d", cryres);
         return false;
     }
-    has_credentials_ = true;
     return true;
 }
 
+bool CryptingEngine::unwrapKeys(const unsigned char* slotKey, const unsigned char* wrapped, unsigned char* keys) noexcept
+{
+    gcry_cipher_hd_t hd;
+    auto cryres = gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_AESWRAP, GCRY_CIPHER_SECURE);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot open key wrapping cipher: %d", cryres);
+        return false;
+    }
+    cryres = gcry_cipher_setkey(hd, slotKey, SLOT_KEY_SIZE);
+    if (!cryres) {
+        // the AES key wrap integrity check fails here when the slot key is not the one used for wrapping
+        cryres = gcry_cipher_decrypt(hd, keys, MASTER_KEYS_SIZE, wrapped, WRAPPED_KEYS_SIZE);
+    }
+    gcry_cipher_close(hd);
+    return cryres == 0;
+}
+
 bool CryptingEngine::encrypt(void* out, size_t lout, const void* in, size_t lin) noexcept
 {
     if (!isReady())
@@ -296,6 +349,7 @@ bool CryptingEngine::decrypt(void* out, size_t lout, const void* in, size_t lin)
 
 CryptingEngine::MAC::MAC()
     : need_init_(true)
+    , keyring_key_(false)
     , ignore_updates_(false)
 {
     auto gcryerr = gcry_mac_open(&hd_, GCRY_MAC_HMAC_SHA512, 0, 0);
@@ -315,15 +369,29 @@ CryptingEngine::MAC::~MAC()
     }
 }
 
-bool CryptingEngine::MAC::reset() noexcept
+bool CryptingEngine::MAC::reset(const CryptingContext* keys) noexcept
 {
     if (!valid_) {
         syslog(KSS_LOG_ERR, "ksecrets: MAC object is not valid");
         return false;
     }
-    if (need_init_) {
-        char macKey[KSECRETS_KEYSIZE];
-        if (kss_read_mac_key(macKey, KSECRETS_KEYSIZE) != 0) {
+    if (keys != nullptr) {
+        if (!keys->hasMasterKeys()) {
+            syslog(KSS_LOG_ERR, "ksecrets: the crypting context has no master keys");
+            return false;
+        }
+        // setting the key also resets the calculation
+        auto gcryerr = gcry_mac_setkey(hd_, keys->macKey(), CryptingEngine::MAC_KEY_SIZE);
+        if (gcryerr) {
+            syslog(KSS_LOG_ERR, "setting MAC key failed: code 0x%0x: %s/%s", gcryerr, gcry_strsource(gcryerr), gcry_strerror(gcryerr));
+            return false;
+        }
+        need_init_ = false;
+        keyring_key_ = false;
+    }
+    else if (!keyring_key_) {
+        char macKey[CryptingEngine::MAC_KEY_SIZE];
+        if (kss_read_mac_key(macKey, CryptingEngine::MAC_KEY_SIZE) != 0) {
             syslog(KSS_LOG_ERR, "ksecrets: cannot retrieve MAC key");
             return false;
         }
@@ -332,12 +400,13 @@ bool CryptingEngine::MAC::reset() noexcept
         //     syslog(KSS_LOG_ERR, "setting MAC IV failed: code 0x%0x: %s/%s", gcryerr, gcry_strsource(gcryerr), gcry_strerror(gcryerr));
         //     return false;
         // }
-        auto gcryerr = gcry_mac_setkey(hd_, macKey, KSECRETS_KEYSIZE);
+        auto gcryerr = gcry_mac_setkey(hd_, macKey, CryptingEngine::MAC_KEY_SIZE);
         if (gcryerr) {
             syslog(KSS_LOG_ERR, "setting MAC key failed: code 0x%0x: %s/%s", gcryerr, gcry_strsource(gcryerr), gcry_strerror(gcryerr));
             return false;
         }
         need_init_ = false;
+        keyring_key_ = true;
     }
     else {
         auto gcryerr = gcry_mac_reset(hd_);
@@ -414,6 +483,124 @@ bool CryptingEngine::MAC::verify(unsigned char* buffer, size_t len) noexcept
     return true;
 }
 
+CryptingContext::CryptingContext()
+    : has_keys_(false)
+    , has_iv_(false)
+    , valid_(false)
+{
+    // the secure memory pool is set-up along with the engine
+    CryptingEngine::instance();
+    keys_ = (unsigned char*)gcry_malloc_secure(CryptingEngine::MASTER_KEYS_SIZE);
+    if (keys_ == nullptr) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot allocate secure memory for the master keys");
+        return;
+    }
+    auto cryres = gcry_cipher_open(&hd_, GCRY_CIPHER_BLOWFISH, GCRY_CIPHER_MODE_CBC, 0);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: gcry_cipher_open returned error %d", cryres);
+        return;
+    }
+    valid_ = true;
+}
+
+CryptingContext::~CryptingContext()
+{
+    if (valid_) {
+        gcry_cipher_close(hd_);
+    }
+    gcry_free(keys_);
+}
+
+bool CryptingContext::generateMasterKeys() noexcept
+{
+    if (keys_ == nullptr)
+        return false;
+    CryptingEngine::randomize(keys_, CryptingEngine::MASTER_KEYS_SIZE);
+    return setCipherKey();
+}
+
+bool CryptingContext::setMasterKeys(const unsigned char* keys) noexcept
+{
+    if (keys_ == nullptr)
+        return false;
+    memcpy(keys_, keys, CryptingEngine::MASTER_KEYS_SIZE);
+    return setCipherKey();
+}
+
+bool CryptingContext::readSessionKeys() noexcept
+{
+    if (keys_ == nullptr)
+        return false;
+    has_keys_ = false;
+    return CryptingEngine::instance().readMasterKeys(keys_) && setCipherKey();
+}
+
+bool CryptingContext::setCipherKey() noexcept
+{
+    has_keys_ = false;
+    if (!valid_)
+        return false;
+    auto cryres = gcry_cipher_setkey(hd_, keys_, CryptingEngine::ENCRYPTING_KEY_SIZE);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: gcry_cipher_setkey returned %d", cryres);
+        return false;
+    }
+    has_keys_ = true;
+    return true;
+}
+
+bool CryptingContext::setIV(const unsigned char* iv, size_t liv) noexcept
+{
+    if (liv < CryptingEngine::IV_SIZE) {
+        syslog(KSS_LOG_ERR, "ksecrets: setIV called with a too short buffer");
+        return false;
+    }
+    memcpy(iv_, iv, CryptingEngine::IV_SIZE);
+    has_iv_ = true;
+    return true;
+}
+
+bool CryptingContext::isReady() const noexcept
+{
+    if (!has_keys_) {
+        syslog(KSS_LOG_ERR, "ksecrets: the crypting context has no master keys");
+        return false;
+    }
+    if (!has_iv_) {
+        syslog(KSS_LOG_ERR, "ksecrets: IV must be set before attempting encryption operations");
+        return false;
+    }
+    return true;
+}
+
+bool CryptingContext::encrypt(void* out, size_t lout, const void* in, size_t lin) noexcept
+{
+    if (!isReady())
+        return false;
+    auto cryres = gcry_cipher_setiv(hd_, iv_, CryptingEngine::IV_SIZE);
+    if (!cryres)
+        cryres = gcry_cipher_encrypt(hd_, out, lout, in, lin);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: gcry_cipher_encrypt returned %d", cryres);
+        return false;
+    }
+    return true;
+}
+
+bool CryptingContext::decrypt(void* out, size_t lout, const void* in, size_t lin) noexcept
+{
+    if (!isReady())
+        return false;
+    auto cryres = gcry_cipher_setiv(hd_, iv_, CryptingEngine::IV_SIZE);
+    if (!cryres)
+        cryres = gcry_cipher_decrypt(hd_, out, lout, in, lin);
+    if (cryres) {
+        syslog(KSS_LOG_ERR, "ksecrets: gcry_cipher_decrypt returned %d", cryres);
+        return false;
+    }
+    return true;
+}
+
 CryptingEngine::Buffer::Buffer()
     : bytes_(nullptr)
     , len_(0)
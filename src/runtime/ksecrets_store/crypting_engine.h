@@ -25,11 +25,15 @@
 #define GCRPYT_NO_DEPRECATED
 #include <gcrypt.h>
 #include <memory>
+#include <string>
+
+class CryptingContext;
 
 class CryptingEngine {
     CryptingEngine();
     void setup() noexcept;
     bool isReady() noexcept;
+    bool setEncryptingKey(const unsigned char* key) noexcept;
 
 public:
     static CryptingEngine& instance();
@@ -41,19 +45,34 @@ public:
 
     constexpr static auto IV_SIZE = 8;
     constexpr static auto SALT_SIZE = 56;
+    constexpr static auto ENCRYPTING_KEY_SIZE = 56; /// blowfish maximum key length
+    constexpr static auto MAC_KEY_SIZE = 64;
+    constexpr static auto MASTER_KEYS_SIZE = ENCRYPTING_KEY_SIZE + MAC_KEY_SIZE;
+    constexpr static auto SLOT_KEY_SIZE = 32;                     /// AES-256 key wrapping the master keys
+    constexpr static auto WRAPPED_KEYS_SIZE = MASTER_KEYS_SIZE + 8; /// AES key wrap adds one 64 bit block
 
     bool isValid() noexcept;
     static bool setIV(const unsigned char* iv, size_t liv) noexcept;
     static unsigned char* getIV() noexcept;
+
     /**
-     * @brief This allow to specify a password instead of letting this engine get it from the kernel keyring
-     *
-     * @param password the new password
-     * @param salt the salt to be used for deriving the keys
+     * @brief The secrets are encrypted with random master keys, the encrypting key and the MAC key, concatenated in that order
+     * into MASTER_KEYS_SIZE bytes. The user's password only wraps these keys into the key slots of the secrets file, so
+     * changing the password does not need to re-encrypt the secrets.
      *
-     * @return
+     * The master keys are kept in the kernel keyring for the duration of the user session.
+     */
+    bool generateMasterKeys() noexcept;
+    bool setMasterKeys(const unsigned char* keys) noexcept;
+    bool readMasterKeys(unsigned char* keys) noexcept;
+
+    static bool deriveSlotKey(const std::string& password, const unsigned char* salt, unsigned char* slotKey) noexcept;
+    static bool wrapKeys(const unsigned char* slotKey, const unsigned char* keys, unsigned char* wrapped) noexcept;
+    /**
+     * @return false if the slot key does not correspond to the one used when wrapping, e.g. the password is not the right one
      */
-    bool setCredentials(const std::string& password, const unsigned char* salt) noexcept;
+    static bool unwrapKeys(const unsigned char* slotKey, const unsigned char* wrapped, unsigned char* keys) noexcept;
+
     bool encrypt(void* out, size_t lout, const void* in, size_t lin) noexcept;
     bool decrypt(void* out, size_t lout, const void* in, size_t lin) noexcept;
 
@@ -69,7 +88,10 @@ public:
     struct MAC {
         MAC();
         ~MAC();
-        bool reset() noexcept;
+        /**
+         * @brief Starts a new MAC calculation, keyed with the MAC key of the given context or, without one, of the keyring
+         */
+        bool reset(const CryptingContext* keys = nullptr) noexcept;
         bool update(const void* buffer, size_t len) noexcept;
         void stop() noexcept;
         BufferPtr read() noexcept;
@@ -79,6 +101,7 @@ public:
         gcry_mac_hd_t hd_;
         bool valid_;
         bool need_init_;
+        bool keyring_key_; /// the key in use comes from the keyring, so it's only set once
         bool ignore_updates_;
     };
 
@@ -91,5 +114,49 @@ private:
     gcry_cipher_hd_t hd_;
 };
 
+/**
+ * @brief Master keys and cipher held outside the kernel keyring and the CryptingEngine
+ *
+ * Each secrets file encrypts its entities with its own context, so opening another file, or creating one, does not change
+ * the keys a file already in use encrypts with. The keys are kept in secure memory.
+ */
+class CryptingContext {
+public:
+    CryptingContext();
+    ~CryptingContext();
+    CryptingContext(const CryptingContext&) = delete;
+    CryptingContext& operator=(const CryptingContext&) = delete;
+
+    bool generateMasterKeys() noexcept;
+    bool setMasterKeys(const unsigned char* keys) noexcept;
+    /**
+     * @brief Sets the master keys of the session, read from the kernel keyring
+     */
+    bool readSessionKeys() noexcept;
+    bool hasMasterKeys() const noexcept { return has_keys_; }
+    /**
+     * @return the MASTER_KEYS_SIZE bytes of the master keys, valid only if hasMasterKeys()
+     */
+    const unsigned char* masterKeys() const noexcept { return keys_; }
+    const unsigned char* macKey() const noexcept { return keys_ + CryptingEngine::ENCRYPTING_KEY_SIZE; }
+
+    bool setIV(const unsigned char* iv, size_t liv) noexcept;
+    const unsigned char* iv() const noexcept { return iv_; }
+    bool encrypt(void* out, size_t lout, const void* in, size_t lin) noexcept;
+    bool decrypt(void* out, size_t lout, const void* in, size_t lin) noexcept;
+
+private:
+    bool setCipherKey() noexcept;
+    bool isReady() const noexcept;
+
+    unsigned char* keys_;
+    bool has_keys_;
+    unsigned char iv_[CryptingEngine::IV_SIZE];
+    bool has_iv_;
+    gcry_cipher_hd_t hd_;
+    bool valid_;
+};
+using CryptingContextPtr = std::shared_ptr<CryptingContext>;
+
 #endif
 // vim: tw=220:ts=4
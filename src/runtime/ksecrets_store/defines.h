@@ -28,6 +28,7 @@
 #define KSS_LOG_ERR (LOG_AUTH | LOG_ERR)
 
 #define KSECRETS_ITERATIONS 50000
+#define KSECRETS_BACKUP_GENERATIONS 3
 
 #define FALSE 0
 #define TRUE 1
@@ -0,0 +1,112 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#ifndef KSECRETS_ARENA_H
+#define KSECRETS_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * @brief Bump allocator holding the entities loaded from one generation of the secrets file
+ *
+ * Loading a file creates thousands of small entities. The arena carves them, along with their shared_ptr control blocks,
+ * out of a few large blocks, so they sit next to each other in the file order. Nothing is freed individually: the blocks
+ * are released all at once when the last entity of the generation goes away, as each entity keeps its arena alive through
+ * its allocator, @see make()
+ *
+ * @note the arena is not thread-safe, it's only used by the thread loading the file
+ */
+class EntityArena {
+public:
+    constexpr static size_t BLOCK_SIZE = 64 * 1024;
+
+    EntityArena()
+        : used_(BLOCK_SIZE)
+    {
+    }
+    EntityArena(const EntityArena&) = delete;
+    EntityArena& operator=(const EntityArena&) = delete;
+
+    void* allocate(size_t size, size_t align)
+    {
+        used_ = (used_ + align - 1) & ~(align - 1);
+        if (blocks_.empty() || used_ + size > blockSize_) {
+            // oversized requests get their own block
+            blockSize_ = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+            blocks_.emplace_back(new unsigned char[blockSize_]);
+            used_ = 0;
+        }
+        void* p = blocks_.back().get() + used_;
+        used_ += size;
+        return p;
+    }
+
+    size_t blocksCount() const noexcept { return blocks_.size(); }
+
+    /**
+     * @return an entity allocated in the given arena, in a single allocation with its shared_ptr control block
+     */
+    template <class T, class... Args> static std::shared_ptr<T> make(const std::shared_ptr<EntityArena>& arena, Args&&... args);
+
+private:
+    std::vector<std::unique_ptr<unsigned char[]> > blocks_;
+    size_t blockSize_ = 0;
+    size_t used_;
+};
+
+using EntityArenaPtr = std::shared_ptr<EntityArena>;
+
+/**
+ * @brief Standard allocator adapter for @ref EntityArena. Deallocation does nothing, the memory goes back with the arena.
+ */
+template <class T> class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(EntityArenaPtr arena) noexcept : arena_(std::move(arena)) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.arena_)
+    {
+    }
+
+    T* allocate(size_t n) { return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) noexcept {}
+
+    template <class U> bool operator==(const ArenaAllocator<U>& other) const noexcept { return arena_ == other.arena_; }
+    template <class U> bool operator!=(const ArenaAllocator<U>& other) const noexcept { return arena_ != other.arena_; }
+
+private:
+    template <class U> friend class ArenaAllocator;
+    EntityArenaPtr arena_;
+};
+
+template <class T, class... Args> std::shared_ptr<T> EntityArena::make(const std::shared_ptr<EntityArena>& arena, Args&&... args)
+{
+    if (!arena)
+        return std::make_shared<T>(std::forward<Args>(args)...);
+    return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+}
+
+#endif
+// vim: tw=220:ts=4
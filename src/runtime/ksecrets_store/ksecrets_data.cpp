@@ -26,8 +26,74 @@
 #include <algorithm>
 #include <cassert>
 #include <iomanip>
+#include <sstream>
+
+#ifdef KSECRETS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+
+/**
+ * The first decrypted byte of the compressed entities. The fields of the uncompressed ones always start with a space.
+ */
+const char COMPRESSED_MARK = 'Z';
+/**
+ * Refuse inflating anything bigger than this, as the sizes come from the file before its MAC gets checked
+ */
+const std::string::size_type MAX_INFLATED_SIZE = 256 * 1024 * 1024;
+
+#ifdef KSECRETS_HAVE_ZLIB
+/**
+ * Preset deflate dictionary made of the strings the desktop applications put in most of their items. It's part of the
+ * file format: changing it would need another compression mark.
+ */
+const char DEFLATE_DICTIONARY[] = "text/plain application/octet-stream xdg:schema org.freedesktop.Secret.Generic org.gnome.keyring.NetworkPassword "
+                                  "org.kde.kwallet.Password org.mozilla.Login server service protocol domain user username password https://";
+
+bool deflateFields(const std::string& fields, std::string& compressed) noexcept
+{
+    z_stream zs{};
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+        return false;
+    bool res = false;
+    if (deflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(DEFLATE_DICTIONARY), sizeof(DEFLATE_DICTIONARY) - 1) == Z_OK) {
+        compressed.resize(deflateBound(&zs, fields.size()));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(fields.data()));
+        zs.avail_in = fields.size();
+        zs.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+        zs.avail_out = compressed.size();
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+            compressed.resize(zs.total_out);
+            res = true;
+        }
+    }
+    deflateEnd(&zs);
+    return res;
+}
 
-SecretsEntityPtr SecretsEntityFactory::createInstance(SecretsEntity::EntityType et)
+bool inflateFields(const std::string& compressed, std::string& fields) noexcept
+{
+    z_stream zs{};
+    if (inflateInit(&zs) != Z_OK)
+        return false;
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+    zs.avail_in = compressed.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&fields[0]);
+    zs.avail_out = fields.size();
+    int ret = inflate(&zs, Z_FINISH);
+    if (ret == Z_NEED_DICT && inflateSetDictionary(&zs, reinterpret_cast<const Bytef*>(DEFLATE_DICTIONARY), sizeof(DEFLATE_DICTIONARY) - 1) == Z_OK) {
+        ret = inflate(&zs, Z_FINISH);
+    }
+    bool res = ret == Z_STREAM_END && zs.total_out == fields.size();
+    inflateEnd(&zs);
+    return res;
+}
+#endif
+
+} // namespace
+
+SecretsEntityPtr SecretsEntityFactory::createInstance(SecretsEntity::EntityType et, const EntityArenaPtr& arena)
 {
     SecretsEntityPtr res;
     switch (et) {
@@ -35,16 +101,22 @@ SecretsEntityPtr SecretsEntityFactory::createInstance(SecretsEntity::EntityType
         assert(0);
         break;
     case SecretsEntity::EntityType::CollectionDirectoryType:
-        res = std::make_shared<CollectionDirectory>();
+        res = EntityArena::make<CollectionDirectory>(arena);
         break;
     case SecretsEntity::EntityType::SecretsItemType:
-        res = std::make_shared<SecretsItem>();
+        res = EntityArena::make<SecretsItem>(arena);
         break;
     case SecretsEntity::EntityType::SecretsEOFType:
-        res = std::make_shared<SecretsEOF>();
+        res = EntityArena::make<SecretsEOF>(arena);
+        break;
+    case SecretsEntity::EntityType::SecretsCollectionType: {
+        auto collection = EntityArena::make<SecretsCollection>(arena);
+        collection->setArena(arena);
+        res = collection;
         break;
-    case SecretsEntity::EntityType::SecretsCollectionType:
-        res = std::make_shared<SecretsCollection>();
+    }
+    case SecretsEntity::EntityType::ChangeLogType:
+        res = EntityArena::make<ChangeLog>(arena);
         break;
     default:
         syslog(KSS_LOG_ERR, "ksecrets: unkonw entity type creation requested %ld", (long)et);
@@ -58,14 +130,45 @@ SecretsEntity::~SecretsEntity() {}
 
 bool SecretsEntity::write(KSecretsFile& file) noexcept
 {
-    std::ostream os(&buffer_);
-    if (!serialize(os) || !os.good())
+    // entities are written again upon each save, so the buffer only lives for the duration of the write
+    CryptBuffer buffer;
+    std::ostream os(&buffer);
+    if (compressed()) {
+#ifdef KSECRETS_HAVE_ZLIB
+        std::ostringstream fields;
+        if (!serialize(fields) || !serializeChildren(fields))
+            return false;
+        // same as below, a trailing number would otherwise hit the end of the stream when read back
+        fields << '\n';
+        if (!fields.good())
+            return false;
+        std::string compressedFields;
+        if (!deflateFields(fields.str(), compressedFields)) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot compress entity");
+            return false;
+        }
+        os << COMPRESSED_MARK << ' ' << fields.str().size() << compressedFields;
+        if (!serializeValues(os) || !os.good())
+            return false;
+#else
+        syslog(KSS_LOG_ERR, "ksecrets: compression requested but the library was built without it");
         return false;
+#endif
+    }
+    else {
+        if (!serialize(os) || !os.good())
+            return false;
 
-    if (!serializeChildren(os) || !os.good())
+        if (!serializeChildren(os) || !os.good())
+            return false;
+    }
+
+    // the buffer gets padded with random bytes, so terminate the last field, otherwise reading a trailing number may go on with padding digits
+    os << '\n';
+    if (!os.good())
         return false;
 
-    if (!buffer_.write(file)) {
+    if (!buffer.write(file)) {
         onWriteError();
         return false;
     }
@@ -78,15 +181,45 @@ bool SecretsEntity::read(KSecretsFile& file) noexcept
     if (!doBeforeRead())
         return false;
 
+    KSecretsMetrics::Timer timer(file.metrics(), KSecretsMetrics::Operation::DecryptEntity);
+    // the entity keeps the deserialized fields only, so do not keep the encrypted and the decrypted copies along
+    CryptBuffer buffer;
     bool res = false;
-    if (buffer_.read(file)) {
-        std::istream is(&buffer_);
-
-        if (!deserialize(is))
+    if (buffer.read(file)) {
+        std::istream is(&buffer);
+
+        if (is.peek() == COMPRESSED_MARK) {
+#ifdef KSECRETS_HAVE_ZLIB
+            is.get();
+            std::string::size_type fieldsSize = 0;
+            std::string compressedFields;
+            is >> fieldsSize >> compressedFields;
+            if (!is.good() || fieldsSize > MAX_INFLATED_SIZE)
+                return false;
+            std::string fields(fieldsSize, '\0');
+            if (!inflateFields(compressedFields, fields)) {
+                syslog(KSS_LOG_ERR, "ksecrets: cannot uncompress entity");
+                return false;
+            }
+            setCompressed(true);
+            std::istringstream fieldsStream(fields);
+            if (!deserialize(fieldsStream) || !deserializeChildren(fieldsStream))
+                return false;
+
+            if (!deserializeValues(is))
+                return false;
+#else
+            syslog(KSS_LOG_ERR, "ksecrets: found a compressed entity but the library was built without compression");
             return false;
+#endif
+        }
+        else {
+            if (!deserialize(is))
+                return false;
 
-        if (!deserializeChildren(is))
-            return false;
+            if (!deserializeChildren(is))
+                return false;
+        }
 
         res = true;
     }
@@ -98,6 +231,8 @@ bool SecretsEntity::read(KSecretsFile& file) noexcept
 
 bool SecretsEntity::deserializeChildren(std::istream&) noexcept { return true; }
 bool SecretsEntity::serializeChildren(std::ostream&) noexcept { return true; }
+bool SecretsEntity::deserializeValues(std::istream&) noexcept { return true; }
+bool SecretsEntity::serializeValues(std::ostream&) noexcept { return true; }
 void SecretsEntity::onReadError() noexcept { /* nothing to do here */}
 void SecretsEntity::onWriteError() noexcept { /* nothing to do here */}
 
@@ -107,22 +242,26 @@ void CollectionDirectory::addCollection(const std::string& collName) noexcept
 {
     assert(!hasEntry(collName));
     entries_.emplace_back(collName);
-    // FIXME should we sort this list?
+    entriesIndex_.emplace(collName);
 }
 
-bool CollectionDirectory::hasEntry(const std::string& collName) const noexcept
+bool CollectionDirectory::removeCollection(const std::string& collName) noexcept
 {
-    // FIXME should we use some binary search algo here?
-    auto pos = std::find(entries_.begin(), entries_.end(), collName);
-    return pos != entries_.end();
+    if (entriesIndex_.erase(collName) == 0)
+        return false;
+    entries_.erase(std::find(entries_.begin(), entries_.end(), collName));
+    return true;
 }
 
+bool CollectionDirectory::hasEntry(const std::string& collName) const noexcept { return entriesIndex_.find(collName) != entriesIndex_.end(); }
+
 bool CollectionDirectory::serialize(std::ostream& os) noexcept
 {
-    syslog(KSS_LOG_INFO, "ksecrets: CollectionDirectory serializing %d items", (int)entries_.size());
+#ifdef KSECRETS_TRACE_IO
+    syslog(KSS_LOG_DEBUG, "ksecrets: CollectionDirectory serializing %d items", (int)entries_.size());
+#endif
     os << ' ' << entries_.size();
     for (const std::string& entry : entries_) {
-        syslog(KSS_LOG_INFO, "   %s", entry.c_str());
         os << entry;
     }
     return true;
@@ -140,32 +279,104 @@ bool CollectionDirectory::deserialize(std::istream& is) noexcept
         if (!is.good())
             return false;
         entries_.emplace_back(entry);
+        entriesIndex_.emplace(entry);
     }
     return true;
 }
 
 void SecretsCollection::setName(const std::string& name) noexcept { name_ = name; }
 
+size_t SecretsCollection::ItemsTable::find(const std::string& id) const noexcept
+{
+    auto pos = std::lower_bound(ids_.begin(), ids_.end(), id);
+    return pos != ids_.end() && *pos == id ? pos - ids_.begin() : npos;
+}
+
+size_t SecretsCollection::ItemsTable::upper_bound(const std::string& id) const noexcept { return std::upper_bound(ids_.begin(), ids_.end(), id) - ids_.begin(); }
+
+void SecretsCollection::ItemsTable::insert(SecretsItemPtr item) noexcept
+{
+    // the file keeps the items sorted, so loading only appends
+    size_t pos = upper_bound(item->id());
+    if (pos > 0 && ids_[pos - 1] == item->id()) {
+        items_[pos - 1] = item;
+        return;
+    }
+    ids_.insert(ids_.begin() + pos, item->id());
+    items_.insert(items_.begin() + pos, item);
+}
+
+bool SecretsCollection::ItemsTable::erase(const std::string& id) noexcept
+{
+    size_t pos = find(id);
+    if (pos == npos)
+        return false;
+    ids_.erase(ids_.begin() + pos);
+    items_.erase(items_.begin() + pos);
+    return true;
+}
+
+void SecretsCollection::ItemsTable::clear() noexcept
+{
+    ids_.clear();
+    items_.clear();
+}
+
+void SecretsCollection::addItem(SecretsItemPtr item) noexcept { items_.insert(item); }
+
+bool SecretsCollection::removeItem(SecretsItemPtr item) noexcept
+{
+    size_t pos = items_.find(item->id());
+    if (pos == ItemsTable::npos || items_.item(pos) != item)
+        return false;
+    return items_.erase(item->id());
+}
+
 bool SecretsCollection::serializeChildren(std::ostream& os) noexcept
 {
     bool res = true;
     for (SecretsItemPtr item : items_) {
-        if (item->serialize(os) || !os.good())
+        if (!(compressed_ ? item->serializeMetadata(os) : item->serialize(os)) || !os.good())
             return false;
     }
     return res;
 }
 
+bool SecretsCollection::serializeValues(std::ostream& os) noexcept
+{
+    for (SecretsItemPtr item : items_) {
+        if (!item->serializeValue(os) || !os.good())
+            return false;
+    }
+    return true;
+}
+
 bool SecretsCollection::deserializeChildren(std::istream& is) noexcept
 {
-    bool res = true;
+    items_.clear();
+    for (size_t i = 0; i < itemsCount_; i++) {
+        auto item = EntityArena::make<SecretsItem>(arena_);
+        if (!(compressed_ ? item->deserializeMetadata(is) : item->deserialize(is)) || !is.good())
+            return false;
+        addItem(item);
+    }
+    return true;
+}
 
-    return res;
+bool SecretsCollection::deserializeValues(std::istream& is) noexcept
+{
+    // the values follow the items table order, which is the one they were serialized in
+    for (SecretsItemPtr item : items_) {
+        if (!item->deserializeValue(is))
+            return false;
+    }
+    return true;
 }
 
 bool SecretsCollection::serialize(std::ostream& os) noexcept
 {
     os << name_;
+    os << ' ' << sequence_;
     os << ' ' << items_.size();
     return true;
 }
@@ -173,20 +384,125 @@ bool SecretsCollection::serialize(std::ostream& os) noexcept
 bool SecretsCollection::deserialize(std::istream& is) noexcept
 {
     is >> name_;
+    is >> sequence_;
     is >> itemsCount_;
     return true;
 }
 
-bool SecretsItem::serialize(std::ostream&) noexcept
+SecretsItem::SecretsItem()
+    : sequence_(0)
+    , createdTime_(std::time(nullptr))
+    , modifiedTime_(createdTime_)
 {
-    // TODO
-    return false;
 }
 
-bool SecretsItem::deserialize(std::istream&) noexcept
+void SecretsItem::setId(const std::string& id) noexcept { id_ = id; }
+
+void SecretsItem::setLabel(const std::string& label) noexcept
 {
-    // TODO
-    return false;
+    label_ = label;
+    modifiedTime_ = std::time(nullptr);
+}
+
+void SecretsItem::setAttributes(AttributesMap attributes) noexcept
+{
+    attributes_ = std::move(attributes);
+    modifiedTime_ = std::time(nullptr);
+}
+
+void SecretsItem::setValue(const std::string& contentType, Contents contents) noexcept
+{
+    contentType_ = contentType;
+    contents_ = std::move(contents);
+    modifiedTime_ = std::time(nullptr);
+}
+
+bool SecretsItem::serialize(std::ostream& os) noexcept { return serializeMetadata(os) && serializeValue(os); }
+
+bool SecretsItem::serializeMetadata(std::ostream& os) noexcept
+{
+    os << id_;
+    os << ' ' << sequence_;
+    os << label_;
+    os << ' ' << static_cast<long long>(createdTime_) << ' ' << static_cast<long long>(modifiedTime_);
+    os << ' ' << attributes_.size();
+    for (const auto& attr : attributes_) {
+        os << attr.first << attr.second;
+    }
+    return true;
+}
+
+bool SecretsItem::serializeValue(std::ostream& os) noexcept
+{
+    os << contentType_;
+    os << std::string(contents_.begin(), contents_.end());
+    return true;
+}
+
+bool SecretsItem::deserialize(std::istream& is) noexcept { return deserializeMetadata(is) && deserializeValue(is); }
+
+bool SecretsItem::deserializeMetadata(std::istream& is) noexcept
+{
+    is >> id_;
+    is >> sequence_;
+    is >> label_;
+    long long created = 0, modified = 0;
+    is >> created >> modified;
+    createdTime_ = created;
+    modifiedTime_ = modified;
+    AttributesMap::size_type n = 0;
+    is >> n;
+    attributes_.clear();
+    for (AttributesMap::size_type i = 0; i < n && is.good(); i++) {
+        std::string name, value;
+        is >> name >> value;
+        attributes_.emplace(std::move(name), std::move(value));
+    }
+    return is.good();
+}
+
+bool SecretsItem::deserializeValue(std::istream& is) noexcept
+{
+    is >> contentType_;
+    std::string contents;
+    is >> contents;
+    contents_.assign(contents.begin(), contents.end());
+    return is.good();
+}
+
+void ChangeLog::addTombstone(Tombstone tombstone) noexcept { tombstones_.emplace_back(std::move(tombstone)); }
+
+void ChangeLog::purgeTombstones(Sequence upTo) noexcept
+{
+    while (!tombstones_.empty() && tombstones_.front().sequence_ <= upTo) {
+        tombstones_.pop_front();
+    }
+}
+
+bool ChangeLog::serialize(std::ostream& os) noexcept
+{
+    os << ' ' << sequence_;
+    os << ' ' << tombstones_.size();
+    for (const Tombstone& tombstone : tombstones_) {
+        os << ' ' << tombstone.sequence_;
+        os << tombstone.collection_ << tombstone.item_;
+    }
+    return true;
+}
+
+bool ChangeLog::deserialize(std::istream& is) noexcept
+{
+    is >> sequence_;
+    Tombstones::size_type n = 0;
+    is >> n;
+    tombstones_.clear();
+    for (Tombstones::size_type i = 0; i < n && is.good(); i++) {
+        Tombstone tombstone;
+        is >> tombstone.sequence_;
+        is >> tombstone.collection_ >> tombstone.item_;
+        tombstones_.emplace_back(std::move(tombstone));
+    }
+    return is.good();
 }
 
 bool SecretsEOF::serialize(std::ostream&) noexcept
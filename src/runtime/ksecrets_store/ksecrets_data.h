@@ -22,11 +22,17 @@
 #define KSECRETS_DATA_H
 
 #include "crypt_buffer.h"
+#include "ksecrets_arena.h"
 
 #include <cstdint>
 #include <sys/types.h>
 #include <memory>
 #include <deque>
+#include <map>
+#include <vector>
+#include <ctime>
+#include <string>
+#include <unordered_set>
 #include <ostream>
 #include <istream>
 
@@ -60,9 +66,15 @@ public:
         CollectionDirectoryType,
         SecretsItemType,
         SecretsCollectionType,
-        SecretsEOFType
+        SecretsEOFType,
+        ChangeLogType
     };
 
+    /**
+     * @brief Store-wide mutation counter value, @see ChangeLog
+     */
+    using Sequence = std::uint64_t;
+
     virtual EntityType getType() const = 0;
 
     bool write(KSecretsFile&) noexcept;
@@ -71,23 +83,36 @@ public:
     virtual bool serialize(std::ostream&) noexcept = 0;
     virtual bool deserialize(std::istream&) noexcept = 0;
 
+    /**
+     * @brief Compressed entities get their fields deflated before being encrypted
+     *
+     * The secret values are kept out of the compressed part, see serializeValues(), as their compressed size would tell
+     * something about their contents. The compression is flagged in the entity itself, so the setting survives the
+     * reloads and the files written without compression stay readable.
+     */
+    virtual bool compressed() const noexcept { return false; }
+    virtual void setCompressed(bool) noexcept {}
+
 private:
     virtual bool deserializeChildren(std::istream&) noexcept;
+    virtual bool deserializeValues(std::istream&) noexcept;
     virtual bool doBeforeRead() noexcept { return true; }
     virtual void onReadError() noexcept;
 
     virtual bool serializeChildren(std::ostream&) noexcept;
+    virtual bool serializeValues(std::ostream&) noexcept;
     virtual void onWriteError() noexcept;
-
-private:
-    CryptBuffer buffer_;
 };
 
 using SecretsEntityPtr = std::shared_ptr<SecretsEntity>;
 
 class SecretsEntityFactory {
 public:
-    static SecretsEntityPtr createInstance(SecretsEntity::EntityType);
+    /**
+     * @brief Creates an empty entity of the given type, in the given arena if any. The collections also create their
+     * items there when reading them.
+     */
+    static SecretsEntityPtr createInstance(SecretsEntity::EntityType, const EntityArenaPtr& arena = EntityArenaPtr());
 };
 
 /**
@@ -105,7 +130,8 @@ public:
  */
 class CollectionDirectory : public SecretsEntity {
 public:
-    using Entries = std::deque<std::string>;
+    using Entries = std::vector<std::string>;
+    using EntriesIndex = std::unordered_set<std::string>;
 
     CollectionDirectory();
 
@@ -115,6 +141,7 @@ public:
     CollectionDirectory& operator = (const CollectionDirectory&) = delete;
 
     void addCollection(const std::string&) noexcept;
+    bool removeCollection(const std::string&) noexcept;
     bool hasEntry(const std::string&) const noexcept;
     virtual EntityType getType() const noexcept { return EntityType::CollectionDirectoryType; }
     const Entries& entries() const noexcept { return entries_; }
@@ -124,35 +151,146 @@ public:
 
 private:
     Entries entries_;
+    EntriesIndex entriesIndex_; /// mirrors entries_ for constant time hasEntry, entries_ keeps the creation order
 };
 
 using CollectionDirectoryPtr = std::shared_ptr<CollectionDirectory>;
 
 class SecretsItem : public SecretsEntity {
 public:
+    using AttributesMap = std::map<std::string, std::string>;
+    using Contents = std::vector<char>;
+
+    SecretsItem();
+
+    /**
+     * @brief Each item gets an unique identifier upon creation. It's the key used by the @ref KSecretsFile items index
+     */
+    const std::string& id() const noexcept { return id_; }
+    void setId(const std::string&) noexcept;
+
+    /**
+     * @note the setters below also update the modified time
+     */
+    const std::string& label() const noexcept { return label_; }
+    void setLabel(const std::string&) noexcept;
+    const AttributesMap& attributes() const noexcept { return attributes_; }
+    void setAttributes(AttributesMap) noexcept;
+    const std::string& contentType() const noexcept { return contentType_; }
+    const Contents& contents() const noexcept { return contents_; }
+    void setValue(const std::string& contentType, Contents) noexcept;
+
+    std::time_t createdTime() const noexcept { return createdTime_; }
+    std::time_t modifiedTime() const noexcept { return modifiedTime_; }
+
+    /**
+     * @brief Store sequence number of the last change of this item, stamped by the @ref KSecretsFile
+     */
+    Sequence sequence() const noexcept { return sequence_; }
+    void setSequence(Sequence sequence) noexcept { sequence_ = sequence; }
+
     virtual bool serialize(std::ostream&) noexcept override;
     virtual bool deserialize(std::istream&) noexcept override;
+    /**
+     * @brief The serialize() and deserialize() halves, used separately by the compressed collections
+     */
+    bool serializeMetadata(std::ostream&) noexcept;
+    bool serializeValue(std::ostream&) noexcept;
+    bool deserializeMetadata(std::istream&) noexcept;
+    bool deserializeValue(std::istream&) noexcept;
 private:
     virtual EntityType getType() const noexcept { return EntityType::SecretsItemType; }
+
+    Sequence sequence_;
+    std::string id_;
+    std::string label_;
+    AttributesMap attributes_;
+    std::string contentType_;
+    Contents contents_;
+    std::time_t createdTime_;
+    std::time_t modifiedTime_;
 };
 
 using SecretsItemPtr = std::shared_ptr<SecretsItem>;
 
 class SecretsCollection : public SecretsEntity {
 public:
+    /**
+     * @brief Flat table of the items, sorted by their ids, so listings can be resumed after a given item
+     *
+     * The ids have their own contiguous column, so the lookups and the paging binary-search them without touching the items.
+     * Iterating the table gives the items.
+     */
+    class ItemsTable {
+    public:
+        using Ids = std::vector<std::string>;
+        using Items = std::vector<SecretsItemPtr>;
+        constexpr static size_t npos = static_cast<size_t>(-1);
+
+        size_t size() const noexcept { return ids_.size(); }
+        bool empty() const noexcept { return ids_.empty(); }
+        const std::string& id(size_t pos) const noexcept { return ids_[pos]; }
+        const SecretsItemPtr& item(size_t pos) const noexcept { return items_[pos]; }
+        Items::const_iterator begin() const noexcept { return items_.begin(); }
+        Items::const_iterator end() const noexcept { return items_.end(); }
+
+        /**
+         * @return the position of the item having the given id, or npos
+         */
+        size_t find(const std::string& id) const noexcept;
+        /**
+         * @return the position of the first item whose id follows the given one, or size()
+         */
+        size_t upper_bound(const std::string& id) const noexcept;
+
+        void insert(SecretsItemPtr) noexcept;
+        bool erase(const std::string& id) noexcept;
+        void clear() noexcept;
+
+    private:
+        Ids ids_;
+        Items items_;
+    };
+
     void setName(const std::string&) noexcept;
+    const std::string& name() const noexcept { return name_; }
+
+    void addItem(SecretsItemPtr) noexcept;
+    bool removeItem(SecretsItemPtr) noexcept;
+    const ItemsTable& items() const noexcept { return items_; }
+
+    /**
+     * @brief Arena where the items get created when reading the collection, @see SecretsEntityFactory
+     */
+    void setArena(const EntityArenaPtr& arena) noexcept { arena_ = arena; }
+
+    /**
+     * @brief Store sequence number of the collection creation. The item changes are tracked by the items themselves.
+     */
+    Sequence sequence() const noexcept { return sequence_; }
+    void setSequence(Sequence sequence) noexcept { sequence_ = sequence; }
 
     virtual bool serialize(std::ostream&) noexcept override;
     virtual bool deserialize(std::istream&) noexcept override;
+
+    /**
+     * @brief Large collections with many similar labels and attributes get way smaller when compressed. The item values
+     * are not compressed.
+     */
+    virtual bool compressed() const noexcept override { return compressed_; }
+    virtual void setCompressed(bool compressed) noexcept override { compressed_ = compressed; }
 private:
     virtual bool deserializeChildren(std::istream&) noexcept override;
+    virtual bool deserializeValues(std::istream&) noexcept override;
     virtual bool serializeChildren(std::ostream&) noexcept override;
+    virtual bool serializeValues(std::ostream&) noexcept override;
     virtual EntityType getType() const noexcept { return EntityType::SecretsCollectionType; }
 
-    using Items = std::deque<SecretsItemPtr>;
-
+    Sequence sequence_ = 0;
     std::string name_;
-    Items items_;
+    ItemsTable items_;
+    EntityArenaPtr arena_;
+    bool compressed_ = false;
     size_t itemsCount_; // used during serialization
 };
 
@@ -169,5 +307,42 @@ private:
 
 using SecretsEOFPtr = std::shared_ptr<SecretsEOF>;
 
+/**
+ * @brief Holds the store sequence number and the tombstones of the deleted collections and items
+ *
+ * Each mutation of the store gets the next sequence number, which is stamped on the changed item or collection, or on the
+ * tombstone if it was deleted. Consumers remember the last sequence number they've seen and ask for the changes since
+ * then, @see KSecretsFile::changes_since()
+ */
+class ChangeLog : public SecretsEntity {
+public:
+    struct Tombstone {
+        Sequence sequence_;
+        std::string collection_;
+        std::string item_; /// empty for the collection tombstones
+    };
+    using Tombstones = std::deque<Tombstone>; /// ordered by sequence number
+
+    Sequence sequence() const noexcept { return sequence_; }
+    Sequence next() noexcept { return ++sequence_; }
+
+    void addTombstone(Tombstone) noexcept;
+    const Tombstones& tombstones() const noexcept { return tombstones_; }
+    /**
+     * @brief Forgets the tombstones up to the given sequence number, once all the consumers have seen them
+     */
+    void purgeTombstones(Sequence upTo) noexcept;
+
+    virtual bool serialize(std::ostream&) noexcept override;
+    virtual bool deserialize(std::istream&) noexcept override;
+private:
+    virtual EntityType getType() const noexcept { return EntityType::ChangeLogType; }
+
+    Sequence sequence_ = 0;
+    Tombstones tombstones_;
+};
+
+using ChangeLogPtr = std::shared_ptr<ChangeLog>;
+
 #endif
 // vim: tw=220:ts=4
@@ -22,13 +22,23 @@
 #define KSECRETS_DEVICE_H
 
 #include <memory>
+
+class CryptingContext;
+
 /**
- * @brief This class acts as an interface to allow testing the CryptBuffer
+ * @brief Sequential device the entities get serialized to, through the CryptBuffer
+ *
+ * The @ref KSecretsFile implements it either on a disk file or on an in-memory image. This interface also allows testing
+ * the CryptBuffer alone.
  */
 class KSecretsDevice {
 public:
     virtual ~KSecretsDevice() = default;
     virtual const unsigned char* iv() const noexcept = 0;
+    /**
+     * @return the context encrypting the data of this device, or nullptr if that's the CryptingEngine's
+     */
+    virtual CryptingContext* cryptingContext() const noexcept { return nullptr; }
 
     virtual bool read(void* buf, size_t count) noexcept = 0;
     template <typename T> bool read(T& s) noexcept
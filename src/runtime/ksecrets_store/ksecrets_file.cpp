@@ -20,6 +20,7 @@
 */
 
 #include "ksecrets_file.h"
+#include "ksecrets_sealed.h"
 #include "defines.h"
 
 #include <unistd.h>
@@ -27,25 +28,38 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/param.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
 #include <string.h>
 #include <cassert>
 #include <stdlib.h>
 #include <algorithm>
 
-char fileMagic[] = { 'k', 's', 'e', 'c', 'r', 'e', 't', 's' };
+// the last character is the format version, 2 being the master keys wrapped into key slots
+char fileMagic[] = { 'k', 's', 'e', 'c', 'r', 'e', 't', '2' };
 constexpr auto fileMagicLen = sizeof(fileMagic) / sizeof(fileMagic[0]);
+// the files written before the key slots, their keys being derived from the password
+char legacyFileMagic[] = { 'k', 's', 'e', 'c', 'r', 'e', 't', 's' };
+static_assert(sizeof(legacyFileMagic) == fileMagicLen, "the format magics should have the same length");
 
 KSecretsFile::KSecretsFile()
-    : readFile_(-1)
+    : inMemory_(false)
+    , readFile_(-1)
     , writeFile_(-1)
     , locked_(false)
+    , backupGenerations_(KSECRETS_BACKUP_GENERATIONS)
+    , context_(std::make_shared<CryptingContext>())
+    , generation_(0)
     , eof_(false)
 {
     memset(&fileHead_, 0, sizeof(fileHead_));
+    memset(&keySlots_, 0, sizeof(keySlots_));
 }
 
 KSecretsFile::~KSecretsFile()
 {
+    clearPassword();
     if (readFile_ != -1) {
         closeFile(readFile_);
     }
@@ -56,6 +70,9 @@ KSecretsFile::~KSecretsFile()
 
 void KSecretsFile::closeFile(int& f) noexcept
 {
+    if (f == -1) {
+        return; // nothing to close, e.g. in memory mode
+    }
     auto r = close(f);
     if (r == -1) {
         syslog(KSS_LOG_ERR, "ksecrets: system return erro upon secrets file close: %d", errno);
@@ -64,67 +81,158 @@ void KSecretsFile::closeFile(int& f) noexcept
     f = -1;
 }
 
-int KSecretsFile::create(const std::string& path) noexcept
+bool KSecretsFile::buildEmptyFile(KSecretsIO::Image& image, const CryptingContext& keys) noexcept
 {
-    int fd = ::creat(path.c_str(), S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot create new secrets file");
-        return errno;
-    }
-
-    struct AutoClose {
-        AutoClose(int fd)
-            : fd_(fd)
-        {
-        }
-        ~AutoClose() { ::close(fd_); }
-        int fd_;
-    } autoClose(fd);
-
     CryptingEngine::MAC mac;
-    if (!mac.reset()) {
+    if (!mac.reset(&keys)) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot setup MAC calculation");
-        return -1;
+        return false;
     }
     FileHeadStruct emptyFileData;
+    memset(&emptyFileData, 0, sizeof(emptyFileData));
     memcpy(emptyFileData.magic_, fileMagic, fileMagicLen);
 
     CryptingEngine::randomize(emptyFileData.salt_, CryptingEngine::SALT_SIZE);
     CryptingEngine::randomize(emptyFileData.iv_, CryptingEngine::IV_SIZE);
 
-    int res = 0;
-    if (::write(fd, &emptyFileData, sizeof(emptyFileData)) != sizeof(emptyFileData)) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot write data to newly create file");
-        return errno;
+    image.clear();
+    auto io = KSecretsIO::createInMemory(image);
+    if (!io->write(&emptyFileData, sizeof(emptyFileData))) {
+        return false;
     }
     if (!mac.update(&emptyFileData, sizeof(emptyFileData))) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot update MAC");
-        return -1;
+        return false;
+    }
+    KeySlotsStruct emptyKeySlots;
+    memset(&emptyKeySlots, 0, sizeof(emptyKeySlots));
+    // with a password at hand, the master keys get protected right away
+    if (!password_.empty() && !wrapIntoSlot(emptyKeySlots.slots_[0], password_, keys.masterKeys())) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot wrap the master keys of the new file");
+        return false;
+    }
+    if (!io->write(&emptyKeySlots, sizeof(emptyKeySlots))) {
+        return false;
     }
     size_t count = 0; // this file has 0 items in it
-    if (::write(fd, &count, sizeof(count)) != sizeof(count)) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot write data to newly create file");
-        return errno;
+    if (!io->write(&count, sizeof(count))) {
+        return false;
     }
     if (!mac.update(&count, sizeof(count))) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot update MAC");
-        return -1;
+        return false;
     }
     auto m = mac.read();
-    if (!::write(fd, &m->len_, sizeof(m->len_))) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot write data to newly create file");
+    return io->write(&m->len_, sizeof(m->len_)) && io->write(m->bytes_, m->len_);
+}
+
+/**
+ * @brief Atomically replaces the file at the given path with the image
+ */
+static bool writeImage(const std::string& path, const KSecretsIO::Image& image) noexcept
+{
+    auto tempPath = path + ".XXXXXX";
+    int fd = mkostemp(&tempPath[0], 0);
+    if (fd == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot create temp file for %s errno=%d", path.c_str(), errno);
+        return false;
+    }
+    auto io = KSecretsIO::create();
+    io->attach(fd);
+    bool res = io->write(image.data(), image.size()) && io->finish(tempPath.c_str(), path.c_str());
+    if (!res) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot write %s errno=%d", path.c_str(), errno);
+        unlink(tempPath.c_str());
+    }
+    ::close(fd);
+    return res;
+}
+
+int KSecretsFile::create(const std::string& path) noexcept
+{
+    // the new master keys stay out of the keyring, where they would replace the ones of a store already in use
+    auto keys = std::make_shared<CryptingContext>();
+    KSecretsIO::Image image;
+    if (!keys->generateMasterKeys() || !buildEmptyFile(image, *keys)) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot build the new secrets file contents");
         return -1;
     }
-    if (!::write(fd, m->bytes_, m->len_)) {
+
+    int fd = ::creat(path.c_str(), S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot create new secrets file");
+        return errno;
+    }
+    auto io = KSecretsIO::create();
+    io->attach(fd);
+    int res = 0;
+    if (!io->write(image.data(), image.size()) || !io->finish()) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot write data to newly create file");
-        return -1;
+        res = errno;
+    }
+    ::close(fd);
+    if (res == 0 && password_.empty()) {
+        // keep the keys for the first open, @see unlockKeySlots()
+        createdKeys_ = keys;
+        createdPath_ = path;
     }
     return res;
 }
 
+int KSecretsFile::setupInMemory(const std::string& snapshotPath) noexcept
+{
+    inMemory_ = true;
+    readOnly_ = false;
+    filePath_.clear();
+    snapshotPath_ = snapshotPath;
+    image_.clear();
+    readIO_.reset();
+    writeIO_.reset();
+    context_ = std::make_shared<CryptingContext>();
+
+    if (!snapshotPath_.empty()) {
+        int fd = ::open(snapshotPath_.c_str(), O_RDONLY | O_NOFOLLOW);
+        if (fd == -1 && errno != ENOENT) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot open snapshot %s errno=%d", snapshotPath_.c_str(), errno);
+            return errno;
+        }
+        if (fd != -1) {
+            auto io = KSecretsIO::create();
+            io->attach(fd);
+            char buf[BUFSIZ];
+            ssize_t rres;
+            while ((rres = io->read(buf, sizeof(buf))) > 0) {
+                image_.insert(image_.end(), buf, buf + rres);
+            }
+            auto err = errno;
+            ::close(fd);
+            if (rres < 0) {
+                syslog(KSS_LOG_ERR, "ksecrets: cannot read snapshot %s errno=%d", snapshotPath_.c_str(), err);
+                image_.clear();
+                return err;
+            }
+        }
+    }
+    if (image_.empty()) {
+        // the keys of the session let the snapshot be opened as a regular file, but they are only copied from the keyring
+        bool sessionKeys = password_.empty() && readSessionKeys();
+        if ((!sessionKeys && !context_->generateMasterKeys()) || !buildEmptyFile(image_, *context_)) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot build the new secrets contents");
+            return -1;
+        }
+        syslog(KSS_LOG_INFO, "ksecrets: created new in-memory secrets");
+    }
+    return 0;
+}
+
 bool KSecretsFile::save() noexcept
 {
     assert(writeFile_ == -1);
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::Save);
+    if (readOnly_) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot save a file opened read-only");
+        return false;
+    }
 
     if (!openSaveTempFile()) {
         return false;
@@ -132,68 +240,114 @@ bool KSecretsFile::save() noexcept
 
     if (!writeHeader()) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot write file header errno=%d", errno);
-        closeFile(writeFile_);
+        discardSaveTempFile();
+        return false;
+    }
+
+    if (!writeKeySlots()) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot write key slots errno=%d", errno);
+        discardSaveTempFile();
         return false;
     }
 
     size_t count = std::count_if(entities_.cbegin(), entities_.cend(), [](SecretsEntityPtr) { return true; });
     if (!base_class::template write(count)) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot write entity count errno=%d", errno);
-        closeFile(writeFile_);
+        discardSaveTempFile();
         return false;
     }
 
     for (SecretsEntityPtr entity : entities_) {
         if (!saveEntity(entity)) {
-            closeFile(writeFile_);
+            discardSaveTempFile();
             return false;
         }
     }
 
-    if (!saveMac())
+    if (!saveMac()) {
+        discardSaveTempFile();
         return false;
+    }
 
-    char lnpath[PATH_MAX];
-    memset(lnpath, 0, sizeof(lnpath) / sizeof(lnpath[0]));
-    snprintf(lnpath, PATH_MAX, "/proc/self/fd/%d", writeFile_);
-    char tempWrittenFile[PATH_MAX];
-    memset(tempWrittenFile, 0, sizeof(tempWrittenFile) / sizeof(tempWrittenFile[0]));
-    auto rlink = readlink(lnpath, tempWrittenFile, PATH_MAX - 1);
-    if (rlink == -1) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot get written temp file path! errno=%d", errno);
-        return false;
+    if (inMemory_) {
+        image_.swap(writtenImage_);
+        if (!snapshotPath_.empty() && !writeImage(snapshotPath_, image_)) {
+            // the image stays the one of the snapshot
+            image_.swap(writtenImage_);
+            writtenImage_.clear();
+            return false;
+        }
+        writtenImage_.clear();
+        return reopenReplaced();
     }
 
+    // the backup is taken before the rename gets queued along with the last write and the data sync of the temp file
+    if (!backupLiveFile()) {
+        discardSaveTempFile();
+        return false;
+    }
+    if (!writeIO_->finish(tempPath_.c_str(), filePath_.c_str())) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot replace the secrets file with %s errno=%d", tempPath_.c_str(), errno);
+        discardSaveTempFile();
+        return false;
+    }
+    struct stat written;
+    if (fstat(writeFile_, &written) == -1) {
+        written.st_ino = 0;
+    }
     closeFile(writeFile_);
-    syslog(KSS_LOG_INFO, "ksecrets: temp file written: %s", tempWrittenFile);
+    syslog(KSS_LOG_INFO, "ksecrets: temp file written: %s", tempPath_.c_str());
 
-    // OK that worked, now replace the current file with the temp file
-    return backupAndReplaceWithWritten(tempWrittenFile);
+    return reopenReplaced(written.st_ino);
 }
 
 bool KSecretsFile::openSaveTempFile() noexcept
 {
-    const char* pattern = "ksecrets-XXXXXX";
-    char* tmpfilename = new char[strlen(pattern) + 1];
-    strcpy(tmpfilename, pattern);
-    writeFile_ = mkostemp(tmpfilename, O_SYNC);
-    if (writeFile_ == -1) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot create temp file for save errno=%d", errno);
-        return false;
+    if (inMemory_) {
+        writtenImage_.clear();
+        if (!writeIO_) {
+            writeIO_ = KSecretsIO::createInMemory(writtenImage_);
+            writeIO_->setMetrics(&metrics_);
+        }
     }
     else {
-        syslog(KSS_LOG_INFO, "ksecrets: saving to temporary file %s", tmpfilename);
-        delete[] tmpfilename;
+        // the temp file sits next to the secrets file, so the final rename stays on the same file system
+        // no O_SYNC, the data gets synced only once, by KSecretsIO::finish()
+        tempPath_ = filePath_ + ".XXXXXX";
+        writeFile_ = mkostemp(&tempPath_[0], 0);
+        if (writeFile_ == -1) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot create temp file for save errno=%d", errno);
+            return false;
+        }
+        syslog(KSS_LOG_INFO, "ksecrets: saving to temporary file %s", tempPath_.c_str());
+        if (!writeIO_) {
+            writeIO_ = KSecretsIO::create();
+            writeIO_->setMetrics(&metrics_);
+        }
     }
+    writeIO_->attach(writeFile_);
 
-    if (!mac_.reset()) {
+    if (!mac_.reset(context_.get())) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot setup MAC calculation");
+        discardSaveTempFile();
         return false;
     }
 
     return true;
 }
 
+void KSecretsFile::discardSaveTempFile() noexcept
+{
+    if (inMemory_) {
+        writtenImage_.clear();
+        return;
+    }
+    closeFile(writeFile_);
+    if (unlink(tempPath_.c_str()) == -1 && errno != ENOENT) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot remove the temp file %s errno=%d", tempPath_.c_str(), errno);
+    }
+}
+
 bool KSecretsFile::saveMac() noexcept
 {
     mac_.stop();
@@ -224,40 +378,254 @@ bool KSecretsFile::saveEntity(SecretsEntityPtr entity)
         return true;
 }
 
-bool KSecretsFile::backupAndReplaceWithWritten(const char* tempFilePath) noexcept
+/**
+ * @brief Copies a file, sharing the data blocks with the source when the file system supports it
+ *
+ * On Btrfs and XFS the FICLONE reflink makes the copy cost only a metadata update. Otherwise copy_file_range lets the kernel
+ * do the copy, possibly still sharing blocks, and the plain read/write loop is the last resort. With reflinkOnly, only the
+ * first one is attempted and nothing is logged if the file system does not support it.
+ */
+static bool cloneFile(const char* fromPath, const char* toPath, bool reflinkOnly = false) noexcept
 {
-    closeFile(readFile_);
+    int in = ::open(fromPath, O_RDONLY | O_NOFOLLOW);
+    if (in == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot open %s for cloning errno=%d", fromPath, errno);
+        return false;
+    }
+    int out = ::open(toPath, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+    if (out == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot create %s errno=%d", toPath, errno);
+        ::close(in);
+        return false;
+    }
 
-    char backupPath[PATH_MAX];
-    snprintf(backupPath, PATH_MAX, "%s.bkp", filePath_.c_str());
-    auto rres = rename(filePath_.c_str(), backupPath);
-    if (rres == -1) {
-        syslog(KSS_LOG_ERR, "ksecrets: cannot backup the secrets file errno=%d", errno);
+    bool res = ioctl(out, FICLONE, in) == 0;
+    if (!res && !reflinkOnly) {
+        struct stat st;
+        res = fstat(in, &st) == 0;
+        off_t left = st.st_size;
+        bool useCopyRange = true;
+        char buf[BUFSIZ];
+        while (res && left > 0) {
+            ssize_t copied = -1;
+            if (useCopyRange) {
+                copied = copy_file_range(in, nullptr, out, nullptr, left, 0);
+                if (copied == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    useCopyRange = false;
+                    continue;
+                }
+            }
+            else {
+                copied = ::read(in, buf, sizeof(buf));
+                if (copied > 0 && ::write(out, buf, copied) != copied) {
+                    copied = -1;
+                }
+            }
+            if (copied <= 0) {
+                syslog(KSS_LOG_ERR, "ksecrets: cannot copy %s to %s errno=%d", fromPath, toPath, errno);
+                res = false;
+            }
+            else {
+                left -= copied;
+            }
+        }
+    }
+    res = res && fdatasync(out) == 0;
+    ::close(in);
+    ::close(out);
+    if (!res) {
+        unlink(toPath);
+    }
+    return res;
+}
+
+bool KSecretsFile::snapshot(const std::string& path) noexcept
+{
+    if (inMemory_) {
+        return writeImage(path, image_);
+    }
+    // the secrets file is only ever replaced by renames, so a clone is consistent
+    auto tempPath = path + ".snapshot";
+    if (!cloneFile(filePath_.c_str(), tempPath.c_str())) {
+        return false;
+    }
+    if (rename(tempPath.c_str(), path.c_str()) == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot rename snapshot to %s errno=%d", path.c_str(), errno);
+        unlink(tempPath.c_str());
         return false;
     }
-    syslog(KSS_LOG_INFO, "ksecrets: backed-up to: %s", backupPath);
+    return true;
+}
+
+std::string KSecretsFile::backupPath(unsigned generation) const noexcept { return filePath_ + ".bkp." + std::to_string(generation); }
+
+bool KSecretsFile::rotateBackups() noexcept
+{
+    // drop the oldest generation, then shift the others to make room for the newest
+    unlink(backupPath(backupGenerations_).c_str());
+    for (unsigned generation = backupGenerations_ - 1; generation > 0; generation--) {
+        auto from = backupPath(generation);
+        if (rename(from.c_str(), backupPath(generation + 1).c_str()) == -1 && errno != ENOENT) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot rotate backup %s errno=%d", from.c_str(), errno);
+            return false;
+        }
+    }
+    return true;
+}
 
-    rres = rename(tempFilePath, filePath_.c_str());
+bool KSecretsFile::backupLiveFile() noexcept
+{
+    if (backupGenerations() == 0) {
+        return true;
+    }
+    // the live file stays in place and the rename atomically replaces it, so there is no time when the file is missing
+    auto newestBackup = backupPath(1);
+    if (!rotateBackups()) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot backup the secrets file");
+        return false;
+    }
+    // without reflinks, the live file itself becomes the backup once the rename replaces it, instead of copying all its data
+    if (!cloneFile(filePath_.c_str(), newestBackup.c_str(), true) && link(filePath_.c_str(), newestBackup.c_str()) == -1
+        && !cloneFile(filePath_.c_str(), newestBackup.c_str())) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot backup the secrets file");
+        return false;
+    }
+    syslog(KSS_LOG_INFO, "ksecrets: backed-up to: %s", newestBackup.c_str());
+    return true;
+}
+
+bool KSecretsFile::backupAndReplaceWithWritten(const char* tempFilePath) noexcept
+{
+    if (!backupLiveFile()) {
+        return false;
+    }
+
+    auto rres = rename(tempFilePath, filePath_.c_str());
     if (rres == -1) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot move temp file to current secrets file errno=%d", errno);
         return false;
     }
+    return reopenReplaced();
+}
 
+bool KSecretsFile::reopenReplaced(ino_t written) noexcept
+{
+    closeFile(readFile_);
     if (openAndCheck(locked_, true) != OpenStatus::Ok) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot reopen file");
         return false;
     }
+    // the lock on the previous file is released by the rename, so another process may have replaced our file before we locked it again
+    struct stat reopened;
+    if (written != 0 && !inMemory_ && fstat(readFile_, &reopened) == 0 && reopened.st_ino != written) {
+        syslog(KSS_LOG_INFO, "ksecrets: the file was replaced by another process, reloading it");
+        closeFile(readFile_);
+        if (openAndCheck(locked_) != OpenStatus::Ok) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot reload file");
+            return false;
+        }
+    }
     syslog(KSS_LOG_INFO, "ksecrets: successfully replaced the file");
+    // a failure leaves the previous image, which the readers refuse as it does not match the new file
+    if (locked_ && sealing()) {
+        seal();
+    }
     return true;
 }
 
+bool KSecretsFile::sealing() const noexcept { return !inMemory_ && access(KSecretsSealed::sealedPath(filePath_).c_str(), F_OK) == 0; }
+
+bool KSecretsFile::setSealing(bool sealing) noexcept
+{
+    if (readOnly_ || inMemory_) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot seal a file opened read-only or kept in memory");
+        return false;
+    }
+    if (!sealing) {
+        return unlink(KSecretsSealed::sealedPath(filePath_).c_str()) == 0 || errno == ENOENT;
+    }
+    return seal();
+}
+
+bool KSecretsFile::seal() noexcept
+{
+    auto path = KSecretsSealed::sealedPath(filePath_);
+    struct stat current;
+    KSecretsIO::Image image;
+    if (fstat(readFile_, &current) == -1 || !KSecretsSealed::build(*this, current.st_ino, image) || !writeImage(path, image)) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot write the sealed image %s", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool KSecretsFile::copyKeySlots(const char* fromPath, const char* toPath) noexcept
+{
+    KeySlotsStruct slots;
+    int in = ::open(fromPath, O_RDONLY | O_NOFOLLOW);
+    if (in == -1 || pread(in, &slots, sizeof(slots), sizeof(FileHeadStruct)) != sizeof(slots)) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot read the key slots of %s errno=%d", fromPath, errno);
+        closeFile(in);
+        return false;
+    }
+    closeFile(in);
+    int out = ::open(toPath, O_WRONLY | O_NOFOLLOW);
+    if (out == -1 || pwrite(out, &slots, sizeof(slots), sizeof(FileHeadStruct)) != sizeof(slots) || fdatasync(out) == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot write the key slots of %s errno=%d", toPath, errno);
+        closeFile(out);
+        return false;
+    }
+    closeFile(out);
+    return true;
+}
+
+bool KSecretsFile::restoreBackup(unsigned generation) noexcept
+{
+    if (readOnly_ || inMemory_) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot restore a backup of a file opened read-only or kept in memory");
+        return false;
+    }
+    auto restoredPath = backupPath(generation);
+    {
+        // the backups share the master keys with the live file, even if their key slots differ
+        KSecretsFile backup;
+        backup.setup(restoredPath, true);
+        if (!context_->hasMasterKeys() || !backup.context_->setMasterKeys(context_->masterKeys()) || backup.openAndCheck(false, true) != OpenStatus::Ok) {
+            syslog(KSS_LOG_ERR, "ksecrets: backup %s is not valid, not restoring it", restoredPath.c_str());
+            return false;
+        }
+    }
+
+    // work on a copy, the generations get rotated when replacing the live file, so that the restore can itself be undone
+    auto tempPath = filePath_ + ".restore";
+    if (!cloneFile(restoredPath.c_str(), tempPath.c_str())) {
+        return false;
+    }
+    // the key slots are not covered by the MAC, so the current ones are kept, otherwise a restore would bring back old passwords
+    if (!copyKeySlots(filePath_.c_str(), tempPath.c_str())) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+    if (!backupAndReplaceWithWritten(tempPath.c_str())) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    closeFile(readFile_);
+    return openAndCheck(locked_) == OpenStatus::Ok;
+}
+
 bool KSecretsFile::readEntities(bool justCheck) noexcept
 {
-    assert(readFile_ != -1);
+    assert(inMemory_ || readFile_ != -1);
     if (!justCheck) {
         if (!entities_.empty()) {
             entities_.clear();
         }
+        clear_index();
+        generation_++;
+        // the previous generation's arena goes away along with its last entity, which may still be held by an EntityHandle
+        arena_ = std::make_shared<EntityArena>();
     }
 
     size_t entityCount = 0;
@@ -271,6 +639,9 @@ bool KSecretsFile::readEntities(bool justCheck) noexcept
             return false;
         }
     }
+    if (!justCheck) {
+        stamp_unsequenced();
+    }
     return true;
 }
 
@@ -291,6 +662,7 @@ bool KSecretsFile::readCheckMac() noexcept
         syslog(KSS_LOG_ERR, "Cannot read MAC value");
         return false;
     }
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::MacVerify);
     if (!mac_.verify(buffer, len)) {
         syslog(KSS_LOG_ERR, "ksecrets: MAC check error, the file is corrupted or someone tampered with it");
         return false;
@@ -305,13 +677,14 @@ bool KSecretsFile::readNextEntity(bool justCheck) noexcept
         syslog(KSS_LOG_ERR, "ksecrets: cannot read next entities type");
         return false;
     }
-    SecretsEntityPtr entity = SecretsEntityFactory::createInstance((SecretsEntity::EntityType)et);
+    SecretsEntityPtr entity = SecretsEntityFactory::createInstance((SecretsEntity::EntityType)et, justCheck ? EntityArenaPtr() : arena_);
     if (!entity->read(*this)) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot read next entity");
         return false;
     }
     if (!justCheck) {
         entities_.emplace_back(entity);
+        index_entity(entity);
     }
     return true;
 }
@@ -320,10 +693,18 @@ void KSecretsFile::setup(const std::string& path, bool readOnly) noexcept
 {
     filePath_ = path;
     readOnly_ = readOnly;
+    inMemory_ = false;
+    snapshotPath_.clear();
+    image_.clear();
+    // the I/O backends depend on the mode
+    readIO_.reset();
+    writeIO_.reset();
+    context_ = std::make_shared<CryptingContext>();
 }
 
 KSecretsFile::OpenStatus KSecretsFile::openAndCheck(bool lockFile, bool justCheck) noexcept
 {
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::Open);
     if (!open()) {
         syslog(KSS_LOG_ERR, "ksecrets: failed to open file %s", filePath_.c_str());
         return OpenStatus::CannotOpenFile;
@@ -332,16 +713,36 @@ KSecretsFile::OpenStatus KSecretsFile::openAndCheck(bool lockFile, bool justChec
         syslog(KSS_LOG_ERR, "ksecrets: cannot lock file %s", filePath_.c_str());
         return OpenStatus::CannotLockFile;
     }
-    mac_.reset();
     if (!readHeader()) {
         syslog(KSS_LOG_ERR, "ksecrets: failed to read header from file %s", filePath_.c_str());
         return OpenStatus::CannotReadHeader;
     }
     if (!checkMagic()) {
+        if (memcmp(fileHead_.magic_, legacyFileMagic, fileMagicLen) == 0) {
+            syslog(KSS_LOG_ERR, "ksecrets: file %s has the format preceding the key slots, which is not supported", filePath_.c_str());
+            return OpenStatus::UnsupportedVersion;
+        }
         syslog(KSS_LOG_ERR, "ksecrets: magic check failed for file %s", filePath_.c_str());
         return OpenStatus::UnknownHeader;
     }
-    if (!CryptingEngine::setIV(fileHead_.iv_, sizeof(fileHead_.iv_))) {
+    if (!readKeySlots()) {
+        syslog(KSS_LOG_ERR, "ksecrets: failed to read key slots from file %s", filePath_.c_str());
+        return OpenStatus::CannotReadHeader;
+    }
+    if ((!password_.empty() || createdHere()) && !unlockKeySlots()) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot unlock the master keys of file %s", filePath_.c_str());
+        return OpenStatus::CannotUnlockKeys;
+    }
+    if (!context_->hasMasterKeys() && !readSessionKeys()) {
+        syslog(KSS_LOG_ERR, "ksecrets: no master keys for file %s", filePath_.c_str());
+        return OpenStatus::CryptEngineError;
+    }
+    // the MAC key is only known once the key slots are unlocked, so the header gets accounted for only now
+    if (!mac_.reset(context_.get()) || !mac_.update(&fileHead_, sizeof(fileHead_))) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot setup MAC calculation");
+        return OpenStatus::CryptEngineError;
+    }
+    if (!context_->setIV(fileHead_.iv_, sizeof(fileHead_.iv_))) {
         syslog(KSS_LOG_ERR, "ksecrets: cannot set IV read from the secrets file");
         return OpenStatus::CryptEngineError;
     }
@@ -358,22 +759,268 @@ KSecretsFile::OpenStatus KSecretsFile::openAndCheck(bool lockFile, bool justChec
 
 bool KSecretsFile::open() noexcept
 {
+    if (inMemory_) {
+        if (!readIO_) {
+            readIO_ = KSecretsIO::createInMemory(image_);
+            readIO_->setMetrics(&metrics_);
+        }
+        readIO_->attach(-1);
+        eof_ = false;
+        return !image_.empty();
+    }
     readFile_ = ::open(filePath_.c_str(), O_DSYNC | O_NOATIME | O_NOFOLLOW);
-    mac_.reset();
-    return readFile_ != -1;
+    if (readFile_ == -1) {
+        return false;
+    }
+    if (!readIO_) {
+        readIO_ = KSecretsIO::create();
+        readIO_->setMetrics(&metrics_);
+    }
+    readIO_->attach(readFile_);
+    eof_ = false;
+    return true;
 }
 
 bool KSecretsFile::lock() noexcept
 {
-    bool res = flock(readFile_, LOCK_EX) != -1;
+    if (inMemory_) {
+        locked_ = true;
+        return true; // only this instance sees the contents
+    }
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::LockWait);
     locked_ = true;
-    return res;
+    for (;;) {
+        if (flock(readFile_, LOCK_EX) == -1)
+            return false;
+        // the lock holder may have renamed a new file over the one we were waiting for, then we would hold a lock nobody else takes
+        struct stat lockedStat, currentStat;
+        if (fstat(readFile_, &lockedStat) == -1)
+            return false;
+        if (stat(filePath_.c_str(), &currentStat) == 0 && currentStat.st_dev == lockedStat.st_dev && currentStat.st_ino == lockedStat.st_ino)
+            return true;
+        closeFile(readFile_);
+        if (!open())
+            return false;
+    }
 }
 
-bool KSecretsFile::readHeader() noexcept { return read(&fileHead_, sizeof(fileHead_)); }
+bool KSecretsFile::readHeader() noexcept
+{
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::ReadHeader);
+    return readRaw(&fileHead_, sizeof(fileHead_));
+}
 
 bool KSecretsFile::writeHeader() noexcept { return write(&fileHead_, sizeof(fileHead_)); }
 
+bool KSecretsFile::readKeySlots() noexcept { return readRaw(&keySlots_, sizeof(keySlots_)); }
+
+bool KSecretsFile::writeKeySlots() noexcept { return writeRaw(&keySlots_, sizeof(keySlots_)); }
+
+void KSecretsFile::setPassword(const std::string& password) noexcept
+{
+    clearPassword();
+    password_ = password;
+}
+
+void KSecretsFile::clearPassword() noexcept
+{
+    if (!password_.empty()) {
+        memset(&password_[0], 0, password_.size());
+        password_.clear();
+    }
+}
+
+bool KSecretsFile::createdHere() const noexcept { return createdKeys_ && createdPath_ == filePath_; }
+
+bool KSecretsFile::hasPasswordSlots() const noexcept
+{
+    return std::any_of(std::begin(keySlots_.slots_), std::end(keySlots_.slots_), [](const KeySlotStruct& slot) { return slot.type_ == (std::uint8_t)KeySlotType::Password; });
+}
+
+bool KSecretsFile::unwrapKeySlots(const std::string& password, unsigned char* keys) noexcept
+{
+    unsigned char* slotKey = (unsigned char*)gcry_malloc_secure(CryptingEngine::SLOT_KEY_SIZE);
+    if (slotKey == nullptr) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot allocate secure memory for the key slot");
+        return false;
+    }
+    bool res = false;
+    for (KeySlotStruct& slot : keySlots_.slots_) {
+        if (slot.type_ != (std::uint8_t)KeySlotType::Password)
+            continue;
+        if (CryptingEngine::deriveSlotKey(password, slot.salt_, slotKey) && CryptingEngine::unwrapKeys(slotKey, slot.wrappedKeys_, keys)) {
+            res = true;
+            break;
+        }
+    }
+    gcry_free(slotKey);
+    if (!res) {
+        syslog(KSS_LOG_ERR, "ksecrets: no key slot could be unlocked with the given password");
+    }
+    return res;
+}
+
+bool KSecretsFile::installMasterKeys(const unsigned char* masterKeys) noexcept
+{
+    // the other applications of the session open the file with the keys of the keyring, the in-memory contents are private
+    return context_->setMasterKeys(masterKeys) && (inMemory_ || CryptingEngine::instance().setMasterKeys(masterKeys));
+}
+
+bool KSecretsFile::readSessionKeys() noexcept { return context_->readSessionKeys(); }
+
+bool KSecretsFile::unlockKeySlots() noexcept
+{
+    bool res = false;
+    if (hasPasswordSlots()) {
+        unsigned char* keys = (unsigned char*)gcry_malloc_secure(CryptingEngine::MASTER_KEYS_SIZE);
+        if (keys == nullptr) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot allocate secure memory for the master keys");
+        }
+        else {
+            res = !password_.empty() && unwrapKeySlots(password_, keys) && installMasterKeys(keys);
+            gcry_free(keys);
+        }
+    }
+    else if (createdHere()) {
+        // the file was created by this instance, without a password, so its master keys are still at hand
+        res = (password_.empty() || (wrapIntoSlot(keySlots_.slots_[0], password_, createdKeys_->masterKeys()) && updateKeySlots())) && installMasterKeys(createdKeys_->masterKeys());
+        if (res) {
+            createdKeys_.reset();
+        }
+    }
+    else {
+        // the key slots are not covered by the MAC, so they may have been cleared by someone expecting us to wrap the session keys
+        syslog(KSS_LOG_ERR, "ksecrets: the file has no key slot to unlock");
+    }
+
+    clearPassword();
+    return res;
+}
+
+bool KSecretsFile::wrapIntoSlot(KeySlotStruct& slot, const std::string& password, const unsigned char* masterKeys) noexcept
+{
+    unsigned char* slotKey = (unsigned char*)gcry_malloc_secure(CryptingEngine::SLOT_KEY_SIZE);
+    if (slotKey == nullptr) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot allocate secure memory for the key slot");
+        return false;
+    }
+    KeySlotStruct newSlot;
+    newSlot.type_ = (std::uint8_t)KeySlotType::Password;
+    CryptingEngine::randomize(newSlot.salt_, CryptingEngine::SALT_SIZE);
+    bool res = CryptingEngine::deriveSlotKey(password, newSlot.salt_, slotKey) && CryptingEngine::wrapKeys(slotKey, masterKeys, newSlot.wrappedKeys_);
+    gcry_free(slotKey);
+    if (res) {
+        slot = newSlot;
+    }
+    return res;
+}
+
+bool KSecretsFile::addPasswordSlot(const std::string& password) noexcept
+{
+    auto isUnused = [](const KeySlotStruct& slot) { return slot.type_ == (std::uint8_t)KeySlotType::Unused; };
+    // the last free slot is kept for changePassword(), which should never overwrite a slot in use
+    if (std::count_if(std::begin(keySlots_.slots_), std::end(keySlots_.slots_), isUnused) < 2) {
+        syslog(KSS_LOG_ERR, "ksecrets: no free key slot left");
+        return false;
+    }
+    auto freeSlot = std::find_if(std::begin(keySlots_.slots_), std::end(keySlots_.slots_), isUnused);
+    if (!context_->hasMasterKeys()) {
+        syslog(KSS_LOG_ERR, "ksecrets: the file should be opened before adding a key slot");
+        return false;
+    }
+    if (!wrapIntoSlot(*freeSlot, password, context_->masterKeys())) {
+        freeSlot->type_ = (std::uint8_t)KeySlotType::Unused;
+        return false;
+    }
+    return updateKeySlots();
+}
+
+bool KSecretsFile::changePassword(const std::string& newPassword) noexcept
+{
+    if (!context_->hasMasterKeys()) {
+        syslog(KSS_LOG_ERR, "ksecrets: the file should be opened before changing its password");
+        return false;
+    }
+    return replacePasswordSlots(newPassword, context_->masterKeys());
+}
+
+bool KSecretsFile::changePassword(const std::string& oldPassword, const std::string& newPassword) noexcept
+{
+    if (readOnly_ || inMemory_) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot change the password of a file opened read-only or kept in memory");
+        return false;
+    }
+    unsigned char* keys = (unsigned char*)gcry_malloc_secure(CryptingEngine::MASTER_KEYS_SIZE);
+    if (keys == nullptr) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot allocate secure memory for the master keys");
+        return false;
+    }
+    // only the key slots get read, so neither the session keys nor the whole file are needed
+    bool res = open() && lock() && readHeader() && checkMagic() && readKeySlots() && unwrapKeySlots(oldPassword, keys) && replacePasswordSlots(newPassword, keys);
+    gcry_free(keys);
+    closeFile(readFile_);
+    locked_ = false;
+    return res;
+}
+
+bool KSecretsFile::replacePasswordSlots(const std::string& newPassword, const unsigned char* masterKeys) noexcept
+{
+    // addPasswordSlot() always leaves a slot free, so the new slot never replaces one in use
+    auto newSlot = std::find_if(std::begin(keySlots_.slots_), std::end(keySlots_.slots_), [](const KeySlotStruct& slot) { return slot.type_ == (std::uint8_t)KeySlotType::Unused; });
+    if (newSlot == std::end(keySlots_.slots_)) {
+        syslog(KSS_LOG_ERR, "ksecrets: no free key slot left for the new password");
+        return false;
+    }
+    KeySlotsStruct oldSlots = keySlots_;
+    if (!wrapIntoSlot(*newSlot, newPassword, masterKeys) || !updateKeySlots()) {
+        keySlots_ = oldSlots;
+        return false;
+    }
+
+    for (KeySlotStruct* slot = std::begin(keySlots_.slots_); slot != std::end(keySlots_.slots_); slot++) {
+        if (slot != newSlot && slot->type_ == (std::uint8_t)KeySlotType::Password) {
+            memset(slot, 0, sizeof(*slot));
+        }
+    }
+    return updateKeySlots();
+}
+
+bool KSecretsFile::updateKeySlots() noexcept
+{
+    if (readOnly_) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot update the key slots of a file opened read-only");
+        return false;
+    }
+    if (inMemory_) {
+        if (image_.size() < sizeof(FileHeadStruct) + sizeof(keySlots_)) {
+            return setFailState(EINVAL);
+        }
+        memcpy(image_.data() + sizeof(FileHeadStruct), &keySlots_, sizeof(keySlots_));
+        return snapshotPath_.empty() || writeImage(snapshotPath_, image_);
+    }
+    int fd = ::open(filePath_.c_str(), O_WRONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot open the secrets file to update the key slots errno=%d", errno);
+        return setFailState(errno);
+    }
+    // the exclusive lock is already held if the file was opened for writing
+    if (!locked_ && flock(fd, LOCK_EX) == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot lock the secrets file to update the key slots errno=%d", errno);
+        closeFile(fd);
+        return setFailState(errno);
+    }
+    auto wres = pwrite(fd, &keySlots_, sizeof(keySlots_), sizeof(FileHeadStruct));
+    if (wres != sizeof(keySlots_) || fdatasync(fd) == -1) {
+        syslog(KSS_LOG_ERR, "ksecrets: cannot write the key slots errno=%d", errno);
+        auto err = errno;
+        closeFile(fd);
+        return setFailState(err);
+    }
+    closeFile(fd);
+    syslog(KSS_LOG_INFO, "ksecrets: key slots updated");
+    return true;
+}
+
 bool KSecretsFile::checkMagic() noexcept
 {
     if (memcmp(fileHead_.magic_, fileMagic, fileMagicLen) != 0) {
@@ -382,35 +1029,50 @@ bool KSecretsFile::checkMagic() noexcept
     return true;
 }
 
-bool KSecretsFile::write(const void* buf, size_t len) noexcept
+bool KSecretsFile::writeRaw(const void* buf, size_t len) noexcept
 {
-    assert(writeFile_ != -1);
-    auto wres = ::write(writeFile_, buf, len);
-    if (wres < 0) {
+    assert(writeIO_);
+    if (!writeIO_->write(buf, len)) {
+        // upon ENOSPC, the live file and its backups are left untouched as we're writing a temp file
         syslog(KSS_LOG_ERR, "ksecrets: cannot write to file errno=%d", errno);
         return setFailState(errno);
     }
-    if (static_cast<size_t>(wres) < len) {
-        // no more space left on the file system
-        // FIXME we should prevent such an event by keeping versions of the secrets file
-        // TODO manage secrets file versions to prevent this kind of problem
-        syslog(KSS_LOG_ERR, "ksecrets: cannot write all data to file. Disk full?");
-        return setFailState(ENOSPC);
-    }
-    syslog(KSS_LOG_INFO, "ksecrets: W offset %ld", lseek(writeFile_, 0, SEEK_CUR));
+    metrics_.addBytesWritten(len);
+    return true;
+}
+
+bool KSecretsFile::write(const void* buf, size_t len) noexcept
+{
+    if (!writeRaw(buf, len))
+        return false;
+#ifdef KSECRETS_TRACE_IO
+    syslog(KSS_LOG_DEBUG, "ksecrets: W offset %ld", writeIO_->offset());
+#endif
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::MacUpdate);
     return mac_.update(buf, len);
 }
 
-bool KSecretsFile::read(void* buf, size_t len) noexcept
+bool KSecretsFile::readRaw(void* buf, size_t len) noexcept
 {
     if (eof_)
         return false;
-    auto rres = ::read(readFile_, buf, len);
+    auto rres = readIO_->read(buf, len);
     if (rres < 0)
         return setFailState(errno);
+    metrics_.addBytesRead(rres);
     if (static_cast<size_t>(rres) < len)
         return setEOF(); // are we @ EOF?
-    syslog(KSS_LOG_INFO, "ksecrets: R offset %ld", lseek(readFile_, 0, SEEK_CUR));
+    return true;
+}
+
+bool KSecretsFile::read(void* buf, size_t len) noexcept
+{
+    if (!readRaw(buf, len))
+        return false;
+#ifdef KSECRETS_TRACE_IO
+    syslog(KSS_LOG_DEBUG, "ksecrets: R offset %ld", readIO_->offset());
+#endif
+    KSecretsMetrics::Timer timer(metrics_, KSecretsMetrics::Operation::MacUpdate);
     return mac_.update(buf, len);
 }
 
@@ -418,11 +1080,219 @@ bool KSecretsFile::remove_entity(SecretsEntityPtr entity)
 {
     Entities::iterator pos = std::find(entities_.begin(), entities_.end(), entity);
     if (pos != entities_.end()) {
+        unindex_entity(entity);
         entities_.erase(pos);
+        if (entity->getType() == SecretsEntity::EntityType::SecretsCollectionType) {
+            add_tombstone(std::static_pointer_cast<SecretsCollection>(entity)->name(), std::string());
+        }
+        else if (entity->getType() == SecretsEntity::EntityType::SecretsItemType) {
+            add_tombstone(std::string(), std::static_pointer_cast<SecretsItem>(entity)->id());
+        }
         return true;
     }
     else
         return false;
 }
 
+bool KSecretsFile::emplace_item(SecretsCollectionPtr collection, SecretsItemPtr item) noexcept
+{
+    assert(find_collection(collection->name()) == collection);
+    item->setSequence(stamp());
+    collection->addItem(item);
+    itemsIndex_[item->id()] = item;
+    changesIndex_[item->sequence()] = ChangeRef{ collection->name(), item->id(), false };
+    return save();
+}
+
+bool KSecretsFile::remove_item(SecretsCollectionPtr collection, SecretsItemPtr item) noexcept
+{
+    if (!collection->removeItem(item))
+        return false;
+    itemsIndex_.erase(item->id());
+    changesIndex_.erase(item->sequence());
+    add_tombstone(collection->name(), item->id());
+    return save();
+}
+
+bool KSecretsFile::update_item(SecretsItemPtr item) noexcept
+{
+    ChangeRef change{ std::string(), item->id(), false };
+    auto pos = changesIndex_.find(item->sequence());
+    if (pos != changesIndex_.end()) {
+        change = pos->second;
+        changesIndex_.erase(pos);
+    }
+    item->setSequence(stamp());
+    changesIndex_[item->sequence()] = change;
+    return save();
+}
+
+bool KSecretsFile::remove_collection(SecretsCollectionPtr collection) noexcept
+{
+    if (collectionDirectory_) {
+        collectionDirectory_->removeCollection(collection->name());
+    }
+    return remove_entity(collection) && save();
+}
+
+bool KSecretsFile::purge_tombstones(Sequence upTo) noexcept
+{
+    if (!changeLog_)
+        return true;
+    for (const auto& tombstone : changeLog_->tombstones()) {
+        if (tombstone.sequence_ > upTo)
+            break;
+        changesIndex_.erase(tombstone.sequence_);
+    }
+    changeLog_->purgeTombstones(upTo);
+    return save();
+}
+
+KSecretsFile::Sequence KSecretsFile::stamp() noexcept
+{
+    if (!changeLog_) {
+        // files without any mutation yet do not need the change log
+        changeLog_ = std::make_shared<ChangeLog>();
+        entities_.emplace_back(changeLog_);
+    }
+    return changeLog_->next();
+}
+
+void KSecretsFile::stamp_entity(SecretsEntityPtr entity) noexcept
+{
+    switch (entity->getType()) {
+    case SecretsEntity::EntityType::SecretsCollectionType: {
+        auto collection = std::static_pointer_cast<SecretsCollection>(entity);
+        collection->setSequence(stamp());
+        for (SecretsItemPtr item : collection->items()) {
+            item->setSequence(stamp());
+        }
+        break;
+    }
+    case SecretsEntity::EntityType::SecretsItemType:
+        std::static_pointer_cast<SecretsItem>(entity)->setSequence(stamp());
+        break;
+    default:
+        break;
+    }
+}
+
+void KSecretsFile::stamp_unsequenced() noexcept
+{
+    // the entities written before the change feed all got indexed at 0, which changes_since() never reports
+    changesIndex_.erase(0);
+    // stamping may add the change log to the entities
+    Entities loaded(entities_);
+    for (SecretsEntityPtr entity : loaded) {
+        if (entity->getType() == SecretsEntity::EntityType::SecretsCollectionType) {
+            auto collection = std::static_pointer_cast<SecretsCollection>(entity);
+            if (collection->sequence() == 0) {
+                collection->setSequence(stamp());
+                changesIndex_[collection->sequence()] = ChangeRef{ collection->name(), std::string(), false };
+            }
+            for (SecretsItemPtr item : collection->items()) {
+                if (item->sequence() == 0) {
+                    item->setSequence(stamp());
+                    changesIndex_[item->sequence()] = ChangeRef{ collection->name(), item->id(), false };
+                }
+            }
+        }
+        else if (entity->getType() == SecretsEntity::EntityType::SecretsItemType) {
+            auto item = std::static_pointer_cast<SecretsItem>(entity);
+            if (item->sequence() == 0) {
+                item->setSequence(stamp());
+                changesIndex_[item->sequence()] = ChangeRef{ std::string(), item->id(), false };
+            }
+        }
+    }
+}
+
+void KSecretsFile::add_tombstone(const std::string& collection, const std::string& item) noexcept
+{
+    auto sequence = stamp();
+    changeLog_->addTombstone(ChangeLog::Tombstone{ sequence, collection, item });
+    changesIndex_[sequence] = ChangeRef{ collection, item, true };
+}
+
+SecretsCollectionPtr KSecretsFile::find_collection(const std::string& name) const noexcept
+{
+    auto pos = collectionsIndex_.find(name);
+    return pos != collectionsIndex_.end() ? pos->second : SecretsCollectionPtr();
+}
+
+SecretsItemPtr KSecretsFile::find_item(const std::string& id) const noexcept
+{
+    auto pos = itemsIndex_.find(id);
+    return pos != itemsIndex_.end() ? pos->second : SecretsItemPtr();
+}
+
+void KSecretsFile::index_entity(SecretsEntityPtr entity) noexcept
+{
+    switch (entity->getType()) {
+    case SecretsEntity::EntityType::CollectionDirectoryType:
+        collectionDirectory_ = std::static_pointer_cast<CollectionDirectory>(entity);
+        break;
+    case SecretsEntity::EntityType::SecretsCollectionType: {
+        auto collection = std::static_pointer_cast<SecretsCollection>(entity);
+        collectionsIndex_[collection->name()] = collection;
+        changesIndex_[collection->sequence()] = ChangeRef{ collection->name(), std::string(), false };
+        for (SecretsItemPtr item : collection->items()) {
+            itemsIndex_[item->id()] = item;
+            changesIndex_[item->sequence()] = ChangeRef{ collection->name(), item->id(), false };
+        }
+        break;
+    }
+    case SecretsEntity::EntityType::SecretsItemType: {
+        auto item = std::static_pointer_cast<SecretsItem>(entity);
+        itemsIndex_[item->id()] = item;
+        changesIndex_[item->sequence()] = ChangeRef{ std::string(), item->id(), false };
+        break;
+    }
+    case SecretsEntity::EntityType::ChangeLogType:
+        changeLog_ = std::static_pointer_cast<ChangeLog>(entity);
+        for (const auto& tombstone : changeLog_->tombstones()) {
+            changesIndex_[tombstone.sequence_] = ChangeRef{ tombstone.collection_, tombstone.item_, true };
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void KSecretsFile::unindex_entity(SecretsEntityPtr entity) noexcept
+{
+    switch (entity->getType()) {
+    case SecretsEntity::EntityType::CollectionDirectoryType:
+        collectionDirectory_.reset();
+        break;
+    case SecretsEntity::EntityType::SecretsCollectionType: {
+        auto collection = std::static_pointer_cast<SecretsCollection>(entity);
+        collectionsIndex_.erase(collection->name());
+        changesIndex_.erase(collection->sequence());
+        for (SecretsItemPtr item : collection->items()) {
+            itemsIndex_.erase(item->id());
+            changesIndex_.erase(item->sequence());
+        }
+        break;
+    }
+    case SecretsEntity::EntityType::SecretsItemType: {
+        auto item = std::static_pointer_cast<SecretsItem>(entity);
+        itemsIndex_.erase(item->id());
+        changesIndex_.erase(item->sequence());
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void KSecretsFile::clear_index() noexcept
+{
+    collectionDirectory_.reset();
+    collectionsIndex_.clear();
+    itemsIndex_.clear();
+    changeLog_.reset();
+    changesIndex_.clear();
+}
+
 // vim: tw=220:ts=4
@@ -24,9 +24,13 @@
 #include "ksecrets_data.h"
 #include "ksecrets_device.h"
 #include "crypting_engine.h"
+#include "ksecrets_io.h"
+#include "ksecrets_metrics.h"
 
 #include <memory>
-#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <map>
 #include <algorithm>
 #define GCRPYT_NO_DEPRECATED
 #include <gcrypt.h>
@@ -43,15 +47,33 @@
  *   Checksum
  *
  * The file header is described by the @ref FileHeadStruct. This structure contains the file format magic string
- * followed by the salt and the initialization vector needed during libgcrypt setup.
+ * followed by the salt and the initialization vector needed during libgcrypt setup. The header is followed by the key
+ * slots, described by the @ref KeySlotsStruct.
  *
- * The actual data follows the file header and is encrypted with libgcrypt using a pair of keys derived by from user's
- * password using libgcrypt. The encryption details are handled by the @ref CryptingEngine. The serialization of the
+ * The actual data follows the key slots and is encrypted with libgcrypt using a pair of random master keys. Each used key
+ * slot holds these master keys, wrapped with a key derived from user's password. The key slots are not part of the MAC,
+ * as the key wrapping already detects tampering, so they can be rewritten in place, e.g. upon password change, without
+ * touching the rest of the file. Each file encrypts with its own @ref CryptingContext, so several files may be open at
+ * once, while the @ref CryptingEngine shares the keys with the rest of the user session. The serialization of the
  * items is taken care of by the @ref SecretsItem class and it's inheritors. The serialization is done in ASCII in
  * order to avoid endian issues.
  *
  * The end of the file containa the checksum. That'a also handled by the @ref SecretsItem base class.
  *
+ * The contents may also be kept in memory only, @see setupInMemory()
+ *
+ * Each save keeps the previous version of the file as a backup, up to backupGenerations(). The backups are cloned from the
+ * live file on file systems supporting reflinks, otherwise they are hard links to the live file the save replaces, so they
+ * never cost a copy of the data. Any of them can be brought back with restoreBackup().
+ *
+ * The file is always read and written sequentially, through @ref KSecretsIO, which overlaps the disk transfers with the
+ * crypting when io_uring is available.
+ *
+ * Once read, the entities are kept in memory and indexed by type: the collection directory is held directly, the
+ * collections are indexed by name and the items by id. The index is maintained by the entity manipulation methods below,
+ * so lookups do not depend on the number of entities in the file. @ref EntityHandle lets callers keep references to
+ * indexed entities across saves and reloads. The changes are also indexed by their sequence number, @see changes_since()
+ *
  * @sa SecretsItem, CryptingEngine
  */
 class KSecretsFile : public KSecretsDevice {
@@ -67,13 +89,64 @@ public:
         unsigned char iv_[CryptingEngine::IV_SIZE];
     };
 
-    enum class OpenStatus { Ok, CannotOpenFile, CannotLockFile, CannotReadHeader, UnknownHeader, CryptEngineError, EntitiesReadError, IntegrityCheckFailed };
+    enum class KeySlotType : std::uint8_t { Unused, Password };
+    struct KeySlotStruct {
+        std::uint8_t type_; /// one of the KeySlotType values
+        unsigned char salt_[CryptingEngine::SALT_SIZE];
+        unsigned char wrappedKeys_[CryptingEngine::WRAPPED_KEYS_SIZE];
+    };
+    constexpr static auto KEY_SLOTS_COUNT = 4;
+    struct KeySlotsStruct {
+        KeySlotStruct slots_[KEY_SLOTS_COUNT];
+    };
+
+    /**
+     * UnsupportedVersion is returned for the files of the format preceding the key slots. Their keys were derived from the
+     * password and never reached the cipher, so they cannot be migrated and should be moved away.
+     */
+    enum class OpenStatus { Ok, CannotOpenFile, CannotLockFile, CannotReadHeader, UnknownHeader, UnsupportedVersion, CannotUnlockKeys, CryptEngineError, EntitiesReadError, IntegrityCheckFailed };
 
+    /**
+     * @brief Creates a new, empty, secrets file with new master keys
+     *
+     * If a password was given, the master keys get wrapped with it into the first key slot. Otherwise, this instance keeps
+     * them until the first open of the file, @see setPassword()
+     *
+     * @return 0 on success or the errno value
+     */
     int create(const std::string& path) noexcept;
     void setup(const std::string& path, bool readOnly) noexcept;
+    /**
+     * @brief Keeps the file contents in memory instead of on disk, with the same format, crypting and entities
+     *
+     * If a snapshot path is given, the contents are loaded from that file if it exists, and each save atomically writes
+     * them back there. Otherwise, or if the snapshot does not exist yet, new empty contents get created. This is meant for
+     * session-scoped secrets, e.g. with the snapshot on a tmpfs. No backups are kept in this mode.
+     *
+     * The contents never change the keys of the kernel keyring. New contents use the keys of the session if there is no
+     * password and the keyring has them, so the snapshot may be opened as a regular file, otherwise their own new keys.
+     *
+     * @return 0 on success or the errno value
+     */
+    int setupInMemory(const std::string& snapshotPath = std::string()) noexcept;
+    bool inMemory() const noexcept { return inMemory_; }
+    bool readOnly() const noexcept { return readOnly_; }
+    /**
+     * @brief Atomically writes the current contents to the given path, as a regular secrets file
+     */
+    bool snapshot(const std::string& path) noexcept;
+    /**
+     * @brief Writes the sealed image of the file next to it, or removes it, @see KSecretsSealed
+     *
+     * Once the image exists, each replacement of the file writes it again, whatever the process doing it, while still
+     * holding the lock. The in-memory contents cannot be sealed.
+     */
+    bool setSealing(bool) noexcept;
+    bool sealing() const noexcept;
     OpenStatus openAndCheck(bool lock, bool justCheck =false) noexcept;
     bool open() noexcept;
     bool openSaveTempFile() noexcept;
+    void discardSaveTempFile() noexcept;
     bool saveMac() noexcept;
     bool readEntities(bool justCheck) noexcept;
     bool readCheckMac() noexcept;
@@ -83,19 +156,80 @@ public:
     bool lock() noexcept;
     bool readHeader() noexcept;
     bool writeHeader() noexcept;
+    bool readKeySlots() noexcept;
+    bool writeKeySlots() noexcept;
     bool checkMagic() noexcept;
+
+    /**
+     * @brief Gives the password used to unwrap the master keys upon next open
+     *
+     * Without a password, the master keys should already be in the kernel keyring. A file without any used key slot can
+     * only be opened by the instance which created it, the master keys then getting wrapped with this password into the
+     * first slot. Unlocked master keys are also put into the keyring, except for the contents kept in memory.
+     */
+    void setPassword(const std::string& password) noexcept;
+    bool unlockKeySlots() noexcept;
+    /**
+     * @brief Adds an unlock method to the file by wrapping the current master keys with this password into a free key slot
+     *
+     * Only the key slots get rewritten, in place. The last free slot is kept for changePassword().
+     */
+    bool addPasswordSlot(const std::string& password) noexcept;
+    /**
+     * @brief Replaces all the password key slots with one using this new password
+     *
+     * The new slot is written and synced before the old ones get cleared, so a crash in between leaves the file usable with
+     * either password.
+     */
+    bool changePassword(const std::string& newPassword) noexcept;
+    /**
+     * @brief Same as above, but the master keys get unwrapped with the old password instead of being the ones of the open file
+     *
+     * This only reads the header and the key slots of the file, which should not be open, so it works outside of the user
+     * session, e.g. from passwd.
+     */
+    bool changePassword(const std::string& oldPassword, const std::string& newPassword) noexcept;
+
+    /**
+     * @brief Number of file versions kept as backups upon save, 0 disables backups. The oldest generations get deleted.
+     */
+    void setBackupGenerations(unsigned generations) noexcept { backupGenerations_ = generations; }
+    unsigned backupGenerations() const noexcept { return inMemory_ ? 0 : backupGenerations_; }
+    /**
+     * @brief Backup file path for the given generation, 1 being the most recent one
+     */
+    std::string backupPath(unsigned generation) const noexcept;
+    /**
+     * @brief Replaces the live file with the backup of the given generation, then reloads the entities
+     *
+     * The backup is checked first. The live file gets itself backed-up, so the generations are shifted after this call.
+     * Only the entities are restored, the key slots of the live file are kept, so the current passwords still apply.
+     */
+    bool restoreBackup(unsigned generation) noexcept;
     const unsigned char* salt() const noexcept { return fileHead_.salt_; }
     virtual const unsigned char* iv() const noexcept override { return fileHead_.iv_; }
+    virtual CryptingContext* cryptingContext() const noexcept override { return context_.get(); }
     virtual bool read(void* buf, size_t count) noexcept override;
     int errnumber() const noexcept { return errno_; }
     bool eof() const noexcept { return eof_; }
     virtual bool write(const void* buf, size_t count) noexcept override;
+    /**
+     * @brief Counters and latencies of the operations on this file, @see KSecretsMetrics
+     */
+    KSecretsMetrics& metrics() noexcept { return metrics_; }
+    const KSecretsMetrics& metrics() const noexcept { return metrics_; }
 
     template <class E> bool emplace_entity(E&& e) noexcept
     {
         entities_.emplace_back(e);
+        auto entity = entities_.back();
+        stamp_entity(entity);
+        index_entity(entity);
         return save();
     }
+    /**
+     * @brief Removes the entity and leaves a tombstone if it's a collection or an item, without saving the file
+     */
     bool remove_entity(SecretsEntityPtr);
     template <class P> SecretsEntityPtr find_entity(P pred)
     {
@@ -107,6 +241,95 @@ public:
             return SecretsEntityPtr();
     }
 
+    /**
+     * @brief Adds the item to the collection and saves the file
+     *
+     * The collection should be one of the indexed collections of this file.
+     */
+    bool emplace_item(SecretsCollectionPtr, SecretsItemPtr) noexcept;
+    bool remove_item(SecretsCollectionPtr, SecretsItemPtr) noexcept;
+    /**
+     * @brief Stamps the item with the next sequence number then saves the file. Call this after modifying an item.
+     */
+    bool update_item(SecretsItemPtr) noexcept;
+    /**
+     * @brief Removes the collection, along with its items and its directory entry, then saves the file
+     */
+    bool remove_collection(SecretsCollectionPtr) noexcept;
+
+    using Sequence = SecretsEntity::Sequence;
+    /**
+     * @brief Entry of the changes index, that is, what changed, or got deleted, at a given sequence number
+     */
+    struct ChangeRef {
+        std::string collection_;
+        std::string item_; /// empty for the collection changes
+        bool deleted_;
+    };
+    using ChangesIndex = std::map<Sequence, ChangeRef>;
+
+    /**
+     * @brief Sequence number of the last mutation of the file contents
+     */
+    Sequence sequence() const noexcept { return changeLog_ ? changeLog_->sequence() : 0; }
+    /**
+     * @return the first change following the given sequence number in the changes index
+     *
+     * Only the last change of each collection and item is indexed, so walking from here to changes_end() costs
+     * proportionally to what changed since, not to the file size. Removing a collection only leaves the collection
+     * tombstone, whether it had items or not, its items being implicitly deleted. The entities loaded without a sequence
+     * number get one, @see stamp_unsequenced()
+     */
+    ChangesIndex::const_iterator changes_since(Sequence sequence) const noexcept { return changesIndex_.upper_bound(sequence); }
+    ChangesIndex::const_iterator changes_end() const noexcept { return changesIndex_.end(); }
+    /**
+     * @brief Forgets the tombstones up to the given sequence number, then saves the file
+     */
+    bool purge_tombstones(Sequence upTo) noexcept;
+
+    CollectionDirectoryPtr collection_directory() const noexcept { return collectionDirectory_; }
+    SecretsCollectionPtr find_collection(const std::string& name) const noexcept;
+    SecretsItemPtr find_item(const std::string& id) const noexcept;
+
+    /**
+     * @brief Incremented each time the entities get reloaded from disk, invalidating the pointers previously obtained
+     */
+    unsigned long generation() const noexcept { return generation_; }
+
+    /**
+     * @brief Stable reference to an indexed entity
+     *
+     * The handle keeps the entity lookup key along with the pointer resolved from the index. The pointer gets resolved
+     * again if the file reloaded its entities in the meantime, so handles stay valid across save() and re-opens.
+     */
+    template <class E> class EntityHandle {
+    public:
+        using EntityPtr = std::shared_ptr<E>;
+        EntityHandle() = default;
+        explicit EntityHandle(const std::string& key)
+            : key_(key)
+        {
+        }
+        const std::string& key() const noexcept { return key_; }
+        EntityPtr get(const KSecretsFile& file) const noexcept
+        {
+            if (!entity_ || generation_ != file.generation()) {
+                entity_ = file.find_indexed<E>(key_);
+                generation_ = file.generation();
+            }
+            return entity_;
+        }
+
+    private:
+        std::string key_;
+        mutable EntityPtr entity_;
+        mutable unsigned long generation_ = 0;
+    };
+    using CollectionHandle = EntityHandle<SecretsCollection>;
+    using ItemHandle = EntityHandle<SecretsItem>;
+
+    template <class E> std::shared_ptr<E> find_indexed(const std::string& key) const noexcept;
+
 private:
     bool setFailState(int err, bool retval = false) noexcept
     {
@@ -119,22 +342,77 @@ private:
         return false; // this work the same as setFailState
     }
     bool decryptEntity(SecretsEntity&) noexcept;
+    bool readRaw(void* buf, size_t count) noexcept;
+    bool writeRaw(const void* buf, size_t count) noexcept;
+    bool buildEmptyFile(KSecretsIO::Image&, const CryptingContext& keys) noexcept;
+    bool createdHere() const noexcept;
+    bool hasPasswordSlots() const noexcept;
+    bool unwrapKeySlots(const std::string& password, unsigned char* masterKeys) noexcept;
+    bool installMasterKeys(const unsigned char* masterKeys) noexcept;
+    bool readSessionKeys() noexcept;
+    bool wrapIntoSlot(KeySlotStruct&, const std::string& password, const unsigned char* masterKeys) noexcept;
+    bool replacePasswordSlots(const std::string& newPassword, const unsigned char* masterKeys) noexcept;
+    bool updateKeySlots() noexcept;
+    void clearPassword() noexcept;
     void closeFile(int&) noexcept;
     bool backupAndReplaceWithWritten(const char*) noexcept;
+    bool backupLiveFile() noexcept;
+    bool reopenReplaced(ino_t written = 0) noexcept;
+    bool seal() noexcept;
+    bool rotateBackups() noexcept;
+    bool copyKeySlots(const char* fromPath, const char* toPath) noexcept;
+    void index_entity(SecretsEntityPtr) noexcept;
+    void unindex_entity(SecretsEntityPtr) noexcept;
+    void clear_index() noexcept;
+    Sequence stamp() noexcept;
+    void stamp_entity(SecretsEntityPtr) noexcept;
+    /**
+     * @brief Gives the next sequence numbers to the loaded entities having none, in the file order
+     *
+     * This order makes the processes reading the same file agree on these numbers, which the next save keeps.
+     */
+    void stamp_unsequenced() noexcept;
+    void add_tombstone(const std::string& collection, const std::string& item) noexcept;
 
-    using Entities = std::deque<SecretsEntityPtr>;
+    using Entities = std::vector<SecretsEntityPtr>;
+    using CollectionsIndex = std::unordered_map<std::string, SecretsCollectionPtr>;
+    using ItemsIndex = std::unordered_map<std::string, SecretsItemPtr>;
 
     std::string filePath_;
+    std::string tempPath_;
+    bool inMemory_;
+    std::string snapshotPath_;
+    KSecretsIO::Image image_;
+    KSecretsIO::Image writtenImage_;
     int readFile_;
     int writeFile_;
+    KSecretsIOPtr readIO_;
+    KSecretsIOPtr writeIO_;
     bool locked_;
     bool readOnly_;
+    unsigned backupGenerations_;
     FileHeadStruct fileHead_;
+    KeySlotsStruct keySlots_;
+    std::string password_;
+    CryptingContextPtr createdKeys_; /// master keys of the file created by this instance without a password
+    std::string createdPath_;
+    CryptingContextPtr context_; /// master keys and cipher of the entities, set by setup() and the first unlock
     Entities entities_;
+    EntityArenaPtr arena_; /// holds the entities loaded from the current generation, @see readEntities()
+    CollectionDirectoryPtr collectionDirectory_;
+    CollectionsIndex collectionsIndex_;
+    ItemsIndex itemsIndex_;
+    ChangeLogPtr changeLog_;
+    ChangesIndex changesIndex_;
+    unsigned long generation_;
     int errno_;
     bool eof_;
     CryptingEngine::MAC mac_;
+    KSecretsMetrics metrics_;
 };
 
+template <> inline SecretsCollectionPtr KSecretsFile::find_indexed<SecretsCollection>(const std::string& key) const noexcept { return find_collection(key); }
+template <> inline SecretsItemPtr KSecretsFile::find_indexed<SecretsItem>(const std::string& key) const noexcept { return find_item(key); }
+
 #endif
 // vim: tw=220:ts=4
@@ -0,0 +1,684 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+#include "ksecrets_io.h"
+#include "defines.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <new>
+
+#ifdef KSECRETS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+constexpr size_t KSecretsIO::CHUNK_SIZE;
+
+namespace {
+
+/**
+ * @brief Blocking backend, reading and writing the file in CHUNK_SIZE pieces
+ */
+class SyscallsIO : public KSecretsIO {
+public:
+    SyscallsIO()
+        : buffer_(new char[CHUNK_SIZE])
+        , pos_(0)
+        , len_(0)
+    {
+    }
+
+    Backend backend() const noexcept override { return Backend::Syscalls; }
+
+    void attach(int fd) noexcept override
+    {
+        fd_ = fd;
+        offset_ = 0;
+        pos_ = 0;
+        len_ = 0;
+    }
+
+    ssize_t read(void* buf, size_t count) noexcept override
+    {
+        char* out = static_cast<char*>(buf);
+        size_t done = 0;
+        while (done < count) {
+            if (pos_ == len_) {
+                auto rres = ::read(fd_, buffer_.get(), CHUNK_SIZE);
+                if (rres < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return -1;
+                }
+                if (rres == 0)
+                    break;
+                pos_ = 0;
+                len_ = rres;
+            }
+            auto n = std::min(count - done, len_ - pos_);
+            memcpy(out + done, buffer_.get() + pos_, n);
+            pos_ += n;
+            done += n;
+        }
+        offset_ += done;
+        return done;
+    }
+
+    bool write(const void* buf, size_t count) noexcept override
+    {
+        const char* in = static_cast<const char*>(buf);
+        while (count > 0) {
+            auto n = std::min(count, CHUNK_SIZE - len_);
+            memcpy(buffer_.get() + len_, in, n);
+            len_ += n;
+            in += n;
+            count -= n;
+            offset_ += n;
+            if (len_ == CHUNK_SIZE && !flush())
+                return false;
+        }
+        return true;
+    }
+
+    bool finish(const char* renameFrom, const char* renameTo) noexcept override
+    {
+        if (!flush())
+            return false;
+        auto start = Clock::now();
+        if (fdatasync(fd_) == -1) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot sync written file errno=%d", errno);
+            return false;
+        }
+        record(KSecretsMetrics::Operation::Sync, start);
+        if (renameFrom != nullptr) {
+            start = Clock::now();
+            if (rename(renameFrom, renameTo) == -1) {
+                syslog(KSS_LOG_ERR, "ksecrets: cannot rename %s to %s errno=%d", renameFrom, renameTo, errno);
+                return false;
+            }
+            record(KSecretsMetrics::Operation::Rename, start);
+        }
+        return true;
+    }
+
+private:
+    bool flush() noexcept
+    {
+        size_t done = 0;
+        while (done < len_) {
+            auto wres = ::write(fd_, buffer_.get() + done, len_ - done);
+            if (wres < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (wres == 0) {
+                errno = ENOSPC;
+                return false;
+            }
+            done += wres;
+        }
+        len_ = 0;
+        return true;
+    }
+
+    std::unique_ptr<char[]> buffer_;
+    size_t pos_;
+    size_t len_;
+};
+
+class MemoryIO : public KSecretsIO {
+public:
+    explicit MemoryIO(Image& image)
+        : image_(image)
+    {
+    }
+
+    Backend backend() const noexcept override { return Backend::Memory; }
+
+    void attach(int fd) noexcept override
+    {
+        fd_ = fd;
+        offset_ = 0;
+    }
+
+    ssize_t read(void* buf, size_t count) noexcept override
+    {
+        auto n = std::min(count, image_.size() - std::min(image_.size(), static_cast<size_t>(offset_)));
+        memcpy(buf, image_.data() + offset_, n);
+        offset_ += n;
+        return n;
+    }
+
+    bool write(const void* buf, size_t count) noexcept override
+    {
+        auto in = static_cast<const unsigned char*>(buf);
+        try {
+            image_.insert(image_.end(), in, in + count);
+        }
+        catch (std::bad_alloc&) {
+            errno = ENOMEM;
+            return false;
+        }
+        offset_ += count;
+        return true;
+    }
+
+    bool finish(const char*, const char*) noexcept override { return true; }
+
+private:
+    Image& image_;
+};
+
+#ifdef KSECRETS_HAVE_IO_URING
+
+/**
+ * @brief Minimal io_uring wrapper using the raw system calls, so no liburing is needed
+ *
+ * Only one thread uses a given ring, and there is no SQ polling, so the kernel only looks at the submission queue during
+ * io_uring_enter.
+ */
+class Ring {
+public:
+    explicit Ring(unsigned entries) noexcept
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd_ == -1)
+            return;
+
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        singleMmap_ = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap_) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+        sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sqRing_ == MAP_FAILED) {
+            sqRing_ = nullptr;
+            return;
+        }
+        if (singleMmap_) {
+            cqRing_ = sqRing_;
+        }
+        else {
+            cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cqRing_ == MAP_FAILED) {
+                cqRing_ = nullptr;
+                return;
+            }
+        }
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        auto sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return;
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto sq = static_cast<char*>(sqRing_);
+        sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries_ = params.sq_entries;
+        sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto cq = static_cast<char*>(cqRing_);
+        cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        localTail_ = *sqTail_;
+    }
+
+    ~Ring()
+    {
+        if (sqes_ != nullptr)
+            munmap(sqes_, sqesSize_);
+        if (cqRing_ != nullptr && !singleMmap_)
+            munmap(cqRing_, cqRingSize_);
+        if (sqRing_ != nullptr)
+            munmap(sqRing_, sqRingSize_);
+        if (fd_ != -1)
+            ::close(fd_);
+    }
+
+    bool isValid() const noexcept { return sqes_ != nullptr; }
+
+    /**
+     * @return a cleared submission entry, or nullptr if the submission queue is full
+     */
+    io_uring_sqe* getSqe() noexcept
+    {
+        auto head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (localTail_ - head >= sqEntries_)
+            return nullptr;
+        auto idx = localTail_ & sqMask_;
+        sqArray_[idx] = idx;
+        localTail_++;
+        toSubmit_++;
+        auto sqe = &sqes_[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    bool submit() noexcept
+    {
+        __atomic_store_n(sqTail_, localTail_, __ATOMIC_RELEASE);
+        while (toSubmit_ > 0) {
+            auto res = syscall(__NR_io_uring_enter, fd_, toSubmit_, 0, 0, nullptr, 0);
+            if (res < 0) {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                return false;
+            }
+            toSubmit_ -= res;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Pops the next completion, waiting for it if needed
+     */
+    bool waitCqe(io_uring_cqe& cqe) noexcept
+    {
+        for (;;) {
+            auto head = *cqHead_;
+            if (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+                cqe = cqes_[head & cqMask_];
+                __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            auto res = syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (res < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+private:
+    int fd_ = -1;
+    bool singleMmap_ = false;
+    void* sqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    void* cqRing_ = nullptr;
+    size_t cqRingSize_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    unsigned* sqArray_ = nullptr;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned localTail_ = 0;
+    unsigned toSubmit_ = 0;
+};
+
+/**
+ * @brief io_uring backend using two chunks: one is being transferred by the kernel while the caller works on the other one
+ */
+class UringIO : public KSecretsIO {
+public:
+    constexpr static unsigned CHUNKS_COUNT = 2;
+    constexpr static __u64 FSYNC_TAG = CHUNKS_COUNT;
+    constexpr static __u64 RENAME_TAG = CHUNKS_COUNT + 1;
+
+    UringIO()
+        : ring_(8)
+    {
+        for (auto& c : chunks_) {
+            c.data_.reset(new char[CHUNK_SIZE]);
+        }
+    }
+    ~UringIO() { drain(); }
+
+    bool isValid() const noexcept { return ring_.isValid(); }
+    Backend backend() const noexcept override { return Backend::IoUring; }
+
+    void attach(int fd) noexcept override
+    {
+        // the buffers may still be targeted by the kernel if the previous file was not entirely read
+        drain();
+        fd_ = fd;
+        offset_ = 0;
+        fileOffset_ = 0;
+        current_ = 0;
+        pos_ = 0;
+        started_ = false;
+        error_ = 0;
+        for (auto& c : chunks_) {
+            c.len_ = 0;
+        }
+    }
+
+    ssize_t read(void* buf, size_t count) noexcept override
+    {
+        if (!started_) {
+            // read ahead right from the start
+            started_ = true;
+            for (unsigned i = 0; i < CHUNKS_COUNT; i++) {
+                if (!submitChunk(i, IORING_OP_READ))
+                    return -1;
+            }
+        }
+        char* out = static_cast<char*>(buf);
+        size_t done = 0;
+        while (done < count) {
+            Chunk& chunk = chunks_[current_];
+            if (chunk.pending_ && !waitFor(current_))
+                return -1;
+            if (pos_ < chunk.len_) {
+                auto n = std::min(count - done, chunk.len_ - pos_);
+                memcpy(out + done, chunk.data_.get() + pos_, n);
+                pos_ += n;
+                done += n;
+                continue;
+            }
+            if (chunk.len_ < CHUNK_SIZE)
+                break; // EOF
+            // this chunk was consumed, recycle it to read further while the caller uses the next one
+            if (!submitChunk(current_, IORING_OP_READ))
+                return -1;
+            current_ = (current_ + 1) % CHUNKS_COUNT;
+            pos_ = 0;
+        }
+        offset_ += done;
+        return done;
+    }
+
+    bool write(const void* buf, size_t count) noexcept override
+    {
+        const char* in = static_cast<const char*>(buf);
+        while (count > 0) {
+            Chunk& chunk = chunks_[current_];
+            if (chunk.pending_ && !waitFor(current_))
+                return false;
+            auto n = std::min(count, CHUNK_SIZE - chunk.len_);
+            memcpy(chunk.data_.get() + chunk.len_, in, n);
+            chunk.len_ += n;
+            in += n;
+            count -= n;
+            offset_ += n;
+            if (chunk.len_ == CHUNK_SIZE) {
+                if (!submitChunk(current_, IORING_OP_WRITE))
+                    return false;
+                current_ = (current_ + 1) % CHUNKS_COUNT;
+            }
+        }
+        return true;
+    }
+
+    bool finish(const char* renameFrom, const char* renameTo) noexcept override
+    {
+        // the final chain must only start once the previous writes completed, as their completion may require resubmission
+        for (unsigned i = 0; i < CHUNKS_COUNT; i++) {
+            if (i != current_ && !waitFor(i))
+                return false;
+        }
+        Chunk& last = chunks_[current_];
+        if (last.pending_ && !waitFor(current_))
+            return false;
+
+        // write -> fdatasync -> rename, linked so each one only starts if the previous one succeeded
+        unsigned chained = 0;
+        off_t lastOffset = fileOffset_;
+        if (last.len_ > 0) {
+            if (!prepareChunk(current_, IORING_OP_WRITE, IOSQE_IO_LINK))
+                return false;
+            chained++;
+        }
+        auto sqe = ring_.getSqe();
+        if (sqe == nullptr)
+            return false;
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd_;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = FSYNC_TAG;
+        chained++;
+        if (renameFrom != nullptr) {
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe = ring_.getSqe();
+            if (sqe == nullptr)
+                return false;
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<__u64>(renameFrom);
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = reinterpret_cast<__u64>(renameTo);
+            sqe->user_data = RENAME_TAG;
+            chained++;
+        }
+        if (!ring_.submit())
+            return false;
+
+        // the sync duration includes the last write, as they are chained
+        auto start = Clock::now();
+        bool written = last.len_ == 0;
+        bool synced = false;
+        int syncError = 0;
+        bool renamed = renameFrom == nullptr;
+        while (chained--) {
+            io_uring_cqe cqe;
+            if (!ring_.waitCqe(cqe))
+                return false;
+            if (cqe.user_data == FSYNC_TAG) {
+                synced = cqe.res == 0;
+                if (synced) {
+                    record(KSecretsMetrics::Operation::Sync, start);
+                    start = Clock::now();
+                }
+                else if (cqe.res != -ECANCELED && cqe.res != -EINVAL) {
+                    // the kernel may drop the dirty pages after a writeback error, so syncing again could wrongly succeed
+                    syncError = -cqe.res;
+                }
+            }
+            else if (cqe.user_data == RENAME_TAG) {
+                renamed = cqe.res == 0;
+                if (renamed) {
+                    record(KSecretsMetrics::Operation::Rename, start);
+                }
+            }
+            else {
+                written = cqe.res >= 0 && static_cast<size_t>(cqe.res) == last.len_;
+                chunks_[cqe.user_data].pending_ = false;
+            }
+        }
+
+        if (syncError != 0) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot sync written file errno=%d", syncError);
+            errno = syncError;
+            return false;
+        }
+
+        // a short write breaks the chain, and older kernels do not know about IORING_OP_RENAMEAT: complete with plain system calls
+        if (!written) {
+            size_t done = 0;
+            while (done < last.len_) {
+                auto wres = pwrite(fd_, last.data_.get() + done, last.len_ - done, lastOffset + done);
+                if (wres <= 0) {
+                    if (wres < 0 && errno == EINTR)
+                        continue;
+                    syslog(KSS_LOG_ERR, "ksecrets: cannot write to file errno=%d", wres == 0 ? ENOSPC : errno);
+                    return false;
+                }
+                done += wres;
+            }
+        }
+        last.len_ = 0;
+        if (!synced) {
+            start = Clock::now();
+            if (fdatasync(fd_) == -1) {
+                syslog(KSS_LOG_ERR, "ksecrets: cannot sync written file errno=%d", errno);
+                return false;
+            }
+            record(KSecretsMetrics::Operation::Sync, start);
+        }
+        if (!renamed) {
+            start = Clock::now();
+            if (rename(renameFrom, renameTo) == -1) {
+                syslog(KSS_LOG_ERR, "ksecrets: cannot rename %s to %s errno=%d", renameFrom, renameTo, errno);
+                return false;
+            }
+            record(KSecretsMetrics::Operation::Rename, start);
+        }
+        return true;
+    }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data_;
+        size_t len_ = 0;
+        size_t requested_ = 0;
+        size_t done_ = 0;
+        off_t offset_ = 0;
+        __u8 opcode_ = 0;
+        bool pending_ = false;
+    };
+
+    bool prepareChunk(unsigned idx, __u8 opcode, __u8 flags = 0) noexcept
+    {
+        Chunk& chunk = chunks_[idx];
+        auto sqe = ring_.getSqe();
+        if (sqe == nullptr) {
+            errno = EBUSY;
+            return false;
+        }
+        chunk.opcode_ = opcode;
+        chunk.offset_ = fileOffset_;
+        if (opcode == IORING_OP_READ) {
+            chunk.len_ = 0;
+            chunk.requested_ = CHUNK_SIZE;
+        }
+        else {
+            chunk.requested_ = chunk.len_;
+        }
+        chunk.done_ = 0;
+        fileOffset_ += chunk.requested_;
+        chunk.pending_ = true;
+        fillSqe(sqe, idx, flags);
+        return true;
+    }
+
+    void fillSqe(io_uring_sqe* sqe, unsigned idx, __u8 flags) noexcept
+    {
+        Chunk& chunk = chunks_[idx];
+        auto done = chunk.done_;
+        sqe->opcode = chunk.opcode_;
+        sqe->flags = flags;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<__u64>(chunk.data_.get() + done);
+        sqe->len = chunk.requested_ - done;
+        sqe->off = chunk.offset_ + done;
+        sqe->user_data = idx;
+    }
+
+    bool submitChunk(unsigned idx, __u8 opcode) noexcept { return prepareChunk(idx, opcode) && ring_.submit(); }
+
+    /**
+     * @brief Waits until the given chunk is transferred, resubmitting the rest upon short transfers
+     */
+    bool waitFor(unsigned idx) noexcept
+    {
+        while (chunks_[idx].pending_) {
+            io_uring_cqe cqe;
+            if (!ring_.waitCqe(cqe)) {
+                return false;
+            }
+            Chunk& chunk = chunks_[cqe.user_data];
+            bool reading = chunk.opcode_ == IORING_OP_READ;
+            if (cqe.res <= 0 && !(reading && cqe.res == 0)) {
+                chunk.pending_ = false;
+                error_ = cqe.res == 0 ? ENOSPC : -cqe.res;
+                continue;
+            }
+            chunk.done_ += cqe.res;
+            if (reading) {
+                chunk.len_ = chunk.done_;
+            }
+            if (chunk.done_ == chunk.requested_ || cqe.res == 0) {
+                chunk.pending_ = false;
+                if (!reading) {
+                    chunk.len_ = 0;
+                }
+                continue;
+            }
+            auto sqe = ring_.getSqe();
+            if (sqe == nullptr) {
+                chunk.pending_ = false;
+                error_ = EBUSY;
+                continue;
+            }
+            fillSqe(sqe, cqe.user_data, 0);
+            if (!ring_.submit())
+                return false;
+        }
+        if (error_ != 0) {
+            errno = error_;
+            return false;
+        }
+        return true;
+    }
+
+    void drain() noexcept
+    {
+        for (unsigned i = 0; i < CHUNKS_COUNT; i++) {
+            waitFor(i);
+        }
+    }
+
+    Ring ring_;
+    Chunk chunks_[CHUNKS_COUNT];
+    unsigned current_ = 0;
+    size_t pos_ = 0;
+    off_t fileOffset_ = 0;
+    bool started_ = false;
+    int error_ = 0;
+};
+
+#endif
+}
+
+std::unique_ptr<KSecretsIO> KSecretsIO::create(Backend preferred) noexcept
+{
+#ifdef KSECRETS_HAVE_IO_URING
+    if (preferred == Backend::IoUring) {
+        std::unique_ptr<UringIO> io(new UringIO);
+        if (io->isValid()) {
+            return io;
+        }
+        syslog(KSS_LOG_INFO, "ksecrets: io_uring not available errno=%d, using plain system calls", errno);
+    }
+#else
+    UNUSED(preferred);
+#endif
+    return std::unique_ptr<KSecretsIO>(new SyscallsIO);
+}
+
+std::unique_ptr<KSecretsIO> KSecretsIO::createInMemory(Image& image) noexcept { return std::unique_ptr<KSecretsIO>(new MemoryIO(image)); }
+// vim: tw=220:ts=4
@@ -0,0 +1,118 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#ifndef KSECRETS_IO_H
+#define KSECRETS_IO_H
+
+#include "ksecrets_metrics.h"
+
+#include <sys/types.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Sequential I/O used by the @ref KSecretsFile to read or to write the secrets file
+ *
+ * The secrets file is always read and written from the beginning to the end, entity after entity. This class takes
+ * advantage of that. When reading, it reads ahead in large chunks while the caller decrypts the data already read. When
+ * writing, it hands full chunks to the kernel and lets the caller encrypt the next entities while they are written.
+ *
+ * Two backends are available. The io_uring backend really overlaps the disk I/O with the crypting, and it chains the final
+ * write, the data sync and the rename of the written file as linked operations. It's only available on Linux, when the
+ * library is built with KSECRETS_HAVE_IO_URING and the running kernel supports it. Otherwise the backend uses buffered
+ * blocking system calls, which at least avoids a system call per serialized field. The memory backend reads from or
+ * appends to an in-memory file image instead, @see createInMemory()
+ *
+ * An instance is either used for reading or for writing a given file descriptor, @see attach()
+ */
+class KSecretsIO {
+public:
+    enum class Backend { Syscalls, IoUring, Memory };
+    using Image = std::vector<unsigned char>;
+
+    /**
+     * @return an instance using the preferred backend if available, or else the system calls backend
+     */
+    static std::unique_ptr<KSecretsIO> create(Backend preferred = Backend::IoUring) noexcept;
+    /**
+     * @return an instance reading from the given image, or appending to it. The file descriptor given to attach() is
+     * ignored and finish() does not rename anything, as there is no file.
+     */
+    static std::unique_ptr<KSecretsIO> createInMemory(Image& image) noexcept;
+
+    constexpr static size_t CHUNK_SIZE = 64 * 1024;
+
+    virtual ~KSecretsIO() = default;
+
+    virtual Backend backend() const noexcept = 0;
+
+    /**
+     * @brief Starts working on the given file descriptor, from its beginning. Any previous state gets discarded.
+     */
+    virtual void attach(int fd) noexcept = 0;
+
+    /**
+     * @return the count of bytes read, which is less than count at the end of file, or -1 on error with errno set
+     */
+    virtual ssize_t read(void* buf, size_t count) noexcept = 0;
+    virtual bool write(const void* buf, size_t count) noexcept = 0;
+
+    /**
+     * @brief Completes the writing: the pending data gets written, then synced to disk, then the written file gets renamed
+     * from renameFrom to renameTo. The rename is skipped if renameFrom is nullptr.
+     */
+    virtual bool finish(const char* renameFrom = nullptr, const char* renameTo = nullptr) noexcept = 0;
+
+    /**
+     * @brief Logical position in the file, that is, what the caller has read or written so far
+     */
+    off_t offset() const noexcept { return offset_; }
+
+    /**
+     * @brief Where to record the duration of the data syncs and of the renames done by finish(), if anywhere
+     */
+    void setMetrics(KSecretsMetrics* metrics) noexcept { metrics_ = metrics; }
+
+protected:
+    KSecretsIO()
+        : fd_(-1)
+        , offset_(0)
+        , metrics_(nullptr)
+    {
+    }
+
+    using Clock = std::chrono::steady_clock;
+    void record(KSecretsMetrics::Operation op, Clock::time_point since) noexcept
+    {
+        if (metrics_) {
+            metrics_->record(op, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - since).count());
+        }
+    }
+
+    int fd_;
+    off_t offset_;
+    KSecretsMetrics* metrics_;
+};
+
+using KSecretsIOPtr = std::unique_ptr<KSecretsIO>;
+
+#endif
+// vim: tw=220:ts=4
@@ -0,0 +1,106 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#include "ksecrets_metrics.h"
+
+constexpr size_t KSecretsMetrics::OPERATIONS_COUNT;
+constexpr size_t KSecretsMetrics::BUCKETS_COUNT;
+
+KSecretsMetrics::KSecretsMetrics() { reset(); }
+
+void KSecretsMetrics::record(Operation op, std::uint64_t nanoseconds) noexcept
+{
+    auto& histogram = operations_[static_cast<size_t>(op)];
+    histogram.count_.fetch_add(1, std::memory_order_relaxed);
+    histogram.totalNs_.fetch_add(nanoseconds, std::memory_order_relaxed);
+    auto max = histogram.maxNs_.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !histogram.maxNs_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+
+    size_t bucket = 0;
+    for (auto us = nanoseconds / 1000; us != 0 && bucket < BUCKETS_COUNT - 1; us >>= 1) {
+        bucket++;
+    }
+    histogram.buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    if (sink_) {
+        sink_(op, nanoseconds);
+    }
+}
+
+KSecretsMetrics::Stats KSecretsMetrics::stats() const noexcept
+{
+    Stats stats;
+    for (size_t i = 0; i < OPERATIONS_COUNT; i++) {
+        const auto& from = operations_[i];
+        auto& to = stats.operations_[i];
+        to.count_ = from.count_.load(std::memory_order_relaxed);
+        to.totalNs_ = from.totalNs_.load(std::memory_order_relaxed);
+        to.maxNs_ = from.maxNs_.load(std::memory_order_relaxed);
+        for (size_t b = 0; b < BUCKETS_COUNT; b++) {
+            to.buckets_[b] = from.buckets_[b].load(std::memory_order_relaxed);
+        }
+    }
+    stats.bytesRead_ = bytesRead_.load(std::memory_order_relaxed);
+    stats.bytesWritten_ = bytesWritten_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void KSecretsMetrics::reset() noexcept
+{
+    for (auto& histogram : operations_) {
+        histogram.count_ = 0;
+        histogram.totalNs_ = 0;
+        histogram.maxNs_ = 0;
+        for (auto& bucket : histogram.buckets_) {
+            bucket = 0;
+        }
+    }
+    bytesRead_ = 0;
+    bytesWritten_ = 0;
+}
+
+const char* KSecretsMetrics::name(Operation op) noexcept
+{
+    switch (op) {
+    case Operation::Open:
+        return "open";
+    case Operation::ReadHeader:
+        return "read_header";
+    case Operation::DecryptEntity:
+        return "decrypt_entity";
+    case Operation::MacUpdate:
+        return "mac_update";
+    case Operation::MacVerify:
+        return "mac_verify";
+    case Operation::Save:
+        return "save";
+    case Operation::Sync:
+        return "sync";
+    case Operation::Rename:
+        return "rename";
+    case Operation::LockWait:
+        return "lock_wait";
+    default:
+        return "unknown";
+    }
+}
+
+// vim: tw=220:ts=4
@@ -0,0 +1,135 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#ifndef KSECRETS_METRICS_H
+#define KSECRETS_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+/**
+ * @brief Performance counters and latency histograms of a secrets file
+ *
+ * Each timed operation gets a count, a total and a maximum duration, and a histogram of power-of-two microsecond buckets.
+ * The counters are relaxed atomics, so recording is cheap enough for the hot paths and stats() could be called from any
+ * thread. The sink, if any, also gets each recorded duration, e.g. to forward it to some monitoring system. It's called
+ * from the thread doing the operation and it should be set before using the store.
+ *
+ * @see KSecretsStore::stats()
+ */
+class KSecretsMetrics {
+public:
+    enum class Operation : unsigned {
+        Open, /// opening, reading and checking the whole file
+        ReadHeader,
+        DecryptEntity, /// reading, decrypting and parsing an entity
+        MacUpdate,
+        MacVerify,
+        Save, /// writing the whole file, including the sync and the rename below
+        Sync,
+        Rename,
+        LockWait,
+        OperationsCount
+    };
+    constexpr static size_t OPERATIONS_COUNT = static_cast<size_t>(Operation::OperationsCount);
+    /**
+     * The bucket i counts the durations in [2^(i-1), 2^i) microseconds, the bucket 0 those below one microsecond and the
+     * last one everything from about 4 seconds on.
+     */
+    constexpr static size_t BUCKETS_COUNT = 24;
+
+    struct Histogram {
+        std::uint64_t count_ = 0;
+        std::uint64_t totalNs_ = 0;
+        std::uint64_t maxNs_ = 0;
+        std::array<std::uint64_t, BUCKETS_COUNT> buckets_{};
+    };
+    struct Stats {
+        std::array<Histogram, OPERATIONS_COUNT> operations_;
+        std::uint64_t bytesRead_ = 0;
+        std::uint64_t bytesWritten_ = 0;
+
+        const Histogram& operator[](Operation op) const noexcept { return operations_[static_cast<size_t>(op)]; }
+    };
+    using Sink = std::function<void(Operation, std::uint64_t nanoseconds)>;
+
+    KSecretsMetrics();
+    KSecretsMetrics(const KSecretsMetrics&) = delete;
+    KSecretsMetrics& operator=(const KSecretsMetrics&) = delete;
+
+    void record(Operation, std::uint64_t nanoseconds) noexcept;
+    void addBytesRead(size_t count) noexcept { bytesRead_.fetch_add(count, std::memory_order_relaxed); }
+    void addBytesWritten(size_t count) noexcept { bytesWritten_.fetch_add(count, std::memory_order_relaxed); }
+
+    Stats stats() const noexcept;
+    void reset() noexcept;
+    void setSink(Sink sink) noexcept { sink_ = std::move(sink); }
+
+    static const char* name(Operation) noexcept;
+
+    /**
+     * @brief Records the duration of its scope, unless it's cancelled, e.g. when the operation failed
+     */
+    class Timer {
+    public:
+        Timer(KSecretsMetrics& metrics, Operation op) noexcept
+            : metrics_(&metrics)
+            , op_(op)
+            , start_(std::chrono::steady_clock::now())
+        {
+        }
+        ~Timer() { stop(); }
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        void stop() noexcept
+        {
+            if (metrics_) {
+                metrics_->record(op_, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+                metrics_ = nullptr;
+            }
+        }
+        void cancel() noexcept { metrics_ = nullptr; }
+
+    private:
+        KSecretsMetrics* metrics_;
+        Operation op_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+private:
+    struct AtomicHistogram {
+        std::atomic<std::uint64_t> count_;
+        std::atomic<std::uint64_t> totalNs_;
+        std::atomic<std::uint64_t> maxNs_;
+        std::array<std::atomic<std::uint64_t>, BUCKETS_COUNT> buckets_;
+    };
+
+    std::array<AtomicHistogram, OPERATIONS_COUNT> operations_;
+    std::atomic<std::uint64_t> bytesRead_;
+    std::atomic<std::uint64_t> bytesWritten_;
+    Sink sink_;
+};
+
+#endif
+// vim: tw=220:ts=4
@@ -0,0 +1,520 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#include "ksecrets_sealed.h"
+#include "ksecrets_file.h"
+#include "crypt_buffer.h"
+#include "crypting_engine.h"
+#include "defines.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char SEALED_MAGIC[8] = { 'K', 'S', 'S', 'E', 'A', 'L', 'E', 'D' };
+const std::uint32_t SEALED_VERSION = 1;
+const unsigned SEED_ATTEMPTS = 16;
+const std::uint32_t MAX_FIRST_DISPLACEMENT = 1024;
+const size_t RECORD_NONCE_SIZE = 16;
+
+/**
+ * The key hashes get prefixed with these, so they never collide with the whole image MAC, which starts with the magic
+ */
+const unsigned char ATTRIBUTE_KEY_TAG = 1;
+const unsigned char COLLECTION_KEY_TAG = 2;
+
+size_t align8(size_t len) noexcept { return (len + 7) & ~size_t(7); }
+
+std::uint64_t mix(std::uint64_t x) noexcept
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+struct KeyHashes {
+    KeyHashes(std::uint64_t key, std::uint32_t seed, std::uint32_t bucketsCount, std::uint32_t slotsCount) noexcept
+    {
+        auto h = mix(key ^ (seed * 0x9e3779b97f4a7c15ULL));
+        bucket_ = h % bucketsCount;
+        f1_ = mix(h + 1) % slotsCount;
+        f2_ = mix(h + 2) % slotsCount;
+    }
+    std::uint32_t slot(std::uint32_t d0, std::uint32_t d1, std::uint32_t slotsCount) const noexcept { return (f1_ + (d0 % slotsCount) * f2_ + d1) % slotsCount; }
+
+    std::uint32_t bucket_;
+    std::uint64_t f1_;
+    std::uint64_t f2_;
+};
+
+/**
+ * @brief CHD perfect hash construction: the buckets get placed by decreasing size, the single key ones simply take the
+ * remaining free slots
+ *
+ * @return false if some bucket could not be placed, another seed should then be tried
+ */
+bool placeKeys(const std::vector<std::uint64_t>& keys, std::uint32_t seed, std::uint32_t bucketsCount, std::vector<std::uint32_t>& displacements,
+    std::vector<std::uint32_t>& slotKeys) noexcept
+{
+    const std::uint32_t slotsCount = keys.size();
+    std::vector<std::vector<std::uint32_t> > buckets(bucketsCount);
+    std::vector<KeyHashes> hashes;
+    hashes.reserve(keys.size());
+    for (std::uint32_t k = 0; k < keys.size(); k++) {
+        hashes.emplace_back(keys[k], seed, bucketsCount, slotsCount);
+        buckets[hashes.back().bucket_].push_back(k);
+    }
+    std::vector<std::uint32_t> order(bucketsCount);
+    for (std::uint32_t b = 0; b < bucketsCount; b++) {
+        order[b] = b;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](std::uint32_t a, std::uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+    displacements.assign(bucketsCount * 2, 0);
+    slotKeys.assign(slotsCount, 0);
+    std::vector<bool> taken(slotsCount, false);
+    std::uint32_t nextFree = 0;
+    std::vector<std::uint32_t> positions;
+    for (auto b : order) {
+        const auto& bucket = buckets[b];
+        if (bucket.empty())
+            break;
+        if (bucket.size() == 1) {
+            while (taken[nextFree]) {
+                nextFree++;
+            }
+            const auto& h = hashes[bucket.front()];
+            displacements[2 * b + 1] = (nextFree + slotsCount - h.f1_) % slotsCount;
+            taken[nextFree] = true;
+            slotKeys[nextFree] = bucket.front();
+            continue;
+        }
+        bool placed = false;
+        for (std::uint32_t d0 = 0; d0 < MAX_FIRST_DISPLACEMENT && !placed; d0++) {
+            for (std::uint32_t d1 = 0; d1 < slotsCount && !placed; d1++) {
+                positions.clear();
+                for (auto k : bucket) {
+                    auto pos = hashes[k].slot(d0, d1, slotsCount);
+                    if (taken[pos] || std::find(positions.begin(), positions.end(), pos) != positions.end())
+                        break;
+                    positions.push_back(pos);
+                }
+                if (positions.size() == bucket.size()) {
+                    for (size_t i = 0; i < positions.size(); i++) {
+                        taken[positions[i]] = true;
+                        slotKeys[positions[i]] = bucket[i];
+                    }
+                    displacements[2 * b] = d0;
+                    displacements[2 * b + 1] = d1;
+                    placed = true;
+                }
+            }
+        }
+        if (!placed)
+            return false;
+    }
+    return true;
+}
+
+bool keyOf(CryptingEngine::MAC& mac, const CryptingContext& keys, unsigned char tag, std::initializer_list<const std::string*> fields, std::uint64_t& key) noexcept
+{
+    if (!mac.reset(&keys) || !mac.update(&tag, sizeof(tag)))
+        return false;
+    for (auto field : fields) {
+        std::uint64_t len = field->size();
+        if (!mac.update(&len, sizeof(len)) || !mac.update(field->data(), field->size()))
+            return false;
+    }
+    auto digest = mac.read();
+    if (!digest || digest->len_ < sizeof(key))
+        return false;
+    memcpy(&key, digest->bytes_, sizeof(key));
+    return true;
+}
+
+/**
+ * @brief Lets the CryptBuffer read and write the records of the image
+ */
+class ImageDevice : public KSecretsDevice {
+public:
+    ImageDevice(KSecretsIO::Image& image, CryptingContext& context)
+        : image_(&image)
+        , data_(nullptr)
+        , size_(0)
+        , pos_(0)
+        , context_(&context)
+    {
+    }
+    ImageDevice(const unsigned char* data, size_t size, CryptingContext& context)
+        : image_(nullptr)
+        , data_(data)
+        , size_(size)
+        , pos_(0)
+        , context_(&context)
+    {
+    }
+    const unsigned char* iv() const noexcept override { return context_->iv(); }
+    CryptingContext* cryptingContext() const noexcept override { return context_; }
+    bool read(void* buf, size_t count) noexcept override
+    {
+        if (data_ == nullptr || count > size_ - pos_)
+            return false;
+        memcpy(buf, data_ + pos_, count);
+        pos_ += count;
+        return true;
+    }
+    bool write(const void* buf, size_t count) noexcept override
+    {
+        if (image_ == nullptr)
+            return false;
+        auto bytes = static_cast<const unsigned char*>(buf);
+        image_->insert(image_->end(), bytes, bytes + count);
+        return true;
+    }
+
+private:
+    KSecretsIO::Image* image_;
+    const unsigned char* data_;
+    size_t size_;
+    size_t pos_;
+    CryptingContext* context_;
+};
+
+template <typename T> void append(KSecretsIO::Image& image, const T* data, size_t count)
+{
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    image.insert(image.end(), bytes, bytes + count * sizeof(T));
+    image.resize(align8(image.size()), 0);
+}
+
+} // namespace
+
+struct KSecretsSealed::Header {
+    char magic_[sizeof(SEALED_MAGIC)];
+    std::uint32_t version_;
+    std::uint32_t seed_;
+    std::uint64_t sourceInode_;
+    std::uint32_t bucketsCount_;
+    std::uint32_t slotsCount_;
+    std::uint32_t postingsCount_;
+    std::uint32_t recordsCount_;
+    std::uint64_t recordsSize_;
+    unsigned char iv_[CryptingEngine::IV_SIZE];
+};
+
+struct KSecretsSealed::Slot {
+    std::uint64_t key_;
+    std::uint32_t first_; /// position in the postings list
+    std::uint32_t count_;
+};
+
+KSecretsSealed::KSecretsSealed()
+    : image_(nullptr)
+    , size_(0)
+    , header_(nullptr)
+{
+}
+
+KSecretsSealed::~KSecretsSealed() { close(); }
+
+bool KSecretsSealed::build(const KSecretsFile& file, ino_t sourceInode, KSecretsIO::Image& image) noexcept
+{
+    auto context = file.cryptingContext();
+    if (context == nullptr || !context->hasMasterKeys())
+        return false;
+    CryptingEngine::MAC keysMac;
+    KSecretsIO::Image records;
+    std::vector<std::uint64_t> recordOffsets;
+    std::map<std::uint64_t, std::vector<std::uint32_t> > postings;
+    auto directory = file.collection_directory();
+    if (directory) {
+        for (const auto& name : directory->entries()) {
+            auto collection = file.find_collection(name);
+            if (!collection)
+                continue;
+            for (const auto& item : collection->items()) {
+                std::uint32_t index = recordOffsets.size();
+                recordOffsets.push_back(records.size());
+
+                std::uint64_t key;
+                if (!keyOf(keysMac, *context, COLLECTION_KEY_TAG, { &name }, key))
+                    return false;
+                postings[key].push_back(index);
+                for (const auto& attr : item->attributes()) {
+                    if (!keyOf(keysMac, *context, ATTRIBUTE_KEY_TAG, { &name, &attr.first, &attr.second }, key))
+                        return false;
+                    postings[key].push_back(index);
+                }
+
+                // the random prefix makes the records differ from their first cipher block on, whatever their contents
+                std::string nonce(RECORD_NONCE_SIZE, '\0');
+                CryptingEngine::create_nonce(reinterpret_cast<unsigned char*>(&nonce[0]), nonce.size());
+                CryptBuffer buffer;
+                std::ostream os(&buffer);
+                os << nonce << name;
+                if (!item->serialize(os))
+                    return false;
+                os << '\n';
+                ImageDevice device(records, *context);
+                if (!os.good() || !buffer.write(device))
+                    return false;
+            }
+        }
+    }
+    recordOffsets.push_back(records.size());
+
+    std::vector<std::uint64_t> keys;
+    keys.reserve(postings.size());
+    for (const auto& posting : postings) {
+        keys.push_back(posting.first);
+    }
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic_, SEALED_MAGIC, sizeof(SEALED_MAGIC));
+    header.version_ = SEALED_VERSION;
+    header.sourceInode_ = sourceInode;
+    header.slotsCount_ = keys.size();
+    header.bucketsCount_ = keys.size() / 4 + 1;
+    header.recordsCount_ = recordOffsets.size() - 1;
+    header.recordsSize_ = records.size();
+    memcpy(header.iv_, context->iv(), CryptingEngine::IV_SIZE);
+
+    std::vector<std::uint32_t> displacements;
+    std::vector<std::uint32_t> slotKeys;
+    while (!placeKeys(keys, header.seed_, header.bucketsCount_, displacements, slotKeys)) {
+        if (++header.seed_ == SEED_ATTEMPTS) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot build the sealed image hash table for %lu keys", (unsigned long)keys.size());
+            return false;
+        }
+    }
+
+    std::vector<Slot> slots(keys.size());
+    std::vector<std::uint32_t> postingsList;
+    for (size_t s = 0; s < slots.size(); s++) {
+        const auto& posting = postings[keys[slotKeys[s]]];
+        slots[s] = Slot{ keys[slotKeys[s]], static_cast<std::uint32_t>(postingsList.size()), static_cast<std::uint32_t>(posting.size()) };
+        postingsList.insert(postingsList.end(), posting.begin(), posting.end());
+    }
+    header.postingsCount_ = postingsList.size();
+
+    image.clear();
+    append(image, &header, 1);
+    append(image, displacements.data(), displacements.size());
+    append(image, slots.data(), slots.size());
+    append(image, postingsList.data(), postingsList.size());
+    append(image, recordOffsets.data(), recordOffsets.size());
+    append(image, records.data(), records.size());
+
+    CryptingEngine::MAC mac;
+    if (!mac.reset(context) || !mac.update(image.data(), image.size()))
+        return false;
+    auto digest = mac.read();
+    if (!digest || digest->len_ == 0)
+        return false;
+    std::uint64_t macLen = digest->len_;
+    append(image, &macLen, 1);
+    append(image, digest->bytes_, digest->len_);
+    return true;
+}
+
+KSecretsSealed::OpenStatus KSecretsSealed::open(const std::string& secretsPath, const CryptingContext& keys) noexcept
+{
+    close();
+    if (!keys.hasMasterKeys())
+        return OpenStatus::CryptEngineError;
+    struct stat source;
+    if (stat(secretsPath.c_str(), &source) == -1)
+        return OpenStatus::CannotOpenFile;
+    int fd = ::open(sealedPath(secretsPath).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return OpenStatus::CannotOpenFile;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        ::close(fd);
+        return OpenStatus::InvalidFile;
+    }
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+        return OpenStatus::CannotOpenFile;
+    image_ = static_cast<const unsigned char*>(addr);
+    size_ = st.st_size;
+    header_ = reinterpret_cast<const Header*>(image_);
+
+    if (memcmp(header_->magic_, SEALED_MAGIC, sizeof(SEALED_MAGIC)) != 0 || header_->version_ != SEALED_VERSION || header_->bucketsCount_ == 0) {
+        close();
+        return OpenStatus::InvalidFile;
+    }
+    if (header_->sourceInode_ != static_cast<std::uint64_t>(source.st_ino)) {
+        close();
+        return OpenStatus::Stale;
+    }
+
+    // the counts are checked against the image size before computing the layout, so the sums below cannot overflow
+    std::uint64_t counts = std::uint64_t(header_->bucketsCount_) + header_->slotsCount_ + header_->postingsCount_ + header_->recordsCount_;
+    if (counts > size_ || header_->recordsSize_ > size_) {
+        close();
+        return OpenStatus::InvalidFile;
+    }
+    size_t pos = align8(sizeof(Header));
+    displacements_ = reinterpret_cast<const std::uint32_t*>(image_ + pos);
+    pos += align8(header_->bucketsCount_ * 2 * sizeof(std::uint32_t));
+    slots_ = reinterpret_cast<const Slot*>(image_ + pos);
+    pos += align8(header_->slotsCount_ * sizeof(Slot));
+    postings_ = reinterpret_cast<const std::uint32_t*>(image_ + pos);
+    pos += align8(header_->postingsCount_ * sizeof(std::uint32_t));
+    recordOffsets_ = reinterpret_cast<const std::uint64_t*>(image_ + pos);
+    pos += align8((header_->recordsCount_ + 1) * sizeof(std::uint64_t));
+    records_ = image_ + pos;
+    pos += align8(header_->recordsSize_);
+    std::uint64_t macLen = 0;
+    if (pos + sizeof(macLen) > size_) {
+        close();
+        return OpenStatus::InvalidFile;
+    }
+    memcpy(&macLen, image_ + pos, sizeof(macLen));
+    if (macLen == 0 || align8(pos + sizeof(macLen) + macLen) != size_) {
+        close();
+        return OpenStatus::InvalidFile;
+    }
+
+    CryptingEngine::MAC mac;
+    if (!mac.reset(&keys) || !mac.update(image_, pos)) {
+        close();
+        return OpenStatus::IntegrityCheckFailed;
+    }
+    auto digest = mac.read();
+    unsigned char diff = digest && digest->len_ == macLen ? 0 : 1;
+    for (size_t i = 0; diff == 0 && i < macLen; i++) {
+        diff |= digest->bytes_[i] ^ image_[pos + sizeof(macLen) + i];
+    }
+    if (diff != 0) {
+        syslog(KSS_LOG_ERR, "ksecrets: the sealed image MAC check failed");
+        close();
+        return OpenStatus::IntegrityCheckFailed;
+    }
+
+    // the postings and the offsets are covered by the MAC, so this was checked at build time, but the image may come from another build
+    for (std::uint32_t s = 0; s < header_->slotsCount_; s++) {
+        if (std::uint64_t(slots_[s].first_) + slots_[s].count_ > header_->postingsCount_) {
+            close();
+            return OpenStatus::InvalidFile;
+        }
+    }
+    context_.reset(new CryptingContext);
+    if (!context_->setMasterKeys(keys.masterKeys()) || !context_->setIV(header_->iv_, CryptingEngine::IV_SIZE)) {
+        close();
+        return OpenStatus::CryptEngineError;
+    }
+    return OpenStatus::Ok;
+}
+
+void KSecretsSealed::close() noexcept
+{
+    if (image_ != nullptr) {
+        munmap(const_cast<unsigned char*>(image_), size_);
+    }
+    image_ = nullptr;
+    size_ = 0;
+    header_ = nullptr;
+    context_.reset();
+}
+
+const KSecretsSealed::Slot* KSecretsSealed::findSlot(std::uint64_t key) const noexcept
+{
+    if (header_->slotsCount_ == 0)
+        return nullptr;
+    KeyHashes hashes(key, header_->seed_, header_->bucketsCount_, header_->slotsCount_);
+    auto slot = &slots_[hashes.slot(displacements_[2 * hashes.bucket_], displacements_[2 * hashes.bucket_ + 1], header_->slotsCount_)];
+    return slot->key_ == key ? slot : nullptr;
+}
+
+SecretsItemPtr KSecretsSealed::readItem(std::uint32_t index, std::string& collection) const noexcept
+{
+    if (index >= header_->recordsCount_)
+        return SecretsItemPtr();
+    auto begin = recordOffsets_[index];
+    auto end = recordOffsets_[index + 1];
+    if (begin > end || end > header_->recordsSize_)
+        return SecretsItemPtr();
+    ImageDevice device(records_ + begin, end - begin, *context_);
+    CryptBuffer buffer;
+    if (!buffer.read(device))
+        return SecretsItemPtr();
+    std::istream is(&buffer);
+    std::string nonce;
+    is >> nonce >> collection;
+    auto item = std::make_shared<SecretsItem>();
+    if (!is.good() || !item->deserialize(is))
+        return SecretsItemPtr();
+    return item;
+}
+
+KSecretsSealed::Items KSecretsSealed::search(const std::string& collection, const SecretsItem::AttributesMap& attrs) const noexcept
+{
+    Items res;
+    if (header_ == nullptr)
+        return res;
+
+    // the key hashes cost one HMAC each, then only the items of the shortest postings list get decrypted
+    CryptingEngine::MAC keysMac;
+    const Slot* best = nullptr;
+    std::uint64_t key;
+    if (attrs.empty()) {
+        if (!keyOf(keysMac, *context_, COLLECTION_KEY_TAG, { &collection }, key) || (best = findSlot(key)) == nullptr)
+            return res;
+    }
+    for (const auto& attr : attrs) {
+        if (!keyOf(keysMac, *context_, ATTRIBUTE_KEY_TAG, { &collection, &attr.first, &attr.second }, key))
+            return res;
+        auto slot = findSlot(key);
+        if (slot == nullptr)
+            return res;
+        if (best == nullptr || slot->count_ < best->count_) {
+            best = slot;
+        }
+    }
+
+    for (std::uint32_t p = best->first_; p < best->first_ + best->count_; p++) {
+        std::string itemCollection;
+        auto item = readItem(postings_[p], itemCollection);
+        if (!item || itemCollection != collection)
+            continue;
+        const auto& itemAttrs = item->attributes();
+        bool matches = std::all_of(attrs.begin(), attrs.end(), [&itemAttrs](const SecretsItem::AttributesMap::value_type& attr) {
+            auto pos = itemAttrs.find(attr.first);
+            return pos != itemAttrs.end() && pos->second == attr.second;
+        });
+        if (matches) {
+            res.push_back(item);
+        }
+    }
+    return res;
+}
+
+// vim: tw=220:ts=4
@@ -0,0 +1,103 @@
+/*
+    This file is part of the KDE Libraries
+
+    Copyright (C) 2015 Valentin Rusu (valir@kde.org)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB. If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+#ifndef KSECRETS_SEALED_H
+#define KSECRETS_SEALED_H
+
+#include "ksecrets_data.h"
+#include "ksecrets_io.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+class CryptingContext;
+class KSecretsFile;
+
+/**
+ * @brief Read-only image of a secrets file, laid out for the lookups of short-lived processes
+ *
+ * Opening a secrets file means reading, decrypting and parsing all of its entities. The sealed image is meant for the
+ * processes doing one lookup then exiting, e.g. credential helpers: it's mapped in memory and a lookup only decrypts the
+ * items it returns.
+ *
+ * The image starts with a header followed by a hash table over the (collection, attribute name, attribute value) keys,
+ * plus one (collection) key per collection. The keys are the truncated HMAC of these strings, so the table does not tell
+ * the attribute values. The table is a perfect hash built with the "hash and displace" method: each key goes to a bucket,
+ * each bucket gets the displacement putting all of its keys to free slots. Each slot holds its key, to reject the keys
+ * which are not in the table, and its range in the postings list, which gives the indexes of the matching items. The
+ * items are then found at fixed offsets and each one is encrypted on its own, with the master keys and the IV of the
+ * secrets file. One MAC, keyed with the MAC key of the file, covers the whole image.
+ *
+ * The header also holds the inode of the secrets file the image was built from. An image not matching the current
+ * secrets file is stale and it's refused, @see KSecretsFile::setSealing()
+ */
+class KSecretsSealed {
+public:
+    KSecretsSealed();
+    ~KSecretsSealed();
+    KSecretsSealed(const KSecretsSealed&) = delete;
+    KSecretsSealed& operator=(const KSecretsSealed&) = delete;
+
+    /**
+     * @brief Builds the image of the current contents of the file, which has the given inode, with the keys of the file
+     */
+    static bool build(const KSecretsFile&, ino_t sourceInode, KSecretsIO::Image&) noexcept;
+
+    enum class OpenStatus { Ok, CannotOpenFile, InvalidFile, Stale, IntegrityCheckFailed, CryptEngineError };
+    /**
+     * @brief Maps the image of the given secrets file then checks its MAC and its source
+     *
+     * The master keys are those of the secrets file. The image gets decrypted by a context of its own, so its IV does not
+     * affect the given context or any other.
+     */
+    OpenStatus open(const std::string& secretsPath, const CryptingContext& keys) noexcept;
+    void close() noexcept;
+
+    using Items = std::vector<SecretsItemPtr>;
+    /**
+     * @return the items of the collection having all the given attributes, or all its items if no attributes are given
+     */
+    Items search(const std::string& collection, const SecretsItem::AttributesMap&) const noexcept;
+
+    static std::string sealedPath(const std::string& secretsPath) { return secretsPath + ".sealed"; }
+
+    struct Header;
+    struct Slot;
+
+private:
+    const Slot* findSlot(std::uint64_t key) const noexcept;
+    SecretsItemPtr readItem(std::uint32_t index, std::string& collection) const noexcept;
+
+    const unsigned char* image_;
+    size_t size_;
+    const Header* header_;
+    const std::uint32_t* displacements_;
+    const Slot* slots_;
+    const std::uint32_t* postings_;
+    const std::uint64_t* recordOffsets_;
+    const unsigned char* records_;
+    std::unique_ptr<CryptingContext> context_;
+};
+
+#endif
+// vim: tw=220:ts=4
@@ -22,6 +22,7 @@
 #include "ksecrets_store.h"
 #include "ksecrets_store_p.h"
 #include "ksecrets_file.h"
+#include "ksecrets_sealed.h"
 #include "ksecrets_data.h"
 #include "crypting_engine.h"
 #include "defines.h"
@@ -31,16 +32,30 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#ifdef KSECRETS_HAVE_LINUX_IOPRIO_H
+#include <linux/ioprio.h>
+#else
+// older kernel headers do not export the I/O priorities
+#define IOPRIO_PRIO_VALUE(ioclass, data) (((ioclass) << 13) | (data))
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#endif
 #include <stdio.h>
 #include <syslog.h>
 #define GCRPYT_NO_DEPRECATED
 #include <gcrypt.h>
 #include <cassert>
+#include <fnmatch.h>
+#include <limits>
 
 #define KSS_LOG_ERR (LOG_AUTH | LOG_ERR)
 
 KSecretsStorePrivate::KSecretsStorePrivate(KSecretsStore* b)
     : b_(b)
+    , ready_(false)
 {
     status_ = KSecretsStore::StoreStatus::JustCreated;
 }
@@ -99,6 +114,124 @@ KSecretsStore::SetupResult KSecretsStorePrivate::setup(const std::string& path,
     return open(!readOnly);
 }
 
+std::future<KSecretsStore::SetupResult> KSecretsStore::warmUp(const char* path)
+{
+    if (d->status_ != StoreStatus::CredentialsSet && d->status_ != StoreStatus::JustCreated) {
+        return std::async(std::launch::deferred, []() { return SetupResult{ StoreStatus::IncorrectState, -1 }; });
+    }
+    if (path == nullptr || strlen(path) == 0) {
+        return std::async(std::launch::deferred, []() { return SetupResult{ StoreStatus::NoPathGiven, 0 }; });
+    }
+    auto localThis = this;
+    std::string filePath = path;
+    return std::async(std::launch::async, [localThis, filePath]() { return localThis->d->warmUp(filePath); });
+}
+
+namespace {
+
+/**
+ * @brief Lowers the CPU and I/O priorities of the calling thread during its lifetime
+ *
+ * The Linux scheduling policy and I/O priority are per thread, so the other threads of the process are not slowed down.
+ * Only the work nobody waits for should run with it, as a caller blocked on an idle thread would be slowed down as well.
+ */
+class IdlePriority {
+public:
+    IdlePriority()
+        : policy_(sched_getscheduler(0))
+        , ioprio_(syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0))
+    {
+        sched_getparam(0, &param_);
+        struct sched_param idleParam;
+        memset(&idleParam, 0, sizeof(idleParam));
+        if (sched_setscheduler(0, SCHED_IDLE, &idleParam) == -1) {
+            syslog(KSS_LOG_DEBUG, "ksecrets: cannot lower the warm-up CPU priority errno=%d", errno);
+        }
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1) {
+            syslog(KSS_LOG_DEBUG, "ksecrets: cannot lower the warm-up I/O priority errno=%d", errno);
+        }
+    }
+    ~IdlePriority()
+    {
+        if (policy_ != -1 && sched_setscheduler(0, policy_, &param_) == -1) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot restore the warm-up CPU priority errno=%d", errno);
+        }
+        if (ioprio_ != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio_) == -1) {
+            syslog(KSS_LOG_ERR, "ksecrets: cannot restore the warm-up I/O priority errno=%d", errno);
+        }
+    }
+    IdlePriority(const IdlePriority&) = delete;
+    IdlePriority& operator=(const IdlePriority&) = delete;
+
+private:
+    int policy_;
+    struct sched_param param_;
+    long ioprio_;
+};
+
+void readAhead(const std::string& path) noexcept
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+}
+
+} // namespace
+
+KSecretsStore::SetupResult KSecretsStorePrivate::warmUp(const std::string& path) noexcept
+{
+    {
+        // only the prefetch runs at idle priorities, the key unwrapping and the setup are waited for by the callers
+        IdlePriority idle;
+        // queue the reads of both files before blocking on the first one, the image being read by other processes
+        readAhead(path);
+        readAhead(KSecretsSealed::sealedPath(path));
+    }
+    return setup(path, false, true);
+}
+
+bool KSecretsStore::isReady() const noexcept { return d->ready_.load(std::memory_order_acquire); }
+
+std::future<KSecretsStore::SetupResult> KSecretsStore::setupInMemory(const char* snapshotPath)
+{
+    if (d->status_ != StoreStatus::CredentialsSet && d->status_ != StoreStatus::JustCreated) {
+        return std::async(std::launch::deferred, []() { return SetupResult{ StoreStatus::IncorrectState, -1 }; });
+    }
+    auto localThis = this;
+    std::string path = snapshotPath ? snapshotPath : "";
+    return std::async(std::launch::async, [localThis, path]() { return localThis->d->setupInMemory(path); });
+}
+
+KSecretsStore::SetupResult KSecretsStorePrivate::setupInMemory(const std::string& snapshotPath) noexcept
+{
+    auto setupres = secretsFile_.setupInMemory(snapshotPath);
+    if (setupres != 0) {
+        return setStoreStatus(KSecretsStore::SetupResult(KSecretsStore::StoreStatus::SystemError, setupres));
+    }
+    return open(true);
+}
+
+KSecretsStore::SnapshotResult KSecretsStore::snapshot(const char* path) noexcept
+{
+    if (path == nullptr || strlen(path) == 0) {
+        return SnapshotResult(StoreStatus::NoPathGiven, 0);
+    }
+    return d->snapshot(path);
+}
+
+KSecretsStore::SnapshotResult KSecretsStorePrivate::snapshot(const std::string& path) noexcept
+{
+    using Result = KSecretsStore::SnapshotResult;
+    if (!isOpen())
+        return Result(status_);
+    if (!secretsFile_.snapshot(path)) {
+        return Result(KSecretsStore::StoreStatus::SystemError, errno);
+    }
+    return Result(KSecretsStore::StoreStatus::Good, 0);
+}
+
 std::future<KSecretsStore::CredentialsResult> KSecretsStore::setCredentials(const char* password, const char* keyNameEncrypting, const char* keyNameMac)
 {
     CryptingEngine::instance().setKeyNameEncrypting(keyNameEncrypting);
@@ -116,19 +249,59 @@ KSecretsStore::CredentialsResult KSecretsStorePrivate::setCredentials(const std:
     if (!cryengine.isValid()) {
         return setStoreStatus(Result(KSecretsStore::StoreStatus::CannotInitGcrypt, -1));
     }
-    auto res = cryengine.setCredentials(password, salt());
-    if (!res) {
-        return setStoreStatus(Result(KSecretsStore::StoreStatus::CannotDeriveKeys, res));
+    // the password only unwraps the master keys from the file's key slots, so the file must be read first
+    secretsFile_.setPassword(password);
+    if (isOpen()) {
+        if (!secretsFile_.unlockKeySlots()) {
+            return Result(KSecretsStore::StoreStatus::CannotDeriveKeys, -1);
+        }
+        return Result(KSecretsStore::StoreStatus::CredentialsSet, 0);
     }
     return setStoreStatus(Result(KSecretsStore::StoreStatus::CredentialsSet, 0));
 }
 
+std::future<KSecretsStore::CredentialsResult> KSecretsStore::changePassword(const char* newPassword)
+{
+    std::string pwd = newPassword ? newPassword : "";
+    auto localThis = this;
+    return std::async(std::launch::async, [localThis, pwd]() { return localThis->d->changePassword(pwd); });
+}
+
+KSecretsStore::CredentialsResult KSecretsStorePrivate::changePassword(const std::string& newPassword) noexcept
+{
+    using Result = KSecretsStore::CredentialsResult;
+    if (!isOpen()) {
+        return Result(KSecretsStore::StoreStatus::IncorrectState, -1);
+    }
+    if (newPassword.empty() || !secretsFile_.changePassword(newPassword)) {
+        return Result(KSecretsStore::StoreStatus::CannotStoreKeys, secretsFile_.errnumber());
+    }
+    return Result(KSecretsStore::StoreStatus::CredentialsSet, 0);
+}
+
+KSecretsStore::CredentialsResult KSecretsStore::changePassword(const char* path, const char* oldPassword, const char* newPassword) noexcept
+{
+    if (path == nullptr || strlen(path) == 0) {
+        return CredentialsResult(StoreStatus::NoPathGiven, 0);
+    }
+    if (!CryptingEngine::instance().isValid()) {
+        return CredentialsResult(StoreStatus::CannotInitGcrypt, -1);
+    }
+    if (oldPassword == nullptr || newPassword == nullptr || strlen(newPassword) == 0) {
+        return CredentialsResult(StoreStatus::CannotStoreKeys, -1);
+    }
+    KSecretsFile secretsFile;
+    secretsFile.setup(path, false);
+    if (!secretsFile.changePassword(oldPassword, newPassword)) {
+        return CredentialsResult(StoreStatus::CannotStoreKeys, secretsFile.errnumber());
+    }
+    return CredentialsResult(StoreStatus::CredentialsSet, 0);
+}
+
 int KSecretsStorePrivate::createFile(const std::string& path) noexcept { return secretsFile_.create(path); }
 
 bool KSecretsStore::isGood() const noexcept { return d->status_ == StoreStatus::Good; }
 
-const unsigned char* KSecretsStorePrivate::salt() const noexcept { return secretsFile_.salt(); }
-
 KSecretsStore::SetupResult KSecretsStorePrivate::open(bool lockFile) noexcept
 {
     // FIXME open sequence should be moved close to KSecretsFile @see KSecretsFile::backupAndReplaceWithWritten
@@ -154,6 +327,12 @@ KSecretsStore::SetupResult KSecretsStorePrivate::open(bool lockFile) noexcept
     case KSecretsFile::OpenStatus::UnknownHeader:
         status = KSecretsStore::StoreStatus::InvalidFile;
         break;
+    case KSecretsFile::OpenStatus::UnsupportedVersion:
+        status = KSecretsStore::StoreStatus::UnsupportedFileVersion;
+        break;
+    case KSecretsFile::OpenStatus::CannotUnlockKeys:
+        status = KSecretsStore::StoreStatus::CannotDeriveKeys;
+        break;
     case KSecretsFile::OpenStatus::CryptEngineError:
         status = KSecretsStore::StoreStatus::InvalidFile;
         break;
@@ -166,7 +345,9 @@ KSecretsStore::SetupResult KSecretsStorePrivate::open(bool lockFile) noexcept
     default:
         assert(0);
     }
-    return setStoreStatus(OpenResult(status, errno));
+    auto res = setStoreStatus(OpenResult(status, errno));
+    ready_.store(res, std::memory_order_release);
+    return res;
 }
 
 KSecretsStore::DirCollectionsResult KSecretsStore::dirCollections() const noexcept { return d->dirCollections(); }
@@ -174,10 +355,9 @@ KSecretsStore::DirCollectionsResult KSecretsStore::dirCollections() const noexce
 KSecretsStore::DirCollectionsResult KSecretsStorePrivate::dirCollections() noexcept
 {
     KSecretsStore::DirCollectionsResult res(KSecretsStore::StoreStatus::InvalidFile);
-    SecretsEntityPtr entity = secretsFile_.find_entity([](SecretsEntityPtr e) { return e->getType() == SecretsEntity::EntityType::CollectionDirectoryType; });
+    CollectionDirectoryPtr dir = secretsFile_.collection_directory();
 
-    if (entity) {
-        CollectionDirectoryPtr dir = std::dynamic_pointer_cast<CollectionDirectory>(entity);
+    if (dir) {
         // note the result_ is now empty so basically would avoid invoking a copy constructor
         res.result_.insert(res.result_.end(), dir->entries().cbegin(), dir->entries().cend());
     }
@@ -207,7 +387,7 @@ template <class R> R mapSecretsFileFailure(KSecretsFile& file, R&& r)
 KSecretsStore::CreateCollectionResult KSecretsStorePrivate::createCollection(const std::string& collName) noexcept
 {
     KSecretsStore::CreateCollectionResult res;
-    auto cptr = std::make_shared<KSecretsCollectionPrivate>();
+    auto cptr = std::make_shared<KSecretsCollectionPrivate>(secretsFile_);
     if (!cptr->createCollection(secretsFile_, collName)) {
         return mapSecretsFileFailure(secretsFile_, res);
     }
@@ -222,10 +402,11 @@ bool KSecretsCollectionPrivate::createCollection(KSecretsFile& file, const std::
     auto dir = collectionsDir(file);
     if (dir) {
         if (!dir->hasEntry(collName)) {
-            collection_data_ = std::make_shared<SecretsCollection>();
-            collection_data_->setName(collName);
+            auto collection = std::make_shared<SecretsCollection>();
+            collection->setName(collName);
+            collection_data_ = KSecretsFile::CollectionHandle(collName);
             dir->addCollection(collName);
-            return file.emplace_entity(collection_data_);
+            return file.emplace_entity(collection);
         }
         else {
             syslog(KSS_LOG_INFO, "ksecrets: a collection named '%s' already exists", collName.c_str());
@@ -239,14 +420,9 @@ bool KSecretsCollectionPrivate::createCollection(KSecretsFile& file, const std::
 
 CollectionDirectoryPtr KSecretsCollectionPrivate::collectionsDir(KSecretsFile& file) noexcept
 {
-    // NOTE collection dir cannot be cached because the file is reloaded upon each operation invalidating the cached pointer
-    // on the other hand, in a typical file, the directory item is the first item so the search is quick
-    CollectionDirectoryPtr collections_dir;
-    SecretsEntityPtr entity = file.find_entity([](SecretsEntityPtr e) { return e->getType() == SecretsEntity::EntityType::CollectionDirectoryType; });
-    if (entity) {
-        collections_dir = std::dynamic_pointer_cast<CollectionDirectory>(entity);
-    }
-    else {
+    // NOTE the file keeps the directory indexed, and reloading it refreshes that index, so there is no need to cache it here
+    CollectionDirectoryPtr collections_dir = file.collection_directory();
+    if (!collections_dir) {
         collections_dir = std::make_shared<CollectionDirectory>();
         if (!file.emplace_entity(collections_dir)) {
             assert(0);
@@ -266,22 +442,162 @@ KSecretsStore::Collection::Collection(KSecretsCollectionPrivatePtr dptr)
 {
 }
 
-KSecretsStore::ReadCollectionResult KSecretsStore::readCollection(const char*) const noexcept
+KSecretsStore::ReadCollectionResult KSecretsStore::readCollection(const char* collName) const noexcept
 {
-    // TODO
-    return ReadCollectionResult();
+    return d->readCollection(collName ? collName : "");
 }
 
-KSecretsStore::DeleteCollectionResult KSecretsStore::deleteCollection(CollectionPtr) noexcept
+KSecretsStore::ReadCollectionResult KSecretsStorePrivate::readCollection(const std::string& collName) noexcept
 {
-    // TODO
-    return DeleteCollectionResult();
+    KSecretsStore::ReadCollectionResult res(status_);
+    if (!isOpen())
+        return res;
+    res.setGood();
+    // not finding the collection leaves the result_ empty, so the operator bool() would report it
+    if (secretsFile_.find_collection(collName)) {
+        res.result_ = std::make_shared<KSecretsStore::Collection>(std::make_shared<KSecretsCollectionPrivate>(secretsFile_, collName));
+    }
+    return res;
 }
 
-KSecretsStore::DeleteCollectionResult KSecretsStore::deleteCollection(const char*) noexcept
+KSecretsStore::DeleteCollectionResult KSecretsStore::deleteCollection(CollectionPtr collection) noexcept
 {
-    // TODO
-    return DeleteCollectionResult();
+    if (!collection) {
+        DeleteCollectionResult res(StoreStatus::Good, 0);
+        res.result_ = false;
+        return res;
+    }
+    return d->deleteCollection(collection->label());
+}
+
+KSecretsStore::DeleteCollectionResult KSecretsStore::deleteCollection(const char* collName) noexcept { return d->deleteCollection(collName ? collName : ""); }
+
+KSecretsStore::DeleteCollectionResult KSecretsStorePrivate::deleteCollection(const std::string& collName) noexcept
+{
+    KSecretsStore::DeleteCollectionResult res(status_);
+    if (!isOpen())
+        return res;
+    res.setGood();
+    // result_ stays false if there is no such collection or the store is read-only
+    res.result_ = false;
+    auto collection = secretsFile_.find_collection(collName);
+    if (collection && !secretsFile_.readOnly()) {
+        if (!secretsFile_.remove_collection(collection)) {
+            return mapSecretsFileFailure(secretsFile_, res);
+        }
+        res.result_ = true;
+    }
+    return res;
+}
+
+KSecretsStore::SealingResult KSecretsStore::setSealing(bool sealing) noexcept
+{
+    if (!d->isOpen())
+        return SealingResult(d->status_);
+    if (d->secretsFile_.readOnly() || d->secretsFile_.inMemory())
+        return SealingResult(StoreStatus::IncorrectState);
+    if (!d->secretsFile_.setSealing(sealing))
+        return SealingResult(StoreStatus::SystemError, errno);
+    return SealingResult(StoreStatus::Good, 0);
+}
+
+KSecretsStore::SealedSearchResult KSecretsStore::searchSealed(const char* path, const char* collName, const AttributesMap& attrs) noexcept
+{
+    if (path == nullptr || strlen(path) == 0)
+        return SealedSearchResult(StoreStatus::NoPathGiven, 0);
+
+    // the image is built with the keys of the secrets file, which are those of the session
+    CryptingContext keys;
+    if (!keys.readSessionKeys())
+        return SealedSearchResult(StoreStatus::CannotDeriveKeys, 0);
+    KSecretsSealed sealed;
+    switch (sealed.open(path, keys)) {
+    case KSecretsSealed::OpenStatus::Ok:
+        break;
+    case KSecretsSealed::OpenStatus::CannotOpenFile:
+        return SealedSearchResult(StoreStatus::CannotOpenFile, errno);
+    case KSecretsSealed::OpenStatus::Stale:
+        return SealedSearchResult(StoreStatus::IncorrectState, 0);
+    case KSecretsSealed::OpenStatus::CryptEngineError:
+        return SealedSearchResult(StoreStatus::CannotDeriveKeys, 0);
+    default:
+        return SealedSearchResult(StoreStatus::InvalidFile, 0);
+    }
+
+    SealedSearchResult res(StoreStatus::Good, 0);
+    for (const auto& item : sealed.search(collName ? collName : "", attrs)) {
+        res.result_.emplace_back(SealedItem{ item->label(), item->attributes(), ItemValue{ item->contentType(), item->contents() } });
+    }
+    return res;
+}
+
+KSecretsStore::Stats KSecretsStore::stats() const noexcept { return d->secretsFile_.metrics().stats(); }
+
+void KSecretsStore::resetStats() noexcept { d->secretsFile_.metrics().reset(); }
+
+void KSecretsStore::setStatsSink(StatsSink sink) noexcept { d->secretsFile_.metrics().setSink(std::move(sink)); }
+
+KSecretsStore::Sequence KSecretsStore::sequence() const noexcept { return d->secretsFile_.sequence(); }
+
+KSecretsStore::ChangesResult KSecretsStore::changesSince(Sequence sequence, size_t maxChanges) const noexcept { return d->changesSince(sequence, maxChanges); }
+
+KSecretsStore::ChangesResult KSecretsStorePrivate::changesSince(KSecretsStore::Sequence sequence, size_t maxChanges) const noexcept
+{
+    KSecretsStore::ChangesResult res(status_);
+    if (!isOpen())
+        return res;
+    for (auto pos = secretsFile_.changes_since(sequence); pos != secretsFile_.changes_end() && res.result_.size() < maxChanges; ++pos) {
+        res.result_.emplace_back(KSecretsStore::Change{ pos->first, pos->second.collection_, pos->second.item_, pos->second.deleted_ });
+    }
+    res.setGood();
+    return res;
+}
+
+KSecretsStore::PurgeTombstonesResult KSecretsStore::purgeTombstones(Sequence upTo) noexcept { return d->purgeTombstones(upTo); }
+
+KSecretsStore::PurgeTombstonesResult KSecretsStorePrivate::purgeTombstones(KSecretsStore::Sequence upTo) noexcept
+{
+    using Result = KSecretsStore::PurgeTombstonesResult;
+    if (!isOpen())
+        return Result(status_);
+    if (secretsFile_.readOnly())
+        return Result(KSecretsStore::StoreStatus::IncorrectState);
+    if (!secretsFile_.purge_tombstones(upTo)) {
+        return mapSecretsFileFailure(secretsFile_, Result());
+    }
+    return Result(KSecretsStore::StoreStatus::Good, 0);
+}
+
+void KSecretsStore::setBackupGenerations(unsigned generations) noexcept { d->secretsFile_.setBackupGenerations(generations); }
+
+KSecretsStore::DirBackupsResult KSecretsStore::dirBackups() const noexcept { return d->dirBackups(); }
+
+KSecretsStore::DirBackupsResult KSecretsStorePrivate::dirBackups() const noexcept
+{
+    KSecretsStore::DirBackupsResult res(status_);
+    if (!isOpen())
+        return res;
+    for (unsigned generation = 1; generation <= secretsFile_.backupGenerations(); generation++) {
+        struct stat buf;
+        if (stat(secretsFile_.backupPath(generation).c_str(), &buf) == 0) {
+            res.result_.emplace_back(KSecretsStore::BackupInfo{ generation, buf.st_mtime, (size_t)buf.st_size });
+        }
+    }
+    res.setGood();
+    return res;
+}
+
+KSecretsStore::RestoreBackupResult KSecretsStore::restoreBackup(unsigned generation) noexcept { return d->restoreBackup(generation); }
+
+KSecretsStore::RestoreBackupResult KSecretsStorePrivate::restoreBackup(unsigned generation) noexcept
+{
+    using Result = KSecretsStore::RestoreBackupResult;
+    if (!isOpen())
+        return Result(status_);
+    if (!secretsFile_.restoreBackup(generation)) {
+        return mapSecretsFileFailure(secretsFile_, Result());
+    }
+    return Result(KSecretsStore::StoreStatus::Good, 0);
 }
 
 std::time_t KSecretsStore::Collection::createdTime() const noexcept
@@ -296,100 +612,216 @@ std::time_t KSecretsStore::Collection::modifiedTime() const noexcept
     return std::time_t();
 }
 
-std::string KSecretsStore::Collection::label() const noexcept
+std::string KSecretsStore::Collection::label() const noexcept { return d->name(); }
+
+bool KSecretsStore::Collection::setCompressed(bool compressed) noexcept { return d->setCompressed(compressed); }
+
+bool KSecretsStore::Collection::compressed() const noexcept { return d->compressed(); }
+
+bool KSecretsCollectionPrivate::setCompressed(bool compressed) noexcept
 {
-    // TODO
-    return "";
+#ifndef KSECRETS_HAVE_ZLIB
+    if (compressed)
+        return false;
+#endif
+    auto collection = collection_data_.get(*file_);
+    if (!collection || file_->readOnly())
+        return false;
+    if (collection->compressed() == compressed)
+        return true;
+    collection->setCompressed(compressed);
+    return file_->save();
 }
 
-KSecretsStore::Collection::ItemList KSecretsStore::Collection::dirItems() const noexcept
+bool KSecretsCollectionPrivate::compressed() const noexcept
 {
-    // TODO
-    return ItemList();
+    auto collection = collection_data_.get(*file_);
+    return collection && collection->compressed();
 }
 
-KSecretsStore::Collection::ItemList KSecretsStore::Collection::searchItems(const AttributesMap&) const noexcept
+KSecretsStore::Collection::ItemList KSecretsStore::Collection::dirItems() const noexcept { return searchItems(nullptr, AttributesMap()); }
+
+KSecretsStore::Collection::ItemList KSecretsStore::Collection::searchItems(const AttributesMap& attrs) const noexcept { return searchItems(nullptr, attrs); }
+
+KSecretsStore::Collection::ItemList KSecretsStore::Collection::searchItems(const char* label, const AttributesMap& attrs) const noexcept
 {
-    // TODO
-    return ItemList();
+    return d->searchItems(label, attrs, Cursor(), std::numeric_limits<size_t>::max(), Projection::Full).items_;
 }
 
-KSecretsStore::Collection::ItemList KSecretsStore::Collection::searchItems(const char*, const AttributesMap&) const noexcept
+KSecretsStore::Collection::ItemList KSecretsStore::Collection::searchItems(const char* label) const noexcept { return searchItems(label, AttributesMap()); }
+
+KSecretsStore::Collection::ItemsPage KSecretsStore::Collection::dirItems(const Cursor& cursor, size_t pageSize, Projection projection) const noexcept
 {
-    // TODO
-    return ItemList();
+    return d->searchItems(nullptr, AttributesMap(), cursor, pageSize, projection);
 }
 
-KSecretsStore::Collection::ItemList KSecretsStore::Collection::searchItems(const char*) const noexcept
+KSecretsStore::Collection::ItemsPage KSecretsStore::Collection::searchItems(
+    const char* label, const AttributesMap& attrs, const Cursor& cursor, size_t pageSize, Projection projection) const noexcept
 {
-    // TODO
-    return ItemList();
+    return d->searchItems(label, attrs, cursor, pageSize, projection);
 }
 
-KSecretsStore::ItemPtr KSecretsStore::Collection::createItem(const char*, AttributesMap, ItemValue) noexcept
+static bool itemMatches(const SecretsItem& item, const char* label, const KSecretsStore::AttributesMap& attrs) noexcept
 {
-    // TODO
-    return ItemPtr();
+    if (label != nullptr && *label != 0 && fnmatch(label, item.label().c_str(), 0) != 0) {
+        return false;
+    }
+    for (const auto& attr : attrs) {
+        auto pos = item.attributes().find(attr.first);
+        if (pos == item.attributes().end() || pos->second.find(attr.second) == std::string::npos) {
+            return false;
+        }
+    }
+    return true;
+}
+
+KSecretsStore::Collection::ItemsPage KSecretsCollectionPrivate::searchItems(const char* label, const KSecretsStore::AttributesMap& attrs,
+    const KSecretsStore::Collection::Cursor& cursor, size_t pageSize, KSecretsStore::Collection::Projection projection) const noexcept
+{
+    KSecretsStore::Collection::ItemsPage page;
+    auto collection = collection_data_.get(*file_);
+    if (!collection || pageSize == 0)
+        return page;
+
+    bool withValue = projection == KSecretsStore::Collection::Projection::Full;
+    const auto& items = collection->items();
+    // the cursor is the id of the last item of the previous page, which may have been deleted since, so the page starts
+    // at the first id following it, found by binary search
+    size_t pos = cursor.empty() ? 0 : items.upper_bound(cursor);
+    size_t last = SecretsCollection::ItemsTable::npos;
+    for (; pos < items.size(); ++pos) {
+        if (!itemMatches(*items.item(pos), label, attrs))
+            continue;
+        if (page.items_.size() == pageSize) {
+            // there is at least one more matching item
+            page.next_ = items.id(last);
+            break;
+        }
+        last = pos;
+        page.items_.emplace_back(std::make_shared<KSecretsStore::Item>(std::make_shared<KSecretsItemPrivate>(*file_, items.id(pos), withValue)));
+    }
+    return page;
 }
 
-bool KSecretsStore::Collection::deleteItem(ItemPtr) noexcept
+KSecretsStore::ItemPtr KSecretsStore::Collection::createItem(const char* label, AttributesMap attrs, ItemValue value) noexcept
 {
-    // TODO
-    return false;
+    return d->createItem(label, std::move(attrs), std::move(value));
 }
 
-KSecretsStore::ItemPtr KSecretsStore::Collection::createItem(const char*, ItemValue) noexcept
+KSecretsStore::ItemPtr KSecretsCollectionPrivate::createItem(const char* label, KSecretsStore::AttributesMap attrs, KSecretsStore::ItemValue value) noexcept
+{
+    auto collection = collection_data_.get(*file_);
+    if (!collection || file_->readOnly())
+        return KSecretsStore::ItemPtr();
+    std::string itemLabel = label ? label : "";
+    for (SecretsItemPtr entry : collection->items()) {
+        if (entry->label() == itemLabel) {
+            syslog(KSS_LOG_INFO, "ksecrets: an item labeled '%s' already exists", itemLabel.c_str());
+            return KSecretsStore::ItemPtr();
+        }
+    }
+
+    // random ids do not disclose the creation order and are unique for all practical purposes
+    unsigned char idBytes[16];
+    CryptingEngine::create_nonce(idBytes, sizeof(idBytes));
+    char id[2 * sizeof(idBytes) + 1];
+    for (size_t i = 0; i < sizeof(idBytes); i++) {
+        snprintf(id + 2 * i, 3, "%02x", idBytes[i]);
+    }
+
+    auto item = std::make_shared<SecretsItem>();
+    item->setId(id);
+    item->setLabel(itemLabel);
+    item->setAttributes(std::move(attrs));
+    item->setValue(value.contentType, std::move(value.contents));
+    if (!file_->emplace_item(collection, item)) {
+        return KSecretsStore::ItemPtr();
+    }
+    return std::make_shared<KSecretsStore::Item>(std::make_shared<KSecretsItemPrivate>(*file_, item->id(), true));
+}
+
+bool KSecretsStore::Collection::deleteItem(ItemPtr item) noexcept { return d->deleteItem(item); }
+
+bool KSecretsCollectionPrivate::deleteItem(KSecretsStore::ItemPtr item) noexcept
+{
+    auto collection = collection_data_.get(*file_);
+    if (!collection || !item || file_->readOnly())
+        return false;
+    auto data = item->d->data();
+    return data && file_->remove_item(collection, data);
+}
+
+KSecretsStore::ItemPtr KSecretsStore::Collection::createItem(const char* label, ItemValue value) noexcept { return createItem(label, AttributesMap(), std::move(value)); }
+
+KSecretsStore::ItemPtr KSecretsStore::Collection::readItem(const char* id) const noexcept { return d->readItem(id ? id : ""); }
+
+KSecretsStore::ItemPtr KSecretsCollectionPrivate::readItem(const std::string& id) const noexcept
+{
+    auto collection = collection_data_.get(*file_);
+    if (!collection || collection->items().find(id) == SecretsCollection::ItemsTable::npos)
+        return KSecretsStore::ItemPtr();
+    return std::make_shared<KSecretsStore::Item>(std::make_shared<KSecretsItemPrivate>(*file_, id, true));
+}
+
+KSecretsStore::Item::Item(KSecretsItemPrivatePtr dptr)
+    : d(dptr)
 {
-    // TODO
-    return ItemPtr();
 }
 
 std::time_t KSecretsStore::Item::createdTime() const noexcept
 {
-    // TODO
-    return std::time_t();
+    auto item = d->data();
+    return item ? item->createdTime() : std::time_t();
 }
 
 std::time_t KSecretsStore::Item::modifiedTime() const noexcept
 {
-    // TODO
-    return std::time_t();
+    auto item = d->data();
+    return item ? item->modifiedTime() : std::time_t();
+}
+
+std::string KSecretsStore::Item::id() const noexcept
+{
+    auto item = d->data();
+    return item ? item->id() : std::string();
 }
 
 std::string KSecretsStore::Item::label() const noexcept
 {
-    // TODO
-    return "";
+    auto item = d->data();
+    return item ? item->label() : std::string();
 }
 
-bool KSecretsStore::Item::setLabel(const char*) noexcept
+bool KSecretsStore::Item::setLabel(const char* label) noexcept
 {
-    // TODO
-    return false;
+    return d->update([label](SecretsItem& item) { item.setLabel(label ? label : ""); });
 }
 
 KSecretsStore::ItemValue KSecretsStore::Item::value() const noexcept
 {
-    // TODO
-    return ItemValue();
+    ItemValue value;
+    auto item = d->data();
+    if (item && d->withValue()) {
+        value.contentType = item->contentType();
+        value.contents = item->contents();
+    }
+    return value;
 }
 
-bool KSecretsStore::Item::setValue(ItemValue) noexcept
+bool KSecretsStore::Item::setValue(ItemValue value) noexcept
 {
-    // TODO
-    return false;
+    return d->update([&value](SecretsItem& item) { item.setValue(value.contentType, std::move(value.contents)); });
 }
 
 KSecretsStore::AttributesMap KSecretsStore::Item::attributes() const
 {
-    // TODO
-    return AttributesMap();
+    auto item = d->data();
+    return item ? item->attributes() : AttributesMap();
 }
 
-bool KSecretsStore::Item::setAttributes(AttributesMap) noexcept
+bool KSecretsStore::Item::setAttributes(AttributesMap attrs) noexcept
 {
-    // TODO
-    return false;
+    return d->update([&attrs](SecretsItem& item) { item.setAttributes(std::move(attrs)); });
 }
 
 // vim: tw=220:ts=4
@@ -22,13 +22,16 @@
 #define KSECRETS_STORE_H
 
 #include <ksecrets_store_export.h>
+#include "ksecrets_metrics.h"
 
 #include <memory>
+#include <cstdint>
 #include <ctime>
 #include <map>
 #include <vector>
 #include <array>
 #include <future>
+#include <limits>
 
 class KSecretsStorePrivate;
 class KSecretsItemPrivate;
@@ -100,6 +103,10 @@ public:
         Item(const Item&) = default;
         Item& operator=(const Item&) = default;
 
+        /**
+         * @brief Internal identifier of the item, unique in the store. This is what the change feed reports, @see changesSince()
+         */
+        std::string id() const noexcept;
         std::string label() const noexcept;
         bool setLabel(const char*) noexcept;
 
@@ -120,9 +127,11 @@ public:
         std::time_t createdTime() const noexcept;
         std::time_t modifiedTime() const noexcept;
 
+        Item(KSecretsItemPrivatePtr dptr);
     protected:
         Item();
         friend class KSecretsStore;
+        friend class KSecretsCollectionPrivate;
 
     private:
         KSecretsItemPrivatePtr d;
@@ -152,12 +161,52 @@ public:
         std::time_t createdTime() const noexcept;
         std::time_t modifiedTime() const noexcept;
 
+        /**
+         * Compressing large collections makes the file smaller and faster to read and save. Only the labels and the
+         * attributes get compressed, not the secret values. The setting is kept in the file and it takes effect on the
+         * next save, which this call triggers.
+         *
+         * @return false if the store is read-only or if the library was built without compression support
+         */
+        bool setCompressed(bool) noexcept;
+        bool compressed() const noexcept;
+
         using ItemList = std::vector<ItemPtr>;
         ItemList dirItems() const noexcept;
         ItemList searchItems(const AttributesMap&) const noexcept;
         ItemList searchItems(const char*) const noexcept;
         ItemList searchItems(const char*, const AttributesMap&) const noexcept;
 
+        /**
+         * Opaque position in an items listing, to be given back to get the next page. The empty cursor starts
+         * the listing from the beginning.
+         *
+         * The items are listed in the order of their internal identifiers and the cursor designates the last listed
+         * item, so it stays valid when items get created or deleted between the pages.
+         */
+        using Cursor = std::string;
+        /**
+         * MetadataOnly items only give the label, the attributes and the timestamps, their value() being empty. Use that
+         * for listings that should not hand out the secret values. This only trims what the returned items expose: the
+         * values are decrypted and kept along with their collection anyway, so it does not save memory.
+         */
+        enum class Projection { Full, MetadataOnly };
+        struct ItemsPage {
+            ItemList items_;
+            Cursor next_; /// empty when the listing reached its end
+        };
+        /**
+         * Paged variants of dirItems() and searchItems(). Each call returns at most pageSize items, so huge collections
+         * could be walked in constant memory. The cursor gets binary-searched among the item identifiers, so a page of
+         * dirItems() costs O(log n + pageSize), whatever its position. A page of searchItems() also goes through the
+         * items which do not match.
+         *
+         * The label may contain shell-style wildcards and the attribute values are matched partially, as for searchItems().
+         * A nullptr or an empty label matches any item.
+         */
+        ItemsPage dirItems(const Cursor&, size_t pageSize, Projection = Projection::Full) const noexcept;
+        ItemsPage searchItems(const char*, const AttributesMap&, const Cursor&, size_t pageSize, Projection = Projection::Full) const noexcept;
+
         /**
          * Creates an item in the collection in one go. This is more efficient than
          * initializing en empty than setting the label, eventually the parameters and
@@ -183,6 +232,10 @@ public:
         ItemPtr createItem(const char* label, ItemValue) noexcept;
 
         bool deleteItem(ItemPtr) noexcept;
+        /**
+         * @return the item having the given identifier, or an empty ItemPtr if there is none in this collection
+         */
+        ItemPtr readItem(const char* id) const noexcept;
 
         Collection(KSecretsCollectionPrivatePtr dptr);
     protected:
@@ -227,7 +280,8 @@ public:
         CannotReadFile,
         PrematureEndOfFileEncountered,
         UnknownError,
-        SystemError
+        SystemError,
+        UnsupportedFileVersion // the file has an older format, which cannot be read anymore
     };
 
     /**
@@ -288,6 +342,66 @@ public:
      */
     std::future<SetupResult> setup(const char* path, bool readOnly = true);
 
+    /**
+     * Read-only setup meant to be started as soon as the credentials are available, e.g. at session start, so the first
+     * application asking for a secret does not pay for the cold start: page cache misses, keyring lookups, decryption and
+     * MAC verification. It reads ahead the file and its sealed image, if any, at idle CPU and I/O priorities, then checks,
+     * decrypts and indexes the file as setup() does, at the normal priorities.
+     *
+     * isReady() tells when the store is usable without having to wait for the returned future.
+     */
+    std::future<SetupResult> warmUp(const char* path);
+    /**
+     * @return true once a setup, including warmUp(), succeeded. This could be called from any thread.
+     */
+    bool isReady() const noexcept;
+
+    /**
+     * Alternative to setup(), keeping the secrets in memory only. The crypting and the data model are the same as for
+     * a store file, so this is handy for session-scoped secrets that should not outlive the session.
+     *
+     * If snapshotPath is given, the secrets are loaded from that file if it exists, and each update atomically writes them
+     * back there, e.g. to a tmpfs. The snapshot is a regular secrets file which could also be given to setup().
+     * Backups are not available in this mode.
+     *
+     * The keys of the session are never replaced by this mode, so it may be used along with stores set up on files. With
+     * credentials, new secrets get their own keys, wrapped with the given password.
+     */
+    std::future<SetupResult> setupInMemory(const char* snapshotPath = nullptr);
+
+    using SnapshotResult = CallResult<StoreStatus::Good>;
+    /**
+     * Atomically writes the current secrets to the given path, as a regular secrets file. This works with both the file
+     * and the in-memory stores.
+     */
+    SnapshotResult snapshot(const char* path) noexcept;
+
+    using SealingResult = CallResult<StoreStatus::Good>;
+    /**
+     * Sealing keeps, next to the secrets file, a read-only image meant for searchSealed(). Once enabled, the image is
+     * written again by each update of the store, whatever the process doing it, until sealing gets disabled. The store
+     * must be setup in read-write mode and not in memory.
+     */
+    SealingResult setSealing(bool) noexcept;
+
+    struct SealedItem {
+        std::string label_;
+        AttributesMap attributes_;
+        ItemValue value_;
+    };
+    using SealedItems = std::vector<SealedItem>;
+    using SealedSearchResult = CallResultWithValue<StoreStatus::Good, SealedItems>;
+    /**
+     * Fast lookup for the processes only needing a secret or two, e.g. credential helpers. This maps the sealed image of
+     * the given secrets file and only decrypts the matching items, instead of setting up a store, which reads the whole file.
+     *
+     * The attribute values are matched exactly, and all the collection items are returned if no attributes are given.
+     * The call fails with StoreStatus::IncorrectState if the image does not match the current secrets file, or with
+     * StoreStatus::CannotOpenFile if there is no image, in which case the caller should fall back to setup() then
+     * Collection::searchItems(). The credentials should have been set, as for setup().
+     */
+    static SealedSearchResult searchSealed(const char* path, const char* collection, const AttributesMap&) noexcept;
+
     using CredentialsResult = CallResult<StoreStatus::CredentialsSet>;
 
     /**
@@ -301,6 +415,23 @@ public:
      */
     std::future<CredentialsResult> setCredentials(const char* password = nullptr, const char* keyNameEcrypting = "ksecrets:encrypting", const char* keyNameMac = "ksecrets:mac");
 
+    /**
+     * Changes the password protecting the secrets store
+     *
+     * The secrets are encrypted with random master keys and the password only protects these master keys in the file
+     * header, so this call only rewrites the file header. The store must be setup in read-write mode and the master keys
+     * must already be available, that is, setCredentials was called with the current password, or pam_ksecrets did it.
+     */
+    std::future<CredentialsResult> changePassword(const char* newPassword);
+
+    /**
+     * Changes the password protecting the given secrets file, the master keys being unwrapped with the old password
+     *
+     * This does not need the master keys in the keyring nor a setup store, so it's meant for the password changes
+     * happening outside of the user session, e.g. from passwd through pam_ksecrets.
+     */
+    static CredentialsResult changePassword(const char* path, const char* oldPassword, const char* newPassword) noexcept;
+
     bool isGood() const noexcept;
 
     // TODO dir collections should return more information than simply the collection names
@@ -337,6 +468,79 @@ public:
     DeleteCollectionResult deleteCollection(CollectionPtr) noexcept;
     DeleteCollectionResult deleteCollection(const char*) noexcept;
 
+    /**
+     * Each file update keeps the previous version of the secrets file as a backup. Only the given number of generations
+     * is kept, the oldest being deleted. Setting this to 0 disables the backups.
+     */
+    void setBackupGenerations(unsigned generations) noexcept;
+
+    struct BackupInfo {
+        unsigned generation_; /// 1 is the most recent backup
+        std::time_t modifiedTime_;
+        size_t size_;
+    };
+    using BackupList = std::vector<BackupInfo>;
+    using DirBackupsResult = CallResultWithValue<StoreStatus::Good, BackupList>;
+    DirBackupsResult dirBackups() const noexcept;
+
+    using RestoreBackupResult = CallResult<StoreStatus::Good>;
+    /**
+     * Brings back the backup of the given generation, as returned by dirBackups(). The backup is verified first. The current
+     * file is itself backed-up, so the restore could be undone by restoring the generation 1.
+     *
+     * @note the store must be setup in read-write mode
+     */
+    RestoreBackupResult restoreBackup(unsigned generation) noexcept;
+
+    /**
+     * Each mutation of the store gets the next number of this sequence, so clients caching the secrets, like the
+     * secrets service, could refresh only what changed since the last sequence number they've seen.
+     */
+    using Sequence = std::uint64_t;
+    Sequence sequence() const noexcept;
+
+    struct Change {
+        Sequence sequence_;
+        std::string collection_;
+        std::string itemId_; /// empty when the change concerns the collection itself
+        bool deleted_;
+    };
+    using ChangeList = std::vector<Change>;
+    using ChangesResult = CallResultWithValue<StoreStatus::Good, ChangeList>;
+    /**
+     * @return at most maxChanges changes that occurred after the given sequence number, in their order. Only the last
+     * change of a given item or collection is reported. Deleting a collection is reported once, for the collection, and
+     * never for its items: a collection deletion means all of its items are gone, whether it had any or not, and the
+     * feed is not partial. Give the sequence number of the last returned change to get the next changes.
+     *
+     * The deletions are reported until their tombstones get purged, @see purgeTombstones()
+     */
+    ChangesResult changesSince(Sequence sequence, size_t maxChanges = std::numeric_limits<size_t>::max()) const noexcept;
+
+    using PurgeTombstonesResult = CallResult<StoreStatus::Good>;
+    /**
+     * Forgets the deletions up to the given sequence number, once all the clients have seen them.
+     */
+    PurgeTombstonesResult purgeTombstones(Sequence upTo) noexcept;
+
+    /**
+     * Counters and latency histograms of the secrets file operations, such as open, entity decryption, MAC checks, save,
+     * data sync, rename and lock wait, along with the count of bytes read and written. They are cumulated since the
+     * store creation, or since the last resetStats() call. This is cheap and could be called from any thread.
+     *
+     * @see KSecretsMetrics
+     */
+    using Operation = KSecretsMetrics::Operation;
+    using Stats = KSecretsMetrics::Stats;
+    Stats stats() const noexcept;
+    void resetStats() noexcept;
+    /**
+     * The sink gets each recorded operation duration, from the thread doing the operation, so it should be quick. Set it
+     * before setup() and give an empty sink to remove it.
+     */
+    using StatsSink = KSecretsMetrics::Sink;
+    void setStatsSink(StatsSink) noexcept;
+
 private:
     std::unique_ptr<KSecretsStorePrivate> d;
 };
@@ -24,6 +24,8 @@
 #include "ksecrets_store.h"
 #include "ksecrets_file.h"
 
+#include <atomic>
+
 class TimeStamped {
 
 protected:
@@ -48,15 +50,59 @@ private:
     std::time_t modifiedTime_;
 };
 
+/**
+ * @note The items and the collections refer to the store's file, so they should not outlive the store
+ */
 class KSecretsItemPrivate : public TimeStamped {
+public:
+    KSecretsItemPrivate(KSecretsFile& file, const std::string& id, bool withValue)
+        : file_(&file)
+        , item_data_(id)
+        , withValue_(withValue)
+    {
+    }
+    SecretsItemPtr data() const noexcept { return item_data_.get(*file_); }
+    bool withValue() const noexcept { return withValue_; }
+    template <class FUNC> bool update(FUNC func) noexcept
+    {
+        auto item = data();
+        if (!item || file_->readOnly())
+            return false;
+        func(*item);
+        return file_->update_item(item);
+    }
+
+private:
+    KSecretsFile* file_;
+    KSecretsFile::ItemHandle item_data_;
+    bool withValue_;
 };
 
 class KSecretsCollectionPrivate : public TimeStamped {
 public:
+    explicit KSecretsCollectionPrivate(KSecretsFile& file)
+        : file_(&file)
+    {
+    }
+    KSecretsCollectionPrivate(KSecretsFile& file, const std::string& collName)
+        : file_(&file)
+        , collection_data_(collName)
+    {
+    }
     bool createCollection(KSecretsFile &secretsFile, const std::string &collName);
     CollectionDirectoryPtr collectionsDir(KSecretsFile &secretsFile) noexcept;
+    const std::string& name() const noexcept { return collection_data_.key(); }
+    bool setCompressed(bool) noexcept;
+    bool compressed() const noexcept;
+
+    KSecretsStore::ItemPtr createItem(const char*, KSecretsStore::AttributesMap, KSecretsStore::ItemValue) noexcept;
+    bool deleteItem(KSecretsStore::ItemPtr) noexcept;
+    KSecretsStore::ItemPtr readItem(const std::string&) const noexcept;
+    KSecretsStore::Collection::ItemsPage searchItems(const char*, const KSecretsStore::AttributesMap&, const KSecretsStore::Collection::Cursor&, size_t, KSecretsStore::Collection::Projection) const noexcept;
+
 private:
-    SecretsCollectionPtr collection_data_;
+    KSecretsFile* file_;
+    KSecretsFile::CollectionHandle collection_data_;
 };
 
 class KSecretsStorePrivate {
@@ -65,12 +111,21 @@ public:
     explicit KSecretsStorePrivate(KSecretsStore*);
 
     KSecretsStore::SetupResult setup(const std::string& path, bool, bool) noexcept;
+    KSecretsStore::SetupResult warmUp(const std::string& path) noexcept;
+    KSecretsStore::SetupResult setupInMemory(const std::string& snapshotPath) noexcept;
+    KSecretsStore::SnapshotResult snapshot(const std::string& path) noexcept;
     KSecretsStore::CredentialsResult setCredentials(const std::string&) noexcept;
+    KSecretsStore::CredentialsResult changePassword(const std::string&) noexcept;
     KSecretsStore::SetupResult open(bool) noexcept;
     int createFile(const std::string&) noexcept;
-    const unsigned char* salt() const noexcept;
     KSecretsStore::CreateCollectionResult createCollection(const std::string&) noexcept;
+    KSecretsStore::ReadCollectionResult readCollection(const std::string&) noexcept;
     KSecretsStore::DirCollectionsResult dirCollections() noexcept;
+    KSecretsStore::DirBackupsResult dirBackups() const noexcept;
+    KSecretsStore::RestoreBackupResult restoreBackup(unsigned) noexcept;
+    KSecretsStore::DeleteCollectionResult deleteCollection(const std::string&) noexcept;
+    KSecretsStore::ChangesResult changesSince(KSecretsStore::Sequence, size_t) const noexcept;
+    KSecretsStore::PurgeTombstonesResult purgeTombstones(KSecretsStore::Sequence) noexcept;
 
     template <typename S> S setStoreStatus(S s) noexcept
     {
@@ -82,6 +137,7 @@ public:
     KSecretsStore* b_;
     KSecretsFile secretsFile_;
     KSecretsStore::StoreStatus status_;
+    std::atomic<bool> ready_;
 };
 
 #endif
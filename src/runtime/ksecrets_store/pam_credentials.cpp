@@ -44,14 +44,15 @@ int KSECRETS_STORE_EXPORT kss_set_credentials(const char* user_name, const char*
 {
     UNUSED(user_name);
 
+    // the password unwraps the master keys upon setup, or protects them if the store gets created now
     KSecretsStore secretsStore;
-    auto setupres = secretsStore.setup(path);
-    if (!setupres.get()) {
+    auto credres = secretsStore.setCredentials(password);
+    if (!credres.get()) {
         return FALSE;
     }
 
-    auto credres = secretsStore.setCredentials(password);
-    return credres.get() ? TRUE: FALSE;
+    auto setupres = secretsStore.setup(path, false);
+    return setupres.get() ? TRUE : FALSE;
 }
 
 extern "C"
@@ -84,21 +85,27 @@ int KSECRETS_STORE_EXPORT kss_delete_credentials()
 }
 
 extern "C"
-int KSECRETS_STORE_EXPORT kss_can_change_password()
+int KSECRETS_STORE_EXPORT kss_can_change_password(const char* path)
 {
-    /* nothing to do for the moment */
     syslog(KSS_LOG_INFO, "kss_can_change_password");
-    // TODO
-    return TRUE;
+    // changing the password only rewraps the master keys into the key slots, so the file only has to be writable
+    if (access(path, W_OK) == 0 || errno == ENOENT) {
+        return TRUE;
+    }
+    syslog(KSS_LOG_ERR, "ksecrets: cannot write %s errno=%d", path, errno);
+    return FALSE;
 }
 
 extern "C"
-int KSECRETS_STORE_EXPORT kss_change_password(const char* new_password)
+int KSECRETS_STORE_EXPORT kss_change_password(const char* path, const char* old_password, const char* new_password)
 {
-    UNUSED(new_password);
-    syslog(LOG_INFO, "kss_change_password");
-    // TODO
-    return TRUE;
+    syslog(KSS_LOG_INFO, "kss_change_password");
+    if (access(path, F_OK) == -1 && errno == ENOENT) {
+        return TRUE; // no secrets to protect yet
+    }
+    // passwd usually runs outside of the user session, where the keyring has no master keys, so unwrap them with the old password
+    auto changeres = KSecretsStore::changePassword(path, old_password, new_password);
+    return changeres ? TRUE : FALSE;
 }
 /* vim: tw=220 ts=4
 */
@@ -31,9 +31,9 @@ int kss_set_credentials(const char* user_name, const char* password, const char*
 
 int kss_delete_credentials();
 
-int kss_can_change_password();
+int kss_can_change_password(const char* path);
 
-int kss_change_password(const char* newPassword);
+int kss_change_password(const char* path, const char* oldPassword, const char* newPassword);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,159 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "attributeindex.h"
+
+#include <QtCore/QRegExp>
+
+#include <algorithm>
+
+static bool shorterThan(const AttributeIndex::PostingList &a, const AttributeIndex::PostingList &b)
+{
+    return a.size() < b.size();
+}
+
+void AttributeIndex::insert(const QString &id, const QMap<QString, QString> &attributes)
+{
+    remove(id);
+
+    QMap<QString, QString>::const_iterator it = attributes.constBegin();
+    const QMap<QString, QString>::const_iterator end = attributes.constEnd();
+    for (; it != end; ++it) {
+        PostingList &list = m_postings[it.key()][it.value()];
+        PostingList::iterator pos = std::lower_bound(list.begin(), list.end(), id);
+        if (pos == list.end() || *pos != id) {
+            list.insert(pos, id);
+        }
+    }
+    m_indexed.insert(id, attributes);
+}
+
+void AttributeIndex::remove(const QString &id)
+{
+    QHash<QString, QMap<QString, QString> >::iterator indexed = m_indexed.find(id);
+    if (indexed == m_indexed.end()) {
+        return;
+    }
+
+    QMap<QString, QString>::const_iterator it = indexed->constBegin();
+    const QMap<QString, QString>::const_iterator end = indexed->constEnd();
+    for (; it != end; ++it) {
+        QHash<QString, QHash<QString, PostingList> >::iterator values = m_postings.find(it.key());
+        if (values == m_postings.end()) {
+            continue;
+        }
+        QHash<QString, PostingList>::iterator list = values->find(it.value());
+        if (list != values->end()) {
+            PostingList::iterator pos = std::lower_bound(list->begin(), list->end(), id);
+            if (pos != list->end() && *pos == id) {
+                list->erase(pos);
+            }
+            if (list->isEmpty()) {
+                values->erase(list);
+            }
+        }
+        if (values->isEmpty()) {
+            m_postings.erase(values);
+        }
+    }
+    m_indexed.erase(indexed);
+}
+
+void AttributeIndex::clear()
+{
+    m_postings.clear();
+    m_indexed.clear();
+}
+
+bool AttributeIndex::contains(const QString &id) const
+{
+    return m_indexed.contains(id);
+}
+
+AttributeIndex::PostingList AttributeIndex::postings(const QString &key, const QString &value) const
+{
+    QHash<QString, QHash<QString, PostingList> >::const_iterator values = m_postings.constFind(key);
+    if (values == m_postings.constEnd()) {
+        return PostingList();
+    }
+
+    if (!value.startsWith(QLatin1String("regexp:"), Qt::CaseInsensitive)) {
+        return values->value(value);
+    }
+
+    // the union of the lists of all the values matching the expression
+    QRegExp rx(value.mid(7));
+    if (rx.isEmpty() || !rx.isValid()) {
+        return PostingList();
+    }
+    PostingList result;
+    QHash<QString, PostingList>::const_iterator it = values->constBegin();
+    const QHash<QString, PostingList>::const_iterator end = values->constEnd();
+    for (; it != end; ++it) {
+        if (rx.exactMatch(it.key())) {
+            result += it.value();
+        }
+    }
+    // an item has only one value per attribute, so there are no duplicates
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+QStringList AttributeIndex::search(const QMap<QString, QString> &attributes) const
+{
+    if (attributes.isEmpty()) {
+        QStringList all = m_indexed.keys();
+        std::sort(all.begin(), all.end());
+        return all;
+    }
+
+    QVector<PostingList> lists;
+    lists.reserve(attributes.size());
+    QMap<QString, QString>::const_iterator it = attributes.constBegin();
+    const QMap<QString, QString>::const_iterator end = attributes.constEnd();
+    for (; it != end; ++it) {
+        PostingList list = postings(it.key(), it.value());
+        if (list.isEmpty()) {
+            return QStringList();
+        }
+        lists.append(list);
+    }
+
+    // start with the shortest list so the intermediate results stay small, then
+    // look each candidate up in the longer lists instead of walking them
+    std::sort(lists.begin(), lists.end(), shorterThan);
+    PostingList result = lists.first();
+    for (int i = 1; i < lists.size() && !result.isEmpty(); ++i) {
+        const PostingList &other = lists.at(i);
+        PostingList::const_iterator from = other.constBegin();
+        PostingList kept;
+        Q_FOREACH(const QString & id, result) {
+            from = std::lower_bound(from, other.constEnd(), id);
+            if (from == other.constEnd()) {
+                break;
+            }
+            if (*from == id) {
+                kept.append(id);
+            }
+        }
+        result = kept;
+    }
+    return result.toList();
+}
@@ -0,0 +1,99 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef ATTRIBUTEINDEX_H
+#define ATTRIBUTEINDEX_H
+
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
+
+/**
+ * Inverted index of the item attributes of a collection.
+ *
+ * Each (attribute name, attribute value) pair maps to the sorted list of the
+ * identifiers of the items having it. A search intersects the lists of the
+ * queried pairs, starting with the shortest one, so it does not depend on
+ * the number of items in the collection but on the number of matches.
+ *
+ * The collections owning an index are responsible for keeping it up to date
+ * by calling \sa insert when an item is created or its attributes change and
+ * \sa remove when an item is deleted.
+ */
+class AttributeIndex
+{
+public:
+    typedef QVector<QString> PostingList;
+
+    /**
+     * Index the item having the given identifier. If the item was already
+     * indexed, its previous attributes are dropped first.
+     *
+     * @param id the identifier of the item
+     * @param attributes the current attributes of the item
+     */
+    void insert(const QString &id, const QMap<QString, QString> &attributes);
+
+    /**
+     * Drop the item having the given identifier from the index.
+     *
+     * @param id the identifier of the item
+     */
+    void remove(const QString &id);
+
+    /**
+     * Drop all items from the index.
+     */
+    void clear();
+
+    /**
+     * Check whether an item is indexed.
+     */
+    bool contains(const QString &id) const;
+
+    /**
+     * Find the items having all of the given attributes.
+     *
+     * The attribute values are matched exactly, as the Secret Service
+     * specification requires. As an extension, a value starting with
+     * "regexp:" matches the attribute values which the rest of the string
+     * matches as a regular expression.
+     *
+     * @param attributes the attributes to look for. If empty, all indexed
+     *                   items are returned
+     * @return the sorted identifiers of the matching items
+     */
+    QStringList search(const QMap<QString, QString> &attributes) const;
+
+private:
+    /**
+     * The posting list of the items matching one search term.
+     */
+    PostingList postings(const QString &key, const QString &value) const;
+
+    // attribute name -> attribute value -> sorted item identifiers
+    QHash<QString, QHash<QString, PostingList> > m_postings;
+    // item identifier -> attributes the item is indexed with
+    QHash<QString, QMap<QString, QString> > m_indexed;
+};
+
+#endif // ATTRIBUTEINDEX_H
@@ -173,6 +173,16 @@ Q_SIGNALS:
      */
     void itemChanged(BackendItem *item);
 
+    /**
+     * This signal must be emitted whenever the attributes of the item change,
+     * in addition to \sa itemChanged.
+     *
+     * @param item the item whose attributes changed
+     * @remarks this is only used internally so the collection can update its
+     *          attribute index.
+     */
+    void attributesChanged(BackendItem *item);
+
 protected:
     BackendCollection *m_collection;
 };
@@ -29,6 +29,7 @@
 
 BackendJob::BackendJob(JobType type)
     : m_type(type), 
+    m_priority(PriorityInteractive),
     m_dismissed(false), 
     m_error(BackendNoError)
 {
@@ -44,6 +45,21 @@ BackendJob::JobType BackendJob::type() const
     return m_type;
 }
 
+BackendJob::Priority BackendJob::priority() const
+{
+    return m_priority;
+}
+
+void BackendJob::setPriority(Priority priority)
+{
+    m_priority = priority;
+}
+
+BackendCollection *BackendJob::queueCollection() const
+{
+    return 0;
+}
+
 bool BackendJob::isDismissed() const
 {
     return m_dismissed;
@@ -199,6 +215,11 @@ BackendCollection *LockCollectionJob::collection()
     return m_collection;
 }
 
+BackendCollection *LockCollectionJob::queueCollection() const
+{
+    return m_collection;
+}
+
 LockItemJob::LockItemJob(BackendItem *item)
     : BooleanResultJob(BackendJob::TypeLockItem), m_item(item)
 {
@@ -209,12 +230,22 @@ BackendItem *LockItemJob::item()
     return m_item;
 }
 
+BackendCollection *LockItemJob::queueCollection() const
+{
+    return m_item ? m_item->collection() : 0;
+}
+
 UnlockCollectionJob::UnlockCollectionJob(const CollectionUnlockInfo &unlockInfo, BackendCollection *collection)
     : BooleanResultJob(BackendJob::TypeUnlockCollection),
       m_collection(collection), m_unlockInfo(unlockInfo)
 {
 }
 
+BackendCollection *UnlockCollectionJob::queueCollection() const
+{
+    return m_collection;
+}
+
 UnlockItemJob::UnlockItemJob(const ItemUnlockInfo& unlockInfo)
     : BooleanResultJob(BackendJob::TypeUnlockItem), m_unlockInfo(unlockInfo)
 {
@@ -225,6 +256,11 @@ BackendItem *UnlockItemJob::item()
     return m_unlockInfo.m_item;
 }
 
+BackendCollection *UnlockItemJob::queueCollection() const
+{
+    return m_unlockInfo.m_item ? m_unlockInfo.m_item->collection() : 0;
+}
+
 DeleteCollectionJob::DeleteCollectionJob(const CollectionDeleteInfo& deleteInfo)
     : BooleanResultJob(BackendJob::TypeDeleteCollection),
       m_deleteInfo(deleteInfo)
@@ -236,6 +272,11 @@ BackendCollection *DeleteCollectionJob::collection()
     return m_deleteInfo.m_collection;
 }
 
+BackendCollection *DeleteCollectionJob::queueCollection() const
+{
+    return m_deleteInfo.m_collection;
+}
+
 DeleteItemJob::DeleteItemJob(const ItemDeleteInfo& deleteInfo)
     : BooleanResultJob(BackendJob::TypeDeleteItem), m_deleteInfo(deleteInfo)
 {
@@ -246,6 +287,11 @@ BackendItem *DeleteItemJob::item()
     return m_deleteInfo.m_item;
 }
 
+BackendCollection *DeleteItemJob::queueCollection() const
+{
+    return m_deleteInfo.m_item ? m_deleteInfo.m_item->collection() : 0;
+}
+
 ChangeAuthenticationCollectionJob::ChangeAuthenticationCollectionJob(BackendCollection* collection, const Peer& peer)
     : BooleanResultJob(BackendJob::TypeChangeAuthenticationCollection),
       m_collection(collection),
@@ -258,6 +304,11 @@ BackendCollection *ChangeAuthenticationCollectionJob::collection()
     return m_collection;
 }
 
+BackendCollection *ChangeAuthenticationCollectionJob::queueCollection() const
+{
+    return m_collection;
+}
+
 const Peer& ChangeAuthenticationCollectionJob::peer() const
 {
     return m_peer;
@@ -273,6 +324,11 @@ BackendItem *ChangeAuthenticationItemJob::item()
     return m_item;
 }
 
+BackendCollection *ChangeAuthenticationItemJob::queueCollection() const
+{
+    return m_item ? m_item->collection() : 0;
+}
+
 CreateItemJob::CreateItemJob(const ItemCreateInfo& createInfo, BackendCollection *collection)
     : BackendJob(BackendJob::TypeCreateItem), m_collection(collection),
       m_createInfo(createInfo), m_item(0)
@@ -314,6 +370,11 @@ BackendCollection *CreateItemJob::collection()
     return m_collection;
 }
 
+BackendCollection *CreateItemJob::queueCollection() const
+{
+    return m_collection;
+}
+
 void CreateItemJob::setItem(BackendItem *item)
 {
     m_item = item;
@@ -31,8 +31,14 @@
 
 #include <QMap>
 
+class BackendCollection;
+
 /**
  * Queued job for implementing various backend actions which need queueing.
+ *
+ * The jobs which aren't immediate are queued by BackendMaster::enqueueJob,
+ * which runs them one at a time per collection, in the order of their
+ * priority, the jobs of different collections running concurrently.
  */
 class BackendJob : public DaemonJob
 {
@@ -57,6 +63,15 @@ public:
         TypeMultiPrompt
     };
 
+    /**
+     * Priorities of the queued jobs. The jobs of a collection waiting for
+     * their turn start with the highest priority ones.
+     */
+    enum Priority {
+        PriorityBackground = 0, /// jobs nobody waits for, as the writes of the changes
+        PriorityInteractive     /// jobs asked for by a client
+    };
+
     /**
      * Constructor.
      *
@@ -83,6 +98,24 @@ public:
      */
     JobType type() const;
 
+    /**
+     * Get the job's priority, which is PriorityInteractive by default.
+     */
+    Priority priority() const;
+
+    /**
+     * Set the job's priority, before it's queued.
+     */
+    void setPriority(Priority priority);
+
+    /**
+     * The collection the job acts on. The jobs of a collection are run one
+     * at a time by BackendMaster::enqueueJob.
+     *
+     * @return the collection, or 0 if the job doesn't need to wait for others
+     */
+    virtual BackendCollection *queueCollection() const;
+
     /**
      * Check if this call has been dismissed.
      *
@@ -128,6 +161,7 @@ protected:
 
 private:
     JobType m_type;
+    Priority m_priority;
     bool m_dismissed;
     ErrorType m_error;
     QString m_errorMessage;
@@ -135,7 +169,6 @@ private:
 
 class BackendMaster;
 class BackendCollectionManager;
-class BackendCollection;
 class BackendItem;
 
 /**
@@ -327,6 +360,8 @@ public:
      */
     BackendCollection *collection();
 
+    virtual BackendCollection *queueCollection() const;
+
 private:
     BackendCollection *m_collection;
 };
@@ -353,6 +388,8 @@ public:
      */
     BackendItem *item();
 
+    virtual BackendCollection *queueCollection() const;
+
 private:
     BackendItem *m_item;
 };
@@ -381,6 +418,8 @@ public:
         return m_collection;
     }
 
+    virtual BackendCollection *queueCollection() const;
+
     /**
      * Get the collection unlock info
      */
@@ -415,6 +454,8 @@ public:
      */
     BackendItem *item();
 
+    virtual BackendCollection *queueCollection() const;
+
 private:
     ItemUnlockInfo m_unlockInfo;
 };
@@ -438,6 +479,8 @@ protected:
      */
     BackendCollection *collection();
 
+    virtual BackendCollection *queueCollection() const;
+
     /**
      * Get the collection delete information
      */
@@ -468,6 +511,8 @@ protected:
      */
     BackendItem *item();
 
+    virtual BackendCollection *queueCollection() const;
+
 private:
     ItemDeleteInfo m_deleteInfo;
 };
@@ -490,6 +535,8 @@ protected:
      * Get the collection to change the authentication for.
      */
     BackendCollection *collection();
+
+    virtual BackendCollection *queueCollection() const;
     const Peer& peer() const;
 
 private:
@@ -516,6 +563,8 @@ protected:
      */
     BackendItem *item();
 
+    virtual BackendCollection *queueCollection() const;
+
 private:
     BackendItem *m_item;
 };
@@ -550,6 +599,8 @@ public:
      */
     BackendCollection *collection();
 
+    virtual BackendCollection *queueCollection() const;
+
 protected:
     /**
      * The label to assign to the new item.
@@ -26,6 +26,7 @@
 
 #include <QtCore/QEventLoop>
 #include <QtCore/QCoreApplication>
+#include <QtCore/QThread>
 
 Q_GLOBAL_STATIC(QCA::Initializer, s_qcaInitializer)
 
@@ -36,6 +37,8 @@ bool BackendMaster::s_initialized = false;
 BackendMaster::BackendMaster()
     : m_uiManager(0)
 {
+    m_interactivePool.setMaxThreadCount(qMax(2, QThread::idealThreadCount()));
+    m_backgroundPool.setMaxThreadCount(1);
 }
 
 BackendMaster::~BackendMaster()
@@ -105,6 +108,144 @@ CreateCollectionMasterJob *BackendMaster::createCreateCollectionMasterJob(
     return new CreateCollectionMasterJob(createCollectionInfo, this);
 }
 
+void BackendMaster::enqueueJob(BackendJob *job)
+{
+    Q_ASSERT(job);
+    if(m_queuedJobs.contains(job)) {
+        // already waiting in the queue or started by runImmediately
+        return;
+    }
+    BackendCollection *collection = job->queueCollection();
+    if(!collection) {
+        job->start();
+        return;
+    }
+
+    JobQueue &queue = m_jobQueues[collection];
+    int pos = 0;
+    while(pos < queue.m_pending.size() && queue.m_pending.at(pos)->priority() >= job->priority()) {
+        ++pos;
+    }
+    queue.m_pending.insert(pos, job);
+    m_queuedJobs.insert(job, collection);
+    connect(job, SIGNAL(finished(KJob*)), SLOT(slotJobFinished(KJob*)));
+    connect(job, SIGNAL(destroyed(QObject*)), SLOT(slotJobDestroyed(QObject*)));
+    slotStartQueuedJobs();
+}
+
+bool BackendMaster::canRunImmediately(BackendJob *job) const
+{
+    Q_ASSERT(job);
+    if(!job->isImmediate()) {
+        return false;
+    }
+    BackendCollection *collection = job->queueCollection();
+    return !collection || !m_jobQueues.contains(collection);
+}
+
+bool BackendMaster::runImmediately(BackendJob *job)
+{
+    Q_ASSERT(job);
+    Q_ASSERT(job->isImmediate());
+    BackendCollection *collection = job->queueCollection();
+    if(collection) {
+        if(m_jobQueues.contains(collection)) {
+            // the caller queues it, usually through a prompt
+            return false;
+        }
+        // the jobs queued while this one runs wait for it
+        m_jobQueues[collection].m_running = job;
+        m_queuedJobs.insert(job, collection);
+    }
+
+    job->start();
+
+    if(!job->isFinished()) {
+        qWarning("Immediate backend job of type %d did not finish when started", job->type());
+        // it keeps holding the queue until it finishes, and a prompt
+        // enqueueing it meanwhile doesn't start it again
+        m_queuedJobs.insert(job, collection);
+        connect(job, SIGNAL(finished(KJob*)), SLOT(slotJobFinished(KJob*)));
+        connect(job, SIGNAL(destroyed(QObject*)), SLOT(slotJobDestroyed(QObject*)));
+        return false;
+    }
+    if(collection && unqueueJob(job)) {
+        QMetaObject::invokeMethod(this, "slotStartQueuedJobs", Qt::QueuedConnection);
+    }
+    return true;
+}
+
+QThreadPool *BackendMaster::threadPool(BackendJob::Priority priority)
+{
+    if(priority == BackendJob::PriorityBackground) {
+        return &m_backgroundPool;
+    }
+    return &m_interactivePool;
+}
+
+bool BackendMaster::unqueueJob(QObject *job)
+{
+    QHash<QObject*, BackendCollection*>::iterator queued = m_queuedJobs.find(job);
+    if(queued == m_queuedJobs.end()) {
+        return false;
+    }
+    QHash<BackendCollection*, JobQueue>::iterator queue = m_jobQueues.find(queued.value());
+    m_queuedJobs.erase(queued);
+    if(queue == m_jobQueues.end()) {
+        return true;
+    }
+
+    if(queue->m_running == job) {
+        queue->m_running = 0;
+    } else {
+        for(int i = 0; i < queue->m_pending.size(); ++i) {
+            if(queue->m_pending.at(i) == job) {
+                queue->m_pending.removeAt(i);
+                break;
+            }
+        }
+    }
+    if(!queue->m_running && queue->m_pending.isEmpty()) {
+        m_jobQueues.erase(queue);
+    }
+    return true;
+}
+
+void BackendMaster::slotJobFinished(KJob *job)
+{
+    disconnect(job, SIGNAL(destroyed(QObject*)), this, SLOT(slotJobDestroyed(QObject*)));
+    if(unqueueJob(job)) {
+        // don't start the next job from inside the finished job's signal
+        QMetaObject::invokeMethod(this, "slotStartQueuedJobs", Qt::QueuedConnection);
+    }
+}
+
+void BackendMaster::slotJobDestroyed(QObject *job)
+{
+    if(unqueueJob(job)) {
+        QMetaObject::invokeMethod(this, "slotStartQueuedJobs", Qt::QueuedConnection);
+    }
+}
+
+void BackendMaster::slotStartQueuedJobs()
+{
+    // collect the jobs first, as starting a job may queue or finish others
+    QList<BackendJob*> startJobs;
+    QHash<BackendCollection*, JobQueue>::iterator it = m_jobQueues.begin();
+    const QHash<BackendCollection*, JobQueue>::iterator end = m_jobQueues.end();
+    for(; it != end; ++it) {
+        if(!it->m_running && !it->m_pending.isEmpty()) {
+            it->m_running = it->m_pending.takeFirst();
+            startJobs.append(it->m_running);
+        }
+    }
+    Q_FOREACH(BackendJob *job, startJobs) {
+        if(m_queuedJobs.contains(job)) {
+            job->start();
+        }
+    }
+}
+
 void BackendMaster::slotCollectionCreated(BackendCollection *collection)
 {
     Q_ASSERT(collection);
@@ -118,6 +259,16 @@ void BackendMaster::slotCollectionDeleted(BackendCollection *collection)
 {
     Q_ASSERT(collection);
     m_collections.removeAll(collection);
+
+    // the jobs still waiting for the collection have nothing left to act on
+    QHash<BackendCollection*, JobQueue>::iterator queue = m_jobQueues.find(collection);
+    if(queue != m_jobQueues.end()) {
+        const QList<BackendJob*> pending = queue->m_pending;
+        Q_FOREACH(BackendJob *job, pending) {
+            job->dismiss();
+        }
+    }
+
     emit collectionDeleted(collection);
 }
 
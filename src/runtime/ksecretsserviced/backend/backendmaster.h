@@ -25,7 +25,9 @@
 #include "backendjob.h"
 
 #include <QtCore/QObject>
+#include <QtCore/QHash>
 #include <QtCore/QList>
+#include <QtCore/QThreadPool>
 
 class BackendCollection;
 class BackendCollectionManager;
@@ -115,6 +117,55 @@ public:
      */
     AbstractUiManager *uiManager();
 
+    /**
+     * Queue a job which isn't immediate and start it when its turn comes.
+     *
+     * The jobs acting on the same collection are run one at a time, the
+     * waiting ones starting in the order of their priority, then in the order
+     * they were queued in. The jobs of different collections, as well as the
+     * jobs not acting on a collection, don't wait for each other.
+     *
+     * A job already queued, or started by runImmediately without finishing,
+     * is left alone.
+     *
+     * @param job the job to run
+     * @see BackendJob::queueCollection
+     */
+    void enqueueJob(BackendJob *job);
+
+    /**
+     * Check whether a job can be run by runImmediately, that is whether it's
+     * immediate and no job of its collection is running or waiting.
+     *
+     * @param job the job to check
+     * @return true if the job can run right away, false if it must be queued
+     */
+    bool canRunImmediately(BackendJob *job) const;
+
+    /**
+     * Run an immediate job right away. The job is started without spinning
+     * an event loop, as immediate jobs finish inside BackendJob::start. It
+     * holds the queue of its collection while it runs.
+     *
+     * @param job the immediate job to run
+     * @return true if the job finished, false if it didn't run because a job
+     *         of its collection is running or waiting, or if it turned out not
+     *         to be immediate and will finish later. Either way the caller
+     *         hands the job to a prompt, which queues it.
+     * @see canRunImmediately
+     */
+    bool runImmediately(BackendJob *job);
+
+    /**
+     * Get the thread pool the backends should run their expensive work on,
+     * such as key derivation or writing collections. The pool of the
+     * interactive work is not shared with the background work, which runs
+     * on a single thread, so the latter never delays the former.
+     *
+     * @param priority the priority of the work to run
+     */
+    QThreadPool *threadPool(BackendJob::Priority priority);
+
 private Q_SLOTS:
     /**
      * Notify the Master about a new collection being available.
@@ -130,6 +181,21 @@ private Q_SLOTS:
      */
     void slotCollectionDeleted(BackendCollection *collection);
 
+    /**
+     * Remove a finished queued job from its queue and start the next one.
+     */
+    void slotJobFinished(KJob *job);
+
+    /**
+     * Remove a queued job deleted before finishing from its queue.
+     */
+    void slotJobDestroyed(QObject *job);
+
+    /**
+     * Start the first waiting job of every collection having none running.
+     */
+    void slotStartQueuedJobs();
+
 Q_SIGNALS:
     /**
      * Notify a listening service about creation of a collection.
@@ -153,9 +219,30 @@ Q_SIGNALS:
     void collectionChanged(BackendCollection *collection);
 
 private:
+    /**
+     * Remove a job from the queue of its collection.
+     *
+     * @return true if the job was queued
+     */
+    bool unqueueJob(QObject *job);
+
+    /**
+     * The jobs of a collection.
+     */
+    struct JobQueue {
+        JobQueue() : m_running(0) {}
+        BackendJob *m_running;
+        QList<BackendJob*> m_pending;
+    };
+
     QList<BackendCollection*> m_collections;
     QList<BackendCollectionManager*> m_collectionManagers;
     AbstractUiManager *m_uiManager;
+    QHash<BackendCollection*, JobQueue> m_jobQueues;
+    // queued or unfinished job -> collection it's queued for, if any
+    QHash<QObject*, BackendCollection*> m_queuedJobs;
+    QThreadPool m_interactivePool;
+    QThreadPool m_backgroundPool;
     static bool s_initialized;
 
     /**
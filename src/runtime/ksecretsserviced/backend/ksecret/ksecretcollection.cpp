@@ -25,20 +25,101 @@
 #include "../securebuffer.h"
 #include "../lib/secrettool.h"
 #include "ksecretencryptionfilter.h"
+#include "ksecretevictionmanager.h"
 #include "ksecretdevice.h"
+#include "ksecretjournal.h"
+#include "ksecretkeycache.h"
 #include "ksecretstream.h"
+#include "ksecretsyncscheduler.h"
+#include <backend/backendmaster.h>
 
 #include <klocalizedstring.h>
 #include <kstandarddirs.h>
 
+#include <QtConcurrent/QtConcurrentRun>
 #include <QtCore/QBuffer>
 #include <QtCore/QFile>
 #include <QtCore/QSet>
-#include <QtCore/QTimer>
 #include <QDebug>
 #include <QFileInfo>
 #include <QSaveFile>
 
+// the journal is not compacted before reaching this size, whatever the size of the file
+static const qint64 JOURNAL_MIN_COMPACT_SIZE = 64 * 1024;
+
+static void writeItemHashes( KSecretStream &stream, const QString &id, const QSet<QByteArray> &hashes )
+{
+    stream << id;
+    (QDataStream&)stream << (quint32)hashes.size();
+    Q_FOREACH( const QByteArray &hash, hashes ) {
+        (QDataStream&)stream << hash;
+    }
+}
+
+static void readItemHashes( KSecretStream &stream, QString &id, QSet<QByteArray> &hashes )
+{
+    stream >> id;
+    quint32 numHashes;
+    (QDataStream&)stream >> numHashes;
+    while ( numHashes-- > 0 && stream.status() == QDataStream::Ok ) {
+        QByteArray hash;
+        (QDataStream&)stream >> hash;
+        hashes.insert( hash );
+    }
+}
+
+// an encrypted part is stored as its own initialization vector followed by the encrypted data
+static QByteArray encryptPart( KSecretEncryptionFilter *filter, const QByteArray &plain, bool &ok )
+{
+    QCA::InitializationVector initVector = filter->createInitVector();
+    QByteArray encrypted = filter->encryptChunk( plain, initVector, ok );
+    QByteArray part;
+    QBuffer buffer( &part );
+    buffer.open( QIODevice::WriteOnly );
+    KSecretStream stream( &buffer );
+    stream << initVector;
+    (QDataStream&)stream << encrypted;
+    ok = ok && stream.isValid();
+    return part;
+}
+
+static QByteArray decryptPart( KSecretEncryptionFilter *filter, const QByteArray &part, bool &ok )
+{
+    QBuffer buffer;
+    buffer.setData( part );
+    buffer.open( QIODevice::ReadOnly );
+    KSecretStream stream( &buffer );
+    QCA::InitializationVector initVector;
+    QByteArray encrypted;
+    stream >> initVector;
+    (QDataStream&)stream >> encrypted;
+    if ( !stream.isValid() ) {
+        ok = false;
+        return QByteArray();
+    }
+    return filter->decryptChunk( encrypted, initVector, ok );
+}
+
+static bool readImagePart( const QByteArray &image, quint32 position, quint32 length, QByteArray &contents )
+{
+    if ( (qint64)position + length > image.size() ) {
+        return false;
+    }
+    contents = image.mid( position, length );
+    return true;
+}
+
+static bool writeFilePart( KSecretDevice< QSaveFile > &device, quint32 type, const QByteArray &contents,
+                           QList<FilePartEntry> &parts )
+{
+    FilePartEntry entry;
+    entry.m_type = type;
+    entry.m_position = device.filePos();
+    entry.m_length = contents.size();
+    parts.append( entry );
+    return device.write( contents ) == contents.size();
+}
+
 static QCA::SecureArray replaceWithDefaultIfEmpty( const QCA::SecureArray &password ) 
 {
     if ( password.isEmpty() ) {
@@ -57,6 +138,7 @@ KSecretCollection *KSecretCollection::create(const QString &id, const QCA::Secur
     coll->m_encryptionFilter = new KSecretEncryptionFilter( replaceWithDefaultIfEmpty( password ) );
     
     coll->m_pub.m_id = id;
+    coll->m_pub.m_hashKey = QCA::Random::randomArray( 32 ).toByteArray();
 
     // write new collection to disk to get a final validation
     coll->m_dirty = true;
@@ -69,14 +151,22 @@ KSecretCollection *KSecretCollection::create(const QString &id, const QCA::Secur
 }
 
 KSecretCollection::KSecretCollection(BackendCollectionManager *parent)
-    : BackendCollection(parent), m_locked(), m_encryptionFilter(0), m_dirty(false)
+    : BackendCollection(parent), m_locked(), m_encryptionFilter(0), m_dirty(false),
+      m_syncScheduler(0), m_evictionManager(0), m_changedAcls(false), m_fullWriteNeeded(false), m_journalSize(0),
+      m_writeInProgress(false)
 {
-    m_syncTimer.setSingleShot(true);
-    connect(&m_syncTimer, SIGNAL(timeout()), SLOT(sync()));
+    KSecretCollectionManager *manager = qobject_cast<KSecretCollectionManager*>(parent);
+    Q_ASSERT(manager);
+    m_syncScheduler = manager->syncScheduler();
+    m_evictionManager = manager->evictionManager();
+    connect(&m_writeWatcher, SIGNAL(finished()), SLOT(slotWriteFinished()));
 }
 
 KSecretCollection::~KSecretCollection()
 {
+    // the write only uses its snapshot, but let it complete
+    m_writeWatcher.waitForFinished();
+    qDeleteAll( m_lockedItems );
     delete m_encryptionFilter;
 }
 
@@ -125,6 +215,7 @@ BackendReturn<QList<BackendItem*> > KSecretCollection::items() const
         result.setError( BackendErrorIsLocked, i18n("The backend is locked!") );
     }
     else {
+        markAsUsed();
         QList<BackendItem*> itemList;
         QHash<QString, KSecretItem*>::const_iterator it = m_secret.m_items.constBegin();
         QHash<QString, KSecretItem*>::const_iterator end = m_secret.m_items.constEnd();
@@ -141,68 +232,34 @@ BackendReturn<QList<BackendItem*> > KSecretCollection::searchItems(
     const QMap<QString, QString> &attributes) const
 {
     BackendReturn<QList<BackendItem*> > result;
+    markAsUsed();
     if ( isLocked() ) {
-        result.setError( BackendErrorIsLocked, i18n("The backend is locked!") );
+        // the stored hashes can only tell exact matches
+        bool hasRegexp = false;
+        Q_FOREACH(const QString & value, attributes) {
+            hasRegexp = hasRegexp || value.startsWith( QLatin1String("regexp:"), Qt::CaseInsensitive );
+        }
+        if ( m_pub.m_hashKey.isEmpty() || hasRegexp ) {
+            result.setError( BackendErrorIsLocked, i18n("The backend is locked!") );
+        }
+        else {
+            QSet<QByteArray> hashes = m_encryptionFilter->createHashes( m_pub.m_hashKey, attributes );
+            // the placeholders are not published, so clients unlock them through their collection's path
+            QList<BackendItem*> itemList;
+            Q_FOREACH(const QString & id, m_pub.m_hashIndex.search( PublicData::hashTerms( hashes ) )) {
+                itemList.append( lockedItem( id ) );
+            }
+            result = itemList;
+        }
     }
     else {
         QList<BackendItem*> itemList;
-        
-        QMap<QString, QString>::const_iterator a = attributes.constBegin();
-        for ( ; a != attributes.constEnd() ; a++ ) {
-            QString attrKey = a.key();
-            QMultiHash< QString, KSecretItem* >::const_iterator it = m_secret.m_lookupHashes.constFind( attrKey );
-            for ( ; it != m_secret.m_lookupHashes.constEnd() ; it++ ) {
-                BackendItem *item = it.value();
-                if ( ! itemList.contains( item ) ) {
-                    bool match = false;
-                    QString searchAttr = a.value();
-                    if ( searchAttr.isEmpty() ) {
-                        match = true;
-                    }
-                    else {
-                        QMap< QString, QString > itemAttrs = item->attributes().value();
-                        
-                        if ( searchAttr.startsWith( QLatin1String("regexp:"), Qt::CaseInsensitive ) ) {
-                            QString expr = searchAttr.mid(7);
-                            if ( !expr.isEmpty() ) {
-                                QRegExp rx( expr );
-                                match = rx.exactMatch( expr );
-                            }
-                        }
-                        else {
-                            // do exact match
-                            if ( itemAttrs.value( attrKey ) == searchAttr ) {
-                                match = true;
-                            }
-                        }
-                    }
-
-                    if ( match ) {
-                        itemList.append( item );
-                    }
-                }
+        Q_FOREACH(const QString & id, m_secret.m_attributeIndex.search(attributes)) {
+            KSecretItem *item = m_secret.m_items.value(id);
+            if (item) {
+                itemList.append(item);
             }
         }
-        
-//         // create hashes for each of the attributes queried
-//         Q_ASSERT( m_encryptionFilter != 0 );
-//         QList<BackendItem*> itemList;
-//         QSet<QByteArray> attributeHashes = m_encryptionFilter->createHashes( attributes);
-//         if(attributeHashes.isEmpty()) {
-//             itemList = items().value();
-//         } else {
-//             // use the first attribute hash to build an initial list of items matching
-//             QHash<QByteArray, KSecretItem*>::const_iterator resit =
-//                 m_secret.m_itemHashes.constFind(*attributeHashes.constBegin());
-//             QHash<QByteArray, KSecretItem*>::const_iterator resend = m_secret.m_itemHashes.constEnd();
-//             // now check which of the items in resit match the remainder of the attributes
-//             // to do this the actual attributes are used instead of the hashes
-//             for(; resit != resend; ++resit) {
-//                 if(resit.value()->matches(attributes)) {
-//                     itemList.append(resit.value());
-//                 }
-//             }
-//         }
         result = itemList;
     }
     return result;
@@ -229,13 +286,18 @@ DeleteCollectionJob *KSecretCollection::createDeleteJob(const CollectionDeleteIn
 BackendReturn<bool> KSecretCollection::deleteCollection()
 {
     BackendReturn< bool > result;
-    // stop any sync timers in progress
-    m_syncTimer.stop();
+    // drop any pending write, once the one in progress is done with the file
+    waitForSync();
+    m_syncScheduler->unschedule(this);
+    m_evictionManager->forgetCollection(this);
+    m_image.clear();
+    m_lockedImage.clear();
     // remove the ksecret file
     if(!QFile::remove(m_path)) {
         result = false;
         // FIXME: should we also call a result.setError here?
     }
+    KSecretJournal::remove(m_path);
 
     // emit signals and actually delete
     emit collectionDeleted(this);
@@ -291,17 +353,22 @@ BackendReturn<BackendItem*> KSecretCollection::createItem(const QString &label,
 
         if(!item) {
             item = new KSecretItem(createId(), this);
-            connect(item, SIGNAL(attributesChanged(KSecretItem*)),
-                    SLOT(changeAttributeHashes(KSecretItem*)));
+            connect(item, SIGNAL(attributesChanged(BackendItem*)),
+                    SLOT(changeAttributeHashes(BackendItem*)));
         }
         item->m_label = label;
         item->m_attributes = attributes;
         item->m_secret = secret;
+        item->m_secretLoaded = true;
+        item->m_secretStored = false;
+        item->m_secretVersion++;
         item->m_contentType = contentType;
+        markAsUsed(item);
 
         // insert new item's hashes
         changeAttributeHashes(item);
 
+        m_changedItems.insert(item->id());
         if(replacing) {
             emit itemChanged(item);
         } else {
@@ -329,6 +396,7 @@ const QString &KSecretCollection::path() const
 
 void KSecretCollection::slotItemChanged(BackendItem* item)
 {
+    m_changedItems.insert( item->id() );
     emit itemChanged( item );
     setDirty();
 }
@@ -338,23 +406,12 @@ void KSecretCollection::slotItemDeleted(BackendItem *item)
     KSecretItem *kitem = qobject_cast<KSecretItem*>(item);
     Q_ASSERT(kitem);
 
-    QMultiHash< QString, KSecretItem* >::iterator it = m_secret.m_lookupHashes.begin();
-    while ( it != m_secret.m_lookupHashes.end() ) {
-        if ( it.value() == item ) {
-            it = m_secret.m_lookupHashes.erase( it );
-        }
-        else {
-            ++it;
-        }
-    }
+    m_secret.m_attributeIndex.remove(kitem->id());
+    m_pub.removeItemHashes(kitem->id());
+    m_evictionManager->forgetItem(kitem);
+    m_changedItems.remove(kitem->id());
+    m_removedItems.insert(kitem->id());
     
-//     // remove the item as well as item hashes
-//     if(m_secret.m_reverseItemHashes.contains(kitem)) {
-//         Q_FOREACH(const QByteArray & hash, m_secret.m_reverseItemHashes.value(kitem)) {
-//             m_secret.m_itemHashes.remove(hash);
-//         }
-//         m_secret.m_reverseItemHashes.remove(kitem);
-//     }
     m_secret.m_items.remove(kitem->id());
     
     // sync
@@ -363,53 +420,32 @@ void KSecretCollection::slotItemDeleted(BackendItem *item)
     emit itemDeleted(item);
 }
 
-void KSecretCollection::changeAttributeHashes(KSecretItem *item)
+void KSecretCollection::changeAttributeHashes(BackendItem *item)
 {
-    Q_ASSERT(item);
+    KSecretItem *kitem = qobject_cast<KSecretItem*>(item);
+    Q_ASSERT(kitem);
 
-    QMap< QString, QString> attrs = item->attributes().value();
-    QMapIterator< QString, QString > it( attrs );
-    while ( it.hasNext() ) {
-        it.next();
-        m_secret.m_lookupHashes.insert( it.key(), item );
-    }
-    
-//     // remove previous item hashes
-//     if(m_secret.m_reverseItemHashes.contains(item)) {
-//         QSet<QByteArray> oldHashes = m_secret.m_reverseItemHashes.value(item);
-//         Q_FOREACH(const QByteArray & hash, oldHashes) {
-//             m_secret.m_itemHashes.remove(hash, item);
-//         }
-//     }
-// 
-//     // insert new hashes
-//     QSet<QByteArray> attributeHashes = m_encryptionFilter->createHashes( item->attributes().value() );
-//     Q_FOREACH(const QByteArray & hash, attributeHashes) {
-//         m_secret.m_itemHashes.insert(hash, item);
-//     }
-//     m_secret.m_reverseItemHashes.insert(item, attributeHashes);
+    m_secret.m_attributeIndex.insert(kitem->id(), kitem->m_attributes);
+    m_pub.setItemHashes(kitem->id(), m_encryptionFilter->createHashes(m_pub.m_hashKey, kitem->m_attributes));
 }
 
-void KSecretCollection::startSyncTimer()
+KSecretItem *KSecretCollection::lockedItem(const QString &id) const
 {
-    // mark collection dirty and start sync in 3 seconds.
-    // make sure it's really synced to constant changes to the collection don't
-    // leave it unsaved for too long.
-    if (!m_syncTimer.isActive()) {
-        m_syncTimer.start(3000);
+    KSecretItem *item = m_lockedItems.value(id);
+    if (!item) {
+        item = new KSecretItem(id, const_cast<KSecretCollection*>(this));
+        m_lockedItems.insert(id, item);
     }
+    return item;
 }
 
-void KSecretCollection::sync()
+void KSecretCollection::markAsUsed(const KSecretItem *item) const
 {
-    if (m_dirty) {
-        QString errorMessage;
-        if (!serialize(errorMessage)) {
-            // try to resync if syncing failed
-            startSyncTimer();
-        } else {
-            m_dirty = false;
-        }
+    m_syncScheduler->noteActivity();
+    KSecretCollection *self = const_cast<KSecretCollection*>(this);
+    m_evictionManager->collectionUsed(self);
+    if (item && item->m_secretLoaded) {
+        m_evictionManager->secretUsed(self, const_cast<KSecretItem*>(item), item->m_secret.size());
     }
 }
 
@@ -418,10 +454,10 @@ KSecretCollection* KSecretCollection::createFromFile(const QString& path, Backen
     KSecretCollection *coll = new KSecretCollection( manager );
     coll->m_path = path;
 
-    // NOTE: when deserializing on startup (for exeample) we don't yet havec the password
-    // so we'll give an empty one. The first unlock attempt would fail so the unlock job
-    // will prompt the user for the password
-    coll->m_encryptionFilter = new KSecretEncryptionFilter( replaceWithDefaultIfEmpty("") );
+    // NOTE: when deserializing on startup (for exeample) we don't yet have the password
+    // and the public data is not encrypted, so no key is derived here. The unlock job
+    // derives it, trying the default password before prompting the user for one
+    coll->m_encryptionFilter = new KSecretEncryptionFilter();
     
     KSecretDevice< QFile > device( path, coll->m_encryptionFilter );
     if ( !device.open( QIODevice::ReadOnly ) ) {
@@ -431,6 +467,7 @@ KSecretCollection* KSecretCollection::createFromFile(const QString& path, Backen
     }
     
     KSecretStream stream( &device );
+    stream.setFormatVersion( device.formatVersion() );
     if ( !stream.isValid() ) {
         errorMessage = i18nc("Error message: secret collection file to be opened is corrupted",
                              "Collection does not exist.");
@@ -438,6 +475,7 @@ KSecretCollection* KSecretCollection::createFromFile(const QString& path, Backen
     }
     
     stream >> coll->m_pub;
+    coll->replayJournal( false );
     
     // the rest of the file will be deserialized upon collection unlock as we need the password for that
     coll->m_locked = true;
@@ -450,57 +488,128 @@ BackendReturn<bool> KSecretCollection::tryUnlock()
         // already unlocked
         return BackendReturn<bool>( true );
     }
-    
-    KSecretDevice< QFile > device( m_path, m_encryptionFilter );
-    if ( !device.open( QIODevice::ReadOnly ) ) {
+    if ( !m_encryptionFilter->hasKey() ) {
         return BackendReturn<bool>( false );
     }
-    KSecretStream stream( &device );
+    
+    if ( !m_lockedImage.isEmpty() ) {
+        // locked since it was read, so its items are in memory, encrypted, and
+        // the public data is up to date
+        if ( !readLockedImage() ) {
+            return BackendReturn<bool>( false );
+        }
+    }
+    else {
+        KSecretDevice< QFile > device( m_path, m_encryptionFilter );
+        if ( !device.open( QIODevice::ReadOnly ) ) {
+            return BackendReturn<bool>( false );
+        }
+        KSecretStream stream( &device );
+        stream.setFormatVersion( device.formatVersion() );
 
-    stream >> m_pub;
-    device.startEncrypting();
-    stream >> m_secret;
+        stream >> m_pub;
+        if ( !stream.isValid() ) {
+            qDebug() << "collection serialization failed";
+            return BackendReturn<bool>( false );
+        }
     
-    if ( !stream.isValid() ) {
-        qDebug() << "collection serialization failed";
-        return BackendReturn<bool>( false );
+        if ( device.formatVersion() >= 4 ) {
+            device.close();
+            if ( !readParts() ) {
+                qDebug() << "collection serialization failed";
+                return BackendReturn<bool>( false );
+            }
+        }
+        else {
+            // older files hold all the secrets in one encrypted stream
+            device.startEncrypting();
+            stream >> m_secret;
+            if ( !stream.isValid() ) {
+                qDebug() << "collection serialization failed";
+                return BackendReturn<bool>( false );
+            }
+        }
+    
+        replayJournal( true );
     }
     
     // collection is now correctly loaded and unlocked
     m_locked = false;
 
+    // files written before the attribute hashes and the journal get them now
+    if ( m_pub.m_generation.isEmpty() ) {
+        m_fullWriteNeeded = true;
+    }
+    bool missingHashes = m_pub.m_hashKey.isEmpty();
+    if ( missingHashes ) {
+        m_pub.m_hashKey = QCA::Random::randomArray( 32 ).toByteArray();
+    }
+
+    // the placeholders handed out while locked take the place of the loaded items
+    QHash<QString, KSecretItem*>::iterator loaded = m_secret.m_items.begin();
+    for ( ; loaded != m_secret.m_items.end(); ++loaded ) {
+        KSecretItem *placeholder = m_lockedItems.take( loaded.key() );
+        if ( placeholder ) {
+            KSecretItem *item = loaded.value();
+            placeholder->m_label = item->m_label;
+            placeholder->m_created = item->m_created;
+            placeholder->m_modified = item->m_modified;
+            placeholder->m_attributes = item->m_attributes;
+            placeholder->m_secret = item->m_secret;
+            placeholder->m_contentType = item->m_contentType;
+            placeholder->m_secretLoaded = item->m_secretLoaded;
+            placeholder->m_secretPosition = item->m_secretPosition;
+            placeholder->m_secretLength = item->m_secretLength;
+            placeholder->m_secretStored = item->m_secretStored;
+            placeholder->m_secretVersion = item->m_secretVersion;
+            delete item;
+            loaded.value() = placeholder;
+        }
+    }
+    // the remaining ones were found by stale hashes
+    qDeleteAll( m_lockedItems );
+    m_lockedItems.clear();
+
     foreach( KSecretItem *item, m_secret.m_items ) {
         item->setCollection( this );
-        connect(item, SIGNAL(attributesChanged(KSecretItem*)),
-                SLOT(changeAttributeHashes(KSecretItem*)));
+        // the items kept while locked are still connected, the ones just read never were
+        connect(item, SIGNAL(attributesChanged(BackendItem*)),
+                SLOT(changeAttributeHashes(BackendItem*)), Qt::UniqueConnection);
+        connect(item, SIGNAL(itemDeleted(BackendItem*)), SLOT(slotItemDeleted(BackendItem*)), Qt::UniqueConnection);
+        connect(item, SIGNAL(itemChanged(BackendItem*)), SLOT(slotItemChanged(BackendItem*)), Qt::UniqueConnection);
         
         emit itemChanged( item ); // that is, item was unlocked
 
-        QMapIterator< QString, QString> it( item->attributes().value() );
-        while ( it.hasNext() ) {
-            it.next();
-            m_secret.m_lookupHashes.insert( it.key(), item );
-        }
-//         QSet<QByteArray> attributeHashes = m_encryptionFilter->createHashes( item->attributes().value() );
-//         Q_FOREACH(const QByteArray & hash, attributeHashes) {
-//             m_secret.m_itemHashes.insert(hash, item);
-//         }
-//         m_secret.m_reverseItemHashes.insert(item, attributeHashes);
+        m_secret.m_attributeIndex.insert( item->id(), item->m_attributes );
+        m_pub.setItemHashes( item->id(), m_encryptionFilter->createHashes( m_pub.m_hashKey, item->m_attributes ) );
+        // the secrets read from a journal or an older file are in memory already
+        markAsUsed( item );
     }
     
+    if ( missingHashes || m_fullWriteNeeded ) {
+        setDirty();
+    }
     
     emit collectionChanged(this);
 
     return BackendReturn<bool>( true );
 }
 
-BackendReturn<bool> KSecretCollection::tryUnlockPassword(const QCA::SecureArray &password)
+QFuture<QCA::SymmetricKey> KSecretCollection::deriveKey(const QCA::SecureArray &password) const
+{
+    return m_encryptionFilter->deriveKey( replaceWithDefaultIfEmpty( password ) );
+}
+
+BackendReturn<bool> KSecretCollection::tryUnlockKey(const QCA::SecureArray &password, const QCA::SymmetricKey &key)
 {
     // TODO: reference/open counting?
 
-    return BackendReturn<bool> (
-        m_encryptionFilter->setPassword( replaceWithDefaultIfEmpty( password ) ) && 
-        tryUnlock().value() );
+    if ( !m_encryptionFilter->setKey( key ) || !tryUnlock().value() ) {
+        return BackendReturn<bool>( false );
+    }
+    // only the keys of the right passwords are kept
+    m_encryptionFilter->keepKey( replaceWithDefaultIfEmpty( password ) );
+    return BackendReturn<bool>( true );
 }
 
 BackendReturn<bool> KSecretCollection::lock()
@@ -514,15 +623,34 @@ BackendReturn<bool> KSecretCollection::lock()
     } else {
         if (m_dirty) {
             QString errorMessage;
-            if(!serialize(errorMessage)) {
+            if(!persist(errorMessage)) {
                 return BackendReturn<bool>(false, BackendErrorOther, errorMessage);
             }
-            m_dirty = false;
+        }
+        m_syncScheduler->unschedule(this);
+        m_evictionManager->forgetCollection(this);
+
+        // keep the items encrypted, so unlocking doesn't read the file again
+        if ( !keepLockedImage() ) {
+            qDebug() << "Cannot keep the items of collection" << id() << "in memory";
         }
 
-        // remove individual item secrets
-        qDeleteAll( m_secret.m_items );
-        m_secret.m_items.empty();
+        // drop the plaintext, the key included. The items stay as the placeholders
+        // of the locked collection, so the references to them remain valid
+        Q_FOREACH( KSecretItem *item, m_secret.m_items ) {
+            item->m_label.clear();
+            item->m_attributes.clear();
+            item->m_secret = QCA::SecureArray();
+            item->m_secretLoaded = false;
+            item->m_contentType.clear();
+            m_lockedItems.insert( item->id(), item );
+        }
+        m_secret.m_items.clear();
+        m_secret.m_attributeIndex.clear();
+        m_secret.m_acls.clear();
+        m_secret.m_creatorApplication.clear();
+        m_encryptionFilter->clearKey();
+        KSecretKeyCache::instance()->clear();
         
         m_locked = true;
         emit collectionChanged(this);
@@ -548,6 +676,7 @@ bool KSecretCollection::setApplicationPermission(const QString& path, Applicatio
     if ( !isLocked() ) {
         if ( !path.isEmpty() && QFile::exists( path ) ) {
             m_secret.m_acls[ path ] = perm;
+            m_changedAcls = true;
             
             // sync
             setDirty();
@@ -582,49 +711,686 @@ void KSecretCollection::setDirty(bool dirty)
             }
         }
     }
-    startSyncTimer();
+    markAsUsed();
+    if ( m_dirty ) {
+        m_syncScheduler->schedule( this );
+    }
 }
 
-bool KSecretCollection::serialize(QString &errorMessage) const
+bool KSecretCollection::serialize(QString &errorMessage)
 {
     if ( !m_dirty )
         return true;
     
     Q_ASSERT( m_encryptionFilter != 0 );
+    return finishWrite( writeSnapshot( takeSnapshot() ), errorMessage );
+}
+
+KSecretCollection::WriteSnapshot KSecretCollection::takeSnapshot()
+{
+    // the journal of the previous generation becomes stale as soon as the file is committed
+    m_pub.m_generation = QCA::Random::randomArray( 16 ).toByteArray();
+    // any failure leaves the file with another generation, so the next write is a full one too
+    m_fullWriteNeeded = true;
+
+    WriteSnapshot snapshot;
+    snapshot.m_path = m_path;
+    bool needsImage = false;
+    snapshot.m_filter = QSharedPointer<KSecretEncryptionFilter>( new KSecretEncryptionFilter( *m_encryptionFilter ) );
+    
+    QBuffer publicBuffer( &snapshot.m_publicData );
+    publicBuffer.open( QIODevice::WriteOnly );
+    KSecretStream publicStream( &publicBuffer );
+    publicStream << m_pub;
+    
+    // the secret parts are written first, in the order of the snapshot, so the
+    // index of an item's secret part is its position in the snapshot
+    QBuffer itemsBuffer( &snapshot.m_items );
+    itemsBuffer.open( QIODevice::WriteOnly );
+    KSecretStream stream( &itemsBuffer );
+    stream << m_secret.m_created;
+    stream << m_secret.m_modified;
+    stream << m_secret.m_cfgCloseScreensaver;
+    stream << m_secret.m_cfgCloseIfUnused;
+    (QDataStream&)stream << m_secret.m_cfgCloseUnusedTimeout;
+    stream << m_secret.m_acls;
+    stream << m_secret.m_creatorApplication;
+    (QDataStream&)stream << (quint32)m_secret.m_items.size();
+    Q_FOREACH( KSecretItem *item, m_secret.m_items ) {
+        stream << item->m_id;
+        stream << item->m_label;
+        stream << item->m_created;
+        stream << item->m_modified;
+        stream << item->m_attributes;
+        stream << item->m_contentType;
+        (QDataStream&)stream << (quint32)snapshot.m_secrets.size();
+        
+        SecretSnapshot secret;
+        secret.m_itemId = item->m_id;
+        secret.m_version = item->m_secretVersion;
+        secret.m_loaded = item->m_secretLoaded;
+        secret.m_secret = item->m_secret;
+        secret.m_position = item->m_secretPosition;
+        secret.m_length = item->m_secretLength;
+        snapshot.m_secrets.append( secret );
+        needsImage = needsImage || !item->m_secretLoaded;
+    }
+    // the write fails if the image can't be read, and it's retried
+    if ( needsImage ) {
+        loadImage();
+    }
+    snapshot.m_image = m_image;
+    snapshot.m_unknownParts = m_secret.m_unknownParts;
+    
+    // the snapshot holds all the changes, the next ones go to the journal of the new generation
+    clearChanges();
+    m_dirty = false;
+    return snapshot;
+}
 
-    qDebug() << "About to create collection file at " << m_path;
-    KSecretDevice< QSaveFile > device( m_path, m_encryptionFilter );
+KSecretCollection::WriteResult KSecretCollection::writeSnapshot(const WriteSnapshot &snapshot)
+{
+    WriteResult result;
+    result.m_ok = false;
+    KSecretEncryptionFilter *filter = snapshot.m_filter.data();
+    
+    qDebug() << "About to create collection file at " << snapshot.m_path;
+    KSecretDevice< QSaveFile > device( snapshot.m_path, filter );
     if ( !device.open( QIODevice::WriteOnly ) ) {
-        errorMessage = i18nc("Error message: secret collection file could not be created",
-                             "The disk may be full");
-        qDebug() << "Cannot create file at " << m_path;
-        return false;
+        result.m_errorMessage = i18nc("Error message: secret collection file could not be created",
+                                      "The disk may be full");
+        qDebug() << "Cannot create file at " << snapshot.m_path;
+        return result;
     }
+    bool ok = device.write( snapshot.m_publicData ) == snapshot.m_publicData.size();
     
+    // each secret gets its own part, so unlocking only needs to decrypt the
+    // items part. The secrets not accessed since unlocking are still
+    // encrypted in the image of the current file, so their parts are copied
+    // as they are
+    QList<FilePartEntry> parts;
+    Q_FOREACH( const SecretSnapshot &secret, snapshot.m_secrets ) {
+        QByteArray part;
+        if ( !ok ) {
+            break;
+        }
+        if ( secret.m_loaded ) {
+            part = encryptPart( filter, secret.m_secret.toByteArray(), ok );
+        }
+        else {
+            ok = readImagePart( snapshot.m_image, secret.m_position, secret.m_length, part );
+        }
+        ok = ok && writeFilePart( device, FilePartItemSecret, part, parts );
+        result.m_itemIds.append( secret.m_itemId );
+        result.m_secretVersions.append( secret.m_version );
+    }
+    
+    if ( ok ) {
+        QByteArray part = encryptPart( filter, snapshot.m_items, ok );
+        ok = ok && writeFilePart( device, FilePartItems, part, parts );
+    }
+    
+    Q_FOREACH( const UnknownFilePart &unknown, snapshot.m_unknownParts ) {
+        ok = ok && writeFilePart( device, unknown.m_type, unknown.m_contents, parts );
+    }
+    
+    // the part table goes last, followed by its position
     KSecretStream ostream( &device );
-    ostream << m_pub;
-    device.startEncrypting();
-    ostream << m_secret;
+    quint32 partTablePos = device.filePos();
+    (QDataStream&)ostream << (quint32)parts.size();
+    Q_FOREACH( const FilePartEntry &entry, parts ) {
+        (QDataStream&)ostream << entry.m_type << entry.m_position << entry.m_length;
+    }
+    (QDataStream&)ostream << partTablePos;
     
-    if ( !ostream.isValid() ) {
-        errorMessage = i18nc("Error message: secret collection contents could not be written to disk",
-                             "The disk may be full");
-        qDebug() << "Cannot write into output stream for file at " << m_path;
-        return false;
+    if ( !ok || !ostream.isValid() ) {
+        result.m_errorMessage = i18nc("Error message: secret collection contents could not be written to disk",
+                                      "The disk may be full");
+        qDebug() << "Cannot write into output stream for file at " << snapshot.m_path;
+        return result;
     }
     
     if ( !device.commit() ) {
+        result.m_errorMessage = i18nc("Error message: secret collection contents could not be written to disk",
+                                      "The disk may be full");
+        qDebug() << "Cannot commit into file at " << snapshot.m_path;
+        return result;
+    }
+    
+    result.m_ok = true;
+    result.m_secretParts = parts.mid( 0, result.m_itemIds.size() );
+    // the image of the new file, otherwise read when first needed
+    QFile written( snapshot.m_path );
+    if ( written.open( QIODevice::ReadOnly ) ) {
+        result.m_image = written.readAll();
+    }
+    return result;
+}
+
+bool KSecretCollection::finishWrite(const WriteResult &result, QString &errorMessage)
+{
+    if ( !result.m_ok ) {
+        errorMessage = result.m_errorMessage;
+        // the collection must be written in full again
+        m_dirty = true;
+        return false;
+    }
+    
+    // ok, the collection was correctly serialized. The secrets changed while
+    // it was written are not stored yet, so they stay in memory
+    for ( int i = 0; i < result.m_itemIds.size(); ++i ) {
+        KSecretItem *item = m_secret.m_items.value( result.m_itemIds.at( i ) );
+        if ( item && item->m_secretVersion == result.m_secretVersions.at( i ) ) {
+            item->m_secretPosition = result.m_secretParts.at( i ).m_position;
+            item->m_secretLength = result.m_secretParts.at( i ).m_length;
+            item->m_secretStored = true;
+        }
+    }
+    // the secrets not loaded yet are now read from the new file
+    m_image = result.m_image;
+    
+    KSecretJournal::remove( m_path );
+    m_journalSize = 0;
+    m_fullWriteNeeded = false;
+    return true;
+}
+
+bool KSecretCollection::needsFullWrite() const
+{
+    // compact the journal once it's as large as the file
+    return m_fullWriteNeeded ||
+           m_journalSize >= qMax<qint64>( JOURNAL_MIN_COMPACT_SIZE, QFileInfo( m_path ).size() );
+}
+
+bool KSecretCollection::persist(QString &errorMessage)
+{
+    // a write in progress lands first, as it replaces the journal
+    waitForSync();
+    
+    if ( !m_dirty ) {
+        return true;
+    }
+    
+    if ( needsFullWrite() ) {
+        return serialize( errorMessage );
+    }
+    return appendJournal( errorMessage );
+}
+
+void KSecretCollection::sync()
+{
+    if ( m_writeInProgress ) {
+        // its completion is reported to the scheduler
+        return;
+    }
+    
+    // the full writes encrypt and write the whole collection, so they're done
+    // in the background from a snapshot, the collection staying usable
+    if ( m_dirty && needsFullWrite() ) {
+        m_writeInProgress = true;
+        QThreadPool *pool = BackendMaster::instance()->threadPool( BackendJob::PriorityBackground );
+        m_writeWatcher.setFuture( QtConcurrent::run( pool, &KSecretCollection::writeSnapshot, takeSnapshot() ) );
+        return;
+    }
+    
+    QString errorMessage;
+    bool ok = persist( errorMessage );
+    m_syncScheduler->syncFinished( this, ok );
+}
+
+void KSecretCollection::waitForSync()
+{
+    if ( m_writeInProgress ) {
+        m_writeWatcher.waitForFinished();
+        slotWriteFinished();
+    }
+}
+
+void KSecretCollection::slotWriteFinished()
+{
+    if ( !m_writeInProgress ) {
+        // already handled by waitForSync
+        return;
+    }
+    m_writeInProgress = false;
+    
+    QString errorMessage;
+    bool ok = finishWrite( m_writeWatcher.result(), errorMessage );
+    if ( !ok ) {
+        qDebug() << "Cannot write collection" << id() << ":" << errorMessage;
+    }
+    m_syncScheduler->syncFinished( this, ok );
+}
+
+bool KSecretCollection::appendJournal(QString &errorMessage)
+{
+    Q_ASSERT( m_encryptionFilter != 0 );
+    
+    QList<KSecretItem*> changedItems;
+    Q_FOREACH( const QString &id, m_changedItems ) {
+        KSecretItem *item = m_secret.m_items.value( id );
+        if ( item ) {
+            // the journal holds the whole item, secret included
+            if ( !loadSecret( item ) ) {
+                errorMessage = i18nc("Error message: secret collection file could not be read",
+                                     "The collection file may be corrupted");
+                return false;
+            }
+            changedItems.append( item );
+        }
+    }
+    
+    QByteArray publicDelta;
+    {
+        QBuffer buffer( &publicDelta );
+        buffer.open( QIODevice::WriteOnly );
+        KSecretStream stream( &buffer );
+        stream << m_pub.m_label;
+        (QDataStream&)stream << (quint32)changedItems.size();
+        Q_FOREACH( KSecretItem *item, changedItems ) {
+            writeItemHashes( stream, item->id(), m_pub.m_itemHashes.value( item->id() ) );
+        }
+        (QDataStream&)stream << (quint32)m_removedItems.size();
+        Q_FOREACH( const QString &id, m_removedItems ) {
+            stream << id;
+        }
+    }
+    
+    QByteArray secretDelta;
+    {
+        QBuffer buffer( &secretDelta );
+        buffer.open( QIODevice::WriteOnly );
+        KSecretStream stream( &buffer );
+        stream << m_secret.m_modified;
+        stream << m_secret.m_cfgCloseScreensaver;
+        stream << m_secret.m_cfgCloseIfUnused;
+        (QDataStream&)stream << m_secret.m_cfgCloseUnusedTimeout;
+        stream << m_secret.m_creatorApplication;
+        stream << m_changedAcls;
+        if ( m_changedAcls ) {
+            stream << m_secret.m_acls;
+        }
+        (QDataStream&)stream << (quint32)changedItems.size();
+        Q_FOREACH( KSecretItem *item, changedItems ) {
+            stream << item;
+        }
+        (QDataStream&)stream << (quint32)m_removedItems.size();
+        Q_FOREACH( const QString &id, m_removedItems ) {
+            stream << id;
+        }
+    }
+    
+    KSecretJournal::Segment segment;
+    segment.m_publicDelta = publicDelta;
+    segment.m_initVector = m_encryptionFilter->createInitVector();
+    bool ok = false;
+    segment.m_secretDelta = m_encryptionFilter->encryptChunk( secretDelta, segment.m_initVector, ok );
+    if ( !ok || !KSecretJournal::append( m_path, m_pub.m_generation, segment, m_journalSize ) ) {
         errorMessage = i18nc("Error message: secret collection contents could not be written to disk",
                              "The disk may be full");
-        qDebug() << "Cannot commit into file at " << m_path;
+        qDebug() << "Cannot append to the journal of " << m_path;
         return false;
     }
     
-    // ok, the collection was correctly serialized
+    clearChanges();
     m_dirty = false;
     return true;
 }
 
+void KSecretCollection::replayJournal(bool withSecrets)
+{
+    QList<KSecretJournal::Segment> segments;
+    m_journalSize = KSecretJournal::read( m_path, m_pub.m_generation, segments );
+    
+    Q_FOREACH( const KSecretJournal::Segment &segment, segments ) {
+        QBuffer publicBuffer;
+        publicBuffer.setData( segment.m_publicDelta );
+        publicBuffer.open( QIODevice::ReadOnly );
+        KSecretStream publicStream( &publicBuffer );
+        publicStream >> m_pub.m_label;
+        quint32 numItems;
+        (QDataStream&)publicStream >> numItems;
+        while ( numItems-- > 0 && publicStream.isValid() ) {
+            QString id;
+            QSet<QByteArray> hashes;
+            readItemHashes( publicStream, id, hashes );
+            m_pub.setItemHashes( id, hashes );
+        }
+        quint32 numRemoved;
+        (QDataStream&)publicStream >> numRemoved;
+        while ( numRemoved-- > 0 && publicStream.isValid() ) {
+            QString id;
+            publicStream >> id;
+            m_pub.removeItemHashes( id );
+        }
+        
+        if ( !withSecrets ) {
+            continue;
+        }
+        
+        bool ok = false;
+        QByteArray secretDelta = m_encryptionFilter->decryptChunk( segment.m_secretDelta, segment.m_initVector, ok );
+        QBuffer secretBuffer( &secretDelta );
+        secretBuffer.open( QIODevice::ReadOnly );
+        KSecretStream secretStream( &secretBuffer );
+        if ( ok ) {
+            secretStream >> m_secret.m_modified;
+            secretStream >> m_secret.m_cfgCloseScreensaver;
+            secretStream >> m_secret.m_cfgCloseIfUnused;
+            (QDataStream&)secretStream >> m_secret.m_cfgCloseUnusedTimeout;
+            secretStream >> m_secret.m_creatorApplication;
+            bool changedAcls;
+            secretStream >> changedAcls;
+            if ( changedAcls ) {
+                m_secret.m_acls.clear();
+                secretStream >> m_secret.m_acls;
+            }
+            (QDataStream&)secretStream >> numItems;
+            while ( numItems-- > 0 && secretStream.isValid() ) {
+                KSecretItem *item = 0;
+                secretStream >> item;
+                delete m_secret.m_items.take( item->id() );
+                m_secret.m_items.insert( item->id(), item );
+            }
+            (QDataStream&)secretStream >> numRemoved;
+            while ( numRemoved-- > 0 && secretStream.isValid() ) {
+                QString id;
+                secretStream >> id;
+                delete m_secret.m_items.take( id );
+            }
+        }
+        if ( !ok || !secretStream.isValid() ) {
+            // keep what could be applied, and replace the journal by a full write
+            qDebug() << "Cannot replay the journal of " << m_path;
+            m_fullWriteNeeded = true;
+            break;
+        }
+    }
+}
+
+void KSecretCollection::clearChanges()
+{
+    m_changedItems.clear();
+    m_removedItems.clear();
+    m_changedAcls = false;
+}
+
+bool KSecretCollection::readParts()
+{
+    // the file is read in full and kept for loadSecret, so a write replacing
+    // it doesn't move the parts of the secrets not loaded yet
+    m_image.clear();
+    if ( !loadImage() || m_image.size() < (int)sizeof( quint32 ) ) {
+        return false;
+    }
+    QBuffer file( &m_image );
+    file.open( QIODevice::ReadOnly );
+    KSecretStream stream( &file );
+    
+    quint32 partTablePos = 0;
+    file.seek( m_image.size() - sizeof( quint32 ) );
+    (QDataStream&)stream >> partTablePos;
+    if ( !stream.isValid() || !file.seek( partTablePos ) ) {
+        return false;
+    }
+    quint32 numParts = 0;
+    (QDataStream&)stream >> numParts;
+    QList<FilePartEntry> parts;
+    while ( numParts-- > 0 && stream.isValid() ) {
+        FilePartEntry entry;
+        (QDataStream&)stream >> entry.m_type >> entry.m_position >> entry.m_length;
+        parts.append( entry );
+    }
+    if ( !stream.isValid() ) {
+        return false;
+    }
+    
+    // the secret parts are left for loadSecret
+    bool ok = false;
+    QByteArray items;
+    QList<UnknownFilePart> unknownParts;
+    Q_FOREACH( const FilePartEntry &entry, parts ) {
+        if ( entry.m_type == FilePartItems ) {
+            ok = readImagePart( m_image, entry.m_position, entry.m_length, items );
+            if ( !ok ) {
+                return false;
+            }
+        }
+        else if ( entry.m_type != FilePartItemSecret ) {
+            UnknownFilePart unknown;
+            unknown.m_type = entry.m_type;
+            if ( !readImagePart( m_image, entry.m_position, entry.m_length, unknown.m_contents ) ) {
+                return false;
+            }
+            unknownParts.append( unknown );
+        }
+    }
+    if ( ok ) {
+        items = decryptPart( m_encryptionFilter, items, ok );
+    }
+    if ( !ok ) {
+        return false;
+    }
+    
+    QBuffer buffer( &items );
+    buffer.open( QIODevice::ReadOnly );
+    KSecretStream in( &buffer );
+    in >> m_secret.m_created;
+    in >> m_secret.m_modified;
+    in >> m_secret.m_cfgCloseScreensaver;
+    in >> m_secret.m_cfgCloseIfUnused;
+    (QDataStream&)in >> m_secret.m_cfgCloseUnusedTimeout;
+    m_secret.m_acls.clear();
+    in >> m_secret.m_acls;
+    in >> m_secret.m_creatorApplication;
+    
+    quint32 numItems = 0;
+    (QDataStream&)in >> numItems;
+    QHash<QString, KSecretItem*> loaded;
+    while ( numItems-- > 0 && in.isValid() ) {
+        KSecretItem *item = new KSecretItem();
+        in >> item->m_id;
+        in >> item->m_label;
+        in >> item->m_created;
+        in >> item->m_modified;
+        in >> item->m_attributes;
+        in >> item->m_contentType;
+        quint32 secretPart = 0;
+        (QDataStream&)in >> secretPart;
+        if ( secretPart < (quint32)parts.size() && parts.at( secretPart ).m_type == FilePartItemSecret ) {
+            item->m_secretLoaded = false;
+            item->m_secretPosition = parts.at( secretPart ).m_position;
+            item->m_secretLength = parts.at( secretPart ).m_length;
+            item->m_secretStored = true;
+        }
+        else {
+            in.setStatus( QDataStream::ReadCorruptData );
+        }
+        delete loaded.take( item->m_id );
+        loaded.insert( item->m_id, item );
+    }
+    if ( !in.isValid() ) {
+        qDeleteAll( loaded );
+        return false;
+    }
+    
+    qDeleteAll( m_secret.m_items );
+    m_secret.m_items = loaded;
+    m_secret.m_unknownParts = unknownParts;
+    return true;
+}
+
+bool KSecretCollection::loadSecret(KSecretItem *item)
+{
+    if ( item->m_secretLoaded ) {
+        return true;
+    }
+    
+    QByteArray part;
+    bool ok = loadImage() && readImagePart( m_image, item->m_secretPosition, item->m_secretLength, part );
+    QByteArray secret;
+    if ( ok ) {
+        secret = decryptPart( m_encryptionFilter, part, ok );
+    }
+    if ( !ok ) {
+        qDebug() << "Cannot read the secret of item" << item->id() << "from" << m_path;
+        return false;
+    }
+    item->m_secret = QCA::SecureArray( secret );
+    item->m_secretLoaded = true;
+    return true;
+}
+
+bool KSecretCollection::loadImage()
+{
+    if ( !m_image.isEmpty() ) {
+        return true;
+    }
+    QFile file( m_path );
+    if ( !file.open( QIODevice::ReadOnly ) ) {
+        return false;
+    }
+    m_image = file.readAll();
+    return !m_image.isEmpty();
+}
+
+bool KSecretCollection::keepLockedImage()
+{
+    m_lockedImage.clear();
+    
+    QByteArray plain;
+    QBuffer buffer( &plain );
+    buffer.open( QIODevice::WriteOnly );
+    KSecretStream stream( &buffer );
+    stream << m_secret.m_created;
+    stream << m_secret.m_modified;
+    stream << m_secret.m_cfgCloseScreensaver;
+    stream << m_secret.m_cfgCloseIfUnused;
+    (QDataStream&)stream << m_secret.m_cfgCloseUnusedTimeout;
+    stream << m_secret.m_acls;
+    stream << m_secret.m_creatorApplication;
+    (QDataStream&)stream << (quint32)m_secret.m_items.size();
+    bool needsImage = false;
+    Q_FOREACH( KSecretItem *item, m_secret.m_items ) {
+        stream << item->m_id;
+        stream << item->m_label;
+        stream << item->m_created;
+        stream << item->m_modified;
+        stream << item->m_attributes;
+        stream << item->m_contentType;
+        // the secrets not written in full yet are kept along
+        stream << item->m_secretStored;
+        if ( item->m_secretStored ) {
+            (QDataStream&)stream << item->m_secretPosition << item->m_secretLength;
+            needsImage = true;
+        }
+        else {
+            stream << item->m_secret;
+        }
+    }
+    if ( !stream.isValid() || ( needsImage && !loadImage() ) ) {
+        return false;
+    }
+    
+    // the HMAC of the encrypted items follows them, so a wrong key is told
+    // apart from one which happens to decrypt them with a valid padding
+    bool ok = false;
+    const QByteArray encrypted = encryptPart( m_encryptionFilter, plain, ok );
+    if ( ok ) {
+        QBuffer image( &m_lockedImage );
+        image.open( QIODevice::WriteOnly );
+        KSecretStream out( &image );
+        (QDataStream&)out << encrypted << m_encryptionFilter->authenticate( encrypted );
+        ok = out.isValid();
+    }
+    if ( !ok ) {
+        m_lockedImage.clear();
+    }
+    return ok;
+}
+
+bool KSecretCollection::readLockedImage()
+{
+    QBuffer image;
+    image.setData( m_lockedImage );
+    image.open( QIODevice::ReadOnly );
+    KSecretStream imageIn( &image );
+    QByteArray encrypted;
+    QByteArray mac;
+    (QDataStream&)imageIn >> encrypted >> mac;
+    if ( !imageIn.isValid() || mac != m_encryptionFilter->authenticate( encrypted ) ) {
+        // a wrong key
+        return false;
+    }
+    
+    bool ok = false;
+    QByteArray plain = decryptPart( m_encryptionFilter, encrypted, ok );
+    if ( !ok ) {
+        return false;
+    }
+    
+    QBuffer buffer( &plain );
+    buffer.open( QIODevice::ReadOnly );
+    KSecretStream in( &buffer );
+    SecretData data;
+    in >> data.m_created;
+    in >> data.m_modified;
+    in >> data.m_cfgCloseScreensaver;
+    in >> data.m_cfgCloseIfUnused;
+    (QDataStream&)in >> data.m_cfgCloseUnusedTimeout;
+    in >> data.m_acls;
+    in >> data.m_creatorApplication;
+    
+    quint32 numItems = 0;
+    (QDataStream&)in >> numItems;
+    while ( numItems-- > 0 && in.isValid() ) {
+        KSecretItem *item = new KSecretItem();
+        in >> item->m_id;
+        in >> item->m_label;
+        in >> item->m_created;
+        in >> item->m_modified;
+        in >> item->m_attributes;
+        in >> item->m_contentType;
+        in >> item->m_secretStored;
+        if ( item->m_secretStored ) {
+            (QDataStream&)in >> item->m_secretPosition >> item->m_secretLength;
+            item->m_secretLoaded = false;
+        }
+        else {
+            in >> item->m_secret;
+        }
+        delete data.m_items.take( item->m_id );
+        data.m_items.insert( item->m_id, item );
+    }
+    if ( !in.isValid() ) {
+        // the items are deleted along with data
+        return false;
+    }
+    
+    m_secret.m_created = data.m_created;
+    m_secret.m_modified = data.m_modified;
+    m_secret.m_cfgCloseScreensaver = data.m_cfgCloseScreensaver;
+    m_secret.m_cfgCloseIfUnused = data.m_cfgCloseIfUnused;
+    m_secret.m_cfgCloseUnusedTimeout = data.m_cfgCloseUnusedTimeout;
+    m_secret.m_acls = data.m_acls;
+    m_secret.m_creatorApplication = data.m_creatorApplication;
+    qDeleteAll( m_secret.m_items );
+    m_secret.m_items = data.m_items;
+    data.m_items.clear();
+    m_lockedImage.clear();
+    return true;
+}
+
+bool KSecretCollection::evictSecret(KSecretItem *item)
+{
+    if ( !item->m_secretLoaded || !item->m_secretStored ) {
+        return false;
+    }
+    item->m_secret = QCA::SecureArray();
+    item->m_secretLoaded = false;
+    return true;
+}
+
 KSecretCollection::SecretData::SecretData() :
     m_cfgCloseScreensaver(false),
     m_cfgCloseIfUnused(false),
@@ -639,10 +1405,41 @@ KSecretCollection::SecretData::~SecretData()
     qDeleteAll( m_items );
 }
 
+void KSecretCollection::PublicData::setItemHashes(const QString &id, const QSet<QByteArray> &hashes)
+{
+    m_itemHashes.insert( id, hashes );
+    m_hashIndex.insert( id, hashTerms( hashes ) );
+}
+
+void KSecretCollection::PublicData::removeItemHashes(const QString &id)
+{
+    m_itemHashes.remove( id );
+    m_hashIndex.remove( id );
+}
+
+QMap<QString, QString> KSecretCollection::PublicData::hashTerms(const QSet<QByteArray> &hashes)
+{
+    QMap<QString, QString> terms;
+    Q_FOREACH( const QByteArray &hash, hashes ) {
+        terms.insert( QString::fromLatin1( hash.toHex() ), QString() );
+    }
+    return terms;
+}
+
 KSecretStream& operator<<(KSecretStream& stream, const KSecretCollection::PublicData& d)
 {
     stream << d.m_id;
     stream << d.m_label;
+
+    (QDataStream&)stream << d.m_hashKey;
+    (QDataStream&)stream << (quint32)d.m_itemHashes.size();
+    QHashIterator< QString, QSet<QByteArray> > it( d.m_itemHashes );
+    while ( it.hasNext() ) {
+        it.next();
+        writeItemHashes( stream, it.key(), it.value() );
+    }
+
+    (QDataStream&)stream << d.m_generation;
     return stream;
 }
 
@@ -650,24 +1447,32 @@ KSecretStream& operator>>(KSecretStream& stream, KSecretCollection::PublicData&
 {
     stream >> d.m_id;
     stream >> d.m_label;
-    return stream;
-}
 
-
-KSecretStream& operator << ( KSecretStream& stream, const KSecretCollection::SecretData &d )
-{
-    stream << d.m_created;
-    stream << d.m_modified;
-    stream << d.m_cfgCloseScreensaver;
-    stream << d.m_cfgCloseIfUnused;
-    (QDataStream&)stream << d.m_cfgCloseUnusedTimeout;
-    stream << d.m_acls;
-    stream << d.m_creatorApplication;
-    stream << d.m_items;
-    // FIXME: should we also serialize hashes? My opinion is "No"
+    d.m_hashKey.clear();
+    d.m_itemHashes.clear();
+    d.m_hashIndex.clear();
+    d.m_generation.clear();
+    // the attribute hashes were added with version 2 of the file format
+    if ( stream.formatVersion() >= 2 ) {
+        (QDataStream&)stream >> d.m_hashKey;
+        quint32 numItems;
+        (QDataStream&)stream >> numItems;
+        while ( numItems-- > 0 && stream.status() == QDataStream::Ok ) {
+            QString id;
+            QSet<QByteArray> hashes;
+            readItemHashes( stream, id, hashes );
+            d.setItemHashes( id, hashes );
+        }
+    }
+    // and the generation, with the journal, with version 3
+    if ( stream.formatVersion() >= 3 ) {
+        (QDataStream&)stream >> d.m_generation;
+    }
     return stream;
 }
 
+
+// the secret data of the files written before version 4, @see KSecretCollection::readParts
 KSecretStream& operator >> ( KSecretStream &stream, KSecretCollection::SecretData &d )
 {
     stream >> d.m_created;
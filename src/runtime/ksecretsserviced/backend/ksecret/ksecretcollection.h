@@ -22,9 +22,11 @@
 #define KSECRETCOLLECTION_H
 
 #include "../backendcollection.h"
+#include "../attributeindex.h"
 #include "ksecretitem.h"
 
-#include <QtCore/QTimer>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QSharedPointer>
 #include "ksecretstream.h"
 
 class KSecretEncryptionFilter;
@@ -33,6 +35,8 @@ class KSecretUnlockCollectionJob;
 class KSecretLockCollectionJob;
 class KSecretDeleteCollectionJob;
 class KSecretCreateItemJob;
+class KSecretSyncScheduler;
+class KSecretEvictionManager;
 
 /**
  * Represents a part of the ksecret file stored in memory. The part's type
@@ -44,6 +48,19 @@ struct UnknownFilePart {
     QByteArray m_contents;
 };
 
+/**
+ * Types of the ksecret file parts, @see FORMAT
+ */
+enum FilePartType {
+    FilePartItemHashes = 0,
+    FilePartSymKey = 1,
+    FilePartItems = 2,
+    FilePartAcls = 3,
+    FilePartConfig = 4,
+    FilePartCollProps = 5,
+    FilePartItemSecret = 6
+};
+
 /**
  * Holds a description of a ksecret file part.
  */
@@ -224,27 +241,19 @@ private Q_SLOTS:
     void slotItemDeleted(BackendItem *item);
 
     /**
-     * This slot is called whenever an Item's attributes change to rebuild the item lookup
-     * hashes the collection uses to search items.
+     * This slot is called whenever an Item's attributes change to update the attribute
+     * index the collection uses to search items.
      *
      * @param item Item whose attributes changed
      */
-    void changeAttributeHashes(KSecretItem *item);
-    
-    /**
-     * This slot can be called to start the sync timer (if it's not running
-     * yet). It's supposed to be called after every change to the collection
-     * or one of its items.
-     */
-    void startSyncTimer();
+    void changeAttributeHashes(BackendItem *item);
     
     void slotItemChanged(BackendItem *item);
-    
+
     /**
-     * This slot is called by the sync timer to sync the collection
-     * on changes.
+     * Called when a write done in the background completes.
      */
-    void sync();
+    void slotWriteFinished();
     
 public:
     /**
@@ -267,12 +276,23 @@ public:
 
 protected:
     /**
-     * Try to unlock the collection using the password provided.
+     * Derive the key of a password in a worker thread. An empty password
+     * stands for the default one.
      *
+     * @remarks this is used by KSecretUnlockCollectionJob
+     */
+    QFuture<QCA::SymmetricKey> deriveKey(const QCA::SecureArray &password) const;
+
+    /**
+     * Try to unlock the collection using a key returned by \sa deriveKey.
+     * The key is kept in the session's key cache if it unlocked it.
+     *
+     * @param password the password the key was derived from
+     * @param key the key derived from the password
      * @return true if unlocking succeeded, false else
      * @remarks this is used by KSecretUnlockCollectionJob
      */
-    BackendReturn<bool> tryUnlockPassword(const QCA::SecureArray &password);
+    BackendReturn<bool> tryUnlockKey(const QCA::SecureArray &password, const QCA::SymmetricKey &key);
 
     /**
      * Lock this collection. This is implemented here for convenience purposes.
@@ -306,6 +326,9 @@ private:
     friend class KSecretDeleteCollectionJob;
     friend class KSecretCreateItemJob;
     friend class KSecretCreateCollectionJob;
+    friend class KSecretSyncScheduler;
+    friend class KSecretEvictionManager;
+    friend class KSecretFileTest;
 
 
     /**
@@ -317,16 +340,175 @@ private:
     BackendReturn<bool> tryUnlock();
 
     /**
-     * Serialize this ksecret collection back to a KSecretFile.
+     * Serialize this ksecret collection back to a KSecretFile. This writes the
+     * collection in full and empties its journal.
      *
      * @param errorMessage set if there's an replaceerror
      * @return true on success, false in case of an error
      */
-    bool serialize(QString &errorMessage) const;
+    bool serialize(QString &errorMessage);
+
+    // the data of a secret as it was when a write started
+    struct SecretSnapshot {
+        QString m_itemId;
+        quint32 m_version;              // @see KSecretItem::m_secretVersion
+        bool m_loaded;
+        QCA::SecureArray m_secret;      // if loaded
+        quint32 m_position;             // else, its part in the current file
+        quint32 m_length;
+    };
+
+    // everything a full write needs, so it can run in another thread while
+    // the collection changes
+    struct WriteSnapshot {
+        QString m_path;
+        QByteArray m_image;             // the current file, for the secrets not loaded
+        QSharedPointer<KSecretEncryptionFilter> m_filter; // a copy for the writing thread
+        QByteArray m_publicData;        // serialized public data
+        QByteArray m_items;             // serialized items part, before encryption
+        QList<SecretSnapshot> m_secrets;
+        QList<UnknownFilePart> m_unknownParts;
+    };
+
+    struct WriteResult {
+        bool m_ok;
+        QString m_errorMessage;
+        // the items and their secret parts in the new file
+        QList<QString> m_itemIds;
+        QList<quint32> m_secretVersions;
+        QList<FilePartEntry> m_secretParts;
+        QByteArray m_image;             // the new file, as read back
+    };
+
+    /**
+     * Take a snapshot of the collection for a full write. The collection is
+     * not dirty any more, unless the write fails.
+     */
+    WriteSnapshot takeSnapshot();
+
+    /**
+     * Write a snapshot to its ksecret file. This doesn't touch the collection
+     * so it may run in another thread.
+     */
+    static WriteResult writeSnapshot(const WriteSnapshot &snapshot);
+
+    /**
+     * Update the collection once a snapshot was written.
+     *
+     * @return false if the write failed
+     */
+    bool finishWrite(const WriteResult &result, QString &errorMessage);
+
+    /**
+     * Check whether the next write must be a full one.
+     */
+    bool needsFullWrite() const;
+
+    /**
+     * Wait for the write running in the background, if any, and update the
+     * collection.
+     */
+    void waitForSync();
+
+    /**
+     * Write the changes made since the last write. They are appended to the
+     * journal, unless the collection must be written in full or the journal
+     * grew as large as the ksecret file.
+     *
+     * @param errorMessage set if there's an error
+     * @return true on success, false in case of an error
+     */
+    bool persist(QString &errorMessage);
+
+    /**
+     * Append the changes made since the last write to the journal.
+     */
+    bool appendJournal(QString &errorMessage);
 
     /**
-     * Set or unset the dirty flag. When setting the flag, the syncTimer will be started
-     * but only of the collection is in the unlocked state
+     * Apply the journal of the ksecret file to the loaded collection.
+     *
+     * @param withSecrets if false, only the unencrypted changes are applied,
+     *                    as when the collection is locked
+     */
+    void replayJournal(bool withSecrets);
+
+    /**
+     * Forget the changes made since the last write, once written.
+     */
+    void clearChanges();
+
+    /**
+     * Write the collection if it changed. A full write runs in the background,
+     * the others are done right away. Either way, the scheduler is told about
+     * the result through KSecretSyncScheduler::syncFinished.
+     *
+     * @remarks this is called by KSecretSyncScheduler
+     */
+    void sync();
+
+    /**
+     * Let the sync scheduler and the eviction manager know the collection or
+     * one of its items is used.
+     *
+     * @param item the item used, if any
+     */
+    void markAsUsed(const KSecretItem *item = 0) const;
+
+    /**
+     * Read the part table of the ksecret file and decrypt its items part.
+     * The secrets of the items are left in their own parts until accessed.
+     *
+     * @return false if the file could not be read or decrypted
+     */
+    bool readParts();
+
+    /**
+     * Read the ksecret file in memory, if not done yet.
+     *
+     * @return false if the file could not be read
+     */
+    bool loadImage();
+
+    /**
+     * Encrypt the items of the collection being locked, keeping the secrets
+     * stored in the file image as their positions. The next unlock decrypts
+     * them instead of reading the file, after checking the HMAC they are kept
+     * with, which verifies the key.
+     *
+     * @return false if the items could not be encrypted, the file then being
+     *         read again by the next unlock
+     */
+    bool keepLockedImage();
+
+    /**
+     * Decrypt the items kept by \sa keepLockedImage.
+     *
+     * @return false if they could not be decrypted, as with a wrong key
+     */
+    bool readLockedImage();
+
+    /**
+     * Decrypt the secret of an item from its part of the ksecret file.
+     *
+     * @param item the item, which must have been read by \sa readParts
+     * @return false if the part could not be read or decrypted
+     */
+    bool loadSecret(KSecretItem *item);
+
+    /**
+     * Drop the secret of an item from memory. Only the secrets stored in the
+     * ksecret file as they are can be dropped, as they're read again by
+     * \sa loadSecret.
+     *
+     * @return false if the secret was kept
+     * @remarks this is used by KSecretEvictionManager
+     */
+    bool evictSecret(KSecretItem *item);
+
+    /**
+     * Set or unset the dirty flag. When setting the flag, the collection is scheduled
+     * for writing, but only if the collection is in the unlocked state
      * @param dirty the dirty value to give
      */
     void setDirty( bool dirty = true );
@@ -339,14 +521,58 @@ private:
     // flag which is set when the collection was changed and which
     // denotes that the collection should be synced back to disk.
     mutable bool m_dirty;
-    // timer for syncing the collection on changes
-    QTimer m_syncTimer;
+    // schedules the writes of the changed collections
+    KSecretSyncScheduler *m_syncScheduler;
+    // drops the secrets and locks the collections not used
+    KSecretEvictionManager *m_evictionManager;
+
+    // items changed or removed since the last write
+    QSet<QString> m_changedItems;
+    QSet<QString> m_removedItems;
+    // set when the acls changed since the last write
+    bool m_changedAcls;
+    // set when the next write must be a full one, as for a new collection or
+    // a file written with an older format
+    bool m_fullWriteNeeded;
+    // size of the journal, 0 if there is none
+    qint64 m_journalSize;
+
+    // the full write running in the background
+    QFutureWatcher<WriteResult> m_writeWatcher;
+    bool m_writeInProgress;
+    // the encrypted ksecret file, read in full, which the secrets not loaded
+    // yet are read from. It's kept as is while a write replaces the file
+    QByteArray m_image;
+    // the encrypted items of the locked collection, @see keepLockedImage
+    QByteArray m_lockedImage;
+
+    /**
+     * Get the locked placeholder of an item found by its attribute hashes.
+     * The placeholder only knows its id until the collection is unlocked.
+     */
+    KSecretItem *lockedItem(const QString &id) const;
 
     // structure holding the public data serialized when collection
     // file is first loaded
     struct PublicData {
         QString m_id;
         QString m_label;
+
+        // key of the attribute hashes, generated with the collection. It's
+        // stored unencrypted as the hashes must be computed while locked, so
+        // it only keeps the hashes from being compared across collections
+        QByteArray m_hashKey;
+        // maps item identifiers to the keyed hashes of their attributes
+        QHash<QString, QSet<QByteArray> > m_itemHashes;
+        // maps the attribute hashes, as names with an empty value, to items
+        AttributeIndex m_hashIndex;
+
+        // random value changed with each full write, @see KSecretJournal
+        QByteArray m_generation;
+
+        void setItemHashes(const QString &id, const QSet<QByteArray> &hashes);
+        void removeItemHashes(const QString &id);
+        static QMap<QString, QString> hashTerms(const QSet<QByteArray> &hashes);
     };
     
     // this is the secret data that's goes in the storage
@@ -367,7 +593,8 @@ private:
         QHash<QString, ApplicationPermission> m_acls;
         QString m_creatorApplication;
 
-        QMultiHash< QString, KSecretItem* > m_lookupHashes;
+        // maps attribute name and value pairs to items
+        AttributeIndex m_attributeIndex;
         
 //         // maps lookup attribute hashes to items
 //         QMultiHash<QByteArray, KSecretItem*> m_itemHashes;
@@ -376,21 +603,26 @@ private:
 
         // maps item identifiers to items
         QHash<QString, KSecretItem*> m_items;
-        
+
+        // parts of the file this version doesn't know, rewritten as they were
+        QList<UnknownFilePart> m_unknownParts;
     };
     
+    friend class KSecretItem;
     friend KSecretStream& operator << ( KSecretStream&, const PublicData& );
     friend KSecretStream& operator >> ( KSecretStream&, PublicData& );
-    friend KSecretStream& operator << ( KSecretStream&, const SecretData& );
     friend KSecretStream& operator >> ( KSecretStream&, SecretData& );
     
     PublicData  m_pub;
     SecretData  m_secret;
+
+    // placeholders of the items reported by searches while locked, which get
+    // filled in when unlocking so their pointers stay valid
+    mutable QHash<QString, KSecretItem*> m_lockedItems;
 };
 
 KSecretStream & operator << ( KSecretStream& out, const KSecretCollection::PublicData &data );
 KSecretStream & operator >> ( KSecretStream& in, KSecretCollection::PublicData &data );
-KSecretStream & operator << ( KSecretStream& out, const KSecretCollection::SecretData &data );
 KSecretStream & operator >> ( KSecretStream& in, KSecretCollection::SecretData &data );
 
 
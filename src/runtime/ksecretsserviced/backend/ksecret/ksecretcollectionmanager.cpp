@@ -21,6 +21,7 @@
 #include "ksecretcollectionmanager.h"
 #include "ksecretcollection.h"
 #include "ksecretjobs.h"
+#include "ksecretkeycache.h"
 
 #include "../lib/secrettool.h"
 #include <kglobal.h>
@@ -29,6 +30,7 @@
 
 #include <QtCore/QTimer>
 #include <QtCore/QDir>
+#include <QtDBus/QDBusConnection>
 
 KSecretCollectionManager::KSecretCollectionManager(const QString &path, QObject *parent)
     : BackendCollectionManager(parent), m_watcher(this)
@@ -40,11 +42,28 @@ KSecretCollectionManager::KSecretCollectionManager(const QString &path, QObject
 //     m_watcher.startScan();
     // list directory contents to discover existing collections on startup
     QTimer::singleShot(0, this, SLOT(slotStartupDiscovery()));
+
+    QDBusConnection::sessionBus().connect(QStringLiteral("org.freedesktop.ScreenSaver"),
+                                          QStringLiteral("/ScreenSaver"),
+                                          QStringLiteral("org.freedesktop.ScreenSaver"),
+                                          QStringLiteral("ActiveChanged"),
+                                          this, SLOT(slotScreenSaverChanged(bool)));
 }
 
 KSecretCollectionManager::~KSecretCollectionManager()
 {
-    // TODO: cleanup?
+    // the collections are deleted after the scheduler, so write them now
+    m_syncScheduler.flushAll();
+}
+
+KSecretSyncScheduler *KSecretCollectionManager::syncScheduler()
+{
+    return &m_syncScheduler;
+}
+
+KSecretEvictionManager *KSecretCollectionManager::evictionManager()
+{
+    return &m_evictionManager;
 }
 
 CreateCollectionJob *KSecretCollectionManager::createCreateCollectionJob(const CollectionCreateInfo &createCollectionInfo)
@@ -109,4 +128,13 @@ void KSecretCollectionManager::createCollectionJobResult(KJob *job)
     }
 }
 
+void KSecretCollectionManager::slotScreenSaverChanged(bool active)
+{
+    if (active) {
+        m_syncScheduler.flushAll();
+        m_evictionManager.screenSaverStarted();
+        KSecretKeyCache::instance()->clear();
+    }
+}
+
 #include "ksecretcollectionmanager.moc"
@@ -22,6 +22,8 @@
 #define KSECRETCOLLECTIONMANAGER_H
 
 #include "../backendcollectionmanager.h"
+#include "ksecretevictionmanager.h"
+#include "ksecretsyncscheduler.h"
 
 #include <kdirwatch.h>
 
@@ -60,6 +62,17 @@ public:
      */
     virtual CreateCollectionJob *createCreateCollectionJob(const CollectionCreateInfo &createCollectionInfod);
 
+    /**
+     * The scheduler writing the changed collections of this manager.
+     */
+    KSecretSyncScheduler *syncScheduler();
+
+    /**
+     * The manager dropping the secrets and locking the collections of this
+     * manager when they're not used.
+     */
+    KSecretEvictionManager *evictionManager();
+
 protected:
     /**
      * This methods adds a newly created collection to the manager.
@@ -89,6 +102,15 @@ private Q_SLOTS:
      */
     void createCollectionJobResult(KJob *job);
 
+    /**
+     * Connected to the screensaver's ActiveChanged D-Bus signal, this slot
+     * writes the pending changes when the screensaver starts, then locks the
+     * collections configured to close with it.
+     *
+     * @param active true if the screensaver started
+     */
+    void slotScreenSaverChanged(bool active);
+
 private:
     friend class KSecretCreateCollectionJob;
 
@@ -97,6 +119,9 @@ private:
 
     // map of paths pointing to the respective collection objects
     QMap<QString, KSecretCollection*> m_collections;
+
+    KSecretSyncScheduler m_syncScheduler;
+    KSecretEvictionManager m_evictionManager;
 };
 
 #endif
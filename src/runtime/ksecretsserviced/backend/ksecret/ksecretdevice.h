@@ -27,16 +27,34 @@
  * Care should be taken to increment it's value with each file format change.
  * The modified code should be prepared to handle older version file formats.
  */
-#define CURRENT_FILE_VERSION        1
+#define CURRENT_FILE_VERSION        4
 
 #define KSECRET_MAGIC "KSECRET\n\r\r\n"
 #define KSECRET_MAGIC_LEN 11
 #include <QIODevice>
+#include <QFileDevice>
+#include <QtEndian>
 #include <QDebug>
 #include <algorithm>
 
 #include "ksecretencryptionfilter.h"
 
+/**
+ * Device reading and writing ksecret files.
+ *
+ * The file starts with plain data, the header then the public data of the
+ * collection. Once startEncrypting() is called, the data is encrypted in
+ * chunks, each one being stored as its length followed by its encrypted
+ * contents. The chunks are large and each one has its own initialization
+ * vector, derived from the chunk index, @see KSecretEncryptionFilter::chunkInitVector
+ *
+ * Files written before version 4 store the secret data of the collection in
+ * such a stream. Since version 4, it's stored in separately encrypted parts
+ * which are written as plain data, @see KSecretCollection::serialize
+ *
+ * The device switches from plain to encrypted data in the middle of the file,
+ * so it's opened unbuffered and does its own buffering of the underlying file.
+ */
 template <class B>
 class KSecretDevice : public B
 {
@@ -44,23 +62,32 @@ class KSecretDevice : public B
     * Increment this number with each significant change in file format
     * Care should be taken to let the code recognize old file formats
     * @see CURRENT_FILE_VERSION
+    *
+    * Version 1 files have no version number after the magic and use the
+    * initialization vector of the header for all their chunks.
     */
-    static const quint32 FILE_FORMAT_VERSION = 1; 
+    static const quint32 FILE_FORMAT_VERSION = CURRENT_FILE_VERSION;
     /**
-     * While writing, this device accumulates cunks of data before sending
-     * them to the encryption filter. This constant adjusts the minimum size
-     * of these chunks
+     * Size of the plain data of the encrypted chunks. The last chunk may be
+     * shorter.
      */
-    static const int BUFFER_CHUNK_SIZE = 128;
-    
+    static const int CHUNK_SIZE = 64 * 1024;
+    /**
+     * Size of the reads and writes of the underlying file
+     */
+    static const int RAW_BUFFER_SIZE = 64 * 1024;
+
 public:
     KSecretDevice( const QString &path, KSecretEncryptionFilter *encryptionFilter ) :
         B( path ),
         m_encryptionFilter( encryptionFilter ),
         m_valid( false ),
-        m_bufferPos( 0 ),
-        m_closing( false ),
-        m_encrypting( false )
+        m_formatVersion( FILE_FORMAT_VERSION ),
+        m_encrypting( false ),
+        m_chunkIndex( 0 ),
+        m_plainPos( 0 ),
+        m_rawPos( 0 ),
+        m_filePos( 0 )
     {
     }
     virtual ~KSecretDevice() {}
@@ -70,9 +97,14 @@ public:
         // NOTE: this device is not designed to work in buffered mode so we'll add here the unbuffered mode
         flags |= QIODevice::Unbuffered;
 
-        m_buffer.clear();
-        m_bufferPos = 0;
-        m_closing = false;
+        m_plain.clear();
+        m_plainPos = 0;
+        m_raw.clear();
+        m_rawPos = 0;
+        m_filePos = 0;
+        m_encrypting = false;
+        m_chunkIndex = 0;
+        m_formatVersion = FILE_FORMAT_VERSION;
 
         bool result = B::open( flags );
         if ( result ) {
@@ -91,16 +123,55 @@ public:
         return result;
     }
     
-    bool isAtDataStart() const;
-    bool seekDataStart();
+    /**
+     * The format version of the file, which is the current one for the
+     * written files.
+     */
+    quint32 formatVersion() const {
+        return m_formatVersion;
+    }
+    
+    /**
+     * Position in the underlying file of the next byte read or written, the
+     * buffered data being accounted for. It's only meaningful for plain data.
+     */
+    qint64 filePos() const {
+        return m_filePos;
+    }
     
     void startEncrypting() {
         m_encrypting = true;
+        m_chunkIndex = 0;
+    }
+    
+    /**
+     * Encrypt the pending data and write everything to the underlying file.
+     *
+     * @return false if some data could not be written
+     */
+    bool finish() {
+        if ( !m_valid ) {
+            return false;
+        }
+        if ( m_encrypting && m_plainPos < m_plain.size() ) {
+            writeChunk( m_plain.mid( m_plainPos ) );
+        }
+        m_plain.clear();
+        m_plainPos = 0;
+        return flushRaw();
+    }
+    
+    /**
+     * Finish writing then commit the file. This is only available when writing
+     * through a QSaveFile.
+     */
+    bool commit() {
+        return finish() && B::commit();
     }
     
 private:
     /**
-     * Read the ksecret file's magic value.
+     * Read the ksecret file's magic value and format version.
      *
      * @return true if the magic indicates this file is a ksecret file,
      *         false else
@@ -108,98 +179,198 @@ private:
     bool readMagic();
 
     /**
-     * Write the ksecret file's magic value.
+     * Write the ksecret file's magic value and format version.
      *
      * @return true if the magic was written successful, false else
      */
     bool writeMagic();
     
-    virtual qint64  readData ( char * data, qint64 maxSize ) {
-        qint64 result = -1;
-        static bool readingChunk = false;
-        if ( !readingChunk && m_encrypting ) {
-            if ( (m_buffer.size() - m_bufferPos) < maxSize ) {
-                QDataStream stream( this );
-                readingChunk = true;
-                QByteArray chunk;
-                stream >> chunk; // do recursion
-                readingChunk = false;
-                
-                m_buffer = m_encryptionFilter->decryptData( chunk );
-                m_bufferPos = 0;
+    /**
+     * Read from the underlying file through the raw buffer
+     */
+    qint64 readRaw( char *data, qint64 maxSize ) {
+        qint64 done = 0;
+        while ( done < maxSize && fillRaw( 1 ) ) {
+            qint64 len = std::min( maxSize - done, (qint64)( m_raw.size() - m_rawPos ) );
+            memcpy( data + done, m_raw.constData() + m_rawPos, len );
+            m_rawPos += len;
+            done += len;
+        }
+        m_filePos += done;
+        return done;
+    }
+    
+    /**
+     * Make sure the raw buffer holds at least the given number of bytes
+     *
+     * @return false if the end of the file was reached before
+     */
+    bool fillRaw( int size ) {
+        if ( m_raw.size() - m_rawPos >= size ) {
+            return true;
+        }
+        m_raw.remove( 0, m_rawPos );
+        m_rawPos = 0;
+        while ( m_raw.size() < size ) {
+            int oldSize = m_raw.size();
+            m_raw.resize( oldSize + std::max( size - oldSize, RAW_BUFFER_SIZE ) );
+            qint64 len = B::readData( m_raw.data() + oldSize, m_raw.size() - oldSize );
+            m_raw.resize( oldSize + std::max( len, (qint64)0 ) );
+            if ( len <= 0 ) {
+                return false;
             }
-            
-            result = std::min( (qint64)( m_buffer.size() - m_bufferPos ), maxSize );
-            memcpy( data, m_buffer.constData() + m_bufferPos, maxSize );
-            m_bufferPos += maxSize;
         }
-        else {
-            result = B::readData( data, maxSize );
+        return true;
+    }
+    
+    /**
+     * Write to the underlying file through the raw buffer
+     */
+    bool writeRaw( const char *data, qint64 size ) {
+        m_raw.append( data, size );
+        m_filePos += size;
+        return m_raw.size() < RAW_BUFFER_SIZE || flushRaw();
+    }
+    
+    bool flushRaw() {
+        qint64 done = 0;
+        while ( done < m_raw.size() ) {
+            qint64 len = B::writeData( m_raw.constData() + done, m_raw.size() - done );
+            if ( len <= 0 ) {
+                m_valid = false;
+                break;
+            }
+            done += len;
         }
-        return result;
+        m_raw.clear();
+        return m_valid;
+    }
+    
+    QCA::InitializationVector chunkInitVector() {
+        if ( m_formatVersion < 2 ) {
+            return m_encryptionFilter->initVector();
+        }
+        return m_encryptionFilter->chunkInitVector( m_chunkIndex );
+    }
+    
+    /**
+     * Read and decrypt the next chunk into the plain buffer
+     *
+     * @return false at the end of the file or in case of an error
+     */
+    bool readChunk() {
+        m_plain.clear();
+        m_plainPos = 0;
+        uchar length[ sizeof( quint32 ) ];
+        if ( readRaw( reinterpret_cast<char*>( length ), sizeof( length ) ) != sizeof( length ) ) {
+            return false;
+        }
+        quint32 size = qFromBigEndian<quint32>( length );
+        if ( size == 0xffffffff || size == 0 ) {
+            // an empty chunk
+            return true;
+        }
+        QByteArray chunk( size, Qt::Uninitialized );
+        if ( readRaw( chunk.data(), size ) != (qint64)size ) {
+            m_valid = false;
+            return false;
+        }
+        bool ok = false;
+        m_plain = m_encryptionFilter->decryptChunk( chunk, chunkInitVector(), ok );
+        m_chunkIndex++;
+        if ( !ok ) {
+            m_valid = false;
+        }
+        return ok;
+    }
+    
+    /**
+     * Encrypt the given data as the next chunk and write it
+     */
+    bool writeChunk( const QByteArray &plain ) {
+        bool ok = false;
+        QByteArray chunk = m_encryptionFilter->encryptChunk( plain, chunkInitVector(), ok );
+        m_chunkIndex++;
+        if ( !ok ) {
+            m_valid = false;
+            return false;
+        }
+        uchar length[ sizeof( quint32 ) ];
+        qToBigEndian<quint32>( chunk.size(), length );
+        return writeRaw( reinterpret_cast<const char*>( length ), sizeof( length ) ) &&
+               writeRaw( chunk.constData(), chunk.size() );
+    }
+    
+    virtual qint64  readData ( char * data, qint64 maxSize ) {
+        if ( !m_valid ) {
+            return -1;
+        }
+        if ( !m_encrypting ) {
+            return readRaw( data, maxSize );
+        }
+        
+        qint64 done = 0;
+        while ( done < maxSize ) {
+            if ( m_plainPos >= m_plain.size() && !readChunk() ) {
+                break;
+            }
+            qint64 len = std::min( maxSize - done, (qint64)( m_plain.size() - m_plainPos ) );
+            memcpy( data + done, m_plain.constData() + m_plainPos, len );
+            m_plainPos += len;
+            done += len;
+        }
+        return ( done == 0 && !m_valid ) ? -1 : done;
     }
 
-    // TODO: implement a buffering technique to allow for larger chunks to be encrypted, as to reduce redundancy
     virtual qint64  writeData ( const char * data, qint64 maxSize ) {
-        qint64 result = -1;
-        static bool writingChunk = false;
-        if ( !writingChunk && m_encrypting && !m_closing ) {
-            m_buffer.append( data, maxSize );
-            if ( m_buffer.size() >= BUFFER_CHUNK_SIZE ) {
-                QCA::SecureArray arr = m_encryptionFilter->encryptData( m_buffer );
-                QByteArray chunk = arr.toByteArray();
-//                 qDebug() << "buffer size " << m_buffer.size() << " encrypted chunk size " << arr.size();
-                m_buffer.clear();
-                QDataStream stream( this );
-                writingChunk = true;
-                stream << chunk; // do recursion
-                writingChunk = false;
-            }
-            result = maxSize;
+        if ( !m_valid ) {
+            return -1;
         }
-        else {
-            result = B::writeData( data, maxSize );
+        if ( !m_encrypting ) {
+            return writeRaw( data, maxSize ) ? maxSize : -1;
         }
         
-        return result; // take care not to return chunk.length here 
+        m_plain.append( data, maxSize );
+        while ( m_plain.size() - m_plainPos >= CHUNK_SIZE ) {
+            if ( !writeChunk( m_plain.mid( m_plainPos, CHUNK_SIZE ) ) ) {
+                return -1;
+            }
+            m_plainPos += CHUNK_SIZE;
+        }
+        if ( m_plainPos > 0 ) {
+            m_plain.remove( 0, m_plainPos );
+            m_plainPos = 0;
+        }
+        return maxSize; // take care not to return the chunk length here
     }
 
 public:
     virtual void close() {
-        Q_ASSERT( !m_closing );
         // write remaining data before closing
-        if ( !m_buffer.isEmpty() ) {
-            if ( m_buffer.size() < 16 ) {
-                // ensure QCA has the minimal amount of data to do the encryption
-                m_buffer.append("randomDataToMakeQCAHappy");
-            }
-            QByteArray chunk = m_encryptionFilter->encryptData( m_buffer ).toByteArray();
-            m_buffer.clear();
-            QDataStream stream( this );
-            m_closing = true;
-            stream << chunk; // do recursion
+        if ( B::isOpen() && B::isWritable() ) {
+            finish();
         }
-        if ( B::metaObject()->className() ==
-             QStringLiteral( "QFile" ) )
-            QMetaObject::invokeMethod( this, "B::close" );
+        // QSaveFile hides close(), so go through its base
+        QFileDevice::close();
     }
     
     
 private:
     KSecretEncryptionFilter *
                     m_encryptionFilter;
-    qint64          m_dataPos;
-    QByteArray      m_readBuffer;
     bool            m_valid;
-    QByteArray      m_buffer;
-    int             m_bufferPos;
-    bool            m_closing;
+    quint32         m_formatVersion;
     bool            m_encrypting;
+    quint64         m_chunkIndex;
+    // plain data of the current chunk
+    QByteArray      m_plain;
+    int             m_plainPos;
+    // data read from or to be written to the underlying file
+    QByteArray      m_raw;
+    int             m_rawPos;
+    qint64          m_filePos;
 };
 
-// template <class B>
-// quint32 KSecretDevice<B>::FILE_FORMAT_VERSION = 1;
-
 template <class B>
 bool KSecretDevice<B>::readMagic()
 {
@@ -207,14 +378,33 @@ bool KSecretDevice<B>::readMagic()
         return false;
     }
     
-    m_readBuffer.resize(KSECRET_MAGIC_LEN);
-    if(B::read(m_readBuffer.data(), KSECRET_MAGIC_LEN) != KSECRET_MAGIC_LEN) {
+    char magic[ KSECRET_MAGIC_LEN ];
+    if( readRaw( magic, KSECRET_MAGIC_LEN ) != KSECRET_MAGIC_LEN ||
+        memcmp( magic, KSECRET_MAGIC, KSECRET_MAGIC_LEN ) != 0 ) {
+        m_valid = false;
+        return false;
+    }
+    
+    // version 1 files continue with the hash algorithm, which was always 0,
+    // so the version is only consumed when it's there
+    if ( !fillRaw( sizeof( quint32 ) ) ) {
         m_valid = false;
         return false;
     }
-    m_dataPos = B::pos();
-    QString strMagic = QString::fromUtf8( m_readBuffer );
-    return strMagic == QString::fromUtf8( KSECRET_MAGIC );
+    quint32 version = qFromBigEndian<quint32>( reinterpret_cast<const uchar*>( m_raw.constData() + m_rawPos ) );
+    if ( version == 0 ) {
+        m_formatVersion = 1;
+    }
+    else if ( version <= FILE_FORMAT_VERSION ) {
+        m_formatVersion = version;
+        m_rawPos += sizeof( quint32 );
+        m_filePos += sizeof( quint32 );
+    }
+    else {
+        qDebug() << "Unsupported file format version" << version;
+        m_valid = false;
+    }
+    return m_valid;
 }
 
 template <class B>
@@ -224,12 +414,11 @@ bool KSecretDevice<B>::writeMagic()
         return false;
     }
 
-    if( B::write(KSECRET_MAGIC, KSECRET_MAGIC_LEN) != KSECRET_MAGIC_LEN) {
-        m_valid = false;
-    }
-    m_dataPos = B::pos(); 
+    uchar version[ sizeof( quint32 ) ];
+    qToBigEndian<quint32>( FILE_FORMAT_VERSION, version );
+    m_valid = writeRaw( KSECRET_MAGIC, KSECRET_MAGIC_LEN ) &&
+              writeRaw( reinterpret_cast<const char*>( version ), sizeof( version ) );
     return m_valid;
 }
 
 #endif // KSECRETDEVICE_H
-
@@ -23,27 +23,23 @@
 
 #include <klocalizedstring.h>
 #include <QDebug>
+#include <QtEndian>
+#include "ksecretkeycache.h"
 #include "ksecretstream.h"
 
 // this must not be changed or else file compatibility is gone!
 #define VERIFIER_LENGTH 64
 
 
-// create a symmetric encryption key from a user-supplied password using
-// PBKDF2.
-// Returns a zero-length key if creating the key failed.
-static QCA::SymmetricKey createKeyFromPassword(const QCA::SecureArray &password,
-        int keyLength)
+KSecretEncryptionFilter::KSecretEncryptionFilter() :
+        m_hash(0), m_mac(0), m_cipher(0), m_file(0)
 {
-//     if(!QCA::isSupported("sha1")) {
-//         return QCA::SymmetricKey();
-//     }
-
-    QCA::PBKDF2 deriv( QStringLiteral( "sha1" ) );
-    return deriv.makeKey(password, QCA::InitializationVector(), keyLength, 10000);
+    m_algoHash = SHA256;
+    m_algoCipher = AES256;
+    setupAlgorithms();
+    m_initVector.resize( m_cipher->keyLength().minimum() );
 }
 
-
 KSecretEncryptionFilter::KSecretEncryptionFilter( const QCA::SecureArray &password ) :
         m_hash(0), m_mac(0), m_cipher(0), m_file(0)
 {
@@ -54,6 +50,13 @@ KSecretEncryptionFilter::KSecretEncryptionFilter( const QCA::SecureArray &passwo
     setPassword( password );
 }
 
+KSecretEncryptionFilter::KSecretEncryptionFilter( const KSecretEncryptionFilter &other ) :
+        m_hash(0), m_algoHash(other.m_algoHash), m_algoCipher(other.m_algoCipher),
+        m_cryptKey(other.m_cryptKey), m_initVector(other.m_initVector), m_mac(0), m_cipher(0), m_file(0)
+{
+    setupAlgorithms();
+}
+
 KSecretEncryptionFilter::~KSecretEncryptionFilter()
 {
     delete m_hash;
@@ -105,14 +108,30 @@ bool KSecretEncryptionFilter::setupAlgorithms()
 
 bool KSecretEncryptionFilter::setPassword(const QCA::SecureArray& password)
 {
-    bool result = true;
-    int keyLength = m_cipher->keyLength().minimum();
-    m_cryptKey = createKeyFromPassword(password, keyLength);
-    if ( m_cryptKey.isEmpty() ) {
+    return setKey( deriveKey( password ).result() );
+}
+
+QFuture<QCA::SymmetricKey> KSecretEncryptionFilter::deriveKey( const QCA::SecureArray &password ) const
+{
+    // the file format has no salt, the keys have always been derived with an empty one
+    return KSecretKeyCache::instance()->derive( password, QCA::InitializationVector(),
+                                                m_cipher->keyLength().minimum() );
+}
+
+void KSecretEncryptionFilter::keepKey( const QCA::SecureArray &password ) const
+{
+    KSecretKeyCache::instance()->insert( password, QCA::InitializationVector(),
+                                         m_cipher->keyLength().minimum(), m_cryptKey );
+}
+
+bool KSecretEncryptionFilter::setKey( const QCA::SymmetricKey &key )
+{
+    if ( key.isEmpty() ) {
 //         qDebug() << "Cannot create key";
-        result = false;
+        return false;
     }
-    return result;
+    m_cryptKey = key;
+    return true;
 }
 
 bool KSecretEncryptionFilter::attachFile(QIODevice* file)
@@ -128,6 +147,9 @@ bool KSecretEncryptionFilter::attachFile(QIODevice* file)
 
 bool KSecretEncryptionFilter::setupForWriting()
 {
+    // each write gets its own vector, the chunk vectors being derived from it
+    m_initVector = QCA::InitializationVector( m_cipher->blockSize() );
+
     KSecretStream stream( m_file );
     stream.setVersion( QDataStream::Qt_4_7 );
     (QDataStream&)stream  
@@ -156,44 +178,72 @@ bool KSecretEncryptionFilter::setupForReading() {
     return setupAlgorithms();
 }
 
-QCA::SecureArray KSecretEncryptionFilter::encryptData( const QByteArray & data)
+QCA::InitializationVector KSecretEncryptionFilter::chunkInitVector( quint64 index )
+{
+    Q_ASSERT( m_hash );
+    QByteArray counter( sizeof( quint64 ), '\0' );
+    qToBigEndian<quint64>( index, reinterpret_cast<uchar*>( counter.data() ) );
+    m_hash->clear();
+    m_hash->update( m_initVector );
+    m_hash->update( counter );
+    QByteArray digest = m_hash->final().toByteArray();
+    return QCA::InitializationVector( digest.left( m_cipher->blockSize() ) );
+}
+
+QByteArray KSecretEncryptionFilter::encryptChunk( const QByteArray &data, const QCA::InitializationVector &iv, bool &ok )
 {
     Q_ASSERT( !m_cryptKey.isEmpty() );
-    m_cipher->setup( QCA::Encode, m_cryptKey, m_initVector );
+    // the cipher context is set up again with the chunk's vector, but not created again
+    m_cipher->setup( QCA::Encode, m_cryptKey, iv );
     QCA::SecureArray result = m_cipher->update( QCA::SecureArray( data ) );
-    if ( !m_cipher->ok() ) {
-        qDebug() << "Cannot encrypt data!";
-    }
+    ok = m_cipher->ok();
     result.append( m_cipher->final() );
-    if ( !m_cipher->ok() ) {
-        qDebug() << "Cannot encrypt: final failed!";
+    ok = ok && m_cipher->ok();
+    if ( !ok ) {
+        qDebug() << "Cannot encrypt data!";
     }
-//     qDebug() << "Encryted size " << result.size();
-    return result;
+    return result.toByteArray();
 }
 
-QByteArray KSecretEncryptionFilter::decryptData(QByteArray encrypted)
+QByteArray KSecretEncryptionFilter::decryptChunk( const QByteArray &encrypted, const QCA::InitializationVector &iv, bool &ok )
 {
-    m_cipher->setup( QCA::Decode, m_cryptKey, m_initVector );
+    m_cipher->setup( QCA::Decode, m_cryptKey, iv );
     QCA::MemoryRegion result = m_cipher->process( encrypted );
-    if ( !m_cipher->ok() ) {
+    ok = m_cipher->ok();
+    if ( !ok ) {
         qDebug() << "Cannot decrypt data!";
     }
     return result.toByteArray();
 }
 
-QSet<QByteArray> KSecretEncryptionFilter::createHashes(const QMap<QString, QString> &attributes)
+QByteArray KSecretEncryptionFilter::authenticate( const QByteArray &data )
+{
+    Q_ASSERT( m_mac );
+    Q_ASSERT( !m_cryptKey.isEmpty() );
+    // the encryption key is not used as the HMAC key as is
+    m_mac->setup( m_cryptKey );
+    m_mac->update( QByteArray( "ksecret authentication key" ) );
+    const QCA::SymmetricKey macKey( QCA::SecureArray( m_mac->final() ) );
+    m_mac->setup( macKey );
+    m_mac->update( data );
+    return m_mac->final().toByteArray();
+}
+
+QSet<QByteArray> KSecretEncryptionFilter::createHashes(const QByteArray &hashKey, const QMap<QString, QString> &attributes)
 {
-    Q_ASSERT(m_hash);
+    Q_ASSERT(m_mac);
 
     QSet<QByteArray> hashSet;
+    m_mac->setup(QCA::SymmetricKey(hashKey));
     QMap<QString, QString>::const_iterator it = attributes.constBegin();
     QMap<QString, QString>::const_iterator end = attributes.constEnd();
     for(; it != end; ++it) {
-        m_hash->clear();
-        m_hash->update(it.key().toUtf8());
-        m_hash->update(it.value().toUtf8());
-        hashSet.insert(m_hash->final().toByteArray());
+        m_mac->clear();
+        m_mac->update(it.key().toUtf8());
+        // the separator keeps ("ab", "c") and ("a", "bc") from having the same hash
+        m_mac->update(QByteArray(1, '\0'));
+        m_mac->update(it.value().toUtf8());
+        hashSet.insert(m_mac->final().toByteArray());
     }
 
     return hashSet;
@@ -24,6 +24,7 @@
 
 #include <qca_tools.h>
 #include <qca_basic.h>
+#include <QFuture>
 #include <QSet>
 
 class QIODevice;
@@ -45,28 +46,122 @@ public:
     };
 
 
+    /**
+     * Create a filter without a key, e.g. for reading the public part of a
+     * collection file before its password is known.
+     */
+    KSecretEncryptionFilter();
     explicit KSecretEncryptionFilter( const QCA::SecureArray &password );
+    /**
+     * Copy the algorithms and the key of another filter. The copy has its own
+     * hash and cipher objects, so it can be used from another thread.
+     */
+    KSecretEncryptionFilter( const KSecretEncryptionFilter &other );
     virtual ~KSecretEncryptionFilter();
     
+    /**
+     * Derive the key from the password and use it. This blocks until the key
+     * is derived, unless it is found in the session's key cache.
+     */
     bool setPassword( const QCA::SecureArray &password );
+
+    /**
+     * Derive the key of a password in a worker thread, unless it is found in
+     * the session's key cache.
+     *
+     * @param password the password to derive the key from
+     * @return the future key, which is empty if the derivation failed
+     */
+    QFuture<QCA::SymmetricKey> deriveKey( const QCA::SecureArray &password ) const;
+
+    /**
+     * Keep the key in use in the session's key cache, once it proved to be
+     * the one of the file, so other collections using the same password get
+     * it without deriving it again.
+     *
+     * @param password the password the key was derived from
+     */
+    void keepKey( const QCA::SecureArray &password ) const;
+
+    /**
+     * Use a key returned by \sa deriveKey.
+     *
+     * @return false if the key is empty
+     */
+    bool setKey( const QCA::SymmetricKey &key );
+    bool hasKey() const { return !m_cryptKey.isEmpty(); }
+
+    /**
+     * Forget the key, as when the collection is locked.
+     */
+    void clearKey() { m_cryptKey = QCA::SymmetricKey(); }
     bool attachFile( QIODevice* );
     
     QCA::Hash *hash() const { return m_hash; }
 
-    QCA::SecureArray encryptData( const QByteArray & );
-    
-    QByteArray decryptData( QByteArray );
+    /**
+     * The initialization vector of the given chunk of the encrypted stream.
+     * It's derived from the random initialization vector stored in the file
+     * header and the chunk index, so no two chunks use the same one.
+     *
+     * @param index the position of the chunk in the stream, starting at 0
+     */
+    QCA::InitializationVector chunkInitVector( quint64 index );
+
+    /**
+     * The initialization vector stored in the file header, which files
+     * written before version 2 of the format use for all their chunks.
+     */
+    const QCA::InitializationVector &initVector() const { return m_initVector; }
+
+    /**
+     * Create a random initialization vector, for data encrypted on its own.
+     */
+    QCA::InitializationVector createInitVector() const {
+        return QCA::InitializationVector( m_cipher->blockSize() );
+    }
+
+    /**
+     * Encrypt one chunk of the stream.
+     *
+     * @param data the plain data of the chunk
+     * @param iv the initialization vector of the chunk
+     * @param ok set to false in case of an error
+     */
+    QByteArray encryptChunk( const QByteArray &data, const QCA::InitializationVector &iv, bool &ok );
+
+    /**
+     * Decrypt one chunk of the stream.
+     *
+     * @param encrypted the encrypted data of the chunk
+     * @param iv the initialization vector of the chunk
+     * @param ok set to false in case of an error, e.g. a wrong password
+     */
+    QByteArray decryptChunk( const QByteArray &encrypted, const QCA::InitializationVector &iv, bool &ok );
+
+    /**
+     * Create the HMAC of some data, keyed with a key derived from the
+     * encryption key. Checking it tells a wrong key apart from one that
+     * happens to decrypt the data with a valid padding.
+     *
+     * @param data the data to authenticate, usually encrypted
+     */
+    QByteArray authenticate( const QByteArray &data );
     
     /**
-     * Create a list of hashes out of some attributes.
+     * Create a list of keyed hashes out of some attributes. Each hash is the
+     * HMAC of the attribute name followed by a null byte and the attribute
+     * value.
      *
+     * @param hashKey the key of the collection's attribute hashes
      * @param attributes the attributes to create the hashes for
-     * @param hash the hash function to use
      * @returns a list of hashes for each of the attributes
      */
-    QSet<QByteArray> createHashes(const QMap<QString, QString> &attributes);
+    QSet<QByteArray> createHashes(const QByteArray &hashKey, const QMap<QString, QString> &attributes);
 
 private:
+    KSecretEncryptionFilter &operator = ( const KSecretEncryptionFilter& );
+
     /**
      * Set-up the encryption to be used by the secret collection.
      * This creates hash and cipher functors as configured.
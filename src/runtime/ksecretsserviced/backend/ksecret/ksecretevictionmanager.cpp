@@ -0,0 +1,280 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ksecretevictionmanager.h"
+#include "ksecretcollection.h"
+#include <backend/backendmaster.h>
+
+#include <QDebug>
+
+#include <algorithm>
+
+// interval of the checks for the secrets and collections not used
+static const int CHECK_INTERVAL = 5000;
+// time after which a secret not used is dropped from memory
+static const qint64 SECRET_TIMEOUT = 60 * 1000;
+// timeout of the collections closing if unused which have none, as the
+// applications using a collection are not tracked
+static const qint64 DEFAULT_CLOSE_TIMEOUT = 5 * 60 * 1000;
+// size of the decrypted secrets kept in memory, for all the collections
+static const qint64 MAX_RESIDENT_SIZE = 256 * 1024;
+
+typedef QPair<qint64, KSecretItem*> LastUse;
+
+KSecretEvictionManager::KSecretEvictionManager( QObject *parent ) :
+    QObject( parent ),
+    m_residentSize( 0 )
+{
+    m_clock.start();
+    m_timer.setInterval( CHECK_INTERVAL );
+    connect( &m_timer, SIGNAL(timeout()), SLOT(slotTimeout()) );
+}
+
+KSecretEvictionManager::~KSecretEvictionManager()
+{
+}
+
+void KSecretEvictionManager::collectionUsed( KSecretCollection *collection )
+{
+    if ( collection->isLocked() ) {
+        return;
+    }
+    if ( !m_collections.contains( collection ) ) {
+        connect( collection, SIGNAL(destroyed(QObject*)), SLOT(slotCollectionDestroyed(QObject*)) );
+    }
+    m_collections.insert( collection, m_clock.elapsed() );
+    updateTimer();
+}
+
+void KSecretEvictionManager::secretUsed( KSecretCollection *collection, KSecretItem *item, int size )
+{
+    if ( collection->isLocked() ) {
+        return;
+    }
+    ResidentHash::iterator it = m_secrets.find( item );
+    if ( it == m_secrets.end() ) {
+        Resident resident;
+        resident.m_collection = collection;
+        resident.m_size = 0;
+        it = m_secrets.insert( item, resident );
+        connect( item, SIGNAL(destroyed(QObject*)), SLOT(slotItemDestroyed(QObject*)) );
+    }
+    m_residentSize += size - it->m_size;
+    it->m_size = size;
+    it->m_lastUse = m_clock.elapsed();
+    
+    if ( m_residentSize > MAX_RESIDENT_SIZE ) {
+        enforceBudget( item );
+    }
+    updateTimer();
+}
+
+void KSecretEvictionManager::forgetItem( KSecretItem *item )
+{
+    ResidentHash::iterator it = m_secrets.find( item );
+    if ( it != m_secrets.end() ) {
+        eraseSecret( it );
+    }
+}
+
+void KSecretEvictionManager::forgetCollection( KSecretCollection *collection )
+{
+    m_locking.remove( collection );
+    if ( m_collections.remove( collection ) > 0 ) {
+        disconnect( collection, SIGNAL(destroyed(QObject*)), this, SLOT(slotCollectionDestroyed(QObject*)) );
+    }
+    ResidentHash::iterator it = m_secrets.begin();
+    while ( it != m_secrets.end() ) {
+        if ( it->m_collection == collection ) {
+            it = eraseSecret( it );
+        }
+        else {
+            ++it;
+        }
+    }
+    updateTimer();
+}
+
+void KSecretEvictionManager::screenSaverStarted()
+{
+    Q_FOREACH( KSecretCollection *collection, m_collections.keys() ) {
+        if ( m_collections.contains( collection ) && collection->m_secret.m_cfgCloseScreensaver ) {
+            lock( collection );
+        }
+    }
+    Q_FOREACH( KSecretItem *item, m_secrets.keys() ) {
+        evict( item );
+    }
+    updateTimer();
+}
+
+void KSecretEvictionManager::slotTimeout()
+{
+    const qint64 now = m_clock.elapsed();
+    Q_FOREACH( KSecretCollection *collection, m_collections.keys() ) {
+        if ( !m_collections.contains( collection ) || !collection->m_secret.m_cfgCloseIfUnused ) {
+            continue;
+        }
+        qint64 timeout = collection->m_secret.m_cfgCloseUnusedTimeout * Q_INT64_C(1000);
+        if ( timeout == 0 ) {
+            timeout = DEFAULT_CLOSE_TIMEOUT;
+        }
+        if ( now - m_collections.value( collection ) >= timeout ) {
+            lock( collection );
+        }
+    }
+    
+    // the secrets not written yet stay, and are checked again the next time
+    Q_FOREACH( KSecretItem *item, m_secrets.keys() ) {
+        ResidentHash::const_iterator it = m_secrets.constFind( item );
+        if ( it != m_secrets.constEnd() && now - it->m_lastUse >= SECRET_TIMEOUT ) {
+            evict( item );
+        }
+    }
+    updateTimer();
+}
+
+void KSecretEvictionManager::slotCollectionDestroyed( QObject *collection )
+{
+    // the collection is being destroyed, so it's only compared
+    QSet<KSecretCollection*>::iterator locking = m_locking.begin();
+    while ( locking != m_locking.end() ) {
+        if ( static_cast<QObject*>( *locking ) == collection ) {
+            locking = m_locking.erase( locking );
+        }
+        else {
+            ++locking;
+        }
+    }
+    QHash<KSecretCollection*, qint64>::iterator it = m_collections.begin();
+    while ( it != m_collections.end() ) {
+        if ( static_cast<QObject*>( it.key() ) == collection ) {
+            it = m_collections.erase( it );
+        }
+        else {
+            ++it;
+        }
+    }
+    ResidentHash::iterator secret = m_secrets.begin();
+    while ( secret != m_secrets.end() ) {
+        if ( static_cast<QObject*>( secret->m_collection ) == collection ) {
+            // the child items are only deleted after this signal
+            secret = eraseSecret( secret );
+        }
+        else {
+            ++secret;
+        }
+    }
+    updateTimer();
+}
+
+void KSecretEvictionManager::slotItemDestroyed( QObject *item )
+{
+    // the item is being destroyed, so it's only compared
+    ResidentHash::iterator it = m_secrets.begin();
+    while ( it != m_secrets.end() ) {
+        if ( static_cast<QObject*>( it.key() ) == item ) {
+            m_residentSize -= it->m_size;
+            it = m_secrets.erase( it );
+        }
+        else {
+            ++it;
+        }
+    }
+    updateTimer();
+}
+
+bool KSecretEvictionManager::evict( KSecretItem *item )
+{
+    ResidentHash::const_iterator it = m_secrets.constFind( item );
+    if ( it == m_secrets.constEnd() || !it->m_collection->evictSecret( item ) ) {
+        return false;
+    }
+    forgetItem( item );
+    return true;
+}
+
+void KSecretEvictionManager::lock( KSecretCollection *collection )
+{
+    if ( m_locking.contains( collection ) ) {
+        return;
+    }
+    // locking forgets the collection, unless its changes could not be written
+    LockCollectionJob *job = collection->createLockJob();
+    m_locking.insert( collection );
+    connect( job, SIGNAL(result(KJob*)), SLOT(slotLockJobResult(KJob*)) );
+    BackendMaster::instance()->enqueueJob( job );
+}
+
+void KSecretEvictionManager::slotLockJobResult( KJob *job )
+{
+    LockCollectionJob *lcj = qobject_cast<LockCollectionJob*>( job );
+    Q_ASSERT( lcj );
+    KSecretCollection *collection = static_cast<KSecretCollection*>( lcj->collection() );
+    if ( m_locking.remove( collection ) == 0 ) {
+        // locked, which forgot it, or deleted or destroyed meanwhile
+        return;
+    }
+    if ( lcj->isDismissed() || lcj->error() != BackendNoError || !lcj->result() ) {
+        qDebug() << "Cannot close unused collection" << collection->id() << ":" << lcj->errorMessage();
+        // try again after another timeout
+        if ( m_collections.contains( collection ) ) {
+            m_collections.insert( collection, m_clock.elapsed() );
+        }
+    }
+}
+
+void KSecretEvictionManager::enforceBudget( KSecretItem *used )
+{
+    QList<LastUse> secrets;
+    ResidentHash::const_iterator it = m_secrets.constBegin();
+    for ( ; it != m_secrets.constEnd(); ++it ) {
+        if ( it.key() != used ) {
+            secrets.append( LastUse( it->m_lastUse, it.key() ) );
+        }
+    }
+    std::sort( secrets.begin(), secrets.end() );
+    
+    Q_FOREACH( const LastUse &secret, secrets ) {
+        if ( m_residentSize <= MAX_RESIDENT_SIZE ) {
+            break;
+        }
+        evict( secret.second );
+    }
+}
+
+KSecretEvictionManager::ResidentHash::iterator KSecretEvictionManager::eraseSecret( ResidentHash::iterator it )
+{
+    disconnect( it.key(), SIGNAL(destroyed(QObject*)), this, SLOT(slotItemDestroyed(QObject*)) );
+    m_residentSize -= it->m_size;
+    return m_secrets.erase( it );
+}
+
+void KSecretEvictionManager::updateTimer()
+{
+    if ( m_collections.isEmpty() && m_secrets.isEmpty() ) {
+        m_timer.stop();
+    }
+    else if ( !m_timer.isActive() ) {
+        m_timer.start();
+    }
+}
+
+#include "ksecretevictionmanager.moc"
@@ -0,0 +1,155 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef KSECRETEVICTIONMANAGER_H
+#define KSECRETEVICTIONMANAGER_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+
+class KJob;
+class KSecretCollection;
+class KSecretItem;
+
+/**
+ * Bounds the decrypted state the unlocked collections keep in memory, for the
+ * whole daemon.
+ *
+ * It records the last use of each unlocked collection and of each decrypted
+ * secret. The secrets not used for SECRET_TIMEOUT are dropped from memory,
+ * the items and their attribute index staying loaded, and are decrypted again
+ * from the ksecret file when next accessed. When the decrypted secrets exceed
+ * MAX_RESIDENT_SIZE, the least recently used ones are dropped first.
+ *
+ * A collection configured to close if unused is locked once it was not used
+ * for its timeout, by a lock job queued behind the other jobs of the
+ * collection. When the screensaver starts, the collections configured to
+ * close with it are locked and the others drop their secrets.
+ */
+class KSecretEvictionManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit KSecretEvictionManager( QObject *parent = 0 );
+    virtual ~KSecretEvictionManager();
+
+    /**
+     * Note that an unlocked collection was used.
+     */
+    void collectionUsed( KSecretCollection *collection );
+
+    /**
+     * Note that the decrypted secret of an item was used.
+     *
+     * @param size the size of the secret, in bytes
+     */
+    void secretUsed( KSecretCollection *collection, KSecretItem *item, int size );
+
+    /**
+     * Forget an item, as when it's deleted or its secret was dropped.
+     */
+    void forgetItem( KSecretItem *item );
+
+    /**
+     * Forget a collection and its items, as when it's locked or deleted.
+     */
+    void forgetCollection( KSecretCollection *collection );
+
+    /**
+     * Lock the collections configured to close with the screensaver and
+     * drop the secrets of the other ones.
+     */
+    void screenSaverStarted();
+
+private Q_SLOTS:
+    /**
+     * Drop the secrets and lock the collections not used for their timeout.
+     */
+    void slotTimeout();
+
+    void slotCollectionDestroyed( QObject *collection );
+
+    /**
+     * Forget an item deleted without going through forgetItem(), e.g. when
+     * its collection replaced it.
+     */
+    void slotItemDestroyed( QObject *item );
+
+    /**
+     * Try again later to lock a collection whose lock job failed.
+     */
+    void slotLockJobResult( KJob *job );
+
+private:
+    struct Resident {
+        KSecretCollection *m_collection;
+        qint64 m_lastUse;
+        int m_size;             // size of the secret when last used
+    };
+
+    /**
+     * Drop the secret of an item.
+     *
+     * @return false if the secret must stay in memory, as when it was not
+     *         written yet
+     */
+    bool evict( KSecretItem *item );
+
+    /**
+     * Queue a job locking a collection, its changes being written first.
+     */
+    void lock( KSecretCollection *collection );
+
+    /**
+     * Drop the least recently used secrets until the budget is met.
+     *
+     * @param used the secret just used, which is kept
+     */
+    void enforceBudget( KSecretItem *used );
+
+    typedef QHash<KSecretItem*, Resident> ResidentHash;
+
+    /**
+     * Stop tracking a secret.
+     *
+     * @return the iterator to the following secret
+     */
+    ResidentHash::iterator eraseSecret( ResidentHash::iterator it );
+
+    /**
+     * Start the timer if something is tracked, stop it otherwise.
+     */
+    void updateTimer();
+
+    // last use of the unlocked collections
+    QHash<KSecretCollection*, qint64> m_collections;
+    ResidentHash m_secrets;
+    qint64 m_residentSize;
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    // collections a lock job was queued for
+    QSet<KSecretCollection*> m_locking;
+};
+
+#endif // KSECRETEVICTIONMANAGER_H
@@ -27,14 +27,16 @@
 #include <QtCore/QTimer>
 
 KSecretItem::KSecretItem() :
-    BackendItem( 0 )
+    BackendItem( 0 ), m_secretLoaded( true ), m_secretPosition( 0 ), m_secretLength( 0 ),
+    m_secretStored( false ), m_secretVersion( 0 )
 {
     m_created = QDateTime::currentDateTimeUtc();
     m_modified = m_created;
 }
 
 KSecretItem::KSecretItem(const QString &id, KSecretCollection *parent)
-    : BackendItem(parent), m_id(id)
+    : BackendItem(parent), m_id(id), m_secretLoaded(true), m_secretPosition(0), m_secretLength(0),
+      m_secretStored(false), m_secretVersion(0)
 {
     Q_ASSERT(parent);
     m_created = QDateTime::currentDateTimeUtc();
@@ -76,6 +78,9 @@ BackendReturn<QCA::SecureArray> KSecretItem::secret() const
     if(isLocked()) {
         return BackendReturn<QCA::SecureArray>(QCA::SecureArray(), BackendErrorIsLocked);
     } else {
+        if(!loadSecret()) {
+            return BackendReturn<QCA::SecureArray>(QCA::SecureArray(), BackendErrorOther);
+        }
         markAsUsed();
         return BackendReturn<QCA::SecureArray>( m_secret );
     }
@@ -87,6 +92,10 @@ BackendReturn<void> KSecretItem::setSecret(const QCA::SecureArray &secret)
         return BackendReturn<void>(BackendErrorIsLocked);
     } else {
         m_secret = secret;
+        m_secretLoaded = true;
+        m_secretStored = false;
+        m_secretVersion++;
+        markAsUsed();
         markAsModified();
         return BackendReturn<void>();
     }
@@ -207,8 +216,20 @@ void KSecretItem::markAsModified()
 
 void KSecretItem::markAsUsed() const
 {
-    // TODO: figure out what to do. this method exists so a "close-if-unused" timer
-    //       can be implemented.
+    KSecretCollection *collection = qobject_cast<KSecretCollection*>(m_collection);
+    if(collection) {
+        collection->markAsUsed(this);
+    }
+}
+
+bool KSecretItem::loadSecret() const
+{
+    if(m_secretLoaded) {
+        return true;
+    }
+    KSecretCollection *collection = qobject_cast<KSecretCollection*>(m_collection);
+    Q_ASSERT(collection);
+    return collection->loadSecret(const_cast<KSecretItem*>(this));
 }
 
 KSecretStream& operator<<(KSecretStream& out, KSecretItem* item )
@@ -218,6 +239,8 @@ KSecretStream& operator<<(KSecretStream& out, KSecretItem* item )
     out << item->m_created;
     out << item->m_modified;
     out << item->m_attributes;
+    // the caller loads the secret first, @see KSecretItem::loadSecret
+    Q_ASSERT(item->m_secretLoaded);
     out << item->m_secret;
     out << item->m_contentType;
     return out;
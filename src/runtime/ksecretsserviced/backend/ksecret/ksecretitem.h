@@ -169,15 +169,6 @@ Q_SIGNALS:
      */
     void itemUsed(BackendItem *item);
 
-    /**
-     * This signal is emitted when an item's attributes change so the
-     * collection can rebuild the attribute lookup hashes related to this
-     * item.
-     *
-     * @param item Item whose attributes changed
-     */
-    void attributesChanged(KSecretItem *item);
-
 private:
     friend class KSecretCollection;
     friend class KSecretDeleteItemJob;
@@ -191,10 +182,19 @@ private:
     void markAsModified();
 
     /**
-     * Mark this item as used and emit the \sa itemUsed signal.
+     * Mark this item as used, which keeps its collection open and its secret
+     * in memory.
      */
     void markAsUsed() const;
 
+    /**
+     * Make sure the secret is in memory, as the secrets of the items read
+     * from a ksecret file are only decrypted when first accessed.
+     *
+     * @return false if the secret could not be read
+     */
+    bool loadSecret() const;
+
 //     KSecretCollection *m_collection;
 
     QString m_id;
@@ -205,6 +205,17 @@ private:
 
     QCA::SecureArray m_secret;
     QString m_contentType;
+
+    // false until the secret is read from the part the file stores it in
+    bool m_secretLoaded;
+    quint32 m_secretPosition;
+    quint32 m_secretLength;
+    // true if that part holds the current secret, which may then be dropped
+    // from memory and read again, @see KSecretEvictionManager
+    bool m_secretStored;
+    // incremented with each change of the secret, so a write in the
+    // background tells whether it stored the current secret
+    quint32 m_secretVersion;
 };
 
 KSecretStream& operator << ( KSecretStream &out, KSecretItem* );
@@ -137,8 +137,10 @@ KSecretUnlockCollectionJob::KSecretUnlockCollectionJob(const CollectionUnlockInf
     : UnlockCollectionJob(unlockInfo, coll), 
     m_firstTry(true), 
     m_passwordAsked(false), 
+    m_passwordEntered(false),
     m_collectionPerm(PermissionUndefined)
 {
+    connect(&m_keyWatcher, SIGNAL(finished()), SLOT(keyDerived()));
 }
 
 bool KSecretUnlockCollectionJob::isImmediate() const
@@ -174,13 +176,16 @@ void KSecretUnlockCollectionJob::start()
             break;
         case PermissionAllow: {
                 KSecretCollection *ksecretColl = dynamic_cast< KSecretCollection* >(collection());
-                if ( ksecretColl->tryUnlock().isError() ) {
-                    createAskPasswordJob();
-                }
-                else {
+                if ( ksecretColl->tryUnlock().value() ) {
                     setResult(true);
                     emitResult();
                 }
+                else {
+                    // try the default password before asking for one
+                    m_passwordEntered = false;
+                    m_password = QCA::SecureArray();
+                    m_keyWatcher.setFuture( ksecretColl->deriveKey( m_password ) );
+                }
             }
             break;
         case PermissionUndefined:
@@ -270,8 +275,30 @@ void KSecretUnlockCollectionJob::askPasswordJobResult(KJob *job)
         return;
     }
 
+    // the key is derived in a worker thread, \sa keyDerived continues
     KSecretCollection *ksecretColl = dynamic_cast< KSecretCollection* >(collection());
-    BackendReturn<bool> rc = ksecretColl->tryUnlockPassword(apj->password());
+    m_passwordEntered = true;
+    m_password = apj->password();
+    m_keyWatcher.setFuture( ksecretColl->deriveKey( m_password ) );
+}
+
+void KSecretUnlockCollectionJob::keyDerived()
+{
+    KSecretCollection *ksecretColl = dynamic_cast< KSecretCollection* >(collection());
+    BackendReturn<bool> rc = ksecretColl->tryUnlockKey( m_password, m_keyWatcher.result() );
+    m_password = QCA::SecureArray();
+    if ( !m_passwordEntered ) {
+        // the default password didn't work, so ask the user for the actual one
+        if ( rc.isError() || !rc.value() ) {
+            createAskPasswordJob();
+        }
+        else {
+            setResult(true);
+            emitResult();
+        }
+        return;
+    }
+
     if(rc.isError()) {
         setResult(false);
         setError(rc.error(), rc.errorMessage());
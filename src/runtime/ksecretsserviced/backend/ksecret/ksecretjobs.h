@@ -29,6 +29,7 @@
 #include <backend/backendjob.h>
 #include <ui/abstractuijobs.h>
 
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QPointer>
 
 /**
@@ -71,14 +72,20 @@ protected:
 private Q_SLOTS:
     void askPasswordJobResult(KJob *job);
     void askAclPrefsJobResult(KJob *job);
+    void keyDerived();
 
 private:
     void createAskPasswordJob();
 
     bool    m_firstTry;
     bool    m_passwordAsked;
+    bool    m_passwordEntered;      // the key being derived is the one of the entered password
+    QCA::SecureArray
+            m_password;             // the password of the key being derived
     ApplicationPermission   
             m_collectionPerm;
+    QFutureWatcher<QCA::SymmetricKey>
+            m_keyWatcher;           // the key derivation running in a worker thread
 };
 
 /**
@@ -0,0 +1,143 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ksecretjournal.h"
+
+#include <QtCore/QDataStream>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QDebug>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define KSECRET_JOURNAL_MAGIC "KSECRETJ\n\r\r\n"
+#define KSECRET_JOURNAL_MAGIC_LEN 12
+
+QString KSecretJournal::path( const QString &collectionPath )
+{
+    return collectionPath + QStringLiteral( ".journal" );
+}
+
+qint64 KSecretJournal::read( const QString &collectionPath, const QByteArray &generation, QList<Segment> &segments )
+{
+    segments.clear();
+    QFile file( path( collectionPath ) );
+    if ( !file.open( QIODevice::ReadOnly ) ) {
+        return 0;
+    }
+    // the journal is kept small by the full writes, so it's read at once
+    const QByteArray contents = file.readAll();
+    if ( !contents.startsWith( QByteArray( KSECRET_JOURNAL_MAGIC, KSECRET_JOURNAL_MAGIC_LEN ) ) ) {
+        qDebug() << "Ignoring invalid journal of " << collectionPath;
+        return 0;
+    }
+
+    QDataStream stream( contents );
+    stream.skipRawData( KSECRET_JOURNAL_MAGIC_LEN );
+    QByteArray journalGeneration;
+    stream >> journalGeneration;
+    if ( stream.status() != QDataStream::Ok || journalGeneration != generation ) {
+        qDebug() << "Ignoring stale journal of " << collectionPath;
+        return 0;
+    }
+
+    qint64 validSize = stream.device()->pos();
+    while ( !stream.atEnd() ) {
+        quint32 length;
+        stream >> length;
+        qint64 start = stream.device()->pos();
+        if ( stream.status() != QDataStream::Ok || length > contents.size() - start ) {
+            break;
+        }
+
+        QDataStream segmentStream( contents.mid( start, length ) );
+        Segment segment;
+        QByteArray initVector;
+        segmentStream >> segment.m_publicDelta >> initVector >> segment.m_secretDelta;
+        if ( segmentStream.status() != QDataStream::Ok ) {
+            break;
+        }
+        segment.m_initVector = QCA::InitializationVector( initVector );
+        segments.append( segment );
+
+        stream.skipRawData( length );
+        validSize = start + length;
+    }
+    if ( validSize < contents.size() ) {
+        qDebug() << "Ignoring the incomplete end of the journal of " << collectionPath;
+    }
+    return validSize;
+}
+
+bool KSecretJournal::append( const QString &collectionPath, const QByteArray &generation, const Segment &segment, qint64 &size )
+{
+    QByteArray payload;
+    QDataStream payloadStream( &payload, QIODevice::WriteOnly );
+    payloadStream << segment.m_publicDelta << segment.m_initVector.toByteArray() << segment.m_secretDelta;
+
+    QByteArray data;
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    if ( size == 0 ) {
+        stream.writeRawData( KSECRET_JOURNAL_MAGIC, KSECRET_JOURNAL_MAGIC_LEN );
+        stream << generation;
+    }
+    stream << (quint32)payload.size();
+    stream.writeRawData( payload.constData(), payload.size() );
+
+    QFile file( path( collectionPath ) );
+    if ( !file.open( QIODevice::ReadWrite ) ) {
+        qDebug() << "Cannot open the journal of " << collectionPath;
+        return false;
+    }
+    // drop what follows the valid segments, e.g. a stale journal or an incomplete segment
+    if ( ( file.size() != size && !file.resize( size ) ) || !file.seek( size ) ) {
+        return false;
+    }
+    // the change is only acknowledged once on disk, flush() only hands it to the kernel
+    if ( file.write( data ) != data.size() || !file.flush() || fdatasync( file.handle() ) == -1 ) {
+        qDebug() << "Cannot append to the journal of " << collectionPath;
+        file.resize( size );
+        return false;
+    }
+    if ( size == 0 && !syncDirectory( file.fileName() ) ) {
+        qDebug() << "Cannot sync the directory of the journal of " << collectionPath;
+        return false;
+    }
+    size += data.size();
+    return true;
+}
+
+bool KSecretJournal::syncDirectory( const QString &filePath )
+{
+    // a new journal could otherwise vanish along with its directory entry
+    int fd = ::open( QFile::encodeName( QFileInfo( filePath ).absolutePath() ).constData(), O_RDONLY | O_DIRECTORY );
+    if ( fd == -1 ) {
+        return false;
+    }
+    bool synced = fsync( fd ) == 0;
+    ::close( fd );
+    return synced;
+}
+
+void KSecretJournal::remove( const QString &collectionPath )
+{
+    QFile::remove( path( collectionPath ) );
+}
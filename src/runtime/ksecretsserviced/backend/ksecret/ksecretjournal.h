@@ -0,0 +1,90 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef KSECRETJOURNAL_H
+#define KSECRETJOURNAL_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <qca_core.h>
+
+/**
+ * Journal of the changes made to a ksecret file since it was last written in full.
+ *
+ * Each sync of a collection appends one segment holding the changed items and
+ * collection data, so its cost follows the size of the changes instead of the
+ * size of the collection. The collection gets written in full again once the
+ * journal grows too large, which empties the journal.
+ *
+ * The journal starts with the generation of the ksecret file it belongs to, a
+ * random value written along with each full write. A journal of another
+ * generation is stale, as when a crash happened between writing the ksecret
+ * file and removing its journal, and it's ignored.
+ *
+ * journal         = magic generation *segment
+ * segment         = segment-length public-delta init-vector ENCRYPT{ secret-delta }
+ *
+ * The public delta holds the changes to the unencrypted part of the collection,
+ * so they are known while it's locked.
+ */
+class KSecretJournal
+{
+public:
+    struct Segment {
+        QByteArray m_publicDelta;
+        QCA::InitializationVector m_initVector;
+        QByteArray m_secretDelta; // encrypted
+    };
+
+    /**
+     * The path of the journal of the given ksecret file
+     */
+    static QString path( const QString &collectionPath );
+
+    /**
+     * Read the segments of the journal of the given ksecret file. Reading stops at
+     * the first incomplete segment, which a crash while appending may leave.
+     *
+     * @param generation the generation of the ksecret file
+     * @return the size of the journal, or 0 if there is no journal or if it is stale
+     */
+    static qint64 read( const QString &collectionPath, const QByteArray &generation, QList<Segment> &segments );
+
+    /**
+     * Append a segment to the journal of the given ksecret file.
+     *
+     * @param generation the generation of the ksecret file
+     * @param size the current size of the journal, as returned by read() or a previous
+     *             append(). The journal is started over if it's 0. Updated on success
+     * @return true once the segment is synced to disk, false if it could not be written
+     */
+    static bool append( const QString &collectionPath, const QByteArray &generation, const Segment &segment, qint64 &size );
+
+    /**
+     * Remove the journal of the given ksecret file, once it was written in full
+     */
+    static void remove( const QString &collectionPath );
+
+private:
+    static bool syncDirectory( const QString &filePath );
+};
+
+#endif // KSECRETJOURNAL_H
@@ -0,0 +1,132 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ksecretkeycache.h"
+#include <backend/backendmaster.h>
+
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QFutureInterface>
+#include <QtCore/QMutexLocker>
+#include <QtEndian>
+
+Q_GLOBAL_STATIC(KSecretKeyCache, s_keyCache)
+
+// number of PBKDF2 iterations, which must not be changed or else file compatibility is gone!
+static const int KEY_DERIVATION_ITERATIONS = 10000;
+// number of keys kept, which is the number of distinct passwords in use
+static const int MAX_KEYS = 8;
+
+// create a symmetric encryption key from a user-supplied password using
+// PBKDF2.
+// Returns a zero-length key if creating the key failed.
+static QCA::SymmetricKey createKeyFromPassword(const QCA::SecureArray &password,
+        const QCA::InitializationVector &salt, int keyLength)
+{
+    QCA::PBKDF2 deriv( QStringLiteral( "sha1" ) );
+    return deriv.makeKey(password, salt, keyLength, KEY_DERIVATION_ITERATIONS);
+}
+
+KSecretKeyCache::KSecretKeyCache()
+    : m_idKey( 32 )
+{
+}
+
+KSecretKeyCache *KSecretKeyCache::instance()
+{
+    return s_keyCache;
+}
+
+QFuture<QCA::SymmetricKey> KSecretKeyCache::derive( const QCA::SecureArray &password,
+                                                    const QCA::InitializationVector &salt, int keyLength )
+{
+    const QByteArray id = idOf( password, salt, keyLength );
+    
+    QMutexLocker locker( &m_mutex );
+    QHash<QByteArray, QCA::SymmetricKey>::const_iterator key = m_keys.constFind( id );
+    if ( key != m_keys.constEnd() ) {
+        m_recent.removeOne( id );
+        m_recent.append( id );
+        QFutureInterface<QCA::SymmetricKey> done;
+        done.reportStarted();
+        done.reportFinished( &key.value() );
+        return done.future();
+    }
+    
+    QHash<QByteArray, QFuture<QCA::SymmetricKey> >::const_iterator pending = m_pending.constFind( id );
+    if ( pending != m_pending.constEnd() ) {
+        return pending.value();
+    }
+    
+    // somebody waits for the key, so the derivation doesn't queue behind the writes
+    QThreadPool *pool = BackendMaster::instance()->threadPool( BackendJob::PriorityInteractive );
+    QFuture<QCA::SymmetricKey> future = QtConcurrent::run( pool, &KSecretKeyCache::runDerivation, this, id,
+                                                           password, salt, keyLength );
+    m_pending.insert( id, future );
+    return future;
+}
+
+void KSecretKeyCache::insert( const QCA::SecureArray &password, const QCA::InitializationVector &salt,
+                              int keyLength, const QCA::SymmetricKey &key )
+{
+    if ( key.isEmpty() ) {
+        return;
+    }
+    const QByteArray id = idOf( password, salt, keyLength );
+    
+    QMutexLocker locker( &m_mutex );
+    m_recent.removeOne( id );
+    m_recent.append( id );
+    m_keys.insert( id, key );
+    while ( m_recent.size() > MAX_KEYS ) {
+        m_keys.remove( m_recent.takeFirst() );
+    }
+}
+
+void KSecretKeyCache::clear()
+{
+    QMutexLocker locker( &m_mutex );
+    m_keys.clear();
+    m_recent.clear();
+}
+
+QByteArray KSecretKeyCache::idOf( const QCA::SecureArray &password, const QCA::InitializationVector &salt,
+                                  int keyLength ) const
+{
+    // a plain hash of the password could be checked against guesses, the HMAC can't without the secret
+    QCA::MessageAuthenticationCode hmac( QStringLiteral( "hmac(sha256)" ), m_idKey );
+    QByteArray length( sizeof( quint32 ), '\0' );
+    qToBigEndian<quint32>( keyLength, reinterpret_cast<uchar*>( length.data() ) );
+    hmac.update( length );
+    hmac.update( salt );
+    hmac.update( password );
+    return hmac.final().toByteArray();
+}
+
+QCA::SymmetricKey KSecretKeyCache::runDerivation( KSecretKeyCache *cache, const QByteArray &id,
+                                                  const QCA::SecureArray &password,
+                                                  const QCA::InitializationVector &salt, int keyLength )
+{
+    QCA::SymmetricKey key = createKeyFromPassword( password, salt, keyLength );
+    
+    // the key is only kept once it unlocked a collection, \sa insert
+    QMutexLocker locker( &cache->m_mutex );
+    cache->m_pending.remove( id );
+    return key;
+}
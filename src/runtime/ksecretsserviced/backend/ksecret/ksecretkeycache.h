@@ -0,0 +1,103 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef KSECRETKEYCACHE_H
+#define KSECRETKEYCACHE_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QFuture>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <qca_core.h>
+
+/**
+ * Derives the keys of the ksecret collections from their passwords, in a
+ * worker thread, and keeps the ones which unlocked a collection.
+ *
+ * The PBKDF2 derivation is made slow on purpose, so a (password, salt) pair
+ * which proved right is not derived again: the collections sharing the login
+ * password are unlocked with one derivation, and the requests made while a
+ * derivation runs share its result. The keys of wrong passwords are not
+ * kept. At most MAX_KEYS keys are kept, the least recently used ones being
+ * dropped first, and all of them are dropped when a collection is locked or
+ * the screensaver starts.
+ *
+ * The keys are held as QCA::SymmetricKey, in QCA's locked memory. They are
+ * looked up by an HMAC of the password and salt, keyed with a random secret
+ * of the process, so the passwords are not kept and the lookup ids do not
+ * allow guessing them should they leak, e.g. to swap.
+ */
+class KSecretKeyCache
+{
+public:
+    KSecretKeyCache();
+
+    /**
+     * Get the cache of the daemon.
+     */
+    static KSecretKeyCache *instance();
+
+    /**
+     * Get the key derived from a password. The returned future is already
+     * finished when the key is in the cache.
+     *
+     * @param password the password to derive the key from
+     * @param salt the salt of the derivation
+     * @param keyLength the length of the key, in bytes
+     * @return the key, which is empty if the derivation failed
+     */
+    QFuture<QCA::SymmetricKey> derive( const QCA::SecureArray &password,
+                                       const QCA::InitializationVector &salt, int keyLength );
+
+    /**
+     * Keep a key returned by derive() once it unlocked a collection.
+     */
+    void insert( const QCA::SecureArray &password, const QCA::InitializationVector &salt,
+                 int keyLength, const QCA::SymmetricKey &key );
+
+    /**
+     * Drop all the keys kept.
+     */
+    void clear();
+
+private:
+    /**
+     * Get the lookup id of a (password, salt, key length) triple.
+     */
+    QByteArray idOf( const QCA::SecureArray &password, const QCA::InitializationVector &salt,
+                     int keyLength ) const;
+
+    static QCA::SymmetricKey runDerivation( KSecretKeyCache *cache, const QByteArray &id,
+                                            const QCA::SecureArray &password,
+                                            const QCA::InitializationVector &salt, int keyLength );
+
+    // keys the ids of the cached keys, never leaves the process
+    const QCA::SymmetricKey m_idKey;
+    QMutex m_mutex;
+    // the keys by HMAC of their password, salt and length
+    QHash<QByteArray, QCA::SymmetricKey> m_keys;
+    // the ids of the kept keys, the least recently used first
+    QList<QByteArray> m_recent;
+    // the derivations running
+    QHash<QByteArray, QFuture<QCA::SymmetricKey> > m_pending;
+};
+
+#endif // KSECRETKEYCACHE_H
@@ -24,13 +24,15 @@
 #include "ksecretitem.h"
 
 KSecretStream::KSecretStream( QIODevice *device ) :
-    QDataStream( device )
+    QDataStream( device ),
+    m_formatVersion( 1 )
 {
 }
 
 bool KSecretStream::isValid() const
 {
-    return true;
+    // the device fails the reads of chunks it can't decrypt
+    return status() == QDataStream::Ok;
 }
 
 KSecretStream &KSecretStream::operator << ( const bool& b )
@@ -34,6 +34,13 @@ public:
 
     bool isValid() const;
     
+    /**
+     * The format version of the ksecret file being read or written, which
+     * tells the parts the file holds. @see KSecretDevice::formatVersion()
+     */
+    quint32 formatVersion() const { return m_formatVersion; }
+    void setFormatVersion( quint32 version ) { m_formatVersion = version; }
+    
     KSecretStream &operator << ( const bool& );
     KSecretStream &operator >> ( bool& );
     
@@ -56,6 +63,9 @@ public:
         
     KSecretStream &operator << ( const QCA::SecureArray& );
     KSecretStream &operator >> ( QCA::SecureArray& );
+
+private:
+    quint32 m_formatVersion;
 };
 
 #endif // KSECRETSTREAM_H
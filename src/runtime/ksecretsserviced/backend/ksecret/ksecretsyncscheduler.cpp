@@ -0,0 +1,208 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ksecretsyncscheduler.h"
+#include "ksecretcollection.h"
+
+#include <QtCore/QCoreApplication>
+#include <QDebug>
+
+// delay between the first change of a collection and its write
+static const qint64 SYNC_DELAY = 3000;
+// time without any use after which the daemon is considered idle
+static const qint64 IDLE_DELAY = 500;
+// longest time a change waits for the daemon to be idle
+static const qint64 MAX_STALENESS = 30000;
+// delay before retrying a failed write, doubled with each failure
+static const qint64 RETRY_DELAY = 1000;
+static const qint64 MAX_RETRY_DELAY = 5 * 60 * 1000;
+
+KSecretSyncScheduler::KSecretSyncScheduler( QObject *parent ) :
+    QObject( parent ),
+    m_lastActivity( 0 ),
+    m_flushCount( 0 ),
+    m_failureCount( 0 ),
+    m_lastFlushLatency( 0 ),
+    m_maxFlushLatency( 0 )
+{
+    m_clock.start();
+    m_timer.setSingleShot( true );
+    connect( &m_timer, SIGNAL(timeout()), SLOT(slotTimeout()) );
+    if ( QCoreApplication::instance() ) {
+        connect( QCoreApplication::instance(), SIGNAL(aboutToQuit()), SLOT(flushAll()) );
+    }
+}
+
+KSecretSyncScheduler::~KSecretSyncScheduler()
+{
+}
+
+void KSecretSyncScheduler::schedule( KSecretCollection *collection )
+{
+    if ( m_queue.contains( collection ) ) {
+        return;
+    }
+    
+    Entry entry;
+    entry.m_changedAt = m_clock.elapsed();
+    entry.m_dueAt = entry.m_changedAt + SYNC_DELAY;
+    entry.m_failures = 0;
+    entry.m_writing = false;
+    m_queue.insert( collection, entry );
+    connect( collection, SIGNAL(destroyed(QObject*)), SLOT(slotCollectionDestroyed(QObject*)) );
+    restartTimer();
+}
+
+void KSecretSyncScheduler::unschedule( KSecretCollection *collection )
+{
+    if ( m_queue.remove( collection ) > 0 ) {
+        disconnect( collection, SIGNAL(destroyed(QObject*)), this, SLOT(slotCollectionDestroyed(QObject*)) );
+        restartTimer();
+    }
+}
+
+void KSecretSyncScheduler::noteActivity()
+{
+    m_lastActivity = m_clock.elapsed();
+}
+
+void KSecretSyncScheduler::flushAll()
+{
+    Q_FOREACH( KSecretCollection *collection, m_queue.keys() ) {
+        if ( m_queue.contains( collection ) && !m_queue.value( collection ).m_writing ) {
+            flush( collection );
+        }
+    }
+    Q_FOREACH( KSecretCollection *collection, m_queue.keys() ) {
+        if ( m_queue.contains( collection ) && m_queue.value( collection ).m_writing ) {
+            collection->waitForSync();
+        }
+    }
+    restartTimer();
+}
+
+void KSecretSyncScheduler::slotTimeout()
+{
+    const qint64 now = m_clock.elapsed();
+    QList<KSecretCollection*> due;
+    bool stale = false;
+    QHash<KSecretCollection*, Entry>::const_iterator it = m_queue.constBegin();
+    for ( ; it != m_queue.constEnd(); ++it ) {
+        if ( !it->m_writing && it->m_dueAt <= now ) {
+            due.append( it.key() );
+            // retries keep their backoff, whatever their staleness
+            stale = stale || ( it->m_failures == 0 && now - it->m_changedAt >= MAX_STALENESS );
+        }
+    }
+    
+    if ( !due.isEmpty() ) {
+        if ( stale || now - m_lastActivity >= IDLE_DELAY ) {
+            Q_FOREACH( KSecretCollection *collection, due ) {
+                flush( collection );
+            }
+            qDebug() << "Writing" << due.size() << "collections," << m_queue.size() << "queued,"
+                     << m_flushCount << "written and" << m_failureCount << "failed so far,"
+                     << "flush latency" << m_lastFlushLatency << "ms, at most" << m_maxFlushLatency << "ms";
+        }
+        else {
+            // check again once the daemon may be idle
+            m_timer.start( IDLE_DELAY - ( now - m_lastActivity ) );
+            return;
+        }
+    }
+    restartTimer();
+}
+
+void KSecretSyncScheduler::slotCollectionDestroyed( QObject *collection )
+{
+    // the collection is being destroyed, so it's only compared
+    QHash<KSecretCollection*, Entry>::iterator it = m_queue.begin();
+    while ( it != m_queue.end() ) {
+        if ( static_cast<QObject*>( it.key() ) == collection ) {
+            it = m_queue.erase( it );
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void KSecretSyncScheduler::flush( KSecretCollection *collection )
+{
+    QHash<KSecretCollection*, Entry>::iterator it = m_queue.find( collection );
+    if ( it == m_queue.end() ) {
+        return;
+    }
+    it->m_writing = true;
+    // this may call syncFinished right away
+    collection->sync();
+}
+
+void KSecretSyncScheduler::syncFinished( KSecretCollection *collection, bool ok )
+{
+    QHash<KSecretCollection*, Entry>::iterator it = m_queue.find( collection );
+    if ( it == m_queue.end() ) {
+        return;
+    }
+    
+    if ( ok ) {
+        const qint64 changedAt = it->m_changedAt;
+        m_queue.erase( it );
+        disconnect( collection, SIGNAL(destroyed(QObject*)), this, SLOT(slotCollectionDestroyed(QObject*)) );
+        m_flushCount++;
+        m_lastFlushLatency = m_clock.elapsed() - changedAt;
+        m_maxFlushLatency = qMax( m_maxFlushLatency, m_lastFlushLatency );
+        // the changes made during a background write are scheduled again
+        if ( collection->m_dirty ) {
+            schedule( collection );
+        }
+    }
+    else {
+        m_failureCount++;
+        it->m_writing = false;
+        it->m_failures++;
+        qint64 delay = RETRY_DELAY << qMin( it->m_failures - 1, 16 );
+        it->m_dueAt = m_clock.elapsed() + qMin( delay, MAX_RETRY_DELAY );
+        qDebug() << "Cannot write collection" << collection->id() << ", retrying later";
+    }
+    restartTimer();
+}
+
+void KSecretSyncScheduler::restartTimer()
+{
+    if ( m_queue.isEmpty() ) {
+        m_timer.stop();
+        return;
+    }
+    
+    qint64 next = -1;
+    Q_FOREACH( const Entry &entry, m_queue ) {
+        if ( !entry.m_writing && ( next < 0 || entry.m_dueAt < next ) ) {
+            next = entry.m_dueAt;
+        }
+    }
+    if ( next < 0 ) {
+        m_timer.stop();
+        return;
+    }
+    m_timer.start( qMax<qint64>( 0, next - m_clock.elapsed() ) );
+}
+
+#include "ksecretsyncscheduler.moc"
@@ -0,0 +1,126 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef KSECRETSYNCSCHEDULER_H
+#define KSECRETSYNCSCHEDULER_H
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QObject>
+#include <QtCore/QTimer>
+
+class KSecretCollection;
+
+/**
+ * Schedules the writes of the changed collections to disk for the whole daemon.
+ *
+ * A changed collection is written once it stayed unwritten for SYNC_DELAY, so
+ * the changes following each other get written together. The collections due
+ * at the same time are written in one batch, which waits for the daemon to be
+ * idle, that is for no collection or item to have been used for IDLE_DELAY.
+ * A collection waits no longer than MAX_STALENESS for that. A failed write is
+ * retried with an exponential backoff.
+ *
+ * All the changes are written when the daemon quits, and the collection
+ * manager asks for them when the screensaver starts.
+ *
+ * The queue depth, the number of writes and failed writes, and the time
+ * between the change of a collection and its write are reported in the debug
+ * output along with each batch.
+ */
+class KSecretSyncScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit KSecretSyncScheduler( QObject *parent = 0 );
+    virtual ~KSecretSyncScheduler();
+
+    /**
+     * Schedule the write of a changed collection. It's a no-op if the
+     * collection is already scheduled.
+     */
+    void schedule( KSecretCollection *collection );
+
+    /**
+     * Forget a collection, as when it was written or deleted by other means.
+     */
+    void unschedule( KSecretCollection *collection );
+
+    /**
+     * Note that a collection or an item was used, so the daemon is not idle.
+     */
+    void noteActivity();
+
+    /**
+     * Called by a collection once the write the scheduler asked for is done,
+     * which is later on for the writes done in the background.
+     *
+     * @param ok false if the collection could not be written
+     */
+    void syncFinished( KSecretCollection *collection, bool ok );
+
+public Q_SLOTS:
+    /**
+     * Write all the scheduled collections now, whatever their backoff, and
+     * wait for the writes done in the background.
+     */
+    void flushAll();
+
+private Q_SLOTS:
+    /**
+     * Write the collections which are due, if the daemon is idle or if one
+     * of them waited for too long.
+     */
+    void slotTimeout();
+
+    void slotCollectionDestroyed( QObject *collection );
+
+private:
+    struct Entry {
+        qint64 m_changedAt;   // time of the first unwritten change
+        qint64 m_dueAt;       // time the collection may be written
+        int m_failures;       // consecutive failed writes
+        bool m_writing;       // waiting for syncFinished
+    };
+
+    /**
+     * Start writing one collection.
+     */
+    void flush( KSecretCollection *collection );
+
+    /**
+     * Restart the timer for the next due collection, not being written.
+     */
+    void restartTimer();
+
+    QHash<KSecretCollection*, Entry> m_queue;
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_lastActivity;
+
+    // reported in the debug output
+    quint64 m_flushCount;
+    quint64 m_failureCount;
+    qint64 m_lastFlushLatency;    // time between a change and its write, in ms
+    qint64 m_maxFlushLatency;
+};
+
+#endif // KSECRETSYNCSCHEDULER_H
@@ -76,17 +76,16 @@ bool TemporaryCollection::isLocked() const
 
 BackendReturn<QList<BackendItem*> > TemporaryCollection::items() const
 {
-    return BackendReturn<QList<BackendItem*> >( m_items );
+    return BackendReturn<QList<BackendItem*> >( m_items.values() );
 }
 
 BackendReturn<QList<BackendItem*> > TemporaryCollection::searchItems(
     const QMap<QString, QString> &attributes) const
 {
-    TemporaryItem *titem;
     QList<BackendItem*> foundItems;
-    Q_FOREACH(BackendItem * item, m_items) {
-        titem = qobject_cast<TemporaryItem*>(item);
-        if(titem && titem->matches(attributes)) {
+    Q_FOREACH(const QString & id, m_attributeIndex.search(attributes)) {
+        BackendItem *item = m_items.value(id);
+        if(item) {
             foundItems.append(item);
         }
     }
@@ -157,13 +156,15 @@ BackendReturn<BackendItem*> TemporaryCollection::createItem(const QString &label
     item->setSecret(secret);
     item->setContentType(contentType);
     item->blockSignals(false);
+    m_attributeIndex.insert(item->id(), attributes);
 
     if(replacing) {
         emit itemChanged(item);
     } else {
-        m_items.append(item);
+        m_items.insert(item->id(), item);
         // new item, signals need to be wired
         connect(item, SIGNAL(itemDeleted(BackendItem*)), SLOT(slotItemDeleted(BackendItem*)));
+        connect(item, SIGNAL(attributesChanged(BackendItem*)), SLOT(slotAttributesChanged(BackendItem*)));
         connect(item, SIGNAL(itemChanged(BackendItem*)), SIGNAL(itemChanged(BackendItem*)));
         emit itemCreated(item);
     }
@@ -178,10 +179,16 @@ ChangeAuthenticationCollectionJob *TemporaryCollection::createChangeAuthenticati
 
 void TemporaryCollection::slotItemDeleted(BackendItem *item)
 {
-    m_items.removeAll(item);
+    m_items.remove(item->id());
+    m_attributeIndex.remove(item->id());
     emit itemDeleted(item);
 }
 
+void TemporaryCollection::slotAttributesChanged(BackendItem *item)
+{
+    m_attributeIndex.insert(item->id(), item->attributes().value());
+}
+
 void TemporaryCollection::deleteCollectionJobResult(KJob *job)
 {
     TemporaryDeleteCollectionJob *dcj = qobject_cast<TemporaryDeleteCollectionJob*>(job);
@@ -22,6 +22,7 @@
 #define TEMPORARYCOLLECTION_H
 
 #include "../backendcollection.h"
+#include "../attributeindex.h"
 
 // forward declarations
 class TemporaryCreateItemJob;
@@ -187,6 +188,13 @@ private Q_SLOTS:
      */
     void slotItemDeleted(BackendItem *item);
 
+    /**
+     * Update the attribute index when an item's attributes change.
+     *
+     * @param item Item whose attributes changed
+     */
+    void slotAttributesChanged(BackendItem *item);
+
     /**
      * Called when a DeleteCollectionJob signals its result.
      *
@@ -203,7 +211,9 @@ private:
     QDateTime m_modified;
     QString m_creator;
 
-    QList<BackendItem*> m_items;
+    // maps item identifiers to items
+    QHash<QString, BackendItem*> m_items;
+    AttributeIndex m_attributeIndex;
 };
 
 #endif
@@ -86,6 +86,7 @@ BackendReturn<void> TemporaryItem::setAttributes(const QMap<QString, QString> &a
 {
     m_attributes = attributes;
     markAsModified();
+    emit attributesChanged(this);
     return BackendReturn<void>();
 }
 
@@ -0,0 +1,87 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "attributeindextest.h"
+
+#include <QtTest/QtTest>
+
+#include <attributeindex.h>
+
+static QMap<QString, QString> attributes(const QString &service, const QString &user)
+{
+    QMap<QString, QString> attrs;
+    attrs[QStringLiteral("service")] = service;
+    attrs[QStringLiteral("user")] = user;
+    return attrs;
+}
+
+void AttributeIndexTest::testSearchAllAttributes()
+{
+    AttributeIndex index;
+    index.insert(QStringLiteral("3"), attributes(QStringLiteral("mail"), QStringLiteral("alice")));
+    index.insert(QStringLiteral("1"), attributes(QStringLiteral("mail"), QStringLiteral("bob")));
+    index.insert(QStringLiteral("2"), attributes(QStringLiteral("web"), QStringLiteral("alice")));
+
+    // all the attributes must match, not any of them
+    QCOMPARE(index.search(attributes(QStringLiteral("mail"), QStringLiteral("alice"))), QStringList() << QStringLiteral("3"));
+
+    QMap<QString, QString> service;
+    service[QStringLiteral("service")] = QStringLiteral("mail");
+    QCOMPARE(index.search(service), QStringList() << QStringLiteral("1") << QStringLiteral("3"));
+
+    QMap<QString, QString> unknown;
+    unknown[QStringLiteral("host")] = QStringLiteral("mail");
+    QVERIFY(index.search(unknown).isEmpty());
+
+    QCOMPARE(index.search(QMap<QString, QString>()), QStringList() << QStringLiteral("1") << QStringLiteral("2") << QStringLiteral("3"));
+}
+
+void AttributeIndexTest::testSearchRegexp()
+{
+    AttributeIndex index;
+    index.insert(QStringLiteral("1"), attributes(QStringLiteral("mail"), QStringLiteral("alice")));
+    index.insert(QStringLiteral("2"), attributes(QStringLiteral("mailer"), QStringLiteral("alice")));
+    index.insert(QStringLiteral("3"), attributes(QStringLiteral("web"), QStringLiteral("alice")));
+
+    // the expression is matched against the values, not against itself
+    QMap<QString, QString> query;
+    query[QStringLiteral("service")] = QStringLiteral("regexp:mail.*");
+    QCOMPARE(index.search(query), QStringList() << QStringLiteral("1") << QStringLiteral("2"));
+
+    query[QStringLiteral("service")] = QStringLiteral("regexp:nothing.*");
+    QVERIFY(index.search(query).isEmpty());
+}
+
+void AttributeIndexTest::testUpdateAndRemove()
+{
+    AttributeIndex index;
+    index.insert(QStringLiteral("1"), attributes(QStringLiteral("mail"), QStringLiteral("alice")));
+    index.insert(QStringLiteral("1"), attributes(QStringLiteral("web"), QStringLiteral("alice")));
+
+    QVERIFY(index.search(attributes(QStringLiteral("mail"), QStringLiteral("alice"))).isEmpty());
+    QCOMPARE(index.search(attributes(QStringLiteral("web"), QStringLiteral("alice"))), QStringList() << QStringLiteral("1"));
+
+    index.remove(QStringLiteral("1"));
+    QVERIFY(!index.contains(QStringLiteral("1")));
+    QVERIFY(index.search(attributes(QStringLiteral("web"), QStringLiteral("alice"))).isEmpty());
+}
+
+QTEST_MAIN(AttributeIndexTest)
+#include "attributeindextest.moc"
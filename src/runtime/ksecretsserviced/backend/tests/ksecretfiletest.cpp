@@ -0,0 +1,258 @@
+/* This file is part of the KDE project
+ *
+ * Copyright (C) 2015 Valentin Rusu <valir@kde.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public License
+ * along with this library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "ksecretfiletest.h"
+
+#include <QtTest/QtTest>
+
+#include <backendmaster.h>
+#include <backenditem.h>
+#include <ksecret/ksecretcollection.h>
+#include <ksecret/ksecretcollectionmanager.h>
+#include <ksecret/ksecretdevice.h>
+#include <ksecret/ksecretencryptionfilter.h>
+#include <ksecret/ksecretjournal.h>
+#include <peer.h>
+
+#include <kstandarddirs.h>
+
+static const int CHUNK_SIZE = 64 * 1024;
+
+static KSecretJournal::Segment segment(const QByteArray &publicDelta, const QByteArray &secretDelta)
+{
+    KSecretJournal::Segment segment;
+    segment.m_publicDelta = publicDelta;
+    segment.m_initVector = QCA::InitializationVector(16);
+    segment.m_secretDelta = secretDelta;
+    return segment;
+}
+
+void KSecretFileTest::initTestCase()
+{
+    QCA::init();
+    QVERIFY(m_dir.isValid());
+    // use special test-directory for the .ksecret files
+    m_manager = new KSecretCollectionManager("share/apps/ksecretsservice-filetest", BackendMaster::instance());
+    // remove the collections of the previous runs
+    QDir dir = QDir(KGlobal::dirs()->saveLocation("ksecret"));
+    QStringList entries = dir.entryList(QStringList("*.ksecret") << QStringLiteral("*.journal"), QDir::Files);
+    Q_FOREACH(const QString &file, entries) {
+        QVERIFY(dir.remove(file));
+    }
+}
+
+void KSecretFileTest::testJournalRoundTrip()
+{
+    const QString path = m_dir.path() + QStringLiteral("/roundtrip.ksecret");
+    const QByteArray generation("generation1");
+    QList<KSecretJournal::Segment> written;
+    written << segment("public1", "secret1") << segment(QByteArray(), "secret2");
+
+    qint64 size = 0;
+    Q_FOREACH(const KSecretJournal::Segment &s, written) {
+        const qint64 previousSize = size;
+        QVERIFY(KSecretJournal::append(path, generation, s, size));
+        QVERIFY(size > previousSize);
+    }
+
+    QList<KSecretJournal::Segment> segments;
+    QCOMPARE(KSecretJournal::read(path, generation, segments), size);
+    QCOMPARE(segments.size(), written.size());
+    for(int i = 0; i < segments.size(); ++i) {
+        QCOMPARE(segments.at(i).m_publicDelta, written.at(i).m_publicDelta);
+        QCOMPARE(segments.at(i).m_initVector.toByteArray(), written.at(i).m_initVector.toByteArray());
+        QCOMPARE(segments.at(i).m_secretDelta, written.at(i).m_secretDelta);
+    }
+
+    // an incomplete segment, as a crash while appending leaves, is ignored
+    QFile file(KSecretJournal::path(path));
+    QVERIFY(file.open(QIODevice::Append));
+    QDataStream(&file) << (quint32)64;
+    QCOMPARE(file.write("abc"), (qint64)3);
+    file.close();
+    QCOMPARE(KSecretJournal::read(path, generation, segments), size);
+    QCOMPARE(segments.size(), written.size());
+
+    // and overwritten by the next append
+    QVERIFY(KSecretJournal::append(path, generation, segment("public3", "secret3"), size));
+    QCOMPARE(KSecretJournal::read(path, generation, segments), size);
+    QCOMPARE(segments.size(), written.size() + 1);
+    QCOMPARE(segments.last().m_secretDelta, QByteArray("secret3"));
+
+    KSecretJournal::remove(path);
+    QVERIFY(!QFile::exists(KSecretJournal::path(path)));
+    QCOMPARE(KSecretJournal::read(path, generation, segments), (qint64)0);
+    QVERIFY(segments.isEmpty());
+}
+
+void KSecretFileTest::testJournalGenerationMismatch()
+{
+    const QString path = m_dir.path() + QStringLiteral("/stale.ksecret");
+    qint64 size = 0;
+    QVERIFY(KSecretJournal::append(path, "generation1", segment("public1", "secret1"), size));
+
+    // the journal of another generation of the file is stale
+    QList<KSecretJournal::Segment> segments;
+    QCOMPARE(KSecretJournal::read(path, "generation2", segments), (qint64)0);
+    QVERIFY(segments.isEmpty());
+
+    // so the journal is started over by the next append
+    size = 0;
+    QVERIFY(KSecretJournal::append(path, "generation2", segment("public2", "secret2"), size));
+    QCOMPARE(KSecretJournal::read(path, "generation2", segments), size);
+    QCOMPARE(segments.size(), 1);
+    QCOMPARE(segments.first().m_publicDelta, QByteArray("public2"));
+    QCOMPARE(KSecretJournal::read(path, "generation1", segments), (qint64)0);
+    QVERIFY(segments.isEmpty());
+}
+
+void KSecretFileTest::testReadVersion1File()
+{
+    const QString path = m_dir.path() + QStringLiteral("/version1.ksecret");
+    const QCA::SecureArray password("password");
+    const QByteArray publicData("public data");
+    // more than one chunk, as they all used the same initialization vector
+    const QByteArray secretData(CHUNK_SIZE + 1000, 's');
+
+    {
+        QFile file(path);
+        QVERIFY(file.open(QIODevice::WriteOnly));
+        QCOMPARE(file.write(KSECRET_MAGIC, KSECRET_MAGIC_LEN), (qint64)KSECRET_MAGIC_LEN);
+        // version 1 files have no version number, the header of the filter
+        // follows the magic
+        KSecretEncryptionFilter filter(password);
+        QVERIFY(filter.attachFile(&file));
+        QDataStream(&file) << publicData;
+        for(int pos = 0; pos < secretData.size(); pos += CHUNK_SIZE) {
+            bool ok = false;
+            const QByteArray chunk = filter.encryptChunk(secretData.mid(pos, CHUNK_SIZE), filter.initVector(), ok);
+            QVERIFY(ok);
+            QDataStream(&file) << (quint32)chunk.size();
+            QCOMPARE(file.write(chunk), (qint64)chunk.size());
+        }
+    }
+
+    KSecretEncryptionFilter filter(password);
+    KSecretDevice<QFile> device(path, &filter);
+    QVERIFY(device.open(QIODevice::ReadOnly));
+    QCOMPARE(device.formatVersion(), (quint32)1);
+    QByteArray readPublicData;
+    QDataStream stream(&device);
+    stream >> readPublicData;
+    QCOMPARE(readPublicData, publicData);
+    device.startEncrypting();
+    QCOMPARE(device.read(secretData.size()), secretData);
+}
+
+void KSecretFileTest::testReadCurrentFile()
+{
+    const QString path = m_dir.path() + QStringLiteral("/current.ksecret");
+    const QCA::SecureArray password("password");
+    const QByteArray publicData("public data");
+    const QByteArray secretData(CHUNK_SIZE + 1000, 's');
+
+    {
+        KSecretEncryptionFilter filter(password);
+        KSecretDevice<QFile> device(path, &filter);
+        QVERIFY(device.open(QIODevice::WriteOnly));
+        QDataStream(&device) << publicData;
+        device.startEncrypting();
+        QCOMPARE(device.write(secretData), (qint64)secretData.size());
+        QVERIFY(device.finish());
+    }
+
+    KSecretEncryptionFilter filter(password);
+    KSecretDevice<QFile> device(path, &filter);
+    QVERIFY(device.open(QIODevice::ReadOnly));
+    QCOMPARE(device.formatVersion(), (quint32)CURRENT_FILE_VERSION);
+    QByteArray readPublicData;
+    QDataStream stream(&device);
+    stream >> readPublicData;
+    QCOMPARE(readPublicData, publicData);
+    device.startEncrypting();
+    QCOMPARE(device.read(secretData.size()), secretData);
+}
+
+void KSecretFileTest::testLockUnlock()
+{
+    const QCA::SecureArray rightPassword("right password");
+    const QCA::SecureArray wrongPassword("wrong password");
+    QString errorMessage;
+    KSecretCollection *coll = KSecretCollection::create(QStringLiteral("lockunlock"), rightPassword,
+                                                        m_manager, errorMessage);
+    QVERIFY2(coll, qPrintable(errorMessage));
+    QVERIFY(!coll->isLocked());
+
+    QMap<QString, QString> attr;
+    attr["mainattr"] = "haha";
+    ItemCreateInfo createInfo("testitem", attr, QCA::SecureArray(4, 'c'), "", false, false, Peer());
+    CreateItemJob *createItem = coll->createCreateItemJob(createInfo);
+    QTestEventLoop loop;
+    QVERIFY(loop.connect(createItem, SIGNAL(result(KJob*)), SLOT(exitLoop())));
+    createItem->start();
+    if(!createItem->isFinished()) {
+        loop.enterLoop(5);
+    }
+    QCOMPARE(createItem->error(), BackendNoError);
+
+    QVERIFY(coll->lock().value());
+    QVERIFY(coll->isLocked());
+    // the items are kept encrypted, so unlocking doesn't read the file
+    QVERIFY(!coll->m_lockedImage.isEmpty());
+
+    // a wrong password is refused, whatever the padding of the decrypted items
+    BackendReturn<bool> rc = coll->tryUnlockKey(wrongPassword, coll->deriveKey(wrongPassword).result());
+    QVERIFY(!rc.isError());
+    QVERIFY(!rc.value());
+    QVERIFY(coll->isLocked());
+    QVERIFY(!coll->m_lockedImage.isEmpty());
+
+    rc = coll->tryUnlockKey(rightPassword, coll->deriveKey(rightPassword).result());
+    QVERIFY(!rc.isError());
+    QVERIFY(rc.value());
+    QVERIFY(!coll->isLocked());
+    QVERIFY(coll->m_lockedImage.isEmpty());
+
+    QList<BackendItem*> items = coll->items().value();
+    QCOMPARE(items.size(), 1);
+    QCOMPARE(items.first()->label().value(), QStringLiteral("testitem"));
+    QCOMPARE(items.first()->secret().value().toByteArray(), QByteArray(4, 'c'));
+
+    // a collection read from its file decrypts the parts of the file instead
+    KSecretCollection *fromFile = KSecretCollection::createFromFile(coll->m_path, m_manager, errorMessage);
+    QVERIFY2(fromFile, qPrintable(errorMessage));
+    QVERIFY(fromFile->isLocked());
+    QVERIFY(fromFile->m_lockedImage.isEmpty());
+    rc = fromFile->tryUnlockKey(wrongPassword, fromFile->deriveKey(wrongPassword).result());
+    QVERIFY(!rc.value());
+    QVERIFY(fromFile->isLocked());
+    rc = fromFile->tryUnlockKey(rightPassword, fromFile->deriveKey(rightPassword).result());
+    QVERIFY(rc.value());
+    items = fromFile->items().value();
+    QCOMPARE(items.size(), 1);
+    QCOMPARE(items.first()->secret().value().toByteArray(), QByteArray(4, 'c'));
+    delete fromFile;
+
+    QVERIFY(coll->deleteCollection().value());
+    delete coll;
+}
+
+QTEST_MAIN(KSecretFileTest)
+#include "ksecretfiletest.moc"
@@ -114,9 +114,8 @@ QDBusObjectPath Collection::deleteCollection()
         CollectionDeleteInfo deleteInfo(getCallingPeer());
         // TODO: init peer here
         DeleteCollectionJob *dcj = m_collection->createDeleteJob(deleteInfo);
-        if(dcj->isImmediate()) {
+        if(BackendMaster::instance()->canRunImmediately(dcj) && BackendMaster::instance()->runImmediately(dcj)) {
             m_deleted = true;
-            dcj->exec();
         } else {
             SingleJobPrompt *p = new SingleJobPrompt(m_service, dcj, this);
             result = p->objectPath();
@@ -208,15 +207,15 @@ QDBusObjectPath Collection::createItem(const QMap<QString, QVariant> &properties
     }
     ItemCreateInfo createInfo(label, attributes, secretValue, secret.m_contentType, replace, locked, getCallingPeer());
     CreateItemJob *cij = m_collection->createCreateItemJob(createInfo);
-    if(cij->isImmediate()) {
-        cij->exec();
+    if(BackendMaster::instance()->canRunImmediately(cij) && BackendMaster::instance()->runImmediately(cij)) {
+        prompt.setPath( QStringLiteral( "/" ) );
         if(cij->error() != BackendNoError || !cij->item()) {
             // TODO: error creating the item
             qDebug() << "ERROR creating the item";
+            return QDBusObjectPath("/");
         }
 
         // the Item is already created inside slotItemCreated()
-        prompt.setPath( QStringLiteral( "/" ) );
         QDBusObjectPath itemPath(objectPath().path() + QChar::fromLatin1( '/' ) + cij->item()->id());
         return itemPath;
     } else {
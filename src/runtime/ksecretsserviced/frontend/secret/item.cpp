@@ -26,6 +26,7 @@
 #include "prompt.h"
 
 #include <backend/backenditem.h>
+#include <backend/backendmaster.h>
 
 #include <QtDBus/QDBusConnection>
 
@@ -90,8 +91,7 @@ QDBusObjectPath Item::deleteItem()
 {
     ItemDeleteInfo deleteInfo(getCallingPeer());
     DeleteItemJob *dij = m_item->createDeleteJob(deleteInfo);
-    if(dij->isImmediate()) {
-        dij->exec();
+    if(BackendMaster::instance()->canRunImmediately(dij) && BackendMaster::instance()->runImmediately(dij)) {
         return QDBusObjectPath("/");
     } else {
         // FIXME: needs the service!
@@ -73,7 +73,7 @@ void SingleJobPrompt::prompt(const QString &windowId)
     m_prompted = true;
 
     // TODO: convert windowId to a WId and pass it to the job
-    m_job->start();
+    BackendMaster::instance()->enqueueJob(m_job);
 }
 
 void SingleJobPrompt::dismiss()
@@ -207,7 +207,7 @@ void ServiceMultiPrompt::prompt(const QString &windowId)
             break;
         }
         else {
-            job->start();
+            BackendMaster::instance()->enqueueJob(job);
         }
     }
 }
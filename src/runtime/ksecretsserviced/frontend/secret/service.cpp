@@ -35,6 +35,7 @@
 #include <QtDBus/QDBusConnectionInterface>
 #include <QtDBus/QDBusMetaType>
 #include <QtDBus/QDBusMessage>
+#include <QtCore/QStringList>
 #include <QDebug>
 #include <klocalizedstring.h>
 
@@ -128,8 +129,7 @@ QDBusObjectPath Service::createCollection(const QMap<QString, QVariant> &propert
 #undef COLLECTION_PROPERTY
 
     CreateCollectionMasterJob *job = m_master->createCreateCollectionMasterJob(createCollectionInfo);
-    if(job->isImmediate()) {
-        job->exec();
+    if(m_master->canRunImmediately(job) && m_master->runImmediately(job)) {
         if(job->error() != BackendNoError || !job->collection()) {
             // TODO: error creating the collection
             return QDBusObjectPath("/");
@@ -180,6 +180,8 @@ QList<QDBusObjectPath> Service::unlock(const QList<QDBusObjectPath> &objects,
     QList<QDBusObjectPath> rc;
     // jobs to call asynchronously
     QSet<BackendJob*> unlockJobs;
+    // collections already having an unlock job, several locked search results may belong to the same one
+    QSet<BackendCollection*> unlockingCollections;
     QObject *object;
     Item *item;
     Collection *collection;
@@ -188,6 +190,10 @@ QList<QDBusObjectPath> Service::unlock(const QList<QDBusObjectPath> &objects,
 
     Q_FOREACH(const QDBusObjectPath & path, objects) {
         object = QDBusConnection::sessionBus().objectRegisteredAt(path.path());
+        if(!object) {
+            // a locked search result, unlocking its collection unlocks it
+            object = lockedItemCollection(path);
+        }
         if(!object) {
             continue;
         }
@@ -196,11 +202,11 @@ QList<QDBusObjectPath> Service::unlock(const QList<QDBusObjectPath> &objects,
             if(bc) {
                 if(!bc->isLocked()) {
                     rc.append(path);
-                } else {
+                } else if(!unlockingCollections.contains(bc)) {
+                    unlockingCollections.insert(bc);
                     CollectionUnlockInfo unlockInfo(getCallingPeer());
                     UnlockCollectionJob *ucj = bc->createUnlockJob(unlockInfo);
-                    if(ucj->isImmediate()) {
-                        ucj->exec();
+                    if(m_master->canRunImmediately(ucj) && m_master->runImmediately(ucj)) {
                         if(ucj->error() != BackendNoError || !ucj->result()) {
                             // not unlocked, maybe due to an error.
                             // There's not much to do about it. Silently ignore.
@@ -220,8 +226,7 @@ QList<QDBusObjectPath> Service::unlock(const QList<QDBusObjectPath> &objects,
                 } else {
                     ItemUnlockInfo unlockInfo(getCallingPeer());
                     UnlockItemJob *uij = bi->createUnlockJob(unlockInfo);
-                    if(uij->isImmediate()) {
-                        uij->exec();
+                    if(m_master->canRunImmediately(uij) && m_master->runImmediately(uij)) {
                         if(uij->error() != BackendNoError || !uij->result()) {
                             // not unlocked, maybe due to an error.
                             // There's not much to do about it. Silently ignore.
@@ -247,6 +252,20 @@ QList<QDBusObjectPath> Service::unlock(const QList<QDBusObjectPath> &objects,
     return rc;
 }
 
+QObject *Service::lockedItemCollection(const QDBusObjectPath &path) const
+{
+    const QString collectionsPath = objectPath().path() + QStringLiteral( "/collection/" );
+    if(!path.path().startsWith(collectionsPath)) {
+        return 0;
+    }
+    // the item path is <collections>/<collection id>/<item id>
+    const QStringList ids = path.path().mid(collectionsPath.length()).split(QLatin1Char('/'));
+    if(ids.size() != 2 || ids.at(0).isEmpty() || ids.at(1).isEmpty()) {
+        return 0;
+    }
+    return QDBusConnection::sessionBus().objectRegisteredAt(collectionsPath + ids.at(0));
+}
+
 QList<QDBusObjectPath> Service::lock(const QList<QDBusObjectPath> &objects,
                                      QDBusObjectPath &prompt)
 {
@@ -275,8 +294,7 @@ QList<QDBusObjectPath> Service::lock(const QList<QDBusObjectPath> &objects,
                     rc.append(path);
                 } else {
                     LockCollectionJob *lcj = bc->createLockJob();
-                    if(lcj->isImmediate()) {
-                        lcj->exec();
+                    if(m_master->canRunImmediately(lcj) && m_master->runImmediately(lcj)) {
                         if(lcj->error() != BackendNoError || !lcj->result()) {
                             // not locked, maybe due to an error.
                             // There's not much to do about it. Silently ignore.
@@ -295,8 +313,7 @@ QList<QDBusObjectPath> Service::lock(const QList<QDBusObjectPath> &objects,
                     rc.append(path);
                 } else {
                     LockItemJob *lij = bi->createLockJob();
-                    if(lij->isImmediate()) {
-                        lij->exec();
+                    if(m_master->canRunImmediately(lij) && m_master->runImmediately(lij)) {
                         if(lij->error() != BackendNoError || !lij->result()) {
                             // not locked, maybe due to an error.
                             // There's not much to do about it. Silently ignore.
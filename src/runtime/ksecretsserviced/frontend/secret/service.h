@@ -160,6 +160,14 @@ private Q_SLOTS:
 
 
 private:
+    /**
+     * Locked search results are item paths which only get registered once their collection is unlocked.
+     *
+     * @param path Objectpath of an item below a collection of this service
+     * @return the collection object the item belongs to, or 0 if path is not such an item path
+     */
+    QObject *lockedItemCollection(const QDBusObjectPath &path) const;
+
     BackendMaster *m_master;
     QList<QDBusObjectPath> m_collections; // cache object paths of collections
 };
@@ -38,6 +38,42 @@ PAM_EXTERN int pam_sm_authenticate(
     return PAM_IGNORE;
 }
 
+/**
+ * Computes the secrets file path of the user handled by this PAM transaction.
+ * See pam_sm_setcred below for the path configuration.
+ *
+ * @return PAM_SUCCESS or the PAM error the caller should return
+ */
+static int get_secrets_path(pam_handle_t* pamh, int argc, const char** argv,
+    const char** user_name, char* secrets_path)
+{
+    *user_name = 0;
+    int result = pam_get_item(pamh, PAM_USER, (const void**)user_name);
+    if (result != PAM_SUCCESS) {
+        pam_syslog(pamh, LOG_ERR, "Couldn't get password %s",
+            pam_strerror(pamh, result));
+        return PAM_CRED_UNAVAIL;
+    }
+
+    struct passwd *pwd;
+    pwd = getpwnam(*user_name);
+    if (pwd == 0) {
+        pam_syslog(pamh, LOG_ERR, "Couldn't get user passwd info %d (%m)", errno);
+        return PAM_CRED_ERR;
+    }
+
+    memset(secrets_path, 0, PATH_MAX);
+    strncpy(secrets_path, pwd->pw_dir, PATH_MAX);
+    static const char *defaultPath = ".local/share/ksecrets/ksecrets.data";
+    if (argc == 1 && argv[0] != 0) {
+        strncat(secrets_path, argv[0], PATH_MAX - strlen(secrets_path) -1);
+    } else {
+        strncat(secrets_path, defaultPath, PATH_MAX - strlen(secrets_path) -1);
+    }
+    pam_syslog(pamh, LOG_INFO, "ksecrets: setting secrets path to %s", secrets_path);
+    return PAM_SUCCESS;
+}
+
 /**
  * The module PAM module configuration should specify the location of the
  * secrets file. The location should contain only the part of the path
@@ -66,39 +102,16 @@ PAM_EXTERN int pam_sm_authenticate(
 PAM_EXTERN int pam_sm_setcred(
     pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
-    UNUSED(argc);
-    UNUSED(argv);
     pam_syslog(pamh, LOG_INFO, "pam_sm_setcred flags=%X", flags);
     if (flags & PAM_ESTABLISH_CRED) {
         if (0 == password)
             return PAM_CRED_UNAVAIL;
 
         const char* user_name;
-        user_name = 0;
-        int result = pam_get_item(pamh, PAM_USER, (const void**)&user_name);
-        if (result != PAM_SUCCESS) {
-            pam_syslog(pamh, LOG_ERR, "Couldn't get password %s",
-                pam_strerror(pamh, result));
-            return PAM_CRED_UNAVAIL;
-        }
-
-        struct passwd *pwd;
-        pwd = getpwnam(user_name);
-        if (pwd == 0) {
-            pam_syslog(pamh, LOG_ERR, "Couldn't get user passwd info %d (%m)", errno);
-            return PAM_CRED_ERR;
-        }
-
         char secrets_path[PATH_MAX];
-        memset(secrets_path, 0, sizeof(secrets_path)/sizeof(secrets_path[0]));
-        strncpy(secrets_path, pwd->pw_dir, PATH_MAX);
-        static const char *defaultPath = ".local/share/ksecrets/ksecrets.data";
-        if (argc == 1 && argv[0] != 0) {
-            strncat(secrets_path, argv[0], PATH_MAX - strlen(secrets_path) -1);
-        } else {
-            strncat(secrets_path, defaultPath, PATH_MAX - strlen(secrets_path) -1);
-        }
-        pam_syslog(pamh, LOG_INFO, "ksecrets: setting secrets path to %s", secrets_path);
+        int result = get_secrets_path(pamh, argc, argv, &user_name, secrets_path);
+        if (result != PAM_SUCCESS)
+            return result;
 
         if (kss_set_credentials(user_name, password, secrets_path) == 0) {
             pam_syslog(
@@ -138,13 +151,16 @@ PAM_EXTERN int pam_sm_close_session(
 PAM_EXTERN int pam_sm_chauthtok(
     pam_handle_t* pamh, int flags, int argc, const char** argv)
 {
-    UNUSED(argc);
-    UNUSED(argv);
     pam_syslog(pamh, LOG_INFO, "pam_sm_chauthtok flags=%X", flags);
 
+    const char* user_name;
+    char secrets_path[PATH_MAX];
+    if (get_secrets_path(pamh, argc, argv, &user_name, secrets_path) != PAM_SUCCESS)
+        return PAM_IGNORE;
+
     if (flags & PAM_PRELIM_CHECK) {
         pam_syslog(pamh, LOG_INFO, "pam_sm_chauthtok preliminary check");
-        if (kss_can_change_password()) {
+        if (kss_can_change_password(secrets_path)) {
             return PAM_SUCCESS;
         }
         else {
@@ -174,7 +190,19 @@ PAM_EXTERN int pam_sm_chauthtok(
             return PAM_AUTHTOK_ERR;
         }
 
-        if (kss_change_password(password))
+        /* passwd usually runs outside of the user session, so the master
+         * keys are not in the keyring and get unwrapped with the old password */
+        const char* old_password;
+        old_password = 0;
+        result = pam_get_item(pamh, PAM_OLDAUTHTOK, (const void**)&old_password);
+        if (result != PAM_SUCCESS || 0 == old_password) {
+            pam_syslog(pamh, LOG_WARNING,
+                "Couldn't get the old password, "
+                "ksecrets keeps being protected by the old one");
+            return PAM_IGNORE;
+        }
+
+        if (kss_change_password(secrets_path, old_password, password))
             return PAM_SUCCESS;
         else {
             pam_syslog(pamh, LOG_ERR,